@@ -0,0 +1,4050 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1Benchmarks.cpp
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <map>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1DisplayFramebuffer.h"
+#include "SynclavierKBI1LEDState.h"
+#include "SynclavierKBI1PanelState.h"
+#include "SynclavierKBI1EventRing.h"
+#include "SynclavierKBI1HostTime.h"
+#include "SynclavierKBI1NRPNAssembler.h"
+#include "SynclavierKBI1MIDITransportLoopback.h"
+#include "SynclavierKBI1MIDIParser.h"
+#include "SynclavierKBI1InputDecoder.h"
+#include "SynclavierKBI1TimerWheel.h"
+#include "SynclavierKBI1OutputScheduler.h"
+#include "SynclavierKBI1NRPNRequests.h"
+#include "SynclavierKBI1Device.h"
+#include "SynclavierKBI1EchoTest.h"
+#include "SynclavierKBI1SimulatedDevice.h"
+#include "SynclavierKBI1Trace.h"
+#include "SynclavierKBI1MIDITransportTrace.h"
+#include "SynclavierKBI1ControlCoalescer.h"
+#include "SynclavierKBI1DisplayFormat.h"
+#include "SynclavierKBI1OutputQueues.h"
+#include "SynclavierKBI1NoteState.h"
+#include "SynclavierKBI1RepeatEngine.h"
+#include "SynclavierKBI1Metrics.h"
+#include "SynclavierKBI1MIDITransportMetrics.h"
+#include "SynclavierKBI1Log.h"
+#include "SynclavierKBI1ControlMap.h"
+#include "SynclavierKBI1EndpointRegistry.h"
+#include "SynclavierKBI1UMP.h"
+#include "SynclavierKBI1MIDITransportUMP.h"
+#include "SynclavierKBI1Benchmarks.h"
+
+// Wall clock for timing runs
+static double BM_Seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int BM_IntOption(int argc, const char* argv[], const char* option, int defaultValue)
+{
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], option) == 0)
+            return atoi(argv[i+1]);
+    }
+
+    return defaultValue;
+}
+
+static const char* BM_StringOption(int argc, const char* argv[], const char* option, const char* defaultValue)
+{
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], option) == 0)
+            return argv[i+1];
+    }
+
+    return defaultValue;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// batch - compare one send per message against batched sends with and without running status
+// ---------------------------------------------------------------------------------------------
+
+// Stands in for MIDISend. MIDI services copies the packet list out of our address space on every send.
+struct BM_SendCounter {
+    long long sends;
+    long long bytes;
+    unsigned char wire[SynclavierKBI1MIDIOutputBatch::kCapacity + 16];
+};
+
+static void BM_CountingSend(const unsigned char* bytes, int length, void* refCon)
+{
+    auto& counter = *(BM_SendCounter*) refCon;
+
+    memcpy(&counter.wire[0], bytes, length);
+
+    counter.sends += 1;
+    counter.bytes += length;
+}
+
+// Called through a volatile pointer so the compiler can not fold the send into the caller
+static SynclavierKBI1MIDIOutputBatch::FlushProc volatile BM_Send = BM_CountingSend;
+
+// Full refresh of a VK: clear, every button lit, both display lines written
+template <typename SEND3, typename NRPN>
+static void BM_VKRefresh(SEND3 send3, NRPN nrpn)
+{
+    nrpn(SynclavierKBI1MIDIProtocolNRPNMessageClear, 0);
+
+    for (int button = 0; button < 128; button++)
+        send3(0x90 + SynclavierKBI1MIDIProtocolVKChannel, button, SynclavierKBI1MIDIProtocolButtonOn);
+
+    for (int button = 0; button < 32; button++)
+        send3(0x90 + SynclavierKBI1MIDIProtocolVKAltChannel, button, SynclavierKBI1MIDIProtocolButtonOn);
+
+    for (int line = SynclavierKBI1MIDIProtocolVKDisplayLine0; line <= SynclavierKBI1MIDIProtocolVKDisplayLine1; line++) {
+        const char* text = "Synclavier KBI-1 refresh benchmark 12345";
+
+        while (*text)
+            send3(0x90 + SynclavierKBI1MIDIProtocolDisplayChannel, line, (*text++) & 0x7F);
+
+        send3(0x80 + SynclavierKBI1MIDIProtocolDisplayChannel, line, 0);
+    }
+
+    nrpn(SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNAskValue);
+}
+
+static int BM_Batch(int argc, const char* argv[])
+{
+    int iterations = BM_IntOption(argc, argv, "-iterations", 100000);
+
+    // Current path - one packet list per 3-byte message
+    {
+        BM_SendCounter counter = {};
+
+        auto send3 = [&](int byte1, int byte2, int byte3) {
+            unsigned char pkt[3] = {(unsigned char) byte1, (unsigned char) byte2, (unsigned char) byte3};
+            BM_Send(pkt, 3, &counter);
+        };
+
+        auto nrpn = [&](int param, int value) {
+            SynclavierKBI1MIDIProtocolNRPN nrpnMessage(param, value, SynclavierKBI1MIDIProtocolNRPNChannel);
+
+            send3(nrpnMessage.nrpn1()[0], nrpnMessage.nrpn1()[1], nrpnMessage.nrpn1()[2]);
+            send3(nrpnMessage.nrpn2()[0], nrpnMessage.nrpn2()[1], nrpnMessage.nrpn2()[2]);
+            send3(nrpnMessage.data1()[0], nrpnMessage.data1()[1], nrpnMessage.data1()[2]);
+            send3(nrpnMessage.data2()[0], nrpnMessage.data2()[1], nrpnMessage.data2()[2]);
+        };
+
+        double start = BM_Seconds();
+
+        for (int i = 0; i < iterations; i++)
+            BM_VKRefresh(send3, nrpn);
+
+        double elapsed = BM_Seconds() - start;
+
+        printf("batch unbatched      : %6lld sends/refresh %6lld bytes/refresh %12.0f sends/sec %10.0f refreshes/sec\n",
+               counter.sends / iterations, counter.bytes / iterations, counter.sends / elapsed, iterations / elapsed);
+    }
+
+    // Batched, with and without running status
+    for (int running = 0; running < 2; running++) {
+        BM_SendCounter counter = {};
+
+        SynclavierKBI1MIDIOutputBatch batch(BM_Send, &counter, running != 0);
+
+        auto send3 = [&](int byte1, int byte2, int byte3) {
+            batch.send3(byte1, byte2, byte3);
+        };
+
+        auto nrpn = [&](int param, int value) {
+            batch.sendNRPN(param, value, SynclavierKBI1MIDIProtocolNRPNChannel);
+        };
+
+        double start = BM_Seconds();
+
+        for (int i = 0; i < iterations; i++) {
+            BM_VKRefresh(send3, nrpn);
+            batch.flush();
+        }
+
+        double elapsed = BM_Seconds() - start;
+
+        printf("batch %-15s: %6lld sends/refresh %6lld bytes/refresh %12.0f sends/sec %10.0f refreshes/sec (%lld status bytes saved/refresh)\n",
+               running ? "running status" : "batched",
+               counter.sends / iterations, counter.bytes / iterations, counter.sends / elapsed, iterations / elapsed,
+               batch.runningSaved() / iterations);
+    }
+
+    // The NRPN on its own
+    {
+        BM_SendCounter counter = {};
+
+        SynclavierKBI1MIDIOutputBatch batch(BM_Send, &counter, true);
+
+        batch.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNAskValue, SynclavierKBI1MIDIProtocolNRPNChannel);
+        batch.flush();
+
+        printf("batch nrpn           : %6lld sends %lld bytes (12 bytes in 4 sends unbatched)\n", counter.sends, counter.bytes);
+    }
+
+    return 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// display - 30 Hz meter on the VK and ORK, full line rewrites vs the shadow framebuffer
+// ---------------------------------------------------------------------------------------------
+
+static int BM_Display(int argc, const char* argv[])
+{
+    int frames = BM_IntOption(argc, argv, "-frames", 30 * 60);
+
+    BM_SendCounter counter = {};
+
+    SynclavierKBI1MIDIOutputBatch    batch(BM_Send, &counter, false);
+    SynclavierKBI1DisplayFramebuffer display;
+
+    display.markCleared();
+
+    unsigned int seed  = 1;
+    int          level = 0;
+
+    double start = BM_Seconds();
+
+    for (int frame = 0; frame < frames; frame++) {
+        char text[64];
+
+        // Meter wanders a little each frame, like a level meter
+        seed   = seed * 1103515245 + 12345;
+        level += (int) ((seed >> 16) % 7) - 3;
+        level  = level < -600 ? -600 : level > 60 ? 60 : level;
+
+        display.setVKLine(0, "Track 1  Volume      Synclavier KBI-1");
+
+        snprintf(text, sizeof(text), "Level %5d.%d dB  Peak %5d.%d dB", level / 10, abs(level % 10), 6, 0);
+        display.setVKLine(1, text);
+
+        snprintf(text, sizeof(text), "%3d.%dv", abs(level) / 10, abs(level) % 10);
+        display.setORK(text);
+
+        display.flush(batch);
+        batch.flush();
+    }
+
+    double elapsed = BM_Seconds() - start;
+
+    printf("display frames       : %d (%.1f sec at 30 Hz)\n", frames, frames / 30.0);
+    printf("display full lines   : %10lld messages %10lld bytes\n", display.messagesFullLines(), display.messagesFullLines() * 3);
+    printf("display framebuffer  : %10lld messages %10lld bytes (%.1f%% of full lines) %lld sections %lld lines\n",
+           display.messages(), counter.bytes, 100.0 * display.messages() / display.messagesFullLines(), display.sections(), display.lines());
+    printf("display cost         : %.0f ns/frame\n", elapsed * 1e9 / frames);
+
+    return 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// format - parameter readouts formatted straight into display cells vs snprintf and parsing
+// ---------------------------------------------------------------------------------------------
+
+// Checked at compile time
+static_assert(SynclavierKBI1DisplayFormat::ork(4400, 1, SynclavierKBI1ORKUnitHertz).digits.chars[0] == '4', "ork digits");
+static_assert(SynclavierKBI1DisplayFormat::ork(4400, 1, SynclavierKBI1ORKUnitHertz).digits.decimals == 1 << 3, "ork point before the last digit");
+static_assert(SynclavierKBI1DisplayFormat::ork(1000, 3).digits.decimals == 1 << 1, "ork 1.000");
+static_assert(SynclavierKBI1DisplayFormat::ork(-12345, 2).digits.chars[1] == '1', "ork -123.45 rounds to -123");
+static_assert(SynclavierKBI1DisplayFormat::ork(123456, 0).digits.chars[3] == SynclavierKBI1DisplayFormat::kOverflow, "ork overflow");
+
+// Text the way snprintf makes it: value / 10^places, right aligned in width positions
+static int BM_FormatReference(char* text, int size, int64_t value, int places, int width)
+{
+    int64_t  scale     = 1;
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+
+    for (int i = 0; i < places; i++)
+        scale *= 10;
+
+    int length = places ? snprintf(text, size, "%s%llu.%0*llu", value < 0 ? "-" : "", (unsigned long long) (magnitude / scale), places, (unsigned long long) (magnitude % scale))
+                        : snprintf(text, size, "%lld", (long long) value);
+
+    // Positions, the point going with the digit after it
+    int positions = length - (places ? 1 : 0);
+
+    if (positions > width)
+        return -1;
+
+    memmove(text + width - positions, text, length + 1);
+    memset(text, ' ', width - positions);
+
+    return positions;
+}
+
+static int BM_Format(int argc, const char* argv[])
+{
+    int frames   = BM_IntOption(argc, argv, "-frames",   30 * 60);
+    int readouts = BM_IntOption(argc, argv, "-readouts", 8);            // Per VK line, 40 / readouts positions each
+    int checks   = BM_IntOption(argc, argv, "-checks",   1000000);
+
+    readouts = std::max(1, std::min(readouts, SynclavierKBI1DisplayFramebuffer::kVKCharsPerLine / 2));
+
+    int width = SynclavierKBI1DisplayFramebuffer::kVKCharsPerLine / readouts;
+
+    // Every value that fits must come out as snprintf would put it, after parsing
+    std::mt19937 random(1);
+    int          failures = 0;
+
+    for (int check = 0; check < checks; check++) {
+        int     places = (int) (random() % 5);
+        int     field  = 1 + (int) (random() % 12);
+        int64_t value  = (int64_t) (random() % 2000001) - 1000000;
+
+        value >>= random() % 16;
+
+        char text[64];
+        SynclavierKBI1DisplayCells<16> want, got;
+
+        bool fits = BM_FormatReference(text, sizeof(text), value, places, field) >= 0;
+
+        if (fits)
+            SynclavierKBI1DisplayFormat::text(want, 0, field, text);
+
+        bool fitted = SynclavierKBI1DisplayFormat::fixed(got, 0, field, value, places);
+
+        if (fits && (got != want || !fitted)) {
+            if (failures++ < 10)
+                printf("format               : FAILED, %lld / 10^%d in %d: \"%s\" vs \"%.*s\"\n", (long long) value, places, field, text, field, got.chars);
+        }
+    }
+
+    BM_SendCounter counter = {};
+
+    SynclavierKBI1MIDIOutputBatch    batch(BM_Send, &counter, false);
+    SynclavierKBI1DisplayFramebuffer display;
+
+    std::vector<int> levels(2 * readouts + 1);
+
+    // Readouts wander a little each frame, like meters
+    auto step = [&](unsigned int& seed) {
+        for (auto& level : levels) {
+            seed   = seed * 1103515245 + 12345;
+            level += (int) ((seed >> 16) % 7) - 3;
+            level  = level < 0 ? 0 : level > 9999 ? 9999 : level;
+        }
+    };
+
+    // snprintf each readout into the line text, which the framebuffer then parses
+    unsigned int seed  = 1;
+    double       start = BM_Seconds();
+
+    for (int frame = 0; frame < frames; frame++) {
+        step(seed);
+
+        for (int line = 0; line < SynclavierKBI1DisplayFramebuffer::kVKLines; line++) {
+            char text[128];
+            int  length = 0;
+
+            for (int readout = 0; readout < readouts; readout++) {
+                int level = levels[line * readouts + readout];
+
+                length += snprintf(text + length, sizeof(text) - length, "%*d.%d", width - 1, level / 10, level % 10);
+            }
+
+            display.setVKLine(line, text);
+        }
+
+        char text[16];
+        int  level = levels.back();
+
+        snprintf(text, sizeof(text), "%3d.%dv", level / 10, level % 10);
+        display.setORK(text);
+    }
+
+    double printed = BM_Seconds() - start;
+
+    // Straight into cells
+    seed  = 1;
+    start = BM_Seconds();
+
+    for (int frame = 0; frame < frames; frame++) {
+        step(seed);
+
+        for (int line = 0; line < SynclavierKBI1DisplayFramebuffer::kVKLines; line++) {
+            SynclavierKBI1DisplayFramebuffer::Line cells;
+
+            for (int readout = 0; readout < readouts; readout++)
+                SynclavierKBI1DisplayFormat::fixed(cells, readout * width, width, levels[line * readouts + readout], 1);
+
+            display.setVKLine(line, cells);
+        }
+
+        display.setORK(SynclavierKBI1DisplayFormat::ork(levels.back(), 1, SynclavierKBI1ORKUnitVolume));
+    }
+
+    double formatted = BM_Seconds() - start;
+
+    // Scrolling text on the top line, 8 positions a second
+    SynclavierKBI1DisplayFramebuffer::Line cells;
+
+    display.markCleared();
+    counter = {};
+
+    for (int frame = 0; frame < frames; frame++) {
+        SynclavierKBI1DisplayFormat::marquee(cells, 0, SynclavierKBI1DisplayFramebuffer::kVKCharsPerLine,
+                                             "Synclavier KBI-1   Track 1  Volume  Pan  Reverb  Sequencer ready", frame * 8 / 30);
+        display.setVKLine(0, cells);
+        display.flush(batch);
+        batch.flush();
+    }
+
+    int perFrame = 2 * readouts + 1;
+
+    printf("format checks        : %d values against snprintf, %d failed\n", checks, failures);
+    printf("format snprintf      : %6.1f ns per readout (%d readouts per frame, %d positions each)\n", printed * 1e9 / frames / perFrame, perFrame, width);
+    printf("format cells         : %6.1f ns per readout (%.1fx)\n", formatted * 1e9 / frames / perFrame, printed / std::max(formatted, 1e-9));
+    printf("format marquee       : %d frames, %lld bytes sent\n", frames, counter.bytes);
+
+    return failures ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// leds - host rewrites the whole VK panel on every mode change
+// ---------------------------------------------------------------------------------------------
+
+static int BM_LEDs(int argc, const char* argv[])
+{
+    int modeChanges = BM_IntOption(argc, argv, "-changes", 100000);
+
+    BM_SendCounter counter = {};
+
+    SynclavierKBI1MIDIOutputBatch batch(BM_Send, &counter, false);
+    SynclavierKBI1LEDState        leds;
+
+    leds.markCleared();
+
+    long long naiveMessages = 0;
+
+    double start = BM_Seconds();
+
+    for (int change = 0; change < modeChanges; change++) {
+        int mode = change & 7;
+
+        // Whole panel rewritten. Each mode lights its own row and the mode button blinks.
+        for (int button = 0; button < SynclavierKBI1LEDState::kVKButtons; button++) {
+            auto state = (button / 8 == mode) ? SynclavierKBI1LEDState::LEDOn : SynclavierKBI1LEDState::LEDOff;
+
+            leds.set(SynclavierKBI1MIDIProtocolVKChannel, button, state);
+        }
+
+        for (int button = 0; button < SynclavierKBI1LEDState::kVKAltButtons; button++)
+            leds.set(SynclavierKBI1MIDIProtocolVKAltChannel, button, button == mode ? SynclavierKBI1LEDState::LEDBlinking : SynclavierKBI1LEDState::LEDOff);
+
+        // Set and cleared within the frame; sends nothing
+        leds.set(SynclavierKBI1MIDIProtocolVKChannel, 127, SynclavierKBI1LEDState::LEDOn);
+        leds.set(SynclavierKBI1MIDIProtocolVKChannel, 127, SynclavierKBI1LEDState::LEDOff);
+
+        naiveMessages += SynclavierKBI1LEDState::kVKButtons + SynclavierKBI1LEDState::kVKAltButtons + 2;
+
+        leds.flush(batch);
+        batch.flush();
+    }
+
+    double elapsed = BM_Seconds() - start;
+
+    printf("leds mode changes    : %d\n", modeChanges);
+    printf("leds direct sends    : %10lld messages %10lld bytes\n", naiveMessages, naiveMessages * 3);
+    printf("leds shadow state    : %10lld messages %10lld bytes (%.1f%% of direct)\n",
+           leds.sentCount(), counter.bytes, 100.0 * leds.sentCount() / naiveMessages);
+    printf("leds cost            : %.0f ns/mode change\n", elapsed * 1e9 / modeChanges);
+
+    return 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// restore - full panel restore after a Refresh request
+// ---------------------------------------------------------------------------------------------
+
+static int BM_Restore(int argc, const char* argv[])
+{
+    int iterations = BM_IntOption(argc, argv, "-iterations", 100000);
+    int lit        = BM_IntOption(argc, argv, "-lit", 24);
+
+    BM_SendCounter counter = {};
+
+    SynclavierKBI1MIDIOutputBatch batch(BM_Send, &counter, false);
+    SynclavierKBI1PanelState      panel;
+
+    // A typical VK page: some lit buttons, a blinking mode button and both display lines
+    for (int button = 0; button < lit && button < SynclavierKBI1LEDState::kVKButtons; button++)
+        panel.leds.set(SynclavierKBI1MIDIProtocolVKChannel, (button * 5) % SynclavierKBI1LEDState::kVKButtons, SynclavierKBI1LEDState::LEDOn);
+
+    panel.leds.set(SynclavierKBI1MIDIProtocolVKAltChannel, 3, SynclavierKBI1LEDState::LEDBlinking);
+
+    panel.display.setVKLine(0, "Sequencer   Track 4    Bar  12.3");
+    panel.display.setVKLine(1, "Tempo 120.0 bpm");
+
+    SynclavierKBI1PanelState::RestoreStats stats = {};
+
+    double start = BM_Seconds();
+
+    for (int i = 0; i < iterations; i++)
+        stats = panel.restore(batch);
+
+    double elapsed = BM_Seconds() - start;
+
+    // Rewriting everything: clear, every light, both lines in full
+    int naiveMessages = 4 + SynclavierKBI1LEDState::kLEDs + 2 * (SynclavierKBI1DisplayFramebuffer::kVKCharsPerLine + 1);
+
+    printf("restore burst        : %d lights %d display messages %d bytes in %d packet list(s)\n",
+           stats.lights, stats.displayMessages, stats.bytes, stats.packetLists);
+    printf("restore full rewrite : %d messages %d bytes\n", naiveMessages, naiveMessages * 3);
+    printf("restore cost         : %.0f ns/restore\n", elapsed * 1e9 / iterations);
+
+    return 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// ring - stress the input event ring with one producer and one consumer thread
+// ---------------------------------------------------------------------------------------------
+
+static SynclavierKBI1EventRing<1024> BM_Ring;
+
+static std::atomic<long long> BM_RingWakes;
+
+static void BM_RingWake(void* refCon)
+{
+    BM_RingWakes.fetch_add(1, std::memory_order_relaxed);
+}
+
+static int BM_RingStress(int argc, const char* argv[])
+{
+    long long events = BM_IntOption(argc, argv, "-millions", 50) * 1000000LL;
+    bool      wake   = BM_IntOption(argc, argv, "-wake", 1) != 0;
+
+    BM_Ring.setWakeProc(wake ? BM_RingWake : nullptr, nullptr, SynclavierKBI1EventRing<1024>::WakeWhenEmpty);
+
+    std::atomic<bool> producerDone(false);
+
+    long long rejected = 0;
+    long long received = 0;
+    long long errors   = 0;
+    long long batches  = 0;
+
+    double start = BM_Seconds();
+
+    // Producer stands in for the MIDI thread. Sequence number is spread over param and value.
+    std::thread producer([&] {
+        SynclavierKBI1Event event = {};
+
+        event.channel = SynclavierKBI1MIDIProtocolNRPNChannel;
+        event.type    = SynclavierKBI1EventNRPN;
+
+        for (long long sequence = 0; sequence < events; ) {
+            event.timeStamp = sequence;
+            event.param     = (sequence >> 14) & 0x3FFF;
+            event.value     = sequence & 0x3FFF;
+
+            if (BM_Ring.push(event))
+                sequence++;
+
+            // Let the consumer run. Matters on a single core.
+            else {
+                rejected++;
+                std::this_thread::yield();
+            }
+        }
+
+        producerDone.store(true);
+    });
+
+    // Consumer drains in batches and checks nothing was lost or reordered
+    while (true) {
+        bool done = producerDone.load();
+
+        int count = BM_Ring.drain([&](const SynclavierKBI1Event& event) {
+            if ((long long) event.timeStamp != received || event.value != (received & 0x3FFF))
+                errors++;
+
+            received++;
+        });
+
+        if (count)
+            batches++;
+
+        else if (done)
+            break;
+
+        else
+            std::this_thread::yield();
+    }
+
+    producer.join();
+
+    double elapsed = BM_Seconds() - start;
+
+    printf("ring events          : %lld received %lld errors in %.3f sec\n", received, errors, elapsed);
+    printf("ring throughput      : %.1f million events/sec\n", received / elapsed / 1e6);
+    printf("ring full            : %lld pushes rejected, %llu overflows counted\n", rejected, (unsigned long long) BM_Ring.overflows());
+    printf("ring batches         : %lld (%.1f events/batch) %lld wakes\n", batches, batches ? (double) received / batches : 0.0, BM_RingWakes.load());
+
+    return errors == 0 && received == events && (unsigned long long) rejected == BM_Ring.overflows() ? 0 : 1;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// loopback - Echo NRPN round trips through the in-process loopback transport
+// ---------------------------------------------------------------------------------------------
+
+// One side of the loopback: collects output in a batch and puts NRPNs back together from input
+struct BM_LoopbackSide {
+    SynclavierKBI1MIDITransportLoopback*    transport;
+    SynclavierKBI1MIDIOutputBatch           batch;
+    SynclavierKBI1NRPNAssembler             assembler;
+    long long                               nrpns;
+    int                                     lastValue;
+    bool                                    echo;                   // Send Echo NRPNs straight back, like a KBI-1
+
+    inline BM_LoopbackSide(SynclavierKBI1MIDITransportLoopback& loopbackTransport, bool echoBack)
+    :   batch(SynclavierKBI1MIDITransport::BatchFlushProc, &loopbackTransport, false) {
+        transport   = &loopbackTransport;
+        nrpns       = 0;
+        lastValue   = -1;
+        echo        = echoBack;
+    }
+};
+
+// Running status is off on this link so every message is 3 bytes
+static void BM_LoopbackReceive(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    auto& side = *(BM_LoopbackSide*) refCon;
+
+    for (int i = 0; i + 2 < length; i += 3) {
+        if ((bytes[i] & 0xF0) != 0xB0 || (bytes[i] & 0xF) != SynclavierKBI1MIDIProtocolNRPNChannel)
+            continue;
+
+        if (!side.assembler.controller(bytes[i+1], bytes[i+2]))
+            continue;
+
+        side.nrpns++;
+        side.lastValue = side.assembler.value();
+
+        if (side.echo && side.assembler.param() == SynclavierKBI1MIDIProtocolNRPNMessageEcho) {
+            side.batch.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageEcho, side.assembler.value(), SynclavierKBI1MIDIProtocolNRPNChannel);
+            side.batch.flush();
+        }
+    }
+}
+
+static int BM_Loopback(int argc, const char* argv[])
+{
+    int roundTrips = BM_IntOption(argc, argv, "-iterations", 1000000);
+
+    SynclavierKBI1MIDILoopback loopback;
+
+    loopback.host.setAllowsRunningStatus(false);
+    loopback.device.setAllowsRunningStatus(false);
+
+    BM_LoopbackSide host  (loopback.host,   false);
+    BM_LoopbackSide device(loopback.device, true);
+
+    loopback.host.setReceiveProc  (BM_LoopbackReceive, &host);
+    loopback.device.setReceiveProc(BM_LoopbackReceive, &device);
+
+    loopback.host.open();
+    loopback.device.open();
+
+    long long errors = 0;
+
+    double start = BM_Seconds();
+
+    for (int i = 0; i < roundTrips; i++) {
+        int value = i & 0x3FFF;
+
+        host.batch.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageEcho, value, SynclavierKBI1MIDIProtocolNRPNChannel);
+        host.batch.flush();
+
+        if (host.lastValue != value)
+            errors++;
+    }
+
+    double elapsed = BM_Seconds() - start;
+
+    printf("loopback round trips : %d (%lld errors)\n", roundTrips, errors);
+    printf("loopback throughput  : %.0f round trips/sec %.0f ns/round trip\n", roundTrips / elapsed, elapsed * 1e9 / roundTrips);
+    printf("loopback wire        : host %lld sends %lld bytes, device %lld sends %lld bytes\n",
+           loopback.host.sends(), loopback.host.bytes(), loopback.device.sends(), loopback.device.bytes());
+
+    return errors == 0 ? 0 : 1;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// requests - pipelined Echo queries with deadlines and retries over a lossy loopback
+// ---------------------------------------------------------------------------------------------
+
+// Simulated KBI-1 that echoes Echo NRPNs but loses some of its replies
+struct BM_LossyEcho {
+    SynclavierKBI1MIDIOutputBatch   batch;
+    SynclavierKBI1NRPNAssembler     assembler;
+    std::mt19937                    random;
+    int                             loss;                       // Replies lost per 1000
+    long long                       lost;
+
+    inline BM_LossyEcho(SynclavierKBI1MIDITransportLoopback& transport, int lossPerThousand)
+    :   batch(SynclavierKBI1MIDITransport::BatchFlushProc, &transport, false), random(1) {
+        loss = lossPerThousand;
+        lost = 0;
+    }
+};
+
+static void BM_LossyEchoReceive(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    auto& echo = *(BM_LossyEcho*) refCon;
+
+    for (int i = 0; i + 2 < length; i += 3) {
+        if (!echo.assembler.controller(bytes[i+1], bytes[i+2]) || echo.assembler.param() != SynclavierKBI1MIDIProtocolNRPNMessageEcho)
+            continue;
+
+        if ((int) (echo.random() % 1000) < echo.loss) {
+            echo.lost++;
+            continue;
+        }
+
+        echo.batch.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageEcho, echo.assembler.value(), SynclavierKBI1MIDIProtocolNRPNChannel);
+    }
+
+    echo.batch.flush();
+}
+
+struct BM_RequestsHost {
+    SynclavierKBI1NRPNRequests*     requests;
+    SynclavierKBI1NRPNAssembler     assembler;
+    long long                       outcomes[3] = {};
+};
+
+static void BM_RequestsReceive(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    auto& host = *(BM_RequestsHost*) refCon;
+
+    for (int i = 0; i + 2 < length; i += 3) {
+        if (host.assembler.controller(bytes[i+1], bytes[i+2]))
+            host.requests->reply(host.assembler.param(), host.assembler.value(), timeStamp);
+    }
+}
+
+static void BM_RequestDone(const SynclavierKBI1NRPNRequests::Result& result, void* refCon)
+{
+    ((BM_RequestsHost*) refCon)->outcomes[result.outcome]++;
+}
+
+static int BM_Requests(int argc, const char* argv[])
+{
+    int queries  = BM_IntOption(argc, argv, "-queries",  200000);
+    int inFlight = BM_IntOption(argc, argv, "-inflight", 8);
+    int loss     = BM_IntOption(argc, argv, "-loss",     10);     // Per 1000
+    int timeout  = BM_IntOption(argc, argv, "-timeout",  100);    // usec, first try
+    int retries  = BM_IntOption(argc, argv, "-retries",  2);
+
+    inFlight = std::max(1, std::min(inFlight, (int) SynclavierKBI1NRPNRequests::kCapacity));
+
+    SynclavierKBI1MIDILoopback    loopback;
+    SynclavierKBI1MIDIOutputBatch batch(SynclavierKBI1MIDITransport::BatchFlushProc, &loopback.host, false);
+    SynclavierKBI1NRPNRequests    requests(&batch);
+    BM_LossyEcho                  echo(loopback.device, loss);
+    BM_RequestsHost               host;
+
+    host.requests = &requests;
+
+    loopback.host.setReceiveProc  (BM_RequestsReceive,  &host);
+    loopback.device.setReceiveProc(BM_LossyEchoReceive, &echo);
+
+    loopback.host.open();
+    loopback.device.open();
+
+    int sent = 0;
+
+    double start = BM_Seconds();
+
+    while (sent < queries || !requests.empty()) {
+        while (sent < queries && requests.inFlight() < inFlight) {
+            int value = sent++ & 0x3FFF;
+
+            requests.send(SynclavierKBI1MIDIProtocolNRPNMessageEcho, value, (uint64_t) timeout * 1000, retries, BM_RequestDone, &host, value);
+        }
+
+        batch.flush();
+
+        requests.expire(SynclavierKBI1HostTimeNow());
+        batch.flush();
+    }
+
+    double elapsed = BM_Seconds() - start;
+
+    auto& stats = requests.stats(SynclavierKBI1MIDIProtocolNRPNMessageEcho);
+    auto& rtt   = stats.roundTrips;
+
+    printf("requests queries     : %d, %d in flight, %lld replies lost (%.1f%%)\n", queries, inFlight, echo.lost, loss / 10.0);
+    printf("requests outcomes    : %lld answered, %lld timed out, %lld retries, %lld unmatched replies\n",
+           host.outcomes[SynclavierKBI1NRPNRequests::Answered], host.outcomes[SynclavierKBI1NRPNRequests::TimedOut], stats.retries, stats.unmatched);
+    printf("requests throughput  : %.0f queries/sec\n", queries / elapsed);
+    printf("requests rtt ns      : min %llu p50 %llu p99 %llu p99.9 %llu max %llu (%lld samples)\n",
+           (unsigned long long) rtt.min(), (unsigned long long) rtt.percentile(0.5), (unsigned long long) rtt.percentile(0.99),
+           (unsigned long long) rtt.percentile(0.999), (unsigned long long) rtt.max(), rtt.samples());
+    printf("requests give up     : %d usec after the first send with no reply\n", timeout * ((2 << retries) - 1));
+
+    long long outcomes = host.outcomes[SynclavierKBI1NRPNRequests::Answered] + host.outcomes[SynclavierKBI1NRPNRequests::TimedOut];
+
+    return outcomes == queries && stats.sent == queries ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// echo - Echo NRPN round-trip latency and throughput against a simulated KBI-1
+// ---------------------------------------------------------------------------------------------
+
+// Stands in for the KBI-1 firmware: echoes are put in a fixed input buffer as they arrive and
+// answered by a thread of its own at up to rate per second. Echoes arriving while the buffer is
+// full are lost, as they would be on the device.
+struct BM_EchoDevice {
+    SynclavierKBI1MIDITransportLoopback*    transport;
+    SynclavierKBI1InputDecoder              decoder;                    // Host's thread
+    SynclavierKBI1EventRing<256>            buffer;
+    std::atomic<bool>                       running;
+    int                                     rate;
+};
+
+static BM_EchoDevice BM_SimulatedKBI1;
+
+static void BM_EchoDeviceNRPN(const SynclavierKBI1InputEvent& input, void* refCon)
+{
+    auto& device = *(BM_EchoDevice*) refCon;
+
+    if (input.number != SynclavierKBI1MIDIProtocolNRPNMessageEcho)
+        return;
+
+    SynclavierKBI1Event event = {};
+
+    event.timeStamp = input.timeStamp;
+    event.type      = SynclavierKBI1EventNRPN;
+    event.param     = input.number;
+    event.value     = input.value;
+
+    device.buffer.push(event);
+}
+
+static void BM_EchoDeviceReceive(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    ((BM_EchoDevice*) refCon)->decoder.receive(bytes, length, timeStamp);
+}
+
+static void BM_EchoDeviceRun(BM_EchoDevice& device)
+{
+    SynclavierKBI1MIDIOutputBatch batch(SynclavierKBI1MIDITransport::BatchFlushProc, device.transport, device.transport->allowsRunningStatus());
+
+    // Token bucket: answers are earned at rate, up to a short burst's worth
+    uint64_t last   = SynclavierKBI1HostTimeNow();
+    double   tokens = 0;
+
+    while (device.running.load()) {
+        uint64_t now = SynclavierKBI1HostTimeNow();
+
+        tokens = std::min(tokens + SynclavierKBI1HostTimeToNanos(now - last) * 1e-9 * device.rate, 8.0);
+        last   = now;
+
+        SynclavierKBI1Event events[8];
+
+        int count = device.buffer.drain(events, (int) tokens);
+
+        for (int i = 0; i < count; i++)
+            batch.sendNRPN(events[i].param, events[i].value, SynclavierKBI1MIDIProtocolNRPNChannel);
+
+        batch.flush();
+        tokens -= count;
+
+        if (count == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+// Also run by the tool against a real KBI-1 with -echo
+int SynclavierKBI1RunEchoTest(SynclavierKBI1MIDITransport& transport, const char* device, int argc, const char* argv[])
+{
+    int rate       = BM_IntOption(argc, argv, "-rate",   0);         // Echoes/sec. 0 to ramp up to the highest sustained rate.
+    int burst      = BM_IntOption(argc, argv, "-burst",  1);
+    int count      = BM_IntOption(argc, argv, "-count",  2000);      // Per step
+    int settle     = BM_IntOption(argc, argv, "-settle", 100);       // ms to wait for the last replies
+    int startRate  = BM_IntOption(argc, argv, "-start",  1000);
+    int maxRate    = BM_IntOption(argc, argv, "-max",    1000000);
+    auto json      = BM_StringOption(argc, argv, "-json", nullptr);  // File for the results. stdout if not given.
+
+    SynclavierKBI1EchoTest                      test(transport);
+    std::vector<SynclavierKBI1EchoTest::Step>   steps;
+
+    int best;
+
+    if (rate > 0) {
+        steps.push_back(test.run(rate, burst, count, settle));
+        best = SynclavierKBI1EchoTest::sustained(steps.back()) ? rate : 0;
+    }
+
+    else
+        best = test.ramp(burst, count, settle, startRate, maxRate, steps);
+
+    FILE* file = json ? fopen(json, "w") : stdout;
+
+    if (!file) {
+        fprintf(stderr, "Could not write %s.\n", json);
+        return 1;
+    }
+
+    SynclavierKBI1EchoTest::printJSON(file, transport.name(), device, steps, best);
+
+    if (file != stdout)
+        fclose(file);
+
+    return best > 0 ? 0 : 1;
+}
+
+static int BM_Echo(int argc, const char* argv[])
+{
+    int deviceRate = BM_IntOption(argc, argv, "-device-rate", 20000);      // Echoes/sec the simulated KBI-1 answers
+
+    SynclavierKBI1MIDILoopback loopback;
+    auto&                      device = BM_SimulatedKBI1;
+
+    device.transport = &loopback.device;
+    device.rate      = std::max(1, deviceRate);
+    device.running.store(true);
+    device.decoder.setProc(SynclavierKBI1InputNRPN, BM_EchoDeviceNRPN, &device);
+
+    loopback.device.setReceiveProc(BM_EchoDeviceReceive, &device);
+
+    loopback.host.open();
+    loopback.device.open();
+
+    std::thread deviceThread(BM_EchoDeviceRun, std::ref(device));
+
+    int result = SynclavierKBI1RunEchoTest(loopback.host, "simulated", argc, argv);
+
+    device.running.store(false);
+    deviceThread.join();
+
+    return result;
+}
+
+// ---------------------------------------------------------------------------------------------
+// parser - MIDI parser throughput on KBI-1 style traffic
+// ---------------------------------------------------------------------------------------------
+
+// A performance on the KBI-1 as it arrives from a byte-stream link: notes and aftertouch on
+// channel 1 with running status, ribbon movements and ribbon pitch bend, pitch bend, mod wheel,
+// sustain pedal, the knob, panel buttons and the occasional status NRPN and clock byte.
+// Status NRPNs carry status, or random values if status is -1.
+static std::vector<uint8_t> BM_KBI1Traffic(size_t size, unsigned seed, int status = -1)
+{
+    std::vector<uint8_t> traffic;
+    std::mt19937         random(seed);
+
+    traffic.reserve(size + 16);
+
+    auto add = [&](int byte) {traffic.push_back(byte);};
+
+    while (traffic.size() < size) {
+        int which = random() % 20;
+        int key   = 36 + random() % 61;
+
+        if (which < 6) {
+            add(0x90); add(key); add(1 + random() % 127);
+
+            for (int i = 0; i < 4; i++) {                       // Pressure with running status
+                add(0xA0);
+                add(key); add(random() % 128);
+                add(key); add(random() % 128);
+            }
+
+            add(0x80); add(key); add(0x40);
+        }
+
+        else if (which < 10) {                                  // Ribbon controller, relative movements
+            add(0xB0 + SynclavierKBI1MIDIProtocolNoteChannel);
+
+            for (int i = 0; i < 8; i++) {
+                add(0x10); add(random() % 128);
+            }
+        }
+
+        else if (which < 12) {                                  // Ribbon pitch bend
+            add(0xE0 + SynclavierKBI1MIDIProtocolRibbonChannel);
+
+            for (int i = 0; i < 8; i++) {
+                add(random() % 128); add(random() % 128);
+            }
+        }
+
+        else if (which < 14) {                                  // Panel button press and release
+            add(0x90 + SynclavierKBI1MIDIProtocolVKChannel); add(random() % 128); add(0x7F);
+            add(0xF8);
+            add(0x80 + SynclavierKBI1MIDIProtocolVKChannel); add(random() % 128); add(0x00);
+        }
+
+        else if (which < 16) {                                  // Status NRPN
+            int param = SynclavierKBI1MIDIProtocolNRPNMessageStatus;
+            int value = status >= 0 ? status : random() % 128;
+            int chan  = 0xB0 + SynclavierKBI1MIDIProtocolNRPNChannel;
+
+            add(chan); add(SynclavierKBI1MIDIProtocolNRPN::nrpnMSB); add(param >> 7);
+            add(chan); add(SynclavierKBI1MIDIProtocolNRPN::nrpnLSB); add(param & 0x7F);
+            add(chan); add(SynclavierKBI1MIDIProtocolNRPN::dataMSB); add(value >> 7);
+            add(chan); add(SynclavierKBI1MIDIProtocolNRPN::dataLSB); add(value & 0x7F);
+        }
+
+        else if (which < 18) {                                  // Mod wheel and sustain pedal
+            add(0xB0 + SynclavierKBI1MIDIProtocolNoteChannel);
+            add(0x01); add(random() % 128);
+            add(0x40); add(0x7F);
+            add(0x40); add(0x00);
+        }
+
+        else {                                                  // Pitch bend and knob
+            int chan = which == 18 ? SynclavierKBI1MIDIProtocolNoteChannel : SynclavierKBI1MIDIProtocolKnobChannel;
+
+            add(0xE0 + chan); add(random() % 128); add(random() % 128);
+            add(random() % 128); add(random() % 128);
+        }
+    }
+
+    return traffic;
+}
+
+struct BM_ParserCounter : SynclavierKBI1MIDIParserHandler {
+    long long messages  = 0;
+    long long realTimes = 0;
+    long long sum       = 0;
+
+    inline void message(uint8_t status, uint8_t data1, uint8_t data2) {messages++; sum += status + data1 + data2;}
+    inline void realTime(uint8_t status)                             {realTimes++;}
+};
+
+static int BM_Parser(int argc, const char* argv[])
+{
+    int megabytes = BM_IntOption(argc, argv, "-megabytes", 256);
+    int packet    = BM_IntOption(argc, argv, "-packet",    64);
+
+    auto traffic = BM_KBI1Traffic(1 << 20, 1);
+
+    if (packet < 1)
+        packet = 1;
+
+    SynclavierKBI1MIDIParser parser;
+    BM_ParserCounter         counter;
+
+    double start = BM_Seconds();
+
+    for (int pass = 0; pass < megabytes; pass++) {
+        const uint8_t* bytes  = traffic.data();
+        int            length = (int) traffic.size();
+
+        while (length > 0) {
+            int chunk = length < packet ? length : packet;
+
+            parser.parse(bytes, chunk, counter);
+
+            bytes  += chunk;
+            length -= chunk;
+        }
+    }
+
+    double elapsed = BM_Seconds() - start;
+    double bytes   = (double) traffic.size() * megabytes;
+
+    printf("parser input         : %.0f MB in %d byte packets (checksum %lld)\n", bytes / 1e6, packet, counter.sum);
+    printf("parser messages      : %lld messages %lld real-time %lld discarded\n", counter.messages, counter.realTimes, parser.discarded());
+    printf("parser throughput    : %.0f MB/s %.1f M messages/sec\n", bytes / elapsed / 1e6, counter.messages / elapsed / 1e6);
+
+    return parser.discarded() == 0 ? 0 : 1;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// fuzz - MIDI parser differential fuzzing
+// ---------------------------------------------------------------------------------------------
+
+// Records everything the parser hands on, one entry per message, real-time byte or SysEx byte, so
+// runs over different packet splits of the same stream can be compared.
+struct BM_ParserRecorder : SynclavierKBI1MIDIParserHandler {
+    std::vector<uint32_t>   log;
+    long long               errors = 0;
+    bool                    inSysEx = false;
+
+    inline void message(uint8_t status, uint8_t data1, uint8_t data2) {
+        auto& info = SynclavierKBI1MIDIStatusTable[status];
+
+        if (status < 0x80 || data1 >= 0x80 || data2 >= 0x80 || inSysEx)
+            errors++;
+
+        if (info.kind != SynclavierKBI1MIDIStatusChannel && info.kind != SynclavierKBI1MIDIStatusCommon)
+            errors++;
+
+        if ((info.dataBytes < 1 && data1) || (info.dataBytes < 2 && data2))
+            errors++;
+
+        log.push_back(status << 16 | data1 << 8 | data2);
+    }
+
+    inline void realTime(uint8_t status) {
+        if (status < 0xF8)
+            errors++;
+
+        log.push_back(0x1000000 | status);
+    }
+
+    inline void sysEx(const uint8_t* bytes, int length, bool start, bool end) {
+        if (start == inSysEx || (start && (length < 1 || bytes[0] != 0xF0)))
+            errors++;
+
+        for (int i = 0; i < length; i++) {
+            if (bytes[i] >= 0x80 && !(start && i == 0) && !(end && i == length-1 && bytes[i] == 0xF7))
+                errors++;
+
+            log.push_back(0x2000000 | bytes[i]);
+        }
+
+        if (end)
+            log.push_back(0x3000000);
+
+        inSysEx = !end;
+    }
+};
+
+// Seed corpus. Each entry is mutated and fed to the parser with random packet splits.
+static const std::vector<std::vector<uint8_t>> BM_FuzzCorpus =
+{
+    {0xB1, 0x63, 0x00, 0xB1, 0x62, 0x01, 0xB1, 0x06, 0x00, 0xB1, 0x26, 0x03},     // Status NRPN
+    {0xB1, 0x63, 0x00, 0x62, 0x01, 0x06, 0x00, 0x26, 0x03},                         // Same with running status
+    {0x90, 0x3C, 0x40, 0x3E, 0x40, 0x40, 0x40, 0x80, 0x3C, 0x00},                   // Chord, running status
+    {0x90, 0x3C, 0xF8, 0x40, 0xFE, 0x3E, 0xFA, 0x40},                               // Real-time mid message
+    {0xC0, 0x05, 0x06, 0xD0, 0x10, 0x20, 0x30},                                     // 1 data byte messages
+    {0xF0, 0x00, 0x01, 0x02, 0xF8, 0x03, 0xF7, 0x91, 0x10, 0x20},                   // SysEx with clock inside
+    {0xF0, 0x7E, 0x7F, 0x06, 0x01, 0x90, 0x3C, 0x40},                               // SysEx ended by a status byte
+    {0xF1, 0x10, 0xF2, 0x01, 0x02, 0xF3, 0x04, 0xF6, 0x3C, 0x40},                   // System Common cancels running status
+    {0x3C, 0x40, 0xF7, 0x90, 0x3C, 0xB0, 0x10, 0x20},                               // Stray data, stray EOX, truncated note
+    {0xE5, 0x00, 0x40, 0x7F, 0x7F, 0xB5, 0x10, 0x40, 0x11, 0x40},                   // Pitch wheel and ribbon
+};
+
+static void BM_FuzzParse(const std::vector<uint8_t>& stream, const std::vector<int>& splits, BM_ParserRecorder& recorder)
+{
+    SynclavierKBI1MIDIParser parser;
+
+    size_t offset = 0;
+
+    for (int split : splits) {
+        parser.parse(stream.data() + offset, split, recorder);
+        offset += split;
+    }
+
+    parser.parse(stream.data() + offset, (int) (stream.size() - offset), recorder);
+}
+
+static int BM_Fuzz(int argc, const char* argv[])
+{
+    int iterations = BM_IntOption(argc, argv, "-iterations", 100000);
+    int seed       = BM_IntOption(argc, argv, "-seed",       1);
+
+    std::mt19937 random(seed);
+
+    long long failures = 0;
+    long long bytes    = 0;
+
+    double start = BM_Seconds();
+
+    for (int i = 0; i < iterations; i++) {
+        std::vector<uint8_t> stream;
+
+        // Splice a few corpus entries together and mutate them
+        for (int n = 1 + random() % 4; n > 0; n--) {
+            auto& entry = BM_FuzzCorpus[random() % BM_FuzzCorpus.size()];
+            stream.insert(stream.end(), entry.begin(), entry.end());
+        }
+
+        for (int n = random() % 4; n > 0; n--) {
+            size_t where = random() % stream.size();
+
+            switch (random() % 3) {
+                case 0: stream[where] = random() % 256;                         break;
+                case 1: stream.insert(stream.begin() + where, random() % 256);  break;
+                case 2: if (stream.size() > 1) stream.erase(stream.begin() + where); break;
+            }
+        }
+
+        bytes += stream.size();
+
+        // Whole stream at once, one byte at a time, and split at random
+        std::vector<int> whole, single, splits;
+
+        for (size_t n = 1; n < stream.size(); n++)
+            single.push_back(1);
+
+        for (size_t left = stream.size(); left > 1; ) {
+            int split = 1 + random() % left;
+            splits.push_back(split);
+            left -= split;
+        }
+
+        BM_ParserRecorder a, b, c;
+
+        BM_FuzzParse(stream, whole,  a);
+        BM_FuzzParse(stream, single, b);
+        BM_FuzzParse(stream, splits, c);
+
+        if (a.errors || b.errors || c.errors || a.log != b.log || a.log != c.log) {
+            if (failures++ < 10) {
+                printf("fuzz failure         :");
+
+                for (auto byte : stream)
+                    printf(" %02X", byte);
+
+                printf("\n");
+            }
+        }
+    }
+
+    double elapsed = BM_Seconds() - start;
+
+    printf("fuzz streams         : %d (%lld bytes) seed %d\n", iterations, bytes, seed);
+    printf("fuzz failures        : %lld\n", failures);
+    printf("fuzz rate            : %.0f streams/sec\n", iterations / elapsed);
+
+    return failures == 0 ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// decoder - typed input decoding, packet arrival to callback latency
+// ---------------------------------------------------------------------------------------------
+
+struct BM_DecoderStats {
+    long long               counts[SynclavierKBI1InputTypes] = {};
+    std::vector<uint32_t>   latencies;                          // Nanoseconds, packet arrival to callback
+};
+
+static void BM_DecoderProc(const SynclavierKBI1InputEvent& event, void* refCon)
+{
+    auto& stats = *(BM_DecoderStats*) refCon;
+
+    uint64_t now = SynclavierKBI1HostTimeNow();
+
+    stats.counts[event.type]++;
+
+    if (stats.latencies.size() < stats.latencies.capacity())
+        stats.latencies.push_back((uint32_t) SynclavierKBI1HostTimeToNanos(now - event.timeStamp));
+}
+
+static void BM_DecoderReceive(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    ((SynclavierKBI1InputDecoder*) refCon)->receive(bytes, length, timeStamp);
+}
+
+static int BM_Decoder(int argc, const char* argv[])
+{
+    int megabytes = BM_IntOption(argc, argv, "-megabytes", 64);
+    int packet    = BM_IntOption(argc, argv, "-packet",    64);
+
+    if (packet < 1)
+        packet = 1;
+
+    auto traffic = BM_KBI1Traffic(1 << 20, 1);
+
+    SynclavierKBI1MIDILoopback loopback;
+    SynclavierKBI1InputDecoder decoder;
+    BM_DecoderStats            stats;
+
+    stats.latencies.reserve(1 << 20);
+
+    for (int type = SynclavierKBI1InputNote; type < SynclavierKBI1InputTypes; type++)
+        decoder.setProc((SynclavierKBI1InputType) type, BM_DecoderProc, &stats);
+
+    loopback.host.setReceiveProc(BM_DecoderReceive, &decoder);
+    loopback.host.open();
+    loopback.device.open();
+
+    double start = BM_Seconds();
+
+    for (int pass = 0; pass < megabytes; pass++) {
+        for (size_t offset = 0; offset < traffic.size(); offset += packet) {
+            int chunk = (int) std::min((size_t) packet, traffic.size() - offset);
+
+            // Time stamped on arrival by the loopback, as a transport does
+            loopback.device.send(traffic.data() + offset, chunk, 0);
+        }
+    }
+
+    double elapsed = BM_Seconds() - start;
+
+    static const char* names[SynclavierKBI1InputTypes] = {
+        "none", "note", "pressure", "bend", "controller", "pedal", "ribbon", "ribbon bend", "knob", "button", "nrpn"
+    };
+
+    printf("decoder events       : %lld in %.0f MB (%.1f M events/sec)\n", decoder.events(), (double) traffic.size() * megabytes / 1e6, decoder.events() / elapsed / 1e6);
+
+    for (int type = SynclavierKBI1InputNote; type < SynclavierKBI1InputTypes; type++)
+        printf("decoder %-12s : %lld\n", names[type], stats.counts[type]);
+
+    auto& latencies = stats.latencies;
+
+    std::sort(latencies.begin(), latencies.end());
+
+    if (!latencies.empty()) {
+        auto at = [&](double fraction) {return latencies[(size_t) (fraction * (latencies.size() - 1))];};
+
+        printf("decoder latency ns   : min %u median %u p99 %u p99.9 %u max %u (%zu samples)\n",
+               at(0), at(0.5), at(0.99), at(0.999), at(1), latencies.size());
+    }
+
+    return decoder.discarded() == 0 && decoder.nrpnsRejected() == 0 ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// timers - timer wheel cost and event loop wake-ups
+// ---------------------------------------------------------------------------------------------
+
+struct BM_TimerTask {
+    SynclavierKBI1Timer timer;
+    uint64_t            expected;                               // ms, when it should next fire
+    long long           late;                                   // Fired at the wrong time
+};
+
+static uint64_t BM_TimerNow;
+
+static void BM_TimerFire(SynclavierKBI1Timer& timer, void* refCon)
+{
+    auto& task = *(BM_TimerTask*) refCon;
+
+    if (BM_TimerNow != task.expected)
+        task.late++;
+
+    task.expected = timer.due();
+}
+
+static int BM_Timers(int argc, const char* argv[])
+{
+    int count   = BM_IntOption(argc, argv, "-timers",  1000);
+    int seconds = BM_IntOption(argc, argv, "-seconds", 600);
+
+    std::mt19937             random(1);
+    std::vector<BM_TimerTask> tasks(count);
+    SynclavierKBI1TimerWheel wheel(0);
+
+    // The demo's tasks plus a spread of others from 1 ms to 10 s
+    static const int periods[] = {1000, 50, 33, 250};
+
+    double start = BM_Seconds();
+
+    for (int i = 0; i < count; i++) {
+        auto& task   = tasks[i];
+        int   period = i < 4 ? periods[i] : 1 + random() % 10000;
+
+        new (&task.timer) SynclavierKBI1Timer(BM_TimerFire, &task, period);
+        task.late = 0;
+
+        wheel.schedule(task.timer, period);
+        task.expected = period;
+    }
+
+    double scheduled = BM_Seconds();
+
+    // Run the loop as main() does: wake when the next timer is due
+    long long wakes = 0;
+    uint64_t  end   = (uint64_t) seconds * 1000;
+
+    while (true) {
+        int64_t wait = wheel.untilNext(BM_TimerNow);
+
+        if (wait < 0 || BM_TimerNow + wait > end)
+            break;
+
+        BM_TimerNow += wait;
+        wheel.advance(BM_TimerNow);
+        wakes++;
+    }
+
+    double elapsed = BM_Seconds() - scheduled;
+
+    long long late = 0;
+
+    for (auto& task : tasks) {
+        late += task.late;
+        wheel.cancel(task.timer);
+    }
+
+    printf("timers               : %d timers for %d simulated seconds\n", count, seconds);
+    printf("timers schedule      : %.0f ns/timer\n", (scheduled - start) * 1e9 / count);
+    printf("timers fired         : %lld (%lld at the wrong time) %.0f ns/fire\n", wheel.fired(), late, elapsed * 1e9 / wheel.fired());
+    printf("timers wakes         : %lld (vs %llu polling every ms, %d polling every second)\n", wakes, (unsigned long long) end, seconds);
+
+    return late == 0 && wheel.scheduledTimers() == 0 ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// jitter - scheduled output timing through the loopback transport
+// ---------------------------------------------------------------------------------------------
+
+struct BM_JitterReceiver {
+    const uint64_t*         scheduled;                          // Host time each message was scheduled for, in order
+    std::vector<int64_t>    error;                              // ns, arrival - scheduled
+};
+
+static void BM_JitterReceive(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    auto& receiver = *(BM_JitterReceiver*) refCon;
+
+    uint64_t arrived = SynclavierKBI1HostTimeNow();
+
+    for (int i = 0; i + 2 < length; i += 3) {
+        size_t which = receiver.error.size();
+
+        receiver.error.push_back((int64_t) SynclavierKBI1HostTimeToNanos(arrived) - (int64_t) SynclavierKBI1HostTimeToNanos(receiver.scheduled[which]));
+    }
+}
+
+// Wait until host time. Sleeps, then spins for the last spin ns if spin is not 0.
+static void BM_WaitUntil(uint64_t time, uint64_t spin)
+{
+    uint64_t now = SynclavierKBI1HostTimeToNanos(SynclavierKBI1HostTimeNow());
+    uint64_t due = SynclavierKBI1HostTimeToNanos(time);
+
+    if (due > now + spin)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - spin));
+
+    while (spin && SynclavierKBI1HostTimeNow() < time)
+        ;
+}
+
+static int BM_JitterRun(const char* mode, int events, int interval, uint64_t spin)
+{
+    static SynclavierKBI1OutputScheduler<> scheduler;
+
+    SynclavierKBI1MIDILoopback loopback;
+    BM_JitterReceiver          receiver;
+    std::vector<uint64_t>      scheduled(events);
+
+    receiver.scheduled = scheduled.data();
+    receiver.error.reserve(events);
+
+    loopback.device.setReceiveProc(BM_JitterReceive, &receiver);
+    loopback.host.open();
+    loopback.device.open();
+
+    scheduler.setTransport(&loopback.host);
+
+    // A tempo light: on and off on alternate ticks
+    uint64_t start = SynclavierKBI1HostTimeNow() + SynclavierKBI1NanosToHostTime(10000000);
+
+    for (int i = 0; i < events; i++)
+        scheduled[i] = start + SynclavierKBI1NanosToHostTime((uint64_t) i * interval * 1000);
+
+    int queued = 0;
+
+    while (receiver.error.size() < (size_t) events) {
+
+        // Keep the queue topped up ahead of time, as a sequencer would
+        while (queued < events && scheduler.pending() < 256) {
+            scheduler.sendButton(scheduled[queued], SynclavierKBI1MIDIProtocolVKChannel, 0, (queued & 1) ? SynclavierKBI1MIDIProtocolButtonOff : SynclavierKBI1MIDIProtocolButtonOn);
+            queued++;
+        }
+
+        BM_WaitUntil(scheduler.next(), spin);
+        scheduler.dispatch(SynclavierKBI1HostTimeNow());
+    }
+
+    auto& error = receiver.error;
+    std::vector<int64_t> jitter(error.size());
+
+    double mean = 0;
+
+    for (size_t i = 0; i < error.size(); i++) {
+        jitter[i] = error[i] < 0 ? -error[i] : error[i];
+        mean     += error[i];
+    }
+
+    std::sort(jitter.begin(), jitter.end());
+
+    auto at = [&](double fraction) {return jitter[(size_t) (fraction * (jitter.size() - 1))] / 1000.0;};
+
+    printf("jitter %-5s usec     : median %.1f p99 %.1f p99.9 %.1f max %.1f, mean lateness %.1f (%d events every %d usec)\n",
+           mode, at(0.5), at(0.99), at(0.999), at(1), mean / error.size() / 1000.0, events, interval);
+
+    return scheduler.overflows() == 0 ? 0 : 1;
+}
+
+static int BM_Jitter(int argc, const char* argv[])
+{
+    int events   = BM_IntOption(argc, argv, "-events",   2000);
+    int interval = BM_IntOption(argc, argv, "-interval", 1000);   // usec
+    int spin     = BM_IntOption(argc, argv, "-spin",     200);    // usec
+
+    if (events < 1 || interval < 1)
+        return 1;
+
+    // Sleeping only, as a busy application thread would, then sleeping and spinning the last part
+    int result  = BM_JitterRun("sleep", events, interval, 0);
+    result     |= BM_JitterRun("spin",  events, interval, (uint64_t) spin * 1000);
+
+    return result;
+}
+
+// ---------------------------------------------------------------------------------------------
+// repeat - repeat and arpeggiate timing through the loopback transport
+// ---------------------------------------------------------------------------------------------
+
+struct BM_RepeatReceiver {
+    std::vector<int>        notes;                              // Note ons, in order of arrival
+    std::vector<uint64_t>   arrived;                            // Host time of each
+    std::vector<uint64_t>   due;                                // Host time each was queued for
+    uint64_t                sending;                            // Time being dispatched
+    std::atomic<int>        ons;
+    std::atomic<int>        offs;
+};
+
+static void BM_RepeatReceive(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    auto& receiver = *(BM_RepeatReceiver*) refCon;
+
+    uint64_t arrived = SynclavierKBI1HostTimeNow();
+
+    for (int i = 0; i + 2 < length; i += 3) {
+        if ((bytes[i] & 0xF0) == 0x90 && bytes[i + 2]) {
+            if (receiver.notes.size() < receiver.notes.capacity()) {
+                receiver.notes.push_back(bytes[i + 1]);
+                receiver.arrived.push_back(arrived);
+                receiver.due.push_back(receiver.sending);
+            }
+
+            receiver.ons++;
+        }
+
+        else if ((bytes[i] & 0xF0) == 0x80)
+            receiver.offs++;
+    }
+}
+
+// Dispatch one queued time at a time, so the receiver knows what each note was queued for
+static void BM_RepeatDispatch(SynclavierKBI1OutputScheduler<>& scheduler, BM_RepeatReceiver& receiver, uint64_t now)
+{
+    while (scheduler.next() && scheduler.next() <= now) {
+        receiver.sending = scheduler.next();
+        scheduler.dispatch(receiver.sending);
+    }
+}
+
+// Hold chord, put pedal down for steps steps, then check what arrived and when
+static int BM_RepeatRun(const char* mode, int pedal, bool tempo, const std::vector<int>& chord,
+                        const std::vector<int>& expect, int steps, double rate, uint64_t lookahead, uint64_t spin)
+{
+    static SynclavierKBI1OutputScheduler<> scheduler;
+
+    SynclavierKBI1MIDILoopback  loopback;
+    SynclavierKBI1NoteState     notes;
+    SynclavierKBI1RepeatEngine  engine(notes, scheduler);
+    BM_RepeatReceiver           receiver;
+
+    receiver.notes.reserve((size_t) steps * chord.size() + 16);
+    receiver.arrived.reserve((size_t) steps * chord.size() + 16);
+    receiver.due.reserve((size_t) steps * chord.size() + 16);
+    receiver.sending = 0;
+    receiver.ons  = 0;
+    receiver.offs = 0;
+
+    loopback.device.setReceiveProc(BM_RepeatReceive, &receiver);
+    loopback.host.open();
+    loopback.device.open();
+
+    scheduler.setTransport(&loopback.host);
+
+    engine.setPattern(SynclavierKBI1RepeatEngine::PatternUpDown);
+
+    // 4 steps a beat, with a beat somewhere in the past
+    if (tempo)
+        engine.setTempo(rate * 15, 4, SynclavierKBI1HostTimeNow() - SynclavierKBI1NanosToHostTime(123456789));
+    else
+        engine.setRate(rate);
+
+    for (int note : chord)
+        notes.noteOn(note);
+
+    notes.pedal(pedal, true, SynclavierKBI1HostTimeNow());
+
+    double cpu = 0;
+
+    while (engine.steps() < steps) {
+        double before = BM_Seconds();
+
+        engine.run(SynclavierKBI1HostTimeNow(), lookahead);
+
+        cpu += BM_Seconds() - before;
+
+        uint64_t next = engine.next() - (lookahead < engine.next() ? lookahead : 0);
+
+        BM_WaitUntil(scheduler.next() && scheduler.next() < next ? scheduler.next() : next, spin);
+        BM_RepeatDispatch(scheduler, receiver, SynclavierKBI1HostTimeNow());
+    }
+
+    notes.pedal(pedal, false, SynclavierKBI1HostTimeNow());
+    engine.run(SynclavierKBI1HostTimeNow(), lookahead);
+
+    // Play out what is left in the lookahead
+    while (!scheduler.empty()) {
+        BM_WaitUntil(scheduler.next(), spin);
+        BM_RepeatDispatch(scheduler, receiver, SynclavierKBI1HostTimeNow());
+    }
+
+    loopback.device.close();
+    loopback.host.close();
+
+    // Arrival against the step each note was queued for, and the step against the grid
+    uint64_t origin = engine.stepOrigin();
+    double   period = engine.stepPeriod();
+    int      wrong  = 0;
+    int      offGrid = 0;
+
+    std::vector<int64_t> error(receiver.arrived.size());
+
+    for (size_t i = 0; i < error.size(); i++) {
+        double step = ((double) receiver.due[i] - (double) origin) / period;
+
+        if (fabs(step - floor(step + 0.5)) * period > 1)
+            offGrid++;
+
+        error[i] = (int64_t) SynclavierKBI1HostTimeToNanos(receiver.arrived[i]) - (int64_t) SynclavierKBI1HostTimeToNanos(receiver.due[i]);
+        error[i] = error[i] < 0 ? -error[i] : error[i];
+
+        if (receiver.notes[i] != expect[i % expect.size()])
+            wrong++;
+    }
+
+    std::sort(error.begin(), error.end());
+
+    auto at = [&](double fraction) {return error.empty() ? 0 : error[(size_t) (fraction * (error.size() - 1))] / 1000.0;};
+
+    printf("repeat %-10s usec  : median %.1f p99 %.1f max %.1f, %.0f ns/note to generate (%lld steps, %lld notes, %lld skipped)\n",
+           mode, at(0.5), at(0.99), at(1), cpu * 1e9 / (engine.played() ? engine.played() : 1),
+           engine.steps(), engine.played(), engine.skipped());
+
+    // A skipped step is a step run() was too late to play at all
+    if (wrong || offGrid || engine.skipped() || receiver.ons != receiver.offs || receiver.ons != engine.played()) {
+        printf("repeat %-10s       : FAILED, %d out of order, %d off the grid, %lld steps skipped, %d note ons, %d note offs\n",
+               mode, wrong, offGrid, engine.skipped(), receiver.ons.load(), receiver.offs.load());
+        return 1;
+    }
+
+    return scheduler.overflows() == 0 ? 0 : 1;
+}
+
+static int BM_Repeat(int argc, const char* argv[])
+{
+    int steps     = BM_IntOption(argc, argv, "-steps",     500);
+    int rate      = BM_IntOption(argc, argv, "-rate",      100);    // Steps per second
+    int lookahead = BM_IntOption(argc, argv, "-lookahead", 2000);   // usec
+    int spin      = BM_IntOption(argc, argv, "-spin",      200);    // usec
+
+    if (steps < 1 || rate < 1)
+        return 1;
+
+    std::vector<int> chord  = {60, 64, 67, 72};
+    std::vector<int> updown = {60, 64, 67, 72, 67, 64};
+
+    uint64_t ahead = SynclavierKBI1NanosToHostTime((uint64_t) lookahead * 1000);
+
+    // Whole chord on each step at a set rate, then one note a step following a tempo
+    int result  = BM_RepeatRun("repeat",     SynclavierKBI1NoteState::PedalRepeat,     false, chord, chord,  steps, rate, ahead, (uint64_t) spin * 1000);
+    result     |= BM_RepeatRun("arpeggiate", SynclavierKBI1NoteState::PedalArpeggiate, true,  chord, updown, steps, rate, ahead, (uint64_t) spin * 1000);
+
+    // A big chord under Repeat with a second of lookahead fills the scheduler. Every note on queued needs its note off.
+    static SynclavierKBI1OutputScheduler<> fullScheduler;
+
+    SynclavierKBI1MIDILoopback  fullLink;
+    SynclavierKBI1NoteState     fullNotes;
+    SynclavierKBI1RepeatEngine  fullEngine(fullNotes, fullScheduler);
+    BM_RepeatReceiver           fullReceiver;
+
+    fullReceiver.ons  = 0;
+    fullReceiver.offs = 0;
+
+    fullLink.device.setReceiveProc(BM_RepeatReceive, &fullReceiver);
+    fullLink.host.open();
+    fullLink.device.open();
+
+    fullScheduler.setTransport(&fullLink.host);
+    fullEngine.setRate(rate);
+
+    for (int note = 24; note < 120; note++)
+        fullNotes.noteOn(note);
+
+    uint64_t now    = SynclavierKBI1HostTimeNow();
+    uint64_t second = SynclavierKBI1NanosToHostTime(1000000000);
+
+    // Something else on the scheduler too, so pairs of note on and off do not fill it exactly
+    fullScheduler.sendButton(now, SynclavierKBI1MIDIProtocolVKChannel, 1, 0);
+
+    fullNotes.pedal(SynclavierKBI1NoteState::PedalRepeat, true, now);
+    fullEngine.run(now, second);
+
+    bool filled = fullScheduler.room() < 2;
+
+    fullScheduler.dispatch(now, 2 * second);
+
+    printf("repeat full          : %d note ons, %d note offs, %lld played, scheduler %s\n",
+           fullReceiver.ons.load(), fullReceiver.offs.load(), fullEngine.played(), filled ? "filled" : "FAILED to fill");
+
+    if (!filled || fullReceiver.ons != fullReceiver.offs || fullReceiver.ons != fullEngine.played())
+        result |= 1;
+
+    return result;
+}
+
+// ---------------------------------------------------------------------------------------------
+// priority - status queries during full-panel redraws, with an output budget
+// ---------------------------------------------------------------------------------------------
+
+typedef SynclavierKBI1OutputQueues<> BM_PriorityQueues;
+
+struct BM_PriorityHost {
+    BM_PriorityQueues*  queues;
+    uint64_t            now;                                    // Simulated host time
+};
+
+static void BM_PriorityFlush(const unsigned char* bytes, int length, void* refCon)
+{
+    auto& host = *(BM_PriorityHost*) refCon;
+
+    host.queues->receive(bytes, length, host.now);
+}
+
+static int BM_Priority(int argc, const char* argv[])
+{
+    int ms         = BM_IntOption(argc, argv, "-ms",     10000);    // Simulated
+    int budget     = BM_IntOption(argc, argv, "-budget", 32);       // Bytes per ms
+    int burst      = BM_IntOption(argc, argv, "-burst",  256);
+    int redraw     = BM_IntOption(argc, argv, "-redraw", 100);      // ms between full-panel redraws
+
+    SynclavierKBI1MIDILoopback      link;
+    SynclavierKBI1SimulatedDevice   kbi1(link.device);
+    BM_PriorityQueues               queues(&link.host);
+    BM_PriorityHost                 host = {&queues, 0};
+    SynclavierKBI1MIDIOutputBatch   batch(BM_PriorityFlush, &host, false);
+    SynclavierKBI1PanelState        panel;
+
+    link.host.open();
+    link.device.open();
+
+    kbi1.setKeyboard(SynclavierKBI1MIDIProtocolNRPNMessageVKHere);
+    kbi1.powerOn();
+
+    queues.setRunningStatus(link.host.allowsRunningStatus());
+    queues.setBudget(budget, burst);
+
+    std::mt19937 random(1);
+    char         text[64];
+
+    // The same traffic through one queue in call order, for comparison
+    double    fifoBacklog = 0;
+    double    fifoMaxWait = 0;
+    long long fifoBytes   = 0;
+
+    auto fifo = [&](int bytes, bool control) {
+        if (control && fifoBacklog / budget > fifoMaxWait)
+            fifoMaxWait = fifoBacklog / budget;
+
+        fifoBacklog += bytes;
+        fifoBytes   += bytes;
+    };
+
+    double start = BM_Seconds();
+
+    for (int tick = 0; tick < ms; tick++) {
+        host.now = SynclavierKBI1NanosToHostTime((uint64_t) tick * 1000000);
+
+        long long before = batch.bytes() + batch.pending();
+
+        // Full-panel redraw: every light and both lines rewritten, as after a mode change
+        if (tick % redraw == 0) {
+            for (int button = 0; button < 128; button++)
+                panel.leds.set(SynclavierKBI1MIDIProtocolVKChannel, button, (SynclavierKBI1LEDState::LED) (random() % 4));
+
+            snprintf(text, sizeof(text), "PAGE %-4d  TRACK %2d  BAR %4d.%d", tick / redraw, (int) (random() % 32), tick / 500, tick / 50 % 10);
+            panel.display.setVKLine(0, text);
+            snprintf(text, sizeof(text), "VOLUME %5.1f  PAN %4d  TEMPO %5.1f", (random() % 1000) / 10.0, (int) (random() % 128) - 64, 120.0);
+            panel.display.setVKLine(1, text);
+
+            panel.invalidate();
+            panel.flush(batch);
+        }
+
+        // A few lights blink every ms, some more than once before they can go out
+        for (int i = 0; i < 4; i++)
+            panel.leds.set(SynclavierKBI1MIDIProtocolVKAltChannel, (int) (random() % 8), (SynclavierKBI1LEDState::LED) (random() % 4));
+
+        // A meter on the top line every 10 ms
+        if (tick % 10 == 0) {
+            snprintf(text, sizeof(text), "PAGE %-4d  TRACK %2d  BAR %4d.%d", tick / redraw, 1, tick / 500, tick / 50 % 10);
+            panel.display.setVKLine(0, text);
+        }
+
+        panel.flush(batch);
+
+        fifo((int) (batch.bytes() + batch.pending() - before), false);
+
+        // Status query every 5 ms
+        if (tick % 5 == 0) {
+            batch.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNAskValue, SynclavierKBI1MIDIProtocolNRPNChannel);
+            fifo(12, true);
+        }
+
+        batch.flush();
+        queues.dispatch(host.now);
+
+        fifoBacklog = std::max(0.0, fifoBacklog - budget);
+    }
+
+    double elapsed = BM_Seconds() - start;
+
+    // Let everything out, then the KBI-1 must show what the host wants
+    for (int tick = ms; !queues.empty(); tick++)
+        queues.dispatch(SynclavierKBI1NanosToHostTime((uint64_t) tick * 1000000));
+
+    int differences = 0;
+
+    for (int channel : {SynclavierKBI1MIDIProtocolVKChannel, SynclavierKBI1MIDIProtocolVKAltChannel}) {
+        for (int button = 0; button < 128; button++)
+            differences += kbi1.leds.get(channel, button) != panel.leds.get(channel, button);
+    }
+
+    char want[64];
+
+    kbi1.vkLine(0, want, sizeof(want));
+
+    if (strcmp(want, text) != 0) {
+        printf("priority             : FAILED, VK shows \"%s\", host wants \"%s\"\n", want, text);
+        differences++;
+    }
+
+    printf("priority budget      : %d bytes/ms, burst %d, full redraw every %d ms, %d ms simulated in %.3f s\n", budget, burst, redraw, ms, elapsed);
+
+    for (int priority = 0; priority < BM_PriorityQueues::kPriorities; priority++) {
+        printf("priority %-12s: %8lld queued %8lld sent %8lld bytes %8lld stale %4lld overflows  peak depth %4d  max wait %6.2f ms\n",
+               BM_PriorityQueues::name(priority), queues.queued(priority), queues.sent(priority), queues.bytes(priority),
+               queues.stale(priority), queues.overflows(priority), queues.peak(priority), queues.maxWait(priority) / 1e6);
+    }
+
+    long long sentBytes = 0;
+
+    for (int priority = 0; priority < BM_PriorityQueues::kPriorities; priority++)
+        sentBytes += queues.bytes(priority);
+
+    printf("priority fifo        : %8lld bytes, status query max wait %.2f ms (%.1f%% more bytes than with stale dropping)\n",
+           fifoBytes, fifoMaxWait, 100.0 * (fifoBytes - sentBytes) / std::max(1LL, sentBytes));
+    printf("priority panel       : %s\n", differences ? "FAILED" : "ok");
+
+    // A Refresh while lights are still waiting: the Clear drops them, and the lights restore()
+    // sets again after it must go out rather than merge into what was dropped
+    SynclavierKBI1MIDILoopback      refreshLink;
+    SynclavierKBI1SimulatedDevice   refreshKBI1(refreshLink.device);
+    BM_PriorityQueues               refreshQueues(&refreshLink.host);
+    BM_PriorityHost                 refreshHost = {&refreshQueues, 0};
+    SynclavierKBI1MIDIOutputBatch   refreshBatch(BM_PriorityFlush, &refreshHost, false);
+    SynclavierKBI1PanelState        refreshPanel;
+
+    refreshLink.host.open();
+    refreshLink.device.open();
+
+    refreshKBI1.setKeyboard(SynclavierKBI1MIDIProtocolNRPNMessageVKHere);
+    refreshKBI1.powerOn();
+
+    refreshQueues.setBudget(1, 3);                              // One light at a time
+
+    refreshHost.now = SynclavierKBI1NanosToHostTime(1000000);
+
+    refreshPanel.leds.set(SynclavierKBI1MIDIProtocolVKChannel, 10, SynclavierKBI1LEDState::LEDOn);
+    refreshPanel.leds.set(SynclavierKBI1MIDIProtocolVKChannel, 11, SynclavierKBI1LEDState::LEDOn);
+    refreshPanel.flush(refreshBatch);
+    refreshBatch.flush();
+    refreshQueues.dispatch(refreshHost.now);
+
+    int stillWaiting = refreshQueues.pending(BM_PriorityQueues::PriorityLEDs);
+
+    refreshPanel.restore(refreshBatch);
+    refreshBatch.flush();
+
+    for (int tick = 2; !refreshQueues.empty(); tick++)
+        refreshQueues.dispatch(SynclavierKBI1NanosToHostTime((uint64_t) tick * 1000000));
+
+    int dark = 0;
+
+    for (int button : {10, 11})
+        dark += refreshKBI1.leds.get(SynclavierKBI1MIDIProtocolVKChannel, button) != SynclavierKBI1LEDState::LEDOn;
+
+    printf("priority refresh     : Clear with %d light%s waiting, %d of 2 lights dark after the restore\n", stillWaiting, stillWaiting == 1 ? "" : "s", dark);
+
+    if (dark || stillWaiting == 0)
+        differences++;
+
+    return differences ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// devices - input throughput with 1, 4 and 16 KBI-1s, each with its own device state
+// ---------------------------------------------------------------------------------------------
+
+static const int BM_kMaxDevices = 16;
+
+// Devices hold cache-line aligned rings so they are static
+static SynclavierKBI1Device         BM_Devices[BM_kMaxDevices];
+static SynclavierKBI1MIDILoopback   BM_DeviceLinks[BM_kMaxDevices];
+
+// Counted on each device's MIDI thread. A line each so the threads do not share one.
+struct alignas(64) BM_DeviceCount {
+    long long events;
+};
+
+static BM_DeviceCount BM_DeviceCounts[BM_kMaxDevices];
+
+static void BM_DeviceEvent(const SynclavierKBI1InputEvent& event, void* refCon)
+{
+    ((BM_DeviceCount*) refCon)->events++;
+}
+
+// One simulated KBI-1 per thread sends a performance to its device. The application thread
+// drains every device's ring and answers its status NRPNs.
+static double BM_DeviceRun(int devices, int megabytes, int packet, const std::vector<uint8_t>& traffic)
+{
+    std::atomic<int>            running(devices);
+    std::vector<std::thread>    threads;
+    long long                   handled = 0;
+
+    for (int unit = 0; unit < devices; unit++)
+        BM_DeviceCounts[unit].events = 0;
+
+    double start = BM_Seconds();
+
+    for (int unit = 0; unit < devices; unit++) {
+        threads.emplace_back([&, unit] {
+            auto& link = BM_DeviceLinks[unit];
+
+            for (int pass = 0; pass < megabytes; pass++) {
+                for (size_t offset = 0; offset < traffic.size(); offset += packet) {
+                    int chunk = (int) std::min((size_t) packet, traffic.size() - offset);
+
+                    link.device.send(traffic.data() + offset, chunk, 0);
+
+                    // Let the application thread in now and then on a machine with few cores
+                    if ((offset / packet & 15) == 15)
+                        std::this_thread::yield();
+                }
+            }
+
+            running--;
+        });
+    }
+
+    while (running.load() > 0) {
+        int drained = 0;
+
+        for (int unit = 0; unit < devices; unit++)
+            drained += BM_Devices[unit].drainInput();
+
+        // Nothing waiting. Give the producers the core rather than spinning on empty rings.
+        if (drained == 0)
+            std::this_thread::yield();
+
+        handled += drained;
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    for (int unit = 0; unit < devices; unit++)
+        handled += BM_Devices[unit].drainInput();
+
+    double elapsed = BM_Seconds() - start;
+
+    long long events    = 0;
+    long long overflows = 0;
+
+    for (int unit = 0; unit < devices; unit++) {
+        events    += BM_DeviceCounts[unit].events;
+        overflows += BM_Devices[unit].inputOverflows();
+    }
+
+    events += handled;
+
+    printf("devices %2d           : %.1f M events/sec (%.1f M per device), %lld NRPNs handled, %lld ring overflows\n",
+           devices, events / elapsed / 1e6, events / elapsed / 1e6 / devices, handled, overflows);
+
+    return events / elapsed;
+}
+
+static int BM_DevicesScaling(int argc, const char* argv[])
+{
+    int megabytes = BM_IntOption(argc, argv, "-megabytes", 8);     // Per device
+    int packet    = BM_IntOption(argc, argv, "-packet",    64);
+
+    if (packet < 1)
+        packet = 1;
+
+    // Steady ORK status so each device connects once and then just records activity
+    auto traffic = BM_KBI1Traffic(1 << 20, 1, SynclavierKBI1MIDIProtocolNRPNMessageORKHere);
+
+    for (int unit = 0; unit < BM_kMaxDevices; unit++) {
+        auto& device = BM_Devices[unit];
+        auto& link   = BM_DeviceLinks[unit];
+
+        link.host.open();
+        link.device.open();
+
+        device.attach(&link.host, unit + 1);
+        device.setVerbose(false);
+
+        // NRPNs go through the device's ring. Everything else is counted where it is decoded.
+        for (int type = SynclavierKBI1InputNote; type < SynclavierKBI1InputTypes; type++) {
+            if (type != SynclavierKBI1InputNRPN)
+                device.decoder.setProc((SynclavierKBI1InputType) type, BM_DeviceEvent, &BM_DeviceCounts[unit]);
+        }
+    }
+
+    printf("devices cores        : %u\n", std::thread::hardware_concurrency());
+
+    double one = 0;
+
+    for (int devices : {1, 4, 16}) {
+        double rate = BM_DeviceRun(devices, megabytes, packet, traffic);
+
+        if (devices == 1)
+            one = rate;
+        else
+            printf("devices %2d scaling   : %.2fx one device\n", devices, rate / one);
+    }
+
+    int result = 0;
+
+    for (auto& device : BM_Devices) {
+        if (device.decoder.discarded() != 0 || device.decoder.nrpnsRejected() != 0)
+            result = 1;
+    }
+
+    return result;
+}
+
+// ---------------------------------------------------------------------------------------------
+// simulate - the host against a simulated KBI-1: handshake, panel model, power cycles, traffic
+// ---------------------------------------------------------------------------------------------
+
+// Devices hold cache-line aligned rings so they are static
+static SynclavierKBI1Device             BM_SimHost;
+static SynclavierKBI1MIDILoopback       BM_SimLink;
+static SynclavierKBI1SimulatedDevice    BM_SimKBI1(BM_SimLink.device);
+
+// Host events other than NRPNs. Counted with the simulated KBI-1's output lock held.
+static long long BM_SimEvents;
+
+static void BM_SimEvent(const SynclavierKBI1InputEvent& event, void* refCon)
+{
+    BM_SimEvents++;
+}
+
+// Let the host handle whatever the KBI-1 sent. Replies go back and are answered right away.
+static void BM_SimSettle()
+{
+    for (int i = 0; i < 8; i++) {
+        BM_SimHost.drainInput();
+        BM_SimHost.render();
+        BM_SimHost.flush();
+    }
+}
+
+// Compare the simulated KBI-1's panel with what the host wants on it. Returns the number of differences.
+static int BM_SimCompare(const char* step, const char* ork, const char* line0, const char* line1)
+{
+    int  differences = 0;
+    char text[SynclavierKBI1SimulatedDevice::kVKCharsPerLine * 2 + 1];
+
+    if (strcmp(BM_SimKBI1.ork(), ork) != 0) {
+        printf("simulate %-12s: ORK shows \"%s\", host sent \"%s\"\n", step, BM_SimKBI1.ork(), ork);
+        differences++;
+    }
+
+    const char* lines[2] = {line0, line1};
+
+    for (int line = 0; line < 2; line++) {
+        BM_SimKBI1.vkLine(line, text, sizeof(text));
+
+        if (strcmp(text, lines[line]) != 0) {
+            printf("simulate %-12s: VK line %d shows \"%s\", host sent \"%s\"\n", step, line, text, lines[line]);
+            differences++;
+        }
+    }
+
+    const int panels[3][2] = {
+        {SynclavierKBI1MIDIProtocolORKChannel,   SynclavierKBI1LEDState::kORKButtons},
+        {SynclavierKBI1MIDIProtocolVKChannel,    SynclavierKBI1LEDState::kVKButtons},
+        {SynclavierKBI1MIDIProtocolVKAltChannel, SynclavierKBI1LEDState::kVKAltButtons},
+    };
+
+    int lights = 0;
+
+    for (auto& panel : panels) {
+        for (int button = 0; button < panel[1]; button++) {
+            if (BM_SimKBI1.leds.get(panel[0], button) != BM_SimHost.panel.leds.get(panel[0], button))
+                lights++;
+        }
+    }
+
+    if (lights) {
+        printf("simulate %-12s: %d lights differ\n", step, lights);
+        differences += lights;
+    }
+
+    printf("simulate %-12s: %s\n", step, differences ? "FAILED" : "ok");
+
+    return differences;
+}
+
+// Light a pattern of buttons that depends on seed
+static void BM_SimLights(int seed)
+{
+    for (int button = 0; button < SynclavierKBI1LEDState::kVKButtons; button++) {
+        int pattern = (button * 7 + seed) % 5;
+
+        BM_SimHost.panel.leds.set(SynclavierKBI1MIDIProtocolVKChannel, button, pattern == 0 ? SynclavierKBI1LEDState::LEDOn : pattern == 1 ? SynclavierKBI1LEDState::LEDBlinking : SynclavierKBI1LEDState::LEDOff);
+    }
+
+    for (int button = 0; button < SynclavierKBI1LEDState::kVKAltButtons; button += 3)
+        BM_SimHost.panel.leds.set(SynclavierKBI1MIDIProtocolVKAltChannel, button, (button + seed) & 1 ? SynclavierKBI1LEDState::LEDHeld : SynclavierKBI1LEDState::LEDOff);
+}
+
+static int BM_Simulate(int argc, const char* argv[])
+{
+    double seconds = BM_IntOption(argc, argv, "-seconds", 10);     // Of performance
+    double speed   = BM_IntOption(argc, argv, "-speed",   100);    // Times real time. 0 for as fast as possible.
+    bool   verbose = BM_IntOption(argc, argv, "-verbose", 0) != 0;
+
+    const char* ork      = "440.0h";
+    const char* line0    = "TRACK 1  SPEED 1.000  LOOP 4.00";
+    const char* line1    = "PARTIAL 2  HARMONIC 3  VOLUME 99.9";
+    const char* line1Now = "PARTIAL 2  HARMONIC 7  VOLUME 12.5";
+
+    auto& host = BM_SimHost;
+    auto& kbi1 = BM_SimKBI1;
+    int   differences = 0;
+
+    BM_SimLink.host.open();
+    BM_SimLink.device.open();
+
+    host.attach(&BM_SimLink.host, 1);
+    host.setVerbose(verbose);
+
+    for (int type = SynclavierKBI1InputNote; type < SynclavierKBI1InputTypes; type++) {
+        if (type != SynclavierKBI1InputNRPN)
+            host.decoder.setProc((SynclavierKBI1InputType) type, BM_SimEvent, nullptr);
+    }
+
+    // Power on with a VK plugged in. The KBI-1 says HereIAm, the host asks for status.
+    kbi1.setKeyboard(SynclavierKBI1MIDIProtocolNRPNMessageVKHere);
+    kbi1.powerOn();
+    BM_SimSettle();
+
+    bool handshake = host.connected() && host.status() == SynclavierKBI1MIDIProtocolNRPNMessageVKHere && kbi1.clears() == 1;
+
+    printf("simulate %-12s: %s\n", "handshake", handshake ? "ok" : "FAILED");
+
+    if (!handshake)
+        differences++;
+
+    // Put things on the panel, then change some of them
+    host.panel.display.setORK(ork);
+    host.panel.display.setVKLine(0, line0);
+    host.panel.display.setVKLine(1, line1);
+    BM_SimLights(0);
+    BM_SimSettle();
+
+    differences += BM_SimCompare("panel", ork, line0, line1);
+
+    host.panel.display.setVKLine(1, line1Now);
+    BM_SimLights(1);
+    BM_SimSettle();
+
+    differences += BM_SimCompare("update", ork, line0, line1Now);
+
+    // A light step scheduled for later, as the demo's lights task does. The Clear below has to take it back.
+    uint64_t later = SynclavierKBI1HostTimeNow() + SynclavierKBI1NanosToHostTime(1000000000);
+
+    host.scheduler.sendButton(later, SynclavierKBI1MIDIProtocolVKChannel, 5, SynclavierKBI1MIDIProtocolButtonOn);
+    host.panel.leds.setSent(SynclavierKBI1MIDIProtocolVKChannel, 5, SynclavierKBI1LEDState::LEDOn);
+
+    // The VK goes off and comes back blank. The host clears it, puts the display back and starts its lights over.
+    kbi1.powerCycleKeyboard();
+    BM_SimSettle();
+
+    host.dispatch(later, 0);
+
+    differences += BM_SimCompare("power cycle", ork, line0, line1Now);
+
+    BM_SimLights(2);
+    BM_SimSettle();
+
+    // The KBI-1 lost its panel and asks for it back
+    kbi1.requestRefresh();
+    BM_SimSettle();
+
+    differences += BM_SimCompare("refresh", ork, line0, line1Now);
+
+    // Host identifies itself. Echoes come back.
+    kbi1.askHost();
+    BM_SimSettle();
+
+    host.requests.send(SynclavierKBI1MIDIProtocolNRPNMessageEcho, 1234, 100000000, 0, nullptr, nullptr, 1234);
+    BM_SimSettle();
+
+    bool answers = kbi1.hostIdentity() == SynclavierKBI1MIDIProtocolNRPNMessageOtherHere
+                && host.requests.stats(SynclavierKBI1MIDIProtocolNRPNMessageEcho).answered == 1;
+
+    printf("simulate %-12s: %s\n", "queries", answers ? "ok" : "FAILED");
+
+    if (!answers)
+        differences++;
+
+    // A performance, played while the host polls status and keeps its display going
+    auto traffic = SynclavierKBI1SimulatedTraffic::generate(seconds, 1);
+
+    std::atomic<bool> playing(true);
+    long long         played = 0;
+    long long         frames = 0;
+
+    BM_SimEvents = 0;
+
+    double start = BM_Seconds();
+
+    std::thread player([&] {
+        played = SynclavierKBI1SimulatedTraffic::play(kbi1, traffic, speed);
+        playing.store(false);
+    });
+
+    double nextFrame = start;
+
+    while (playing.load()) {
+        if (host.drainInput() == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+        host.expire(SynclavierKBI1HostTimeNow());
+
+        if (BM_Seconds() >= nextFrame) {
+            char text[32];
+
+            snprintf(text, sizeof(text), "%6lld", frames++);
+
+            host.panel.display.setORK(text);
+            host.poll();
+            host.render();
+            host.flush();
+
+            nextFrame += 0.02;
+        }
+    }
+
+    player.join();
+
+    double elapsed = BM_Seconds() - start;
+    char   text[32];
+
+    snprintf(text, sizeof(text), "%6lld", frames - 1);
+    BM_SimSettle();
+
+    bool kept = played == (long long) traffic.size() && BM_SimEvents == played && host.connected() && host.decoder.discarded() == 0;
+
+    printf("simulate traffic     : %lld messages, %.1f s of performance in %.2f s (%.0fx real time), %.0f messages/sec\n",
+           played, seconds, elapsed, seconds / elapsed, played / elapsed);
+    printf("simulate traffic     : %lld host events, %lld display frames, %lld status polls answered, %lld ignored, %s\n",
+           BM_SimEvents, frames, host.requests.stats(SynclavierKBI1MIDIProtocolNRPNMessageStatus).answered, kbi1.ignored(), kept ? "ok" : "FAILED");
+
+    if (!kept)
+        differences++;
+
+    differences += BM_SimCompare("after", text, line0, line1Now);
+
+    return differences ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------------------------
+// trace - record a session with a simulated KBI-1, read it back and replay it
+// ---------------------------------------------------------------------------------------------
+
+// Writer lanes and devices hold cache-line aligned counters so they are static
+static SynclavierKBI1TraceWriter            BM_TraceWriter;
+static SynclavierKBI1MIDITransportTrace     BM_TraceTransport;
+static SynclavierKBI1Device                 BM_TraceHost;
+static SynclavierKBI1MIDILoopback           BM_TraceLink;
+static SynclavierKBI1SimulatedDevice        BM_TraceKBI1(BM_TraceLink.device);
+
+// Decoders count the events they hand to a proc
+static void BM_TraceEvent(const SynclavierKBI1InputEvent& event, void* refCon)
+{
+}
+
+static void BM_TraceDecode(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    ((SynclavierKBI1InputDecoder*) refCon)->receive(bytes, length, timeStamp);
+}
+
+// Replay what came from a KBI-1 (unit -1 for all) into a decoder. expectEvents is what was decoded live, -1 if not known.
+static int BM_TraceReplay(SynclavierKBI1TraceReader& reader, double speed, int unit, long long expectEvents)
+{
+    SynclavierKBI1InputDecoder decoder;
+
+    for (int type = SynclavierKBI1InputNote; type < SynclavierKBI1InputTypes; type++)
+        decoder.setProc((SynclavierKBI1InputType) type, BM_TraceEvent, nullptr);
+
+    reader.rewind();
+
+    double    start   = BM_Seconds();
+    long long packets = reader.replay(BM_TraceDecode, &decoder, SynclavierKBI1TraceIn, speed, unit);
+    double    elapsed = BM_Seconds() - start;
+
+    printf("trace replay         : %lld packets, %lld events in %.3f s (%.1f M events/sec)%s\n",
+           packets, decoder.events(), elapsed, decoder.events() / elapsed / 1e6, speed > 0 ? "" : ", as fast as possible");
+
+    if (expectEvents >= 0 && decoder.events() != expectEvents) {
+        printf("trace replay         : FAILED, %lld events decoded live\n", expectEvents);
+        return 1;
+    }
+
+    return decoder.discarded() != 0 ? 1 : 0;
+}
+
+// Cost of a record on the producer's thread. Bursts small enough for the lane, with time for the writer thread between.
+static double BM_TraceRecordCost(int lane)
+{
+    const uint8_t   note[3] = {0x90, 0x3C, 0x40};
+    double          elapsed = 0;
+    int             records = 0;
+
+    for (int burst = 0; burst < 100; burst++) {
+        double start = BM_Seconds();
+
+        for (int i = 0; i < 1000; i++)
+            records += BM_TraceWriter.record(lane, SynclavierKBI1TraceIn, 0, note, sizeof(note), 0);
+
+        elapsed += BM_Seconds() - start;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    return records ? elapsed * 1e9 / records : 0;
+}
+
+static int BM_Trace(int argc, const char* argv[])
+{
+    auto   replay      = BM_StringOption(argc, argv, "-trace", nullptr);     // Replay this trace instead of recording one
+    auto   path        = BM_StringOption(argc, argv, "-out", "/tmp/kbi1-bench.trace");
+    double seconds     = BM_IntOption(argc, argv, "-seconds", 60);          // Of performance
+    double speed       = BM_IntOption(argc, argv, "-speed", 1000);          // Times real time, recording
+    double replaySpeed = BM_IntOption(argc, argv, "-replay-speed", 0);      // Times the original timing. 0 for as fast as possible.
+
+    SynclavierKBI1TraceReader reader;
+
+    if (replay) {
+        if (!reader.open(replay)) {
+            fprintf(stderr, "%s is not a KBI-1 trace.\n", replay);
+            return 1;
+        }
+
+        printf("trace file           : %lld records%s, %lld dropped\n", reader.records(), reader.hasIndex() ? "" : " (not closed)", reader.dropped());
+
+        return BM_TraceReplay(reader, replaySpeed, -1, -1);
+    }
+
+    auto& host = BM_TraceHost;
+    auto& kbi1 = BM_TraceKBI1;
+
+    // Everything runs on this thread, so each lane has one producer
+    BM_TraceLink.host.open();
+    BM_TraceLink.device.open();
+
+    if (!BM_TraceWriter.open(path)) {
+        fprintf(stderr, "Could not create %s.\n", path);
+        return 1;
+    }
+
+    BM_TraceTransport.attach(&BM_TraceLink.host, &BM_TraceWriter, 1);
+
+    host.attach(&BM_TraceTransport, 1);
+    host.setVerbose(false);
+
+    for (int type = SynclavierKBI1InputNote; type < SynclavierKBI1InputTypes; type++) {
+        if (type != SynclavierKBI1InputNRPN)
+            host.decoder.setProc((SynclavierKBI1InputType) type, BM_TraceEvent, nullptr);
+    }
+
+    // A session: the KBI-1 comes up, the host sets its display, a performance, the VK goes away
+    auto traffic = SynclavierKBI1SimulatedTraffic::generate(seconds, 1);
+
+    kbi1.setKeyboard(SynclavierKBI1MIDIProtocolNRPNMessageVKHere);
+    kbi1.powerOn();
+
+    host.drainInput();
+    host.drainInput();
+    host.panel.display.setVKLine(0, "TRACE  1.000");
+    host.render();
+    host.flush();
+
+    SynclavierKBI1SimulatedTraffic::play(kbi1, traffic, speed);
+
+    host.poll();
+    host.drainInput();
+    kbi1.setKeyboard(SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome);
+    host.drainInput();
+
+    double cost = BM_TraceRecordCost(BM_TraceWriter.addLane());
+
+    BM_TraceWriter.close();
+
+    printf("trace record         : %.1f ns per record on the recording thread\n", cost);
+
+    if (!reader.open(path)) {
+        fprintf(stderr, "Could not read back %s.\n", path);
+        return 1;
+    }
+
+    // Count what was recorded each way for the session
+    SynclavierKBI1TraceReader::Record record;
+    long long counts[2] = {0, 0};
+    uint64_t  lastTime  = 0;
+
+    while (reader.next(record)) {
+        if (record.unit != 1)
+            continue;
+
+        counts[record.direction & 1]++;
+        lastTime = record.time;
+    }
+
+    printf("trace file           : %lld records, session %lld in, %lld out over %.3f s, %lld dropped, %s\n",
+           reader.records(), counts[SynclavierKBI1TraceIn], counts[SynclavierKBI1TraceOut], lastTime / 1e9, reader.dropped(), path);
+
+    int result = 0;
+
+    if (reader.dropped() == 0 && counts[SynclavierKBI1TraceOut] != BM_TraceLink.host.sends()) {
+        printf("trace file           : FAILED, %lld sends to the KBI-1\n", BM_TraceLink.host.sends());
+        result = 1;
+    }
+
+    // The index finds the middle without walking to it
+    reader.seek(lastTime / 2);
+
+    if (!reader.next(record) || record.time < lastTime / 2) {
+        printf("trace seek           : FAILED\n");
+        result = 1;
+    }
+
+    // The session's input replayed gives what was decoded live
+    result |= BM_TraceReplay(reader, replaySpeed, 1, reader.dropped() == 0 ? host.decoder.events() : -1);
+
+    return result;
+}
+
+// ---------------------------------------------------------------------------------------------
+// coalesce - controller coalescing on a performance heavy with ribbon gestures
+// ---------------------------------------------------------------------------------------------
+
+struct BM_CoalesceStats {
+    SynclavierKBI1ControlCoalescer  coalescer;
+    long long                       in[SynclavierKBI1InputTypes];
+    long long                       out[SynclavierKBI1InputTypes];
+    long long                       deltaIn;
+    long long                       deltaOut;
+    int32_t                         lastIn[SynclavierKBI1ControlCoalescer::kControls];
+    int32_t                         lastOut[SynclavierKBI1ControlCoalescer::kControls];
+};
+
+// Absolute controls by type and number, as the coalescer keeps them
+static int BM_CoalesceControl(const SynclavierKBI1InputEvent& event)
+{
+    switch (event.type) {
+        case SynclavierKBI1InputBend:       return SynclavierKBI1ControlCoalescer::ControlBend;
+        case SynclavierKBI1InputRibbonBend: return SynclavierKBI1ControlCoalescer::ControlRibbonBend;
+        case SynclavierKBI1InputKnob:       return SynclavierKBI1ControlCoalescer::ControlKnob;
+        case SynclavierKBI1InputController: return event.number == 0x01 ? SynclavierKBI1ControlCoalescer::ControlWheel : -1;
+        default:                            return -1;
+    }
+}
+
+// What the decoder hands the coalescer
+static void BM_CoalesceIn(const SynclavierKBI1InputEvent& event, void* refCon)
+{
+    auto& stats   = *(BM_CoalesceStats*) refCon;
+    int   control = BM_CoalesceControl(event);
+
+    stats.in[event.type]++;
+
+    if (event.type == SynclavierKBI1InputRibbonDelta)
+        stats.deltaIn += event.value;
+
+    if (control >= 0)
+        stats.lastIn[control] = event.value;
+
+    stats.coalescer.input(event);
+}
+
+// What the coalescer hands on
+static void BM_CoalesceOut(const SynclavierKBI1InputEvent& event, void* refCon)
+{
+    auto& stats   = *(BM_CoalesceStats*) refCon;
+    int   control = BM_CoalesceControl(event);
+
+    stats.out[event.type]++;
+
+    if (event.type == SynclavierKBI1InputRibbonDelta)
+        stats.deltaOut += event.value;
+
+    if (control >= 0)
+        stats.lastOut[control] = event.value;
+}
+
+static int BM_CoalesceRun(const std::vector<SynclavierKBI1TimedMessage>& traffic, int tick, double smoothing)
+{
+    BM_CoalesceStats            stats = {};
+    SynclavierKBI1InputDecoder  decoder;
+
+    for (auto type : {SynclavierKBI1InputBend, SynclavierKBI1InputController, SynclavierKBI1InputRibbonDelta, SynclavierKBI1InputRibbonBend, SynclavierKBI1InputKnob})
+        decoder.setProc(type, BM_CoalesceIn, &stats);
+
+    stats.coalescer.setProc(BM_CoalesceOut, &stats);
+    stats.coalescer.setSmoothing(smoothing);
+
+    // Performance time. Ticks come every tick ms of it.
+    uint64_t period   = (uint64_t) tick * 1000000;
+    uint64_t nextTick = period;
+    int      ticks    = 0;
+    double   start    = BM_Seconds();
+
+    for (auto& message : traffic) {
+        while (message.time >= nextTick) {
+            stats.coalescer.tick(nextTick);
+            nextTick += period;
+            ticks++;
+        }
+
+        decoder.receive(message.bytes, message.length, message.time);
+    }
+
+    // Let smoothed values settle
+    for (int i = 0; i < 1000; i++) {
+        stats.coalescer.tick(nextTick);
+        nextTick += period;
+    }
+
+    double elapsed = BM_Seconds() - start;
+
+    auto& coalescer = stats.coalescer;
+
+    long long ribbonIn  = stats.in[SynclavierKBI1InputRibbonDelta]  + stats.in[SynclavierKBI1InputRibbonBend];
+    long long ribbonOut = stats.out[SynclavierKBI1InputRibbonDelta] + stats.out[SynclavierKBI1InputRibbonBend];
+
+    printf("coalesce %2d ms %3.0f%%   : %lld controller events in, %lld out (%.1fx fewer), %lld coalesced, ribbon %lld -> %lld (%.1fx), %.1f ns per message\n",
+           tick, smoothing * 100, coalescer.received(), coalescer.emitted(), coalescer.received() / (double) std::max(1LL, coalescer.emitted()),
+           coalescer.coalesced(), ribbonIn, ribbonOut, ribbonIn / (double) std::max(1LL, ribbonOut), elapsed * 1e9 / traffic.size());
+
+    int result = 0;
+
+    if (stats.deltaOut != stats.deltaIn) {
+        printf("coalesce             : FAILED, ribbon moved %lld, %lld handed on\n", stats.deltaIn, stats.deltaOut);
+        result = 1;
+    }
+
+    for (int control = 0; control < SynclavierKBI1ControlCoalescer::kControls; control++) {
+        if (stats.lastOut[control] != stats.lastIn[control]) {
+            printf("coalesce             : FAILED, control %d ended at %d, %d handed on\n", control, stats.lastIn[control], stats.lastOut[control]);
+            result = 1;
+        }
+    }
+
+    return result;
+}
+
+static int BM_Coalesce(int argc, const char* argv[])
+{
+    double seconds   = BM_IntOption(argc, argv, "-seconds",   60);     // Of performance
+    int    tick      = BM_IntOption(argc, argv, "-tick",      5);      // ms
+    int    smoothing = BM_IntOption(argc, argv, "-smoothing", 50);     // Percent kept per tick, for the smoothed run
+
+    auto traffic = SynclavierKBI1SimulatedTraffic::generate(seconds, 1);
+    int  result  = 0;
+
+    result |= BM_CoalesceRun(traffic, std::max(1, tick), 0);
+    result |= BM_CoalesceRun(traffic, std::max(1, tick), smoothing / 100.0);
+
+    return result;
+}
+
+// ---------------------------------------------------------------------------------------------
+// notes - held note and pedal state against a note-by-note model, and the cost of its queries
+// ---------------------------------------------------------------------------------------------
+
+// Reference: the same rules, one note at a time
+struct BM_NotesModel {
+    bool keys[128], sustained[128], latched[128];
+    bool sustain, hold;
+
+    void noteOff(int note, bool* released) {
+        if (!keys[note])
+            return;
+
+        keys[note] = false;
+
+        if (sustain)
+            sustained[note] = true;
+        else if (!latched[note])
+            released[note] = true;
+    }
+
+    void pedal(int number, bool down, bool* released) {
+        if (number == SynclavierKBI1NoteState::PedalSustain && down != sustain) {
+            sustain = down;
+
+            if (!down) {
+                for (int note = 0; note < 128; note++) {
+                    if (sustained[note] && !keys[note] && !latched[note])
+                        released[note] = true;
+
+                    sustained[note] = false;
+                }
+            }
+        }
+
+        if (number == SynclavierKBI1NoteState::PedalHold && down != hold) {
+            hold = down;
+
+            for (int note = 0; note < 128; note++) {
+                if (down)
+                    latched[note] = keys[note];
+
+                else {
+                    if (latched[note] && !keys[note] && !sustained[note])
+                        released[note] = true;
+
+                    latched[note] = false;
+                }
+            }
+        }
+    }
+
+    SynclavierKBI1NoteSet sounding() const {
+        SynclavierKBI1NoteSet set = SynclavierKBI1NoteSet::none();
+
+        for (int note = 0; note < 128; note++) {
+            if (keys[note] || sustained[note] || latched[note])
+                set.set(note);
+        }
+
+        return set;
+    }
+};
+
+static void BM_NotesReleased(const SynclavierKBI1NoteSet& released, uint64_t timeStamp, void* refCon)
+{
+    auto& all = *(SynclavierKBI1NoteSet*) refCon;
+
+    all = all | released;
+}
+
+static int BM_Notes(int argc, const char* argv[])
+{
+    int events  = BM_IntOption(argc, argv, "-events",  1000000);
+    int queries = BM_IntOption(argc, argv, "-queries", 10000000);
+
+    SynclavierKBI1NoteState state;
+    SynclavierKBI1NoteSet   released = SynclavierKBI1NoteSet::none();
+    BM_NotesModel           model    = {};
+    std::mt19937            random(1);
+    int                     failures = 0;
+
+    state.setReleaseProc(BM_NotesReleased, &released);
+
+    // Random keys and pedals, checked after every event
+    for (int event = 0; event < events; event++) {
+        bool modelReleased[128] = {};
+        int  choice = (int) (random() % 100);
+        int  note   = 36 + (int) (random() % 61);
+
+        released = SynclavierKBI1NoteSet::none();
+
+        if (choice < 45) {
+            state.noteOn(note);
+            model.keys[note] = true;
+        }
+
+        else if (choice < 90) {
+            state.noteOff(note, 0);
+            model.noteOff(note, modelReleased);
+        }
+
+        else {
+            int  pedal = random() % 2 ? SynclavierKBI1NoteState::PedalSustain : SynclavierKBI1NoteState::PedalHold;
+            bool down  = random() % 2;
+
+            state.pedal(pedal, down, 0);
+            model.pedal(pedal, down, modelReleased);
+        }
+
+        SynclavierKBI1NoteSet want = SynclavierKBI1NoteSet::none();
+
+        for (int i = 0; i < 128; i++) {
+            if (modelReleased[i])
+                want.set(i);
+        }
+
+        if (state.sounding() != model.sounding() || released != want) {
+            if (failures++ < 10)
+                printf("notes                : FAILED at event %d, %d sounding (model %d), %d released (model %d)\n",
+                       event, state.sounding().count(), model.sounding().count(), released.count(), want.count());
+        }
+    }
+
+    // A chord held under the sustain pedal, as the audio thread sees it once per block
+    state.reset();
+    state.pedal(SynclavierKBI1NoteState::PedalSustain, true, 0);
+
+    for (int note = 48; note < 96; note += 3)
+        state.noteOn(note);
+
+    long long total = 0;
+    double    start = BM_Seconds();
+
+    for (int query = 0; query < queries; query++)
+        total += state.sounding().count();
+
+    double bitset = BM_Seconds() - start;
+
+    start = BM_Seconds();
+
+    for (int query = 0; query < queries; query++) {
+        total += model.sounding().count();
+        model.keys[query & 127] ^= (query & 1);
+    }
+
+    double loop = BM_Seconds() - start;
+
+    // Sustain up with 16 sustained notes
+    int       lifts = std::max(1, queries / 100);
+    long long count = 0;
+
+    start = BM_Seconds();
+
+    for (int lift = 0; lift < lifts; lift++) {
+        for (int note = 48; note < 96; note += 3) {
+            state.noteOn(note);
+            state.noteOff(note, 0);
+        }
+
+        released = SynclavierKBI1NoteSet::none();
+        state.pedal(SynclavierKBI1NoteState::PedalSustain, false, 0);
+        count += released.count();
+        state.pedal(SynclavierKBI1NoteState::PedalSustain, true, 0);
+    }
+
+    double lifted = BM_Seconds() - start;
+
+    printf("notes checks         : %d random keys and pedals against the note-by-note model, %d failed\n", events, failures);
+    printf("notes sounding       : %6.2f ns per query (note-by-note %.2f ns) [%lld]\n", bitset * 1e9 / queries, loop * 1e9 / queries, total & 1);
+    printf("notes sustain up     : %6.1f ns per cycle of 16 notes held, let go and released together (%lld released)\n", lifted * 1e9 / lifts, count);
+
+    return failures ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// metrics - cost of counting the link, checked against the parser, and of writing a snapshot
+// ---------------------------------------------------------------------------------------------
+
+struct BM_ChannelCounter : SynclavierKBI1MIDIParserHandler {
+    long long messages[16] = {};
+
+    inline void message(uint8_t status, uint8_t data1, uint8_t data2) {
+        if (status < 0xF0)
+            messages[status & 0xF]++;
+    }
+};
+
+// Decode traffic through the loopback, counted on the way if metrics is given. Returns seconds.
+static double BM_MetricsRun(const std::vector<uint8_t>& traffic, int megabytes, int packet, SynclavierKBI1MIDITransportMetrics* metrics)
+{
+    SynclavierKBI1MIDILoopback loopback;
+    SynclavierKBI1InputDecoder decoder;
+    BM_DecoderStats            stats;
+
+    for (int type = SynclavierKBI1InputNote; type < SynclavierKBI1InputTypes; type++)
+        decoder.setProc((SynclavierKBI1InputType) type, BM_DecoderProc, &stats);
+
+    if (metrics) {
+        metrics->attach(&loopback.host);
+        metrics->setReceiveProc(BM_DecoderReceive, &decoder);
+    }
+
+    else
+        loopback.host.setReceiveProc(BM_DecoderReceive, &decoder);
+
+    loopback.host.open();
+    loopback.device.open();
+
+    double start = BM_Seconds();
+
+    for (int pass = 0; pass < megabytes; pass++) {
+        for (size_t offset = 0; offset < traffic.size(); offset += packet) {
+            int chunk = (int) std::min((size_t) packet, traffic.size() - offset);
+
+            loopback.device.send(traffic.data() + offset, chunk, 0);
+        }
+    }
+
+    return BM_Seconds() - start;
+}
+
+static int BM_Metrics(int argc, const char* argv[])
+{
+    int  megabytes  = BM_IntOption(argc, argv, "-megabytes", 16);
+    int  packet     = BM_IntOption(argc, argv, "-packet",    64);
+    int  iterations = BM_IntOption(argc, argv, "-iterations", 10000000);
+    auto path       = BM_StringOption(argc, argv, "-out", "/tmp/kbi1-bench.prom");
+
+    if (packet < 1)
+        packet = 1;
+
+    static SynclavierKBI1MIDITransportMetrics   link;
+    static SynclavierKBI1MetricsRegistry<>      registry;
+    static SynclavierKBI1Device                 devices[16];
+
+    auto traffic = BM_KBI1Traffic(1 << 20, 1);
+
+    // The same traffic with and without counting
+    double plain   = BM_MetricsRun(traffic, megabytes, packet, nullptr);
+    double counted = BM_MetricsRun(traffic, megabytes, packet, &link);
+    double bytes   = (double) traffic.size() * megabytes;
+
+    printf("metrics input        : %.2f ns/byte decoding, %.2f ns/byte decoding and counting (%.0f MB)\n",
+           plain * 1e9 / bytes, counted * 1e9 / bytes, bytes / 1e6);
+
+    // Every channel message the parser finds is counted on its channel
+    SynclavierKBI1MIDIParser parser;
+    BM_ChannelCounter        reference;
+    int                      failures = 0;
+
+    parser.parse(traffic.data(), (int) traffic.size(), reference);
+
+    for (int channel = 0; channel < 16; channel++) {
+        if (link.input().channelMessages[channel].value() != (uint64_t) (reference.messages[channel] * megabytes)) {
+            printf("metrics channel %2d   : counted %llu, parser found %lld\n", channel,
+                   (unsigned long long) link.input().channelMessages[channel].value(), reference.messages[channel] * megabytes);
+            failures++;
+        }
+    }
+
+    if (link.input().bytes.value() != (uint64_t) bytes)
+        failures++;
+
+    // Output, timed per send
+    SynclavierKBI1MIDILoopback    loopback;
+    SynclavierKBI1MIDIOutputBatch batch(SynclavierKBI1MIDITransport::BatchFlushProc, &link, true);
+
+    link.attach(&loopback.host);
+    loopback.host.open();
+    loopback.device.open();
+
+    for (int i = 0; i < 100000; i++) {
+        batch.send3(0x91, i & 0x7F, 1);
+        batch.send3(0x91, i & 0x7F, 0);
+
+        if ((i & 15) == 15)
+            batch.flush();
+    }
+
+    batch.flush();
+
+    if (link.output().channelMessages[1].value() != 200000)
+        failures++;
+
+    printf("metrics send         : %llu sends, median <= %.1f usec, p99 <= %.1f usec, max %.1f usec\n",
+           (unsigned long long) link.sends().count(), link.sends().percentile(0.5) / 1000.0,
+           link.sends().percentile(0.99) / 1000.0, link.sends().max() / 1000.0);
+
+    // Cost of the metrics themselves
+    SynclavierKBI1Counter   counter;
+    SynclavierKBI1Histogram histogram;
+
+    double start = BM_Seconds();
+
+    for (int i = 0; i < iterations; i++)
+        counter.add();
+
+    double added = BM_Seconds() - start;
+
+    start = BM_Seconds();
+
+    for (int i = 0; i < iterations; i++)
+        histogram.record((uint64_t) (i & 0xFFFFF) * 37);
+
+    double recorded = BM_Seconds() - start;
+
+    printf("metrics cost         : %.2f ns per count, %.2f ns per duration recorded\n", added * 1e9 / iterations, recorded * 1e9 / iterations);
+
+    if (counter.value() != (uint64_t) iterations || histogram.count() != (uint64_t) iterations)
+        failures++;
+
+    // A snapshot of 16 devices, as the demo tool writes once a second
+    link.addTo(registry, "unit=\"1\"");
+
+    for (int unit = 0; unit < 16; unit++) {
+        char labels[SynclavierKBI1MetricsRegistry<>::kLabelSize];
+
+        snprintf(labels, sizeof(labels), "unit=\"%d\"", unit + 1);
+        devices[unit].addMetrics(registry, labels);
+    }
+
+    int writes = 100;
+
+    start = BM_Seconds();
+
+    for (int i = 0; i < writes; i++) {
+        if (!registry.writeFile(path))
+            failures++;
+    }
+
+    double written = BM_Seconds() - start;
+
+    // Read it back as a scraper would
+    FILE* file = fopen(path, "r");
+    char  line[256];
+    char  expect[128];
+    int   lines = 0, families = 0;
+    bool  found = false;
+
+    snprintf(expect, sizeof(expect), "kbi1_midi_in_messages_total{unit=\"1\",channel=\"0\"} %llu\n",
+             (unsigned long long) link.input().channelMessages[0].value());
+
+    while (file && fgets(line, sizeof(line), file)) {
+        lines++;
+        families += strncmp(line, "# TYPE ", 7) == 0;
+        found    |= strcmp(line, expect) == 0;
+    }
+
+    if (file)
+        fclose(file);
+
+    printf("metrics snapshot     : %d metrics, %d families, %d lines to %s in %.0f usec%s\n",
+           registry.size(), families, lines, path, written * 1e6 / writes, found ? "" : ", FAILED to read back");
+
+    if (!found || registry.dropped())
+        failures++;
+
+    return failures ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// log - cost of a log call against fprintf, binary log read back and checked
+// ---------------------------------------------------------------------------------------------
+
+// One call site for every run, so a restarted log has to write its format again
+static void BM_LogRecord(int thread, int i)
+{
+    SynclavierKBI1Log(SynclavierKBI1LogInfo, "thread %d record %d NRPN %d = %d at %.3f ms %s\n", thread, i, i & 0x3FFF, (i * 7) & 0x3FFF, i * 0.25, "ok");
+}
+
+// Log records in bursts, as a busy MIDI thread would, leaving the background thread time to keep up. Returns seconds spent logging.
+static double BM_LogProducer(int thread, int records, int burst)
+{
+    double spent = 0;
+
+    for (int record = 0; record < records; record += burst) {
+        double start = BM_Seconds();
+
+        for (int i = record; i < record + burst && i < records; i++)
+            BM_LogRecord(thread, i);
+
+        spent += BM_Seconds() - start;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(SynclavierKBI1Logger::kPollInterval * 2));
+    }
+
+    return spent;
+}
+
+// Format with the log's printf against snprintf
+template <typename... ARGS>
+static int BM_LogFormatCheck(const char* format, ARGS... args)
+{
+    uint8_t                      bytes[SynclavierKBI1Logger::kMaxRecord];
+    SynclavierKBI1LogArgs::Value values[SynclavierKBI1LogArgs::kMaxArgs];
+    char                         expect[256], got[256] = {};
+
+    snprintf(expect, sizeof(expect), format, args...);
+
+    SynclavierKBI1LogArgs::encode(bytes, args...);
+
+    int   count = SynclavierKBI1LogArgs::decode(bytes, SynclavierKBI1LogArgs::size(args...), values);
+    FILE* file  = tmpfile();
+
+    if (!file)
+        return 1;
+
+    SynclavierKBI1LogArgs::print(file, format, values, count);
+    rewind(file);
+
+    size_t length = fread(got, 1, sizeof(got) - 1, file);
+
+    fclose(file);
+
+    if (length == strlen(expect) && memcmp(got, expect, length) == 0)
+        return 0;
+
+    printf("log format           : \"%s\" gave \"%s\", printf gives \"%s\"\n", format, got, expect);
+    return 1;
+}
+
+static int BM_Log(int argc, const char* argv[])
+{
+    int  records = BM_IntOption(argc, argv, "-records", 100000);     // Per thread, 2 threads
+    int  burst   = BM_IntOption(argc, argv, "-burst",   256);
+    auto path    = BM_StringOption(argc, argv, "-out", "/tmp/kbi1-bench.log");
+
+    if (records < 1 || burst < 1)
+        return 1;
+
+    int failures = 0;
+
+    failures += BM_LogFormatCheck("KBI-1 %d connected.\n", 3);
+    failures += BM_LogFormatCheck("%5.1f%% %-6s|%06x %llu %c", 99.25, "abc", 0xBEEF, (unsigned long long) -1, 'k');
+    failures += BM_LogFormatCheck("%.2s %+d %e %u", "truncated", -42, 1.5e-7, 7u);
+    failures += BM_LogFormatCheck("panel restored in %.0f usec: %d lights, %d bytes in %d packet list%s.\n", 123.6, 40, 512, 1, "");
+
+    // Binary to a file, two threads logging
+    FILE* file = fopen(path, "wb");
+
+    if (!file) {
+        printf("log                  : could not create %s\n", path);
+        return 1;
+    }
+
+    auto& logger = SynclavierKBI1Logger::shared();
+
+    logger.start(file, true);
+
+    double other = 0;
+
+    std::thread second([&] {other = BM_LogProducer(1, records, burst);});
+
+    double mine = BM_LogProducer(0, records, burst);
+
+    second.join();
+    logger.stop();
+    fclose(file);
+
+    // The same records with fprintf, on the calling thread
+    FILE* null = fopen("/dev/null", "w");
+    double start = BM_Seconds();
+
+    for (int i = 0; i < records && null; i++)
+        fprintf(null, "thread %d record %d NRPN %d = %d at %.3f ms %s\n", 0, i, i & 0x3FFF, (i * 7) & 0x3FFF, i * 0.25, "ok");
+
+    double printed = BM_Seconds() - start;
+
+    if (null)
+        fclose(null);
+
+    // Below the compiled level: nothing is left of the call
+    start = BM_Seconds();
+
+    for (int i = 0; i < records; i++)
+        SynclavierKBI1Log(SynclavierKBI1LogTrace, "record %d %s\n", i, "never");
+
+    double compiledOut = BM_Seconds() - start;
+
+    printf("log call             : %.1f ns per record logged (2 threads), fprintf %.1f ns, below the compiled level %.2f ns\n",
+           (mine + other) * 1e9 / (2.0 * records), printed * 1e9 / records, compiledOut * 1e9 / records);
+
+    // Read it back: every record there, in order per thread, with its arguments
+    static SynclavierKBI1LogReader reader;
+    SynclavierKBI1LogReader::Entry entry;
+    SynclavierKBI1LogArgs::Value   values[SynclavierKBI1LogArgs::kMaxArgs];
+
+    int       expected[2] = {0, 0};
+    long long count = 0, wrong = 0;
+
+    if (!reader.open(path))
+        failures++;
+
+    while (reader.next(entry)) {
+        int n = SynclavierKBI1LogArgs::decode(entry.args, entry.argBytes, values);
+
+        count++;
+
+        if (n != 6 || values[0].i < 0 || values[0].i > 1 || values[1].i != expected[values[0].i] ||
+            values[2].i != (values[1].i & 0x3FFF) || values[4].d != values[1].i * 0.25 || values[5].length != 2) {
+            wrong++;
+            continue;
+        }
+
+        expected[values[0].i]++;
+    }
+
+    FILE* size = fopen(path, "rb");
+    long  bytes = 0;
+
+    if (size) {
+        fseek(size, 0, SEEK_END);
+        bytes = ftell(size);
+        fclose(size);
+    }
+
+    printf("log read back        : %lld records, %lld wrong, %llu dropped, %.1f bytes per record in %s\n",
+           count, wrong, (unsigned long long) reader.dropped(), count ? (double) bytes / count : 0.0, path);
+
+    if (count != 2LL * records || wrong || reader.dropped())
+        failures++;
+
+    // Started again into a new file: the formats are written there too, and a burst logged just
+    // before stop() is all in it
+    char again[1024];
+
+    snprintf(again, sizeof(again), "%s.2", path);
+
+    if (!(file = fopen(again, "wb")))
+        return 1;
+
+    logger.start(file, true);
+
+    for (int i = 0; i < burst; i++)
+        BM_LogRecord(0, i);
+
+    logger.stop();
+    fclose(file);
+
+    long long restarted = 0;
+
+    if (!reader.open(again))
+        failures++;
+
+    while (reader.next(entry))
+        restarted++;
+
+    printf("log restarted        : %lld of %d records read back from %s\n", restarted, burst, again);
+
+    if (restarted + (long long) reader.dropped() != burst || restarted == 0)
+        failures++;
+
+    return failures ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// map - compiled control map lookups against a std::map dispatcher, hot reload and LED feedback
+// ---------------------------------------------------------------------------------------------
+
+static const char* const BM_MapActions[] = {nullptr, "select-track", "play", "stop", "record", "cutoff", "resonance", "volume", "tempo", "pitch", "scrub", "repeat"};
+
+static const char BM_MapText[] =
+    "# ORK: tracks 1 - 32 and transport, VK: sounds, VK right: banks\n"
+    "button ork 0-31        select-track 1  led\n"
+    "button ork 40          play            led\n"
+    "button ork 41          stop\n"
+    "button ork 42          record          led\n"
+    "button ork 64-127      20 100\n"
+    "button vk 0-127        21 0            led\n"
+    "button vk-right 0-31   22 0            led\n"
+    "\n"
+    "control wheel          cutoff\n"
+    "control breath         resonance\n"
+    "control pedal1         volume 1\n"
+    "control pedal2         volume 2        # second pedal\n"
+    "control pedal 0x44     volume 3\n"
+    "control ribbon         scrub\n"
+    "control sustain        23\n"
+    "control repeat         repeat\n"
+    "control knob           tempo\n"
+    "control bend           pitch 0\n"
+    "control ribbon-bend    pitch 1\n";
+
+struct BM_MapSum {
+    long long sum;
+    long long calls;
+    long long torn;
+};
+
+static void BM_MapAction(int action, int param, int value, const SynclavierKBI1InputEvent& event, void* refCon)
+{
+    auto& total = *(BM_MapSum*) refCon;
+
+    total.sum += action * 7919 + param * 31 + value;
+    total.calls++;
+}
+
+// Hot reload: one map gives action 1 and the button, the other action 2 and 1000 + the button
+static void BM_MapReloadAction(int action, int param, int value, const SynclavierKBI1InputEvent& event, void* refCon)
+{
+    auto& total = *(BM_MapSum*) refCon;
+
+    if (param != (action == 1 ? event.number : 1000 + event.number))
+        total.torn++;
+
+    total.calls++;
+}
+
+// The usual if-chain and std::map a host would write
+struct BM_MapNaive {
+    struct Target {
+        int action;
+        int param;
+    };
+
+    std::map<uint32_t, Target> targets;
+
+    static uint32_t key(int type, int channel, int number) {
+        return (uint32_t) type << 16 | (uint32_t) channel << 8 | (uint32_t) number;
+    }
+
+    // The same bindings, from the compiled map
+    void fill(const SynclavierKBI1ControlMap& map) {
+        for (int type = 0; type < SynclavierKBI1InputTypes; type++) {
+            for (int channel = 0; channel < 16; channel++) {
+                for (int number = 0; number < 128; number++) {
+                    SynclavierKBI1InputEvent event = {};
+                    int action, param;
+
+                    event.type    = type;
+                    event.channel = channel;
+                    event.number  = number;
+
+                    map.lookup(event, action, param);
+
+                    if (action && (number == 0 || SynclavierKBI1ControlRowTable.mask[type]))
+                        targets[key(type, channel, number)] = {action, param};
+                }
+            }
+        }
+    }
+
+    int dispatch(const SynclavierKBI1InputEvent& event, BM_MapSum& total) {
+        int number = event.number;
+
+        if (event.type == SynclavierKBI1InputBend || event.type == SynclavierKBI1InputKnob || event.type == SynclavierKBI1InputRibbonBend)
+            number = 0;
+
+        auto found = targets.find(key(event.type, event.channel, number));
+
+        if (found == targets.end())
+            return 0;
+
+        BM_MapAction(found->second.action, found->second.param, event.value, event, &total);
+
+        return found->second.action;
+    }
+};
+
+static int BM_Map(int argc, const char* argv[])
+{
+    int events  = BM_IntOption(argc, argv, "-events",  10000000);
+    int reloads = BM_IntOption(argc, argv, "-reloads", 10000);
+
+    static SynclavierKBI1ControlMap map;
+    BM_MapNaive                     naive;
+    BM_MapSum                       compiled = {}, chained = {};
+    int                             failures = 0;
+
+    int actionCount = (int) (sizeof(BM_MapActions) / sizeof(BM_MapActions[0]));
+
+    for (int action = 1; action < 24; action++)
+        map.setAction(action, BM_MapAction, &compiled);
+
+    if (!map.load(BM_MapText, BM_MapActions, actionCount)) {
+        printf("map                  : FAILED to load, %s\n", map.error());
+        return 1;
+    }
+
+    naive.fill(map);
+
+    // A performance's worth of events: mostly controls, some buttons, some keys that map to nothing
+    static const int kEvents = 4096;
+    static const int kControllers[] = {0x01, 0x02, 0x07, 0x0A, 0x0B, 0x10, 0x40, 0x43, 0x44, 0x4A};
+
+    std::vector<SynclavierKBI1InputEvent> performance(kEvents);
+    std::mt19937                          random(1);
+
+    for (auto& event : performance) {
+        int choice = (int) (random() % 100);
+
+        event = {};
+
+        if (choice < 40) {
+            event.number = kControllers[random() % 10];
+            event.type   = SynclavierKBI1InputRoutes.controller[event.number];
+            event.value  = (int) (random() % 128);
+        }
+
+        else if (choice < 55) {
+            event.type    = SynclavierKBI1InputBend;
+            event.number  = (int) (random() % 128);
+            event.value   = (int) (random() % 16384) - 8192;
+        }
+
+        else if (choice < 65) {
+            event.type    = random() % 2 ? SynclavierKBI1InputKnob : SynclavierKBI1InputRibbonBend;
+            event.channel = event.type == SynclavierKBI1InputKnob ? SynclavierKBI1MIDIProtocolKnobChannel : SynclavierKBI1MIDIProtocolRibbonChannel;
+            event.number  = (int) (random() % 128);
+            event.value   = (int) (random() % 16384) - 8192;
+        }
+
+        else if (choice < 90) {
+            static const int panels[] = {SynclavierKBI1MIDIProtocolORKChannel, SynclavierKBI1MIDIProtocolVKChannel, SynclavierKBI1MIDIProtocolVKAltChannel};
+
+            event.type    = SynclavierKBI1InputButton;
+            event.channel = panels[random() % 3];
+            event.number  = (int) (random() % (event.channel == SynclavierKBI1MIDIProtocolVKAltChannel ? 32 : 128));
+            event.value   = (int) (random() % 2);
+        }
+
+        else {
+            event.type    = SynclavierKBI1InputNote;
+            event.number  = (int) (random() % 128);
+            event.value   = (int) (random() % 128);
+        }
+    }
+
+    // Same actions, parameters and values from both
+    long long mapped = 0, naiveMapped = 0;
+
+    for (auto& event : performance) {
+        mapped      += map.dispatch(event) != 0;
+        naiveMapped += naive.dispatch(event, chained) != 0;
+    }
+
+    if (compiled.sum != chained.sum || compiled.calls != chained.calls || mapped != naiveMapped) {
+        printf("map                  : FAILED, compiled and std::map dispatch differ (%lld and %lld calls)\n", compiled.calls, chained.calls);
+        failures++;
+    }
+
+    double start = BM_Seconds();
+
+    for (int event = 0; event < events; event++)
+        map.dispatch(performance[event & (kEvents - 1)]);
+
+    double flat = BM_Seconds() - start;
+
+    start = BM_Seconds();
+
+    for (int event = 0; event < events; event++)
+        naive.dispatch(performance[event & (kEvents - 1)], chained);
+
+    double tree = BM_Seconds() - start;
+
+    printf("map bindings         : %d bindings, %lld of %d events mapped, both dispatchers agree: %s\n",
+           map.mappings(), mapped, kEvents, compiled.sum == chained.sum ? "yes" : "NO");
+    printf("map dispatch         : %6.2f ns per event compiled, std::map %.2f ns [%lld]\n",
+           flat * 1e9 / events, tree * 1e9 / events, (compiled.sum ^ chained.sum) & 1);
+
+    // LED feedback: lights follow their action
+    SynclavierKBI1LEDState leds;
+
+    int lit = map.setState(1, 5, SynclavierKBI1LEDState::LEDOn, leds);          // select-track 5: ORK 4
+    lit += map.setState(2, 0, SynclavierKBI1LEDState::LEDBlinking, leds);       // play: ORK 40
+    lit += map.setState(3, 0, SynclavierKBI1LEDState::LEDOn, leds);             // stop: no led
+    lit += map.setState(21, 60, SynclavierKBI1LEDState::LEDHeld, leds);         // VK 60
+
+    if (lit != 3 || leds.get(SynclavierKBI1MIDIProtocolORKChannel, 4) != SynclavierKBI1LEDState::LEDOn ||
+        leds.get(SynclavierKBI1MIDIProtocolORKChannel, 40) != SynclavierKBI1LEDState::LEDBlinking ||
+        leds.get(SynclavierKBI1MIDIProtocolORKChannel, 41) != SynclavierKBI1LEDState::LEDOff ||
+        leds.get(SynclavierKBI1MIDIProtocolVKChannel, 60) != SynclavierKBI1LEDState::LEDHeld) {
+        printf("map leds             : FAILED, %d lights set\n", lit);
+        failures++;
+    }
+
+    // Errors leave the mapping in use alone
+    static const char* const broken[] = {
+        "button ork 3 play\nbutton ork 3 stop\n",
+        "button panel 3 play\n",
+        "button vk 200 play\n",
+        "control wheel nothing\n",
+        "control knob tempo led\n",
+        "control cc 0x63 volume\n",
+        "buttons ork 1 play\n",
+        "button ork 1 play 1 led extra\n",
+    };
+
+    int rejected = 0;
+
+    for (auto text : broken) {
+        if (!map.load(text, BM_MapActions, actionCount) && map.error()[0])
+            rejected++;
+    }
+
+    int action, param;
+    SynclavierKBI1InputEvent play = {};
+
+    play.type    = SynclavierKBI1InputButton;
+    play.channel = SynclavierKBI1MIDIProtocolORKChannel;
+    play.number  = 40;
+
+    map.lookup(play, action, param);
+
+    printf("map errors           : %d of %zu broken mappings rejected, mapping kept: %s\n",
+           rejected, sizeof(broken) / sizeof(broken[0]), action == 2 ? "yes" : "NO");
+
+    if (action != 2 || rejected != (int) (sizeof(broken) / sizeof(broken[0])))
+        failures++;
+
+    // Hot reload: dispatch on one thread while the other swaps two mappings under it
+    static SynclavierKBI1ControlMap reloading;
+    BM_MapSum                       seen = {};
+    std::atomic<bool>               done(false);
+
+    reloading.setAction(1, BM_MapReloadAction, &seen);
+    reloading.setAction(2, BM_MapReloadAction, &seen);
+    reloading.load("button ork 0-127 1 0\nbutton vk 0-127 1 0\n");
+
+    std::thread dispatcher([&] {
+        SynclavierKBI1InputEvent button = {};
+        int                      which  = 0;
+
+        button.type = SynclavierKBI1InputButton;
+
+        while (!done.load(std::memory_order_relaxed)) {
+            button.channel = which & 1 ? SynclavierKBI1MIDIProtocolVKChannel : SynclavierKBI1MIDIProtocolORKChannel;
+            button.number  = (which >> 1) & 127;
+            which++;
+
+            reloading.dispatch(button);
+        }
+    });
+
+    start = BM_Seconds();
+
+    for (int reload = 0; reload < reloads; reload++) {
+        bool loaded = reload & 1 ? reloading.load("button ork 0-127 1 0\nbutton vk 0-127 1 0\n")
+                                 : reloading.load("button ork 0-127 2 1000\nbutton vk 0-127 2 1000\n");
+
+        if (!loaded)
+            failures++;
+    }
+
+    double swapping = BM_Seconds() - start;
+
+    done = true;
+    dispatcher.join();
+
+    printf("map hot reload       : %lld reloads in %.1f ms (%.1f usec each) while %lld events dispatched, %lld torn\n",
+           reloading.loads(), swapping * 1e3, swapping * 1e6 / reloads, seen.calls, seen.torn);
+
+    if (seen.torn || reloading.loads() != reloads + 1)
+        failures++;
+
+    return failures ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// hotplug - endpoint registry against full rescans, and reconnect latency after unplug and replug
+// ---------------------------------------------------------------------------------------------
+
+static const int kBM_HotplugUnits = 4;
+
+typedef SynclavierKBI1EndpointRegistry BM_HotplugRegistryType;
+
+static BM_HotplugRegistryType           BM_HotplugRegistry;
+static SynclavierKBI1MIDILoopback       BM_HotplugLinks[kBM_HotplugUnits];
+static SynclavierKBI1Device             BM_HotplugHosts[kBM_HotplugUnits];
+static SynclavierKBI1SimulatedDevice    BM_HotplugKBI1s[kBM_HotplugUnits] = {
+    BM_HotplugLinks[0].device, BM_HotplugLinks[1].device, BM_HotplugLinks[2].device, BM_HotplugLinks[3].device,
+};
+
+// A KBI-1's endpoints: entity 0x1000 + 0x10 per unit, its source and destination the two after it
+static inline uint64_t BM_HotplugHandle(int unit, BM_HotplugRegistryType::Kind kind) {return 0x1000 + unit * 0x10 + 1 + kind;}
+static inline int32_t  BM_HotplugID(int unit, BM_HotplugRegistryType::Kind kind)     {return 0x4B310000 + unit * 2 + kind;}
+
+// What a backend does with the registry, over loopbacks standing in for the KBI-1s' USB links
+class BM_HotplugTransport : public SynclavierKBI1MIDITransport {
+public:
+    typedef BM_HotplugRegistryType Registry;
+
+    inline BM_HotplugTransport() : deviceName(Registry::name("Synclavier KBI-1")) {}
+
+    const char* name() const override {return "Hot plug";}
+
+    bool open() override {return true;}
+
+    bool findDevice() override {
+        if (connected() || BM_HotplugRegistry.generation() == seen)
+            return connected();
+
+        seen = BM_HotplugRegistry.generation();
+
+        if (source == 0) {
+            if (auto endpoint = BM_HotplugRegistry.claim(Registry::KindSource, deviceName, this)) {
+                source = endpoint->handle;
+                entity = endpoint->entity;
+            }
+        }
+
+        if (destination == 0) {
+            if (auto endpoint = BM_HotplugRegistry.claim(Registry::KindDestination, deviceName, this, source ? entity : 0))
+                destination = endpoint->handle;
+        }
+
+        return connected();
+    }
+
+    bool connected() const override {return source && destination;}
+
+    bool send(const TransportByte* bytes, int length, uint64_t timeStamp) override {
+        return connected() && BM_HotplugLinks[(destination - 0x1000) >> 4].host.send(bytes, length, timeStamp);
+    }
+
+    bool allowsRunningStatus() const override {return true;}
+
+    inline void receive(const TransportByte* bytes, int length, uint64_t timeStamp) {deliver(bytes, length, timeStamp);}
+
+    Registry::Name  deviceName;
+    uint64_t        source      = 0;
+    uint64_t        destination = 0;
+    uint64_t        entity      = 0;
+    uint64_t        seen        = 0;
+    bool            lost        = false;
+    long long       losses      = 0;
+};
+
+static BM_HotplugTransport BM_HotplugTransports[kBM_HotplugUnits];
+
+// A KBI-1's link delivers to whichever transport claimed its source
+static void BM_HotplugReceive(const SynclavierKBI1MIDITransport::TransportByte* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    int  unit     = (int) (intptr_t) refCon;
+    auto endpoint = BM_HotplugRegistry.find(BM_HotplugID(unit, BM_HotplugRegistryType::KindSource));
+
+    if (endpoint && endpoint->owner)
+        ((BM_HotplugTransport*) endpoint->owner)->receive(bytes, length, timeStamp);
+}
+
+static void BM_HotplugLost(const void* owner, const BM_HotplugRegistryType::Endpoint& endpoint, void* refCon)
+{
+    auto& transport = *(BM_HotplugTransport*) owner;
+
+    BM_HotplugRegistry.release(&transport);
+
+    transport.source = transport.destination = 0;
+    transport.seen   = 0;
+    transport.lost   = true;
+    transport.losses++;
+}
+
+// After a notification, as the Core MIDI backend and MU_Notify do
+static void BM_HotplugNotify()
+{
+    for (int unit = 0; unit < kBM_HotplugUnits; unit++) {
+        auto& transport = BM_HotplugTransports[unit];
+        bool  lost      = transport.lost;
+        bool  found     = !transport.connected() && transport.findDevice();
+
+        transport.lost = false;
+
+        if (lost || found) {
+            BM_HotplugHosts[unit].forget();
+            BM_HotplugHosts[unit].probe();
+        }
+    }
+}
+
+static void BM_HotplugSettle()
+{
+    for (int i = 0; i < 4; i++) {
+        for (auto& host : BM_HotplugHosts) {
+            host.drainInput();
+            host.flush();
+        }
+    }
+}
+
+static void BM_HotplugPlug(int unit, bool in)
+{
+    for (auto kind : {BM_HotplugRegistryType::KindSource, BM_HotplugRegistryType::KindDestination}) {
+        if (in)
+            BM_HotplugRegistry.add(BM_HotplugID(unit, kind), kind, BM_HotplugHandle(unit, kind), 0x1000 + unit * 0x10, 0x1000 + unit * 0x10, "Synclavier KBI-1", true);
+        else
+            BM_HotplugRegistry.remove(BM_HotplugID(unit, kind));
+    }
+}
+
+static int BM_HotplugConnected()
+{
+    int count = 0;
+
+    for (auto& host : BM_HotplugHosts)
+        count += host.connected();
+
+    return count;
+}
+
+static int BM_Hotplug(int argc, const char* argv[])
+{
+    int devices = BM_IntOption(argc, argv, "-devices", 64);         // Other MIDI devices, each a source and destination
+    int changes = BM_IntOption(argc, argv, "-changes", 10000);
+    int replugs = BM_IntOption(argc, argv, "-replugs", 1000);
+    int failures = 0;
+
+    struct Other {
+        char name[BM_HotplugRegistryType::kNameSize];
+    };
+
+    std::vector<Other> others(std::max(devices, 1));
+
+    devices = (int) others.size();
+
+    auto plugOther = [&](int which, bool in) {
+        for (auto kind : {BM_HotplugRegistryType::KindSource, BM_HotplugRegistryType::KindDestination}) {
+            if (in)
+                BM_HotplugRegistry.add(0x100000 + which * 2 + kind, kind, 0x100000 + which * 4 + 1 + kind, 0x100000 + which * 4, 0x100000 + which * 4, others[which].name, true);
+            else
+                BM_HotplugRegistry.remove(0x100000 + which * 2 + kind);
+        }
+    };
+
+    BM_HotplugRegistry.clear();
+    BM_HotplugRegistry.setLostProc(BM_HotplugLost, nullptr);
+
+    for (int which = 0; which < devices; which++) {
+        snprintf(others[which].name, sizeof(others[which].name), "USB MIDI Interface %d Port %d", which / 4 + 1, which % 4 + 1);
+        plugOther(which, true);
+    }
+
+    for (int unit = 0; unit < kBM_HotplugUnits; unit++) {
+        BM_HotplugLinks[unit].host.setReceiveProc(BM_HotplugReceive, (void*) (intptr_t) unit);
+        BM_HotplugLinks[unit].host.open();
+        BM_HotplugLinks[unit].device.open();
+
+        BM_HotplugHosts[unit].attach(&BM_HotplugTransports[unit], unit + 1);
+        BM_HotplugHosts[unit].setVerbose(false);
+
+        BM_HotplugKBI1s[unit].powerOn();
+        BM_HotplugPlug(unit, true);
+    }
+
+    BM_HotplugNotify();
+    BM_HotplugSettle();
+
+    printf("hotplug setup        : %d endpoints, %d of %d KBI-1s connected\n", BM_HotplugRegistry.size(), BM_HotplugConnected(), kBM_HotplugUnits);
+
+    if (BM_HotplugConnected() != kBM_HotplugUnits || BM_HotplugRegistry.full())
+        failures++;
+
+    // Other devices come and go. Nobody connected should notice.
+    long long losses = 0;
+    double    start  = BM_Seconds();
+
+    for (int change = 0; change < changes; change++) {
+        plugOther(change % devices, change / devices % 2 == 1);
+        BM_HotplugNotify();
+    }
+
+    double incremental = BM_Seconds() - start;
+
+    BM_HotplugSettle();
+
+    for (auto& transport : BM_HotplugTransports)
+        losses += transport.losses;
+
+    // Rescanning instead: every endpoint's name fetched and compared on each change
+    const char* kbi1Name = "Synclavier KBI-1";
+    char        fetched[BM_HotplugRegistryType::kNameSize];
+    long long   matches = 0;
+
+    start = BM_Seconds();
+
+    for (int change = 0; change < changes; change++) {
+        for (int which = 0; which < devices * 2 + kBM_HotplugUnits * 2; which++) {
+            snprintf(fetched, sizeof(fetched), "%s", which < devices * 2 ? others[which / 2].name : kbi1Name);
+            matches += strcmp(fetched, kbi1Name) == 0;
+        }
+    }
+
+    double rescan = BM_Seconds() - start;
+
+    printf("hotplug others       : %d changes, %.0f ns each (full rescan %.0f ns) [%lld], %lld KBI-1 connections lost, %d still connected\n",
+           changes, incremental * 1e9 / std::max(changes, 1), rescan * 1e9 / std::max(changes, 1), matches & 1, losses, BM_HotplugConnected());
+
+    if (losses || BM_HotplugConnected() != kBM_HotplugUnits)
+        failures++;
+
+    // Unplug a KBI-1, then plug it back in: time from the replug notification to it answering
+    std::vector<double> latencies;
+    int                 disturbed = 0, missed = 0;
+
+    for (int replug = 0; replug < replugs; replug++) {
+        int unit = replug % kBM_HotplugUnits;
+
+        BM_HotplugPlug(unit, false);
+        BM_HotplugNotify();
+        BM_HotplugSettle();
+
+        if (BM_HotplugConnected() != kBM_HotplugUnits - 1)
+            disturbed++;
+
+        start = BM_Seconds();
+
+        BM_HotplugPlug(unit, true);
+        BM_HotplugNotify();
+        BM_HotplugSettle();
+
+        double replugged = BM_Seconds() - start;
+
+        if (BM_HotplugConnected() != kBM_HotplugUnits)
+            missed++;
+
+        latencies.push_back(replugged);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    losses = -losses;
+
+    for (auto& transport : BM_HotplugTransports)
+        losses += transport.losses;
+
+    double median = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+    double most   = latencies.empty() ? 0 : latencies.back();
+
+    printf("hotplug reconnect    : %d unplugs and replugs, replug to KBI-1 answering %.1f usec median, %.1f usec max, %d not back, %d others disturbed, %lld losses\n",
+           replugs, median * 1e6, most * 1e6, missed, disturbed, losses);
+
+    if (missed || disturbed || losses != replugs)
+        failures++;
+
+    return failures ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// ump - MIDI 2.0 Universal MIDI Packets: converters at the MIDI 1.0 edge, per-message cost
+// ---------------------------------------------------------------------------------------------
+
+struct BM_UmpWords {
+    std::vector<uint32_t> words;
+};
+
+static void BM_UmpAppend(const uint32_t* words, int count, void* refCon)
+{
+    auto& collected = *(BM_UmpWords*) refCon;
+
+    collected.words.insert(collected.words.end(), words, words + count);
+}
+
+static void BM_UmpCollect(const uint32_t* words, int count, uint64_t timeStamp, void* refCon)
+{
+    BM_UmpAppend(words, count, refCon);
+}
+
+static void BM_UmpCollectBytes(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon)
+{
+    auto& collected = *(std::vector<uint8_t>*) refCon;
+
+    collected.insert(collected.end(), bytes, bytes + length);
+}
+
+static void BM_UmpEvent(const SynclavierKBI1InputEvent& event, void* refCon)
+{
+    ((std::vector<SynclavierKBI1InputEvent>*) refCon)->push_back(event);
+}
+
+static void BM_UmpDiscard(const uint32_t* words, int count, void* refCon)
+{
+}
+
+// What the host sees of bytes from the KBI-1
+static std::vector<SynclavierKBI1InputEvent> BM_UmpDecode(const std::vector<uint8_t>& bytes)
+{
+    std::vector<SynclavierKBI1InputEvent> events;
+    SynclavierKBI1InputDecoder            decoder;
+
+    for (int type = SynclavierKBI1InputNote; type < SynclavierKBI1InputTypes; type++)
+        decoder.setProc((SynclavierKBI1InputType) type, BM_UmpEvent, &events);
+
+    decoder.receive(bytes.data(), (int) bytes.size(), 0);
+
+    return events;
+}
+
+static int BM_UmpDifferences(const std::vector<SynclavierKBI1InputEvent>& a, const std::vector<SynclavierKBI1InputEvent>& b)
+{
+    int differences = (int) std::max(a.size(), b.size()) - (int) std::min(a.size(), b.size());
+
+    for (size_t which = 0; which < std::min(a.size(), b.size()); which++) {
+        if (a[which].type != b[which].type || a[which].channel != b[which].channel || a[which].number != b[which].number || a[which].value != b[which].value)
+            differences++;
+    }
+
+    return differences;
+}
+
+// Words in the whole messages from offset that fit in limit, as a MIDI service hands them over
+static int BM_UmpChunk(const std::vector<uint32_t>& words, size_t offset, int limit)
+{
+    int length = 0;
+
+    while (offset + length < words.size()) {
+        int next = SynclavierKBI1UMP::words(words[offset + length]);
+
+        if (length + next > limit && length > 0)
+            break;
+
+        length += next;
+    }
+
+    return length;
+}
+
+// Stands in for a MIDI 2.0 host reading what arrives: the message's fields, by status
+struct BM_UmpSum {
+    long long messages = 0;
+    long long sum      = 0;
+};
+
+static int BM_Ump(int argc, const char* argv[])
+{
+    int megabytes = BM_IntOption(argc, argv, "-megabytes", 32);
+    int packet    = BM_IntOption(argc, argv, "-packet",    64);
+    int nrpns     = BM_IntOption(argc, argv, "-nrpns",     1 << 22);
+    int failures  = 0;
+
+    if (packet < 1)
+        packet = 1;
+
+    // Scaling: lowest, middle and highest stay put, and every value comes back down exactly
+    int scaling = 0;
+
+    for (uint32_t value = 0; value < 128; value++) {
+        scaling += SynclavierKBI1UMP::scaleDown(SynclavierKBI1UMP::scaleUp(value, 7, 16), 16, 7) != value;
+        scaling += SynclavierKBI1UMP::scaleDown(SynclavierKBI1UMP::scaleUp(value, 7, 32), 32, 7) != value;
+    }
+
+    for (uint32_t value = 0; value < 0x4000; value++)
+        scaling += SynclavierKBI1UMP::scaleDown(SynclavierKBI1UMP::scaleUp(value, 14, 32), 32, 14) != value;
+
+    scaling += SynclavierKBI1UMP::scaleUp(0, 7, 32) != 0 || SynclavierKBI1UMP::scaleUp(0x7F, 7, 32) != 0xFFFFFFFF;
+    scaling += SynclavierKBI1UMP::scaleUp(0x2000, 14, 32) != 0x80000000 || SynclavierKBI1UMP::scaleUp(0x3FFF, 14, 32) != 0xFFFFFFFF;
+    scaling += SynclavierKBI1UMP::scaleUp(0x40, 7, 16) != 0x8000 || SynclavierKBI1UMP::scaleUp(0x7F, 7, 16) != 0xFFFF;
+
+    printf("ump scaling          : 7 to 16, 7 to 32 and 14 to 32 bits and back, %d wrong\n", scaling);
+
+    if (scaling)
+        failures++;
+
+    // Round trip through the transport: KBI-1 bytes to words, words back to bytes, same events either way
+    auto traffic  = BM_KBI1Traffic(1 << 20, 1);
+    auto expected = BM_UmpDecode(traffic);
+
+    for (int protocol = 2; protocol >= 1; protocol--) {
+        SynclavierKBI1MIDILoopback      loopback;
+        SynclavierKBI1MIDITransportUMP  ump;
+        BM_UmpWords                     received;
+        std::vector<uint8_t>            returned;
+
+        ump.attach(&loopback.host);
+        ump.setProtocol(protocol);
+        ump.setReceiveProc(BM_UmpCollect, &received);
+        ump.open();
+
+        loopback.device.setReceiveProc(BM_UmpCollectBytes, &returned);
+        loopback.device.open();
+
+        for (size_t offset = 0; offset < traffic.size(); offset += packet)
+            loopback.device.send(traffic.data() + offset, (int) std::min((size_t) packet, traffic.size() - offset), 0);
+
+        bool sent = true;
+
+        for (size_t offset = 0, chunk; offset < received.words.size(); offset += chunk) {
+            chunk = BM_UmpChunk(received.words, offset, 64);
+            sent &= ump.send(received.words.data() + offset, (int) chunk, 0);
+        }
+
+        int differences = BM_UmpDifferences(expected, BM_UmpDecode(returned));
+
+        printf("ump round trip MIDI %d: %zu bytes, %zu words (%.2f bytes each), back to %zu bytes, %zu events, %d different, %lld dropped\n",
+               protocol, traffic.size(), received.words.size(), (double) traffic.size() / std::max(received.words.size(), (size_t) 1),
+               returned.size(), expected.size(), differences, ump.dropped());
+
+        if (!sent || differences || ump.dropped() || ump.failures())
+            failures++;
+    }
+
+    // What arrives at the host each way: bytes for the MIDI 1.0 parser, or MIDI 2.0 words read a message at a time
+    std::vector<uint32_t> words;
+
+    {
+        BM_UmpWords                 collected;
+        SynclavierKBI1UMPBatch      batch(BM_UmpAppend, &collected);
+        SynclavierKBI1UMPFromMIDI1  fromMIDI1(batch);
+
+        fromMIDI1.convert(traffic.data(), (int) traffic.size());
+        batch.flush();
+
+        words = std::move(collected.words);
+    }
+
+    SynclavierKBI1MIDIParser    parser;
+    BM_ParserCounter            counter;
+
+    double start = BM_Seconds();
+
+    for (int pass = 0; pass < megabytes; pass++) {
+        for (size_t offset = 0; offset < traffic.size(); offset += packet)
+            parser.parse(traffic.data() + offset, (int) std::min((size_t) packet, traffic.size() - offset), counter);
+    }
+
+    double bytePath = BM_Seconds() - start;
+
+    BM_UmpSum sum;
+    int       wordPacket = std::max(packet / 4, 1);
+
+    start = BM_Seconds();
+
+    for (int pass = 0; pass < megabytes; pass++) {
+        for (size_t offset = 0, chunk; offset < words.size(); offset += chunk) {
+            chunk = BM_UmpChunk(words, offset, wordPacket);
+
+            SynclavierKBI1UMP::forEach(words.data() + offset, (int) chunk, [&](const uint32_t* message, int length) {
+                sum.messages++;
+                sum.sum += SynclavierKBI1UMP::status(message[0]) + SynclavierKBI1UMP::index1(message[0]) + SynclavierKBI1UMP::index2(message[0]) + (length > 1 ? message[1] : 0);
+            });
+        }
+    }
+
+    double wordPath = BM_Seconds() - start;
+    double events   = (double) expected.size() * megabytes;
+
+    printf("ump host input       : MIDI 1.0 bytes %.1f ns per event (%lld messages), UMP words %.1f ns per event (%lld messages) [%lld]\n",
+           bytePath * 1e9 / events, counter.messages, wordPath * 1e9 / events, sum.messages, (counter.sum ^ sum.sum) & 1);
+
+    // Conversion at the edge, each way
+    BM_SendCounter                  sendCounter = {};
+    SynclavierKBI1MIDIOutputBatch   outBatch(BM_Send, &sendCounter, false);
+    SynclavierKBI1UMPToMIDI1        toMIDI1(outBatch);
+    SynclavierKBI1UMPBatch          wordBatch(BM_UmpDiscard, nullptr);
+    SynclavierKBI1UMPFromMIDI1      fromMIDI1(wordBatch);
+
+    start = BM_Seconds();
+
+    for (int pass = 0; pass < megabytes; pass++) {
+        for (size_t offset = 0; offset < traffic.size(); offset += packet) {
+            fromMIDI1.convert(traffic.data() + offset, (int) std::min((size_t) packet, traffic.size() - offset));
+            wordBatch.flush();
+        }
+    }
+
+    double fromTime = BM_Seconds() - start;
+
+    start = BM_Seconds();
+
+    for (int pass = 0; pass < megabytes; pass++) {
+        for (size_t offset = 0, chunk; offset < words.size(); offset += chunk) {
+            chunk = BM_UmpChunk(words, offset, wordPacket);
+            toMIDI1.convert(words.data() + offset, (int) chunk);
+            outBatch.flush();
+        }
+    }
+
+    double toTime = BM_Seconds() - start;
+
+    printf("ump edge conversion  : MIDI 1.0 to UMP %.1f ns per event, UMP to MIDI 1.0 %.1f ns per event\n", fromTime * 1e9 / events, toTime * 1e9 / events);
+
+    // Host output of an NRPN: four controllers through the byte batch, or one Assignable Controller message
+    start = BM_Seconds();
+
+    for (int which = 0; which < nrpns; which++)
+        outBatch.sendNRPN(which & 0x3FFF, which >> 2 & 0x3FFF, SynclavierKBI1MIDIProtocolNRPNChannel);
+
+    outBatch.flush();
+
+    double nrpnBytes = BM_Seconds() - start;
+
+    start = BM_Seconds();
+
+    for (int which = 0; which < nrpns; which++)
+        SynclavierKBI1UMP::assignable(wordBatch.reserve(2), 0, SynclavierKBI1MIDIProtocolNRPNChannel, which & 0x3FFF, SynclavierKBI1UMP::scaleUp(which >> 2 & 0x3FFF, 14, 32));
+
+    wordBatch.flush();
+
+    double nrpnWords = BM_Seconds() - start;
+
+    printf("ump host nrpn output : %d NRPNs, 4 controllers %.1f ns each (12 bytes), 1 assignable controller %.1f ns each (8 bytes)\n",
+           nrpns, nrpnBytes * 1e9 / std::max(nrpns, 1), nrpnWords * 1e9 / std::max(nrpns, 1));
+
+    return failures ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// Benchmark table
+// ---------------------------------------------------------------------------------------------
+
+struct BM_Benchmark {
+    const char* name;
+    int (*proc)(int argc, const char* argv[]);
+    const char* description;
+};
+
+static const BM_Benchmark BM_Benchmarks[] =
+{
+    {"batch",       BM_Batch,       "Output batching and running status vs one send per message [-iterations n]"},
+    {"display",     BM_Display,     "Display framebuffer vs full line rewrites for a 30 Hz meter [-frames n]"},
+    {"format",      BM_Format,      "Parameter readouts formatted into display cells vs snprintf, checked against snprintf [-frames n] [-readouts n] [-checks n]"},
+    {"leds",        BM_LEDs,        "LED shadow state vs rewriting the whole panel on each mode change [-changes n]"},
+    {"restore",     BM_Restore,     "Full panel restore after a Refresh request [-iterations n] [-lit n]"},
+    {"ring",        BM_RingStress,  "Input event ring stress test, one producer and one consumer thread [-millions n] [-wake 0|1]"},
+    {"loopback",    BM_Loopback,    "Echo NRPN round trips through the loopback transport [-iterations n]"},
+    {"requests",    BM_Requests,    "Pipelined Echo queries with deadlines and retries over a lossy loopback [-queries n] [-inflight n] [-loss per1000] [-timeout usec] [-retries n]"},
+    {"echo",        BM_Echo,        "Echo NRPN round-trip latency, loss and highest sustained rate against a simulated KBI-1, as JSON [-rate n] [-burst n] [-count n] [-settle ms] [-start n] [-max n] [-device-rate n] [-json file]"},
+    {"parser",      BM_Parser,      "MIDI parser throughput on KBI-1 style traffic [-megabytes n] [-packet bytes]"},
+    {"decoder",     BM_Decoder,     "Typed input decoding through the loopback, packet arrival to callback latency [-megabytes n] [-packet bytes]"},
+    {"timers",      BM_Timers,      "Timer wheel: cost per timer and event loop wake-ups [-timers n] [-seconds n]"},
+    {"jitter",      BM_Jitter,      "Scheduled output timing error through the loopback transport [-events n] [-interval usec] [-spin usec]"},
+    {"repeat",      BM_Repeat,      "Repeat and arpeggiate pedals: step timing error through the loopback transport and cost per note [-steps n] [-rate steps/sec] [-lookahead usec] [-spin usec]"},
+    {"priority",    BM_Priority,    "Status queries during full-panel redraws: priority queues with an output budget vs one queue in call order [-ms n] [-budget bytes/ms] [-burst bytes] [-redraw ms]"},
+    {"devices",     BM_DevicesScaling, "Input throughput with 1, 4 and 16 devices, each with its own decoder, ring and batch [-megabytes n] [-packet bytes]"},
+    {"simulate",    BM_Simulate,    "Host against a simulated KBI-1: handshake, panel model checks, power cycle, refresh, then a performance at speed x real time [-seconds n] [-speed n]"},
+    {"trace",       BM_Trace,       "Record a session with a simulated KBI-1 to a trace, check it and replay it, or replay a given trace [-seconds n] [-speed n] [-out file] [-trace file] [-replay-speed n]"},
+    {"coalesce",    BM_Coalesce,    "Controller coalescing: events in and out per tick on a ribbon-heavy performance, with and without smoothing [-seconds n] [-tick ms] [-smoothing percent]"},
+    {"notes",       BM_Notes,       "Held note and pedal state checked against a note-by-note model, cost of sounding() and sustain release [-events n] [-queries n]"},
+    {"metrics",     BM_Metrics,     "Link metrics: decoding with and without counting, counts checked against the parser, send times, snapshot of 16 devices [-megabytes n] [-packet bytes] [-iterations n] [-out file]"},
+    {"log",         BM_Log,         "Log call cost against fprintf from 2 threads, binary log read back and checked, formatting checked against printf [-records n] [-burst n] [-out file]"},
+    {"map",         BM_Map,         "Compiled control map dispatch vs a std::map dispatcher, checked against it, LED feedback, errors and hot reload while dispatching [-events n] [-reloads n]"},
+    {"hotplug",     BM_Hotplug,     "Endpoint registry: other MIDI devices plugged and unplugged vs full rescans, reconnect latency after a KBI-1 is unplugged and plugged back in [-devices n] [-changes n] [-replugs n]"},
+    {"ump",         BM_Ump,         "MIDI 2.0 Universal MIDI Packets: round trip through the MIDI 1.0 converters, host input and NRPN output per message, bytes vs words [-megabytes n] [-packet n] [-nrpns n]"},
+    {"fuzz",        BM_Fuzz,        "MIDI parser fuzzing: mutated seed corpus, results compared across packet splits [-iterations n] [-seed n]"},
+};
+
+int SynclavierKBI1RunBenchmark(const char* name, int argc, const char* argv[])
+{
+    for (auto& benchmark : BM_Benchmarks) {
+        if (strcmp(name, benchmark.name) == 0)
+            return benchmark.proc(argc, argv);
+    }
+
+    printf("Benchmarks:\n");
+
+    for (auto& benchmark : BM_Benchmarks)
+        printf("  %-12s %s\n", benchmark.name, benchmark.description);
+
+    return strcmp(name, "list") == 0 ? 0 : 1;
+}
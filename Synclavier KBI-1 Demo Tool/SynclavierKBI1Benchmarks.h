@@ -0,0 +1,26 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1Benchmarks.h
+//
+
+#ifndef SynclavierKBI1Benchmarks_h
+#define SynclavierKBI1Benchmarks_h
+
+// Stand-alone benchmarks and stress tests for the KBI-1 host code.
+//
+// Run from the command line:
+//    "Synclavier KBI-1 Demo Tool" -bench <name> [options]
+//    "Synclavier KBI-1 Demo Tool" -bench list
+//
+// Benchmarks make no use of MIDI services so they can run on any host without a KBI-1 attached.
+// On Linux they build with CMakeLists.txt (mainLinux.cpp).
+// Results are printed one per line. Returns 0 on success.
+
+int SynclavierKBI1RunBenchmark(const char* name, int argc, const char* argv[]);
+
+// Echo NRPN round-trip latency, loss and highest sustained rate over a transport already
+// connected to a KBI-1. Prints JSON. Options as for -bench echo.
+class SynclavierKBI1MIDITransport;
+
+int SynclavierKBI1RunEchoTest(SynclavierKBI1MIDITransport& transport, const char* device, int argc, const char* argv[]);
+
+#endif
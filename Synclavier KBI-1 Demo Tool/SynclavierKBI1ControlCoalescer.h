@@ -0,0 +1,260 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1ControlCoalescer.h
+//
+
+#ifndef SynclavierKBI1ControlCoalescer_h
+#define SynclavierKBI1ControlCoalescer_h
+
+#include <stdint.h>
+
+#include <atomic>
+#include <initializer_list>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1InputDecoder.h"
+
+// Cuts the continuous controllers down to one event per control per tick.
+//
+// The ribbon sends relative movements (controller 0x10) and ribbon pitch bend at the same time, the
+// knob sends pitch bend, and the wheel and pedals send controllers. Together they can send thousands
+// of messages a second, and most of what uses them only needs where each one is now.
+//
+// Sits between the input decoder and whatever handles its events. The decoder hands it these events
+// on the MIDI thread, where each one only updates its control's slot:
+//
+//  - Absolute controls (pitch bend, knob, ribbon pitch bend, wheel, breath, pedals 1 and 2) keep the last value.
+//  - Ribbon movements are added up.
+//
+// tick(), called on the application thread once per control period, hands each control that moved
+// to the event proc: the last value, or the sum of the movements since the last tick. Everything
+// else the decoder hands on as before (notes, buttons, switch pedals, NRPNs).
+//
+// Absolute controls can also be smoothed: each tick moves the value sent part of the way to the
+// latest, and keeps sending on later ticks until it gets there. Movements are never smoothed, so
+// their sum is always exact.
+//
+// Nothing is allocated, locked or waited for. One producer (the MIDI thread) and one consumer.
+
+class SynclavierKBI1ControlCoalescer {
+public:
+    typedef SynclavierKBI1InputDecoder::EventProc EventProc;
+
+    enum Control {
+        ControlBend,
+        ControlWheel,
+        ControlBreath,
+        ControlPedal1,
+        ControlPedal2,
+        ControlRibbonDelta,
+        ControlRibbonBend,
+        ControlKnob,
+
+        kControls
+    };
+
+    inline SynclavierKBI1ControlCoalescer() {
+        proc            = nullptr;
+        refCon          = nullptr;
+        smoothing       = 0;
+
+        for (auto& slot : slots) {
+            slot.value.store(0);
+            slot.timeStamp.store(0);
+            slot.count.store(0);
+
+            slot.smoothed   = 0;
+            slot.sent       = kNothingSent;
+            slot.settling   = false;
+        }
+
+        receivedCount.store(0);
+        emittedCount    = 0;
+        coalescedCount  = 0;
+    }
+
+    // Take the continuous controllers from decoder
+    inline void attach(SynclavierKBI1InputDecoder& decoder) {
+        for (auto type : {SynclavierKBI1InputBend, SynclavierKBI1InputController, SynclavierKBI1InputRibbonDelta, SynclavierKBI1InputRibbonBend, SynclavierKBI1InputKnob})
+            decoder.setProc(type, InputProc, this);
+    }
+
+    // Where tick() sends events. Called on the application thread.
+    inline void setProc(EventProc eventProc, void* eventRefCon) {
+        proc    = eventProc;
+        refCon  = eventRefCon;
+    }
+
+    // Fraction of the distance left that absolute controls keep each tick. 0 sends the latest value.
+    inline void setSmoothing(double amount) {
+        smoothing = amount < 0 ? 0 : amount > 0.99 ? 0.99 : amount;
+    }
+
+    // ---- MIDI thread ----
+
+    static void InputProc(const SynclavierKBI1InputEvent& event, void* refCon) {
+        ((SynclavierKBI1ControlCoalescer*) refCon)->input(event);
+    }
+
+    inline void input(const SynclavierKBI1InputEvent& event) {
+        int control = controlFor(event);
+
+        if (control < 0)
+            return;
+
+        auto& slot = slots[control];
+
+        if (control == ControlRibbonDelta)
+            slot.value.fetch_add(event.value, std::memory_order_relaxed);
+        else
+            slot.value.store(event.value, std::memory_order_relaxed);
+
+        slot.timeStamp.store(event.timeStamp, std::memory_order_relaxed);
+        slot.count.fetch_add(1, std::memory_order_release);
+
+        receivedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // ---- Application thread ----
+
+    // Send what each control did since the last tick. now is host time, for smoothed values that
+    // are still settling. Returns the number of events sent.
+    inline int tick(uint64_t now) {
+        int sent = 0;
+
+        for (int control = 0; control < kControls; control++) {
+            auto&    slot  = slots[control];
+            uint32_t count = slot.count.exchange(0, std::memory_order_acquire);
+
+            if (count == 0 && !slot.settling)
+                continue;
+
+            SynclavierKBI1InputEvent event = eventFor(control);
+
+            event.timeStamp = count ? slot.timeStamp.load(std::memory_order_relaxed) : now;
+
+            if (control == ControlRibbonDelta) {
+                event.value = slot.value.exchange(0, std::memory_order_relaxed);
+
+                // Movements arriving during the last tick were sent with it
+                if (event.value == 0) {
+                    coalescedCount += count;
+                    continue;
+                }
+            }
+
+            else {
+                int32_t latest = slot.value.load(std::memory_order_relaxed);
+
+                // The first value is sent as is
+                if (slot.sent == kNothingSent)
+                    slot.smoothed = latest;
+
+                if (smoothing > 0) {
+                    slot.smoothed  += (latest - slot.smoothed) * (1 - smoothing);
+                    event.value     = (int32_t) (slot.smoothed + (slot.smoothed < 0 ? -0.5 : 0.5));
+                    slot.settling   = event.value != latest;
+
+                    if (!slot.settling)
+                        slot.smoothed = latest;
+                }
+
+                else {
+                    event.value     = latest;
+                    slot.smoothed   = latest;
+                }
+
+                if (event.value == slot.sent) {
+                    coalescedCount += count;
+                    continue;
+                }
+
+                slot.sent = event.value;
+            }
+
+            if (count > 1)
+                coalescedCount += count - 1;
+
+            if (proc)
+                proc(event, refCon);
+
+            sent++;
+        }
+
+        emittedCount += sent;
+
+        return sent;
+    }
+
+    // Statistics
+    inline long long received()  const {return receivedCount.load(std::memory_order_relaxed);}     // Events from the decoder
+    inline long long emitted()   const {return emittedCount;}                                       // Events sent by tick()
+    inline long long coalesced() const {return coalescedCount;}                                     // Events folded into another
+
+private:
+    static const int32_t kNothingSent = INT32_MIN;
+
+    struct Slot {
+        std::atomic<int32_t>    value;                          // Latest, or movements summed since the last tick
+        std::atomic<uint64_t>   timeStamp;                      // Of the latest
+        std::atomic<uint32_t>   count;                          // Events since the last tick
+
+        // Application thread
+        double                  smoothed;
+        int32_t                 sent;                           // Last absolute value sent
+        bool                    settling;                       // Smoothed value has not reached the latest yet
+    };
+
+    static inline int controlFor(const SynclavierKBI1InputEvent& event) {
+        switch (event.type) {
+            case SynclavierKBI1InputBend:           return ControlBend;
+            case SynclavierKBI1InputRibbonDelta:    return ControlRibbonDelta;
+            case SynclavierKBI1InputRibbonBend:     return ControlRibbonBend;
+            case SynclavierKBI1InputKnob:           return ControlKnob;
+
+            case SynclavierKBI1InputController:
+                switch (event.number) {
+                    case 0x01:  return ControlWheel;
+                    case 0x02:  return ControlBreath;
+                    case 0x07:  return ControlPedal1;
+                    case 0x0B:  return ControlPedal2;
+                    default:    return -1;
+                }
+
+            default:
+                return -1;
+        }
+    }
+
+    // Event with everything but the value and time stamp, as the decoder makes it
+    static inline SynclavierKBI1InputEvent eventFor(int control) {
+        static const struct {uint8_t type, channel; uint16_t number;} events[kControls] = {
+            {SynclavierKBI1InputBend,        SynclavierKBI1MIDIProtocolNoteChannel,   0},
+            {SynclavierKBI1InputController,  SynclavierKBI1MIDIProtocolNoteChannel,   0x01},
+            {SynclavierKBI1InputController,  SynclavierKBI1MIDIProtocolNoteChannel,   0x02},
+            {SynclavierKBI1InputController,  SynclavierKBI1MIDIProtocolNoteChannel,   0x07},
+            {SynclavierKBI1InputController,  SynclavierKBI1MIDIProtocolNoteChannel,   0x0B},
+            {SynclavierKBI1InputRibbonDelta, SynclavierKBI1MIDIProtocolNoteChannel,   0x10},
+            {SynclavierKBI1InputRibbonBend,  SynclavierKBI1MIDIProtocolRibbonChannel, 0},
+            {SynclavierKBI1InputKnob,        SynclavierKBI1MIDIProtocolKnobChannel,   0},
+        };
+
+        SynclavierKBI1InputEvent event = {};
+
+        event.type      = events[control].type;
+        event.channel   = events[control].channel;
+        event.number    = events[control].number;
+
+        return event;
+    }
+
+    Slot                    slots[kControls];
+    EventProc               proc;
+    void*                   refCon;
+    double                  smoothing;
+
+    std::atomic<long long>  receivedCount;
+    long long               emittedCount;
+    long long               coalescedCount;
+};
+
+#endif
@@ -0,0 +1,541 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1ControlMap.h
+//
+
+#ifndef SynclavierKBI1ControlMap_h
+#define SynclavierKBI1ControlMap_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1InputDecoder.h"
+#include "SynclavierKBI1LEDState.h"
+
+// Turns KBI-1 buttons and controls into host actions, from a mapping written as text.
+//
+//    # ORK transport buttons, lit while the action is on
+//    button ork 0-7          select-track 1  led     # Buttons 0 - 7 give select-track 1 - 8
+//    button vk 12            play            led
+//    button vk-right 3       stop
+//    control wheel           cutoff
+//    control pedal 0x43      repeat
+//    control knob            tempo
+//    control cc 0x0B         volume 2
+//
+// Each line is: button <ork|vk|vk-right> <number>[-<last>] or control <name> [number], then an
+// action, then an optional parameter and led. Actions are numbers 1 - kMaxActions - 1, or names
+// looked up in the list given to load(). A range of buttons gives the parameter counting up from
+// the one given. Control names: bend, knob, ribbon-bend, wheel, breath, pedal1, pedal2, ribbon,
+// sustain, portamento, hold, repeat, arpeggiate, punch-in, and cc or pedal with a controller number.
+//
+// load() compiles the text into flat tables. An event is looked up with two table reads, a row
+// for its type and channel (SynclavierKBI1ControlRows), then the binding at its number in that row,
+// and handed to its action's proc. Events nothing is bound to go to action 0, whose proc does
+// nothing, so dispatch() has no tests on what came in.
+//
+// led on a button binds its light to the action: setState() with the action and parameter sets the
+// light of every button bound to them in a SynclavierKBI1LEDState.
+//
+// Reloading swaps tables without stopping input. There are two: load() compiles into the one not
+// in use and publishes it with one atomic store. dispatch() says which table it is reading for the
+// few nanoseconds it reads it, and load() waits for that before it writes over a table. A mapping
+// with errors is not loaded; the one before it stays in use.
+//
+// dispatch() is called on one thread (normally the MIDI thread). load(), setAction() and setState()
+// on another (the application thread). Nothing is allocated.
+
+// Rows of the compiled table
+enum SynclavierKBI1ControlRow : uint8_t {
+    SynclavierKBI1ControlRowNone        = 0,                    // Unmapped
+    SynclavierKBI1ControlRowORK         = 1,                    // Buttons by number
+    SynclavierKBI1ControlRowVK          = 2,
+    SynclavierKBI1ControlRowVKRight     = 3,
+    SynclavierKBI1ControlRowController  = 4,                    // Controllers, pedals and ribbon movements by controller number
+    SynclavierKBI1ControlRowBend        = 5,                    // One binding each
+    SynclavierKBI1ControlRowKnob        = 6,
+    SynclavierKBI1ControlRowRibbonBend  = 7,
+
+    SynclavierKBI1ControlRows           = 8,
+};
+
+struct SynclavierKBI1ControlRowTableType {
+    uint8_t row[SynclavierKBI1InputTypes][16];                  // [type][channel]
+    uint8_t mask[SynclavierKBI1InputTypes];                     // Bits of the number that pick the binding
+
+    constexpr SynclavierKBI1ControlRowTableType() : row(), mask() {
+        row[SynclavierKBI1InputButton][SynclavierKBI1MIDIProtocolORKChannel]      = SynclavierKBI1ControlRowORK;
+        row[SynclavierKBI1InputButton][SynclavierKBI1MIDIProtocolVKChannel]       = SynclavierKBI1ControlRowVK;
+        row[SynclavierKBI1InputButton][SynclavierKBI1MIDIProtocolVKAltChannel]    = SynclavierKBI1ControlRowVKRight;
+
+        for (int type : {SynclavierKBI1InputController, SynclavierKBI1InputPedal, SynclavierKBI1InputRibbonDelta})
+            row[type][SynclavierKBI1MIDIProtocolNoteChannel] = SynclavierKBI1ControlRowController;
+
+        row[SynclavierKBI1InputBend][SynclavierKBI1MIDIProtocolNoteChannel]         = SynclavierKBI1ControlRowBend;
+        row[SynclavierKBI1InputKnob][SynclavierKBI1MIDIProtocolKnobChannel]         = SynclavierKBI1ControlRowKnob;
+        row[SynclavierKBI1InputRibbonBend][SynclavierKBI1MIDIProtocolRibbonChannel] = SynclavierKBI1ControlRowRibbonBend;
+
+        mask[SynclavierKBI1InputButton]      = 0x7F;
+        mask[SynclavierKBI1InputController]  = 0x7F;
+        mask[SynclavierKBI1InputPedal]       = 0x7F;
+        mask[SynclavierKBI1InputRibbonDelta] = 0x7F;
+    }
+};
+
+static constexpr SynclavierKBI1ControlRowTableType SynclavierKBI1ControlRowTable;
+
+static_assert(SynclavierKBI1ControlRowTable.row[SynclavierKBI1InputNote][SynclavierKBI1MIDIProtocolNoteChannel] == SynclavierKBI1ControlRowNone, "Keys are not mapped");
+
+class SynclavierKBI1ControlMap {
+public:
+    static const int kMaxActions    = 1024;
+    static const int kMaxLEDs       = 512;
+    static const int kMaxText       = 1 << 16;                  // loadFile()
+
+    // value is the event's: 1 or 0 for a button pressed or let go, the controller value, the bend
+    typedef void (*ActionProc)(int action, int param, int value, const SynclavierKBI1InputEvent& event, void* refCon);
+
+    inline SynclavierKBI1ControlMap() {
+        for (auto& entry : actions) {
+            entry.proc   = NoAction;
+            entry.refCon = nullptr;
+        }
+
+        tables[0].clear();
+        tables[1].clear();
+
+        current.store(&tables[0]);
+        reading.store(nullptr);
+
+        loadCount       = 0;
+        errorText[0]    = 0;
+        dispatchCount   = 0;
+    }
+
+    // Where an action goes. Set before input starts.
+    inline bool setAction(int action, ActionProc proc, void* refCon) {
+        if (action <= 0 || action >= kMaxActions)
+            return false;
+
+        actions[action].proc   = proc ? proc : NoAction;
+        actions[action].refCon = refCon;
+
+        return true;
+    }
+
+    // Compile a mapping and start using it. names[n] is the name of action n, for mappings that use names.
+    // Returns false, with error() saying where, if the mapping has errors.
+    inline bool load(const char* text, const char* const* names = nullptr, int nameCount = 0) {
+        const Table* inUse = current.load(std::memory_order_relaxed);
+        Table*       spare = inUse == &tables[0] ? &tables[1] : &tables[0];
+
+        // dispatch() may still be reading the table from before the last load
+        while (reading.load(std::memory_order_seq_cst) == spare)
+            ;
+
+        spare->clear();
+
+        if (!compile(*spare, text, names, nameCount))
+            return false;
+
+        current.store(spare, std::memory_order_seq_cst);
+        loadCount++;
+
+        return true;
+    }
+
+    // load() the contents of a file
+    inline bool loadFile(const char* path, const char* const* names = nullptr, int nameCount = 0) {
+        FILE* file = fopen(path, "r");
+
+        if (!file) {
+            snprintf(errorText, sizeof(errorText), "%s: could not open", path);
+            return false;
+        }
+
+        size_t length = fread(fileText, 1, sizeof(fileText) - 1, file);
+        bool   whole  = feof(file) != 0;
+
+        fclose(file);
+
+        if (!whole) {
+            snprintf(errorText, sizeof(errorText), "%s: longer than %d bytes", path, kMaxText - 1);
+            return false;
+        }
+
+        fileText[length] = 0;
+
+        return load(fileText, names, nameCount);
+    }
+
+    // ---- MIDI thread ----
+
+    // Decoder proc, for events straight from the decoder (buttons). Controls can come through a
+    // SynclavierKBI1ControlCoalescer first: call dispatch() from its proc.
+    static void InputProc(const SynclavierKBI1InputEvent& event, void* refCon) {
+        ((SynclavierKBI1ControlMap*) refCon)->dispatch(event);
+    }
+
+    inline void attach(SynclavierKBI1InputDecoder& decoder) {
+        decoder.setProc(SynclavierKBI1InputButton, InputProc, this);
+    }
+
+    // Hand event to the action bound to it. Returns the action, 0 if there is none.
+    inline int dispatch(const SynclavierKBI1InputEvent& event) {
+        const Table* table = current.load(std::memory_order_acquire);
+
+        // Say which table is being read, then make sure it is still the one in use
+        reading.store(table, std::memory_order_seq_cst);
+
+        for (const Table* now; (now = current.load(std::memory_order_seq_cst)) != table; reading.store(table, std::memory_order_seq_cst))
+            table = now;
+
+        int     type  = event.type & 0xF;
+        Binding bound = table->bindings[SynclavierKBI1ControlRowTable.row[type][event.channel & 0xF]][event.number & SynclavierKBI1ControlRowTable.mask[type]];
+
+        reading.store(nullptr, std::memory_order_release);
+
+        auto& entry = actions[bound.action];
+
+        entry.proc(bound.action, bound.param, event.value, event, entry.refCon);
+
+        dispatchCount++;
+
+        return bound.action;
+    }
+
+    // ---- Application thread ----
+
+    // Light every button bound with led to action and param. Returns the number of lights set.
+    inline int setState(int action, int param, SynclavierKBI1LEDState::LED state, SynclavierKBI1LEDState& leds) const {
+        const Table& table = *current.load(std::memory_order_relaxed);
+        int          count = 0;
+
+        if (action <= 0 || action >= kMaxActions)
+            return 0;
+
+        for (int led = table.ledFirst[action]; led < table.ledFirst[action + 1]; led++) {
+            auto& binding = table.leds[led];
+
+            if (binding.param == param && leds.set(binding.channel, binding.button, state))
+                count++;
+        }
+
+        return count;
+    }
+
+    // Action and parameter a button or control is bound to. action is 0 if it is not bound.
+    inline void lookup(const SynclavierKBI1InputEvent& event, int& action, int& param) const {
+        const Table&   table   = *current.load(std::memory_order_relaxed);
+        int            type    = event.type & 0xF;
+        const Binding& binding = table.bindings[SynclavierKBI1ControlRowTable.row[type][event.channel & 0xF]][event.number & SynclavierKBI1ControlRowTable.mask[type]];
+
+        action = binding.action;
+        param  = binding.param;
+    }
+
+    // Why the last load failed
+    inline const char* error() const {return errorText;}
+
+    // Statistics
+    inline long long loads()      const {return loadCount;}
+    inline int       mappings()   const {return current.load(std::memory_order_relaxed)->mappingCount;}
+    inline long long dispatched() const {return dispatchCount;}                 // MIDI thread
+
+private:
+    struct Binding {
+        uint16_t    action;
+        uint16_t    reserved;
+        int32_t     param;
+    };
+
+    struct LEDBinding {
+        int32_t     param;
+        uint8_t     channel;
+        uint8_t     button;
+        uint16_t    action;
+    };
+
+    struct Table {
+        Binding     bindings[SynclavierKBI1ControlRows][128];
+        LEDBinding  leds[kMaxLEDs];                             // Sorted by action
+        uint16_t    ledFirst[kMaxActions + 1];                  // leds[ledFirst[a]] to leds[ledFirst[a + 1] - 1] are action a's
+        int         ledCount;
+        int         mappingCount;
+
+        inline void clear() {
+            memset(bindings, 0, sizeof(bindings));
+            memset(ledFirst, 0, sizeof(ledFirst));
+
+            ledCount     = 0;
+            mappingCount = 0;
+        }
+    };
+
+    struct ActionEntry {
+        ActionProc  proc;
+        void*       refCon;
+    };
+
+    static void NoAction(int action, int param, int value, const SynclavierKBI1InputEvent& event, void* refCon) {}
+
+    struct NamedControl {
+        const char* name;
+        uint8_t     row;
+        uint8_t     number;
+    };
+
+    // A word of a line
+    struct Token {
+        const char* start;
+        int         length;
+
+        inline bool is(const char* word) const {return length == (int) strlen(word) && strncmp(start, word, length) == 0;}
+    };
+
+    static inline int tokenize(const char* line, const char* end, Token* tokens, int most) {
+        int count = 0;
+
+        while (line < end && count < most) {
+            while (line < end && (*line == ' ' || *line == '\t' || *line == '\r'))
+                line++;
+
+            if (line == end || *line == '#')
+                break;
+
+            tokens[count].start = line;
+
+            while (line < end && *line != ' ' && *line != '\t' && *line != '\r' && *line != '#')
+                line++;
+
+            tokens[count].length = (int) (line - tokens[count].start);
+            count++;
+        }
+
+        return count;
+    }
+
+    // Decimal or 0x hex. false if token is not all number.
+    static inline bool number(const Token& token, long& value) {
+        char  text[24];
+        char* end;
+
+        if (token.length == 0 || token.length >= (int) sizeof(text))
+            return false;
+
+        memcpy(text, token.start, token.length);
+        text[token.length] = 0;
+
+        value = strtol(text, &end, 0);
+
+        return *end == 0;
+    }
+
+    inline bool fail(int line, const char* message, const Token* token = nullptr) {
+        if (token)
+            snprintf(errorText, sizeof(errorText), "line %d: %s '%.*s'", line, message, token->length, token->start);
+        else
+            snprintf(errorText, sizeof(errorText), "line %d: %s", line, message);
+
+        return false;
+    }
+
+    inline bool compile(Table& table, const char* text, const char* const* names, int nameCount) {
+        static const NamedControl controls[] = {
+            {"bend",        SynclavierKBI1ControlRowBend,       0},
+            {"knob",        SynclavierKBI1ControlRowKnob,       0},
+            {"ribbon-bend", SynclavierKBI1ControlRowRibbonBend, 0},
+            {"wheel",       SynclavierKBI1ControlRowController, 0x01},
+            {"breath",      SynclavierKBI1ControlRowController, 0x02},
+            {"pedal1",      SynclavierKBI1ControlRowController, 0x07},
+            {"pedal2",      SynclavierKBI1ControlRowController, 0x0B},
+            {"ribbon",      SynclavierKBI1ControlRowController, 0x10},
+            {"sustain",     SynclavierKBI1ControlRowController, 0x40},
+            {"portamento",  SynclavierKBI1ControlRowController, 0x41},
+            {"hold",        SynclavierKBI1ControlRowController, 0x42},
+            {"repeat",      SynclavierKBI1ControlRowController, 0x43},
+            {"arpeggiate",  SynclavierKBI1ControlRowController, 0x44},
+            {"punch-in",    SynclavierKBI1ControlRowController, 0x45},
+        };
+
+        static const int buttonLimit[] = {0, SynclavierKBI1LEDState::kORKButtons, SynclavierKBI1LEDState::kVKButtons, SynclavierKBI1LEDState::kVKAltButtons};
+        static const int buttonChannel[] = {0, SynclavierKBI1MIDIProtocolORKChannel, SynclavierKBI1MIDIProtocolVKChannel, SynclavierKBI1MIDIProtocolVKAltChannel};
+
+        LEDBinding* leds     = table.leds;
+        int         ledCount = 0;
+        int         line     = 0;
+
+        while (text && *text) {
+            const char* end = strchr(text, '\n');
+
+            if (!end)
+                end = text + strlen(text);
+
+            Token tokens[8];
+            int   count = tokenize(text, end, tokens, 8);
+            int   next  = 0;
+
+            line++;
+            text = *end ? end + 1 : end;
+
+            if (count == 0)
+                continue;
+
+            int  row   = SynclavierKBI1ControlRowNone;
+            long first = 0, last = 0;
+
+            if (tokens[0].is("button")) {
+                if (count < 4)
+                    return fail(line, "button needs a panel, a number and an action");
+
+                row = tokens[1].is("ork") ? SynclavierKBI1ControlRowORK : tokens[1].is("vk") ? SynclavierKBI1ControlRowVK :
+                      tokens[1].is("vk-right") ? SynclavierKBI1ControlRowVKRight : SynclavierKBI1ControlRowNone;
+
+                if (row == SynclavierKBI1ControlRowNone)
+                    return fail(line, "no panel", &tokens[1]);
+
+                // n or n-m
+                Token from = tokens[2], to = tokens[2];
+                auto  dash = (const char*) memchr(from.start, '-', from.length);
+
+                if (dash) {
+                    from.length = (int) (dash - from.start);
+                    to.start    = dash + 1;
+                    to.length   = tokens[2].length - from.length - 1;
+                }
+
+                if (!number(from, first) || !number(to, last) || first < 0 || last < first || last >= buttonLimit[row])
+                    return fail(line, "no such button", &tokens[2]);
+
+                next = 3;
+            }
+
+            else if (tokens[0].is("control")) {
+                if (count < 3)
+                    return fail(line, "control needs a control and an action");
+
+                next = 2;
+
+                if (tokens[1].is("cc") || tokens[1].is("pedal")) {
+                    if (count < 4 || !number(tokens[2], first) || first < 0 || first > 127 ||
+                        SynclavierKBI1InputRoutes.controller[first] == SynclavierKBI1InputNone)
+                        return fail(line, "no such controller", &tokens[2]);
+
+                    row  = SynclavierKBI1ControlRowController;
+                    next = 3;
+                }
+
+                else {
+                    for (auto& control : controls) {
+                        if (tokens[1].is(control.name)) {
+                            row   = control.row;
+                            first = control.number;
+                        }
+                    }
+
+                    if (row == SynclavierKBI1ControlRowNone)
+                        return fail(line, "no such control", &tokens[1]);
+                }
+
+                last = first;
+            }
+
+            else
+                return fail(line, "expected button or control, not", &tokens[0]);
+
+            // Action, by number or name
+            long action = 0;
+
+            if (!number(tokens[next], action)) {
+                for (int name = 1; name < nameCount && name < kMaxActions; name++) {
+                    if (names[name] && tokens[next].is(names[name]))
+                        action = name;
+                }
+            }
+
+            if (action <= 0 || action >= kMaxActions)
+                return fail(line, "no such action", &tokens[next]);
+
+            next++;
+
+            long param = 0;
+            bool led   = false;
+
+            if (next < count && number(tokens[next], param))
+                next++;
+
+            if (next < count && tokens[next].is("led")) {
+                if (row > SynclavierKBI1ControlRowVKRight)
+                    return fail(line, "only buttons have lights");
+
+                led = true;
+                next++;
+            }
+
+            if (next < count)
+                return fail(line, "did not expect", &tokens[next]);
+
+            for (long which = first; which <= last; which++) {
+                Binding& binding = table.bindings[row][which];
+
+                if (binding.action)
+                    return fail(line, "already mapped", &tokens[row <= SynclavierKBI1ControlRowVKRight ? 2 : 1]);
+
+                binding.action = (uint16_t) action;
+                binding.param  = (int32_t) (param + which - first);
+
+                table.mappingCount++;
+
+                if (!led)
+                    continue;
+
+                if (ledCount == kMaxLEDs)
+                    return fail(line, "too many lights");
+
+                leds[ledCount++] = {binding.param, (uint8_t) buttonChannel[row], (uint8_t) which, (uint16_t) action};
+            }
+        }
+
+        // LED bindings sorted by action, with where each action's start
+        int counts[kMaxActions] = {};
+
+        for (int led = 0; led < ledCount; led++)
+            counts[leds[led].action]++;
+
+        for (int action = 0; action < kMaxActions; action++)
+            table.ledFirst[action + 1] = (uint16_t) (table.ledFirst[action] + counts[action]);
+
+        LEDBinding sorted[kMaxLEDs];
+        uint16_t   place[kMaxActions];
+
+        memcpy(place, table.ledFirst, sizeof(place));
+
+        for (int led = 0; led < ledCount; led++)
+            sorted[place[leds[led].action]++] = leds[led];
+
+        memcpy(table.leds, sorted, sizeof(LEDBinding) * ledCount);
+        table.ledCount = ledCount;
+
+        errorText[0] = 0;
+
+        return true;
+    }
+
+    Table                       tables[2];
+    std::atomic<const Table*>   current;
+    alignas(64) std::atomic<const Table*> reading;              // Written by dispatch()
+
+    ActionEntry                 actions[kMaxActions];
+
+    long long                   loadCount;
+    char                        errorText[128];
+    char                        fileText[kMaxText];
+
+    long long                   dispatchCount;
+};
+
+#endif
@@ -0,0 +1,419 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1Device.h
+//
+
+#ifndef SynclavierKBI1Device_h
+#define SynclavierKBI1Device_h
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1PanelState.h"
+#include "SynclavierKBI1EventRing.h"
+#include "SynclavierKBI1HostTime.h"
+#include "SynclavierKBI1InputDecoder.h"
+#include "SynclavierKBI1OutputScheduler.h"
+#include "SynclavierKBI1NRPNRequests.h"
+#include "SynclavierKBI1ControlCoalescer.h"
+#include "SynclavierKBI1OutputQueues.h"
+#include "SynclavierKBI1NoteState.h"
+#include "SynclavierKBI1Metrics.h"
+#include "SynclavierKBI1Log.h"
+
+// Everything belonging to one KBI-1, so one process can run any number of them.
+//
+// Each device has its own transport, input decoder (parser and NRPN assembler), input ring,
+// controller coalescer, held note and pedal state, output batch, priority output queues, output scheduler, panel shadow state,
+// status machine and table of queries waiting for replies (SynclavierKBI1NRPNRequests). Nothing is shared
+// between devices so they never contend with one another: each device's MIDI thread input
+// goes into its own ring and each device's output goes out in its own batches.
+//
+// Input side (MIDI thread):   transport -> decoder -> input ring, controller slots, note state
+// Application thread:         drainInput() -> status machine -> output batch / panel -> output queues -> transport
+//                             tickControls() -> latest controller values -> controls proc
+//
+// Each device keeps metrics on its link (see SynclavierKBI1Metrics.h): NRPN frames the decoder threw
+// away, how long input waited in the ring before it was handled and how much output is waiting.
+// Wrap the transport in a SynclavierKBI1MIDITransportMetrics for traffic per channel and send times.
+//
+// The ring is cache-line aligned and held inline, so devices should be static (or members of
+// something static) rather than allocated with new. Mac OS 10.13 does not have aligned new.
+
+class SynclavierKBI1Device {
+public:
+    typedef SynclavierKBI1EventRing<>       InputRing;
+    typedef SynclavierKBI1OutputQueues<>    OutputQueues;
+
+    inline SynclavierKBI1Device()
+    :   batch(nullptr, nullptr, false),
+        requests(&batch) {
+        transport       = nullptr;
+        unit            = 0;
+        timeout         = 200;
+        verbose         = true;
+
+        kbi1Connected   = false;
+        kbi1Status      = 0;
+        testButton      = -1;
+
+        eventCount      = 0;
+
+        decoder.setProc(SynclavierKBI1InputNRPN, NRPNProc, this);
+        controls.attach(decoder);
+        notes.attach(decoder);
+    }
+
+    // Connect to a transport. unit numbers the device in messages.
+    inline void attach(SynclavierKBI1MIDITransport* deviceTransport, int deviceUnit) {
+        transport   = deviceTransport;
+        unit        = deviceUnit;
+
+        // The queues parse what the batch hands them, and apply running status themselves
+        batch.setFlushProc(OutputQueues::BatchFlushProc, &output);
+        batch.setRunningStatus(false);
+        output.setTransport(transport);
+        output.setRunningStatus(transport->allowsRunningStatus());
+        scheduler.setTransport(transport);
+
+        transport->setReceiveProc(ReceiveProc, this);
+    }
+
+    // Wake the application thread when input arrives. Called on the MIDI thread.
+    inline void setWakeProc(InputRing::WakeProc proc, void* refCon) {
+        input.setWakeProc(proc, refCon, InputRing::WakeWhenEmpty);
+    }
+
+    // ms without a status reply before the KBI-1 is taken to be gone
+    inline void setTimeout(int ms) {timeout = ms;}
+
+    // Bytes per ms the KBI-1 is sent, beyond control messages, and the most that builds up while idle. 0 for no limit.
+    inline void setOutputBudget(int bytesPerMs, int burst) {output.setBudget(bytesPerMs, burst);}
+
+    // Whether connection and status changes are logged
+    inline void setVerbose(bool on) {verbose = on;}
+
+    // List the device's metrics. labels go on all of them, e.g. unit="1".
+    template <int kCapacity>
+    inline void addMetrics(SynclavierKBI1MetricsRegistry<kCapacity>& registry, const char* labels) {
+        registry.add(&metrics.nrpnsRejected,    "kbi1_nrpn_rejected_total",     "NRPN frames thrown away for parts missing or out of order", labels);
+        registry.add(&metrics.discarded,        "kbi1_midi_discarded_total",    "Data bytes with no status, or incomplete messages",        labels);
+        registry.add(&metrics.inputOverflows,   "kbi1_input_overflows_total",   "Events dropped because the input ring was full",           labels);
+        registry.add(&metrics.inputLatency,     "kbi1_input_latency_seconds",   "From the MIDI callback to the event being handled",        labels);
+        registry.add(&metrics.inputDepth,       "kbi1_input_ring_depth",        "Events waiting in the input ring when it was drained",     labels);
+        registry.add(metrics.outputDepth,       "kbi1_output_queue_depth",      "Messages waiting in each output queue: 0 control, 1 performance, 2 LEDs, 3 display",       labels, OutputQueues::kPriorities, "priority");
+        registry.add(&metrics.scheduled,        "kbi1_output_scheduled",        "Messages waiting in the output scheduler",                 labels);
+        registry.add(&metrics.requests,         "kbi1_requests_in_flight",      "Queries waiting for a reply",                              labels);
+    }
+
+    // ---- Application thread ----
+
+    // Handle everything waiting in the input ring. Replies are sent right away.
+    inline int drainInput() {
+        uint64_t now = SynclavierKBI1HostTimeNow();
+
+        metrics.inputDepth.set(input.size());
+
+        int count = input.drain([this, now](const SynclavierKBI1Event& event) {
+            metrics.inputLatency.record(now > event.timeStamp ? SynclavierKBI1HostTimeToNanos(now - event.timeStamp) : 0);
+
+            if (event.type == SynclavierKBI1EventNRPN)
+                handleNRPN(event.param, event.value, event.timeStamp);
+        });
+
+        metrics.inputOverflows.set(input.overflows());
+
+        eventCount += count;
+
+        flush();
+
+        return count;
+    }
+
+    // Hand on what the ribbon, knob, wheel and pedals did since the last tick. Call once per control period.
+    inline int tickControls() {
+        return controls.tick(SynclavierKBI1HostTimeNow());
+    }
+
+    // Wait for device to show up and ask it who it is. Also detect it going away.
+    inline void probe() {
+        if (!transport->connected()) {
+            if (kbi1Connected) {
+                if (verbose)
+                    SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 %d unplugged.\n", unit);
+
+                kbi1Connected = false;
+                kbi1Status    = 0;
+            }
+
+            requests.cancelAll();
+
+            if (!transport->findDevice())
+                return;
+        }
+
+        // Poll for KBI1 if it is not connected. The reply is handled by handleNRPN().
+        if (!kbi1Connected && !requests.pending(SynclavierKBI1MIDIProtocolNRPNMessageWhoAreYou))
+            requests.send(SynclavierKBI1MIDIProtocolNRPNMessageWhoAreYou, SynclavierKBI1MIDIProtocolNRPNAskValue, (uint64_t) timeout * 1000000);
+    }
+
+    // If KBI1 connected, poll for ORK or VK being available. One status query is in flight at a time.
+    // Look for it going away (e.g. powered down, maybe stopped in debugger): the query is tried 3 times,
+    // each waiting twice as long as the last, all within timeout. Then StatusDone() gives up on it.
+    inline void poll() {
+        if (!kbi1Connected || !transport->connected())
+            return;
+
+        if (!requests.pending(SynclavierKBI1MIDIProtocolNRPNMessageStatus))
+            requests.send(SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNAskValue, (uint64_t) timeout * 1000000 / 7, 2, StatusDone, this);
+    }
+
+    // Retry or give up on queries that have not been answered in time. Call when nextDeadline() is due.
+    inline void expire(uint64_t now) {
+        requests.expire(now);
+    }
+
+    // Host time a query is next due to be retried or given up on. 0 if none are in flight.
+    inline uint64_t nextDeadline() const {
+        return requests.next();
+    }
+
+    // Send display and light changes
+    inline void render() {
+        if (kbi1Status != SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome)
+            panel.flush(batch);
+    }
+
+    // Hand collected output to the transport, control first, the rest as the output budget allows
+    inline void flush() {
+        batch.flush();
+        output.dispatch(SynclavierKBI1HostTimeNow());
+
+        for (int priority = 0; priority < OutputQueues::kPriorities; priority++)
+            metrics.outputDepth[priority].set(output.pending(priority));
+
+        metrics.requests.set(requests.inFlight());
+    }
+
+    // Host time more output can go within the budget. 0 if none is waiting.
+    inline uint64_t nextOutput() const {
+        return output.next();
+    }
+
+    // Hand scheduled output due before now + lookahead to the transport
+    inline void dispatch(uint64_t now, uint64_t lookahead) {
+        scheduler.dispatch(now, lookahead);
+
+        metrics.scheduled.set(scheduler.pending());
+    }
+
+    // MIDI setup changed. Anything collected for the old device is stale.
+    inline void forget() {
+        requests.cancelAll();
+        batch.discard();
+        output.discard();
+        scheduler.discard();
+        panel.invalidate();
+    }
+
+    // Handle a complete NRPN from the KBI-1. timeStamp is the host time it arrived.
+    inline void handleNRPN(int param, int data, uint64_t timeStamp) {
+        // KBI-1 could now be unplugged
+        if (!transport->connected())
+            return;
+
+        // Replies answer our queries. The KBI-1 asks us things with the ask value.
+        if (data != SynclavierKBI1MIDIProtocolNRPNAskValue)
+            requests.reply(param, data, timeStamp);
+
+        // Look for Identification as KBI-1
+        if (param == SynclavierKBI1MIDIProtocolNRPNMessageHereIAm && data == SynclavierKBI1MIDIProtocolNRPNMessageIAmKBI1) {
+            if (!kbi1Connected) {
+                kbi1Connected = true;
+
+                if (verbose)
+                    SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 %d connected.\n", unit);
+
+                // Ask KBI1 to report whether ORK or VK is connected
+                sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNAskValue);
+            }
+        }
+
+        // Look for ORK or VK connected. Software polls status
+        else if (param == SynclavierKBI1MIDIProtocolNRPNMessageStatus) {
+            int newStatus = data;
+
+            // Look for change in status
+            if (newStatus != kbi1Status) {
+
+                // Kbi1 asks who we are so it can handle velocity accordingly
+                if (newStatus == SynclavierKBI1MIDIProtocolNRPNAskValue)
+                    sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNMessageOtherHere);
+
+                else if (newStatus != SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome) {
+
+                    kbi1Status = newStatus;
+
+                    const char* keyboard = kbi1Status == SynclavierKBI1MIDIProtocolNRPNMessageORKHere ? "Ork"
+                                         : kbi1Status == SynclavierKBI1MIDIProtocolNRPNMessageVKHere  ? "VK" : "Unknown keyboard";
+
+                    if (verbose)
+                        SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 %d %s connected.\n", unit, keyboard);
+
+                    // Begin by clearing ORK/VK Display
+                    panel.clear(batch);
+                    forgetScheduledLights();
+
+                    // Start LED test
+                    panel.leds.clearAll();
+                    testButton = -1;
+                }
+
+                // Else ork disconnected or powered down. Remove the buttons from update list
+                else {
+
+                    kbi1Status = newStatus;
+
+                    if (verbose)
+                        SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 %d ORK/VK disconnected.\n", unit);
+                }
+            }
+        }
+
+        // Refresh. KBI-1 asks for refresh after we time out by breaking into debugger. That is the KBI-1 is reconnecting
+        // to us so it needs a refresh. We never noticed it going away.
+        else if (param == SynclavierKBI1MIDIProtocolNRPNMessageRefresh && data == SynclavierKBI1MIDIProtocolNRPNAskValue)  {
+
+            // Must respond with clear to start things going agin. Then put back what was on the panel.
+            if (kbi1Status != SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome)
+                restorePanel();
+        }
+    }
+
+    // Rebuild the whole panel from what we last put on it
+    inline void restorePanel() {
+        forgetScheduledLights();
+
+        auto stats = panel.restore(batch);
+
+        if (verbose)
+            SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 %d panel restored in %.0f usec: %d lights, %d display messages, %d bytes in %d packet list%s.\n",
+                              unit, stats.microseconds, stats.lights, stats.displayMessages, stats.bytes, stats.packetLists, stats.packetLists == 1 ? "" : "s");
+    }
+
+    // Lights still in the scheduler would go out after a Clear. What restore() puts back comes from the shadow state.
+    inline void forgetScheduledLights() {
+        for (int channel : {SynclavierKBI1MIDIProtocolORKChannel, SynclavierKBI1MIDIProtocolVKChannel, SynclavierKBI1MIDIProtocolVKAltChannel})
+            scheduler.discardNotes(channel);
+
+        metrics.scheduled.set(scheduler.pending());
+    }
+
+    inline void sendNRPN(int param, int value) {
+        SynclavierKBI1Log(SynclavierKBI1LogTrace, "KBI-1 %d NRPN out %d = %d\n", unit, param, value);
+
+        batch.sendNRPN(param, value, SynclavierKBI1MIDIProtocolNRPNChannel);
+    }
+
+    inline void sendDisplay(int whichChannel, int whichDisplay, const char* display) {
+        while (display && *display)
+            batch.send3(0x90 + whichChannel, whichDisplay, (*display++) & 0x7F);
+
+        batch.send3(0x80 + whichChannel, whichDisplay, 0);
+    }
+
+    inline void sendButton(int whichChannel, int whichButton, int velData) {
+        // Note on with velocity of 0 indicates note off
+        batch.send3(0x90 + whichChannel, whichButton, velData);
+    }
+
+    inline bool connected() const {return kbi1Connected;}
+    inline int  status()    const {return kbi1Status;}
+    inline int  number()    const {return unit;}
+
+    // Statistics
+    inline long long events()         const {return eventCount;}
+    inline uint64_t  inputOverflows() const {return input.overflows();}
+
+    // Shadow state of the panel and output for the application to use
+    SynclavierKBI1PanelState            panel;
+    SynclavierKBI1MIDIOutputBatch       batch;
+    OutputQueues                        output;                 // Where the batch goes
+    SynclavierKBI1NRPNRequests          requests;
+    SynclavierKBI1OutputScheduler<>     scheduler;
+    SynclavierKBI1InputDecoder          decoder;
+    SynclavierKBI1ControlCoalescer      controls;               // Set its proc to get controller values
+    SynclavierKBI1NoteState             notes;                  // Set its procs to get notes, pedals and releases
+    int                                 testButton;             // LED test
+
+private:
+    // The status query went unanswered
+    static void StatusDone(const SynclavierKBI1NRPNRequests::Result& result, void* refCon) {
+        auto& device = *(SynclavierKBI1Device*) refCon;
+
+        if (result.outcome != SynclavierKBI1NRPNRequests::TimedOut || !device.kbi1Connected)
+            return;
+
+        if (device.verbose)
+            SynclavierKBI1Log(SynclavierKBI1LogWarning, "KBI-1 %d timout after %d tries\n", device.unit, result.attempts);
+
+        device.kbi1Connected = false;
+        device.kbi1Status    = 0;
+    }
+
+    // ---- MIDI thread ----
+
+    // Called by the transport with each packet received from the KBI-1
+    static void ReceiveProc(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon) {
+        auto& device = *(SynclavierKBI1Device*) refCon;
+
+        device.decoder.receive(bytes, length, timeStamp);
+
+        device.metrics.nrpnsRejected.set(device.decoder.nrpnsRejected());
+        device.metrics.discarded.set(device.decoder.discarded());
+    }
+
+    // Called by the decoder with each complete NRPN message. Handled on the application thread.
+    static void NRPNProc(const SynclavierKBI1InputEvent& input, void* refCon) {
+        auto&               device = *(SynclavierKBI1Device*) refCon;
+        SynclavierKBI1Event event  = {};
+
+        event.timeStamp = input.timeStamp;
+        event.channel   = input.channel;
+        event.type      = SynclavierKBI1EventNRPN;
+        event.param     = input.number;
+        event.value     = input.value;
+
+        SynclavierKBI1Log(SynclavierKBI1LogTrace, "KBI-1 %d NRPN in  %d = %d\n", device.unit, input.number, input.value);
+
+        device.input.push(event);
+    }
+
+    SynclavierKBI1MIDITransport*        transport;
+    int                                 unit;
+    int                                 timeout;                // ms
+    bool                                verbose;
+
+    // Status machine
+    bool                                kbi1Connected;
+    int                                 kbi1Status;
+
+    long long                           eventCount;
+
+    InputRing                           input;
+
+    struct Metrics {
+        alignas(64) SynclavierKBI1Counter   nrpnsRejected;      // MIDI thread
+        SynclavierKBI1Counter               discarded;
+
+        alignas(64) SynclavierKBI1Counter   inputOverflows;     // Application thread
+        SynclavierKBI1Histogram             inputLatency;
+        SynclavierKBI1Gauge                 inputDepth;
+        SynclavierKBI1Gauge                 outputDepth[OutputQueues::kPriorities];
+        SynclavierKBI1Gauge                 scheduled;
+        SynclavierKBI1Gauge                 requests;
+    };
+
+    Metrics                             metrics;
+};
+
+#endif
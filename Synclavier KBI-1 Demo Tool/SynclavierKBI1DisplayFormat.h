@@ -0,0 +1,289 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1DisplayFormat.h
+//
+
+#ifndef SynclavierKBI1DisplayFormat_h
+#define SynclavierKBI1DisplayFormat_h
+
+#include <stdint.h>
+
+// Numbers and text straight into display positions, without printf, locale or heap.
+//
+// Each position of the ORK and VK displays is one character with a decimal point of its own.
+// Text for the KBI-1 puts a decimal point before the character it goes with, so "440.0h" is
+// four positions, 4 4 0 0, with the point lit on the last one, and the hertz unit LED.
+// SynclavierKBI1DisplayCells holds the positions themselves. That is what the display framebuffer
+// compares and sends, so a readout is never printed to text and parsed back.
+//
+// Readouts are written into a field, a run of positions in the cells:
+//
+//  - fixed()     value with places digits after the point, right or left aligned. If it does not fit,
+//                digits after the point are dropped (rounding) until it does. If it still does not
+//                fit the field is filled with the overflow marker.
+//  - integer()   fixed() with nothing after the point
+//  - text()      characters, a '.' lighting the point of the character after it (as ME_SendDisplay takes them)
+//  - marquee()   a window on text longer than the field, scrolled by offset, wrapping around
+//
+// The ORK has 4 positions and a unit LED. ork() makes a SynclavierKBI1ORKReadout of both.
+//
+// Everything is constexpr, so readouts fixed at compile time cost nothing at run time.
+
+// ORK unit LEDs, sent as a letter after the digits
+const char SynclavierKBI1ORKUnitNone            = 0;
+const char SynclavierKBI1ORKUnitMilliseconds    = 'm';
+const char SynclavierKBI1ORKUnitHertz           = 'h';
+const char SynclavierKBI1ORKUnitArbitrary       = 'a';
+const char SynclavierKBI1ORKUnitVolume          = 'v';
+
+template <int kPositions>
+struct SynclavierKBI1DisplayCells {
+    static_assert(kPositions > 0 && kPositions <= 64, "Decimal points are kept in 64 bits");
+
+    static const int kCount = kPositions;
+
+    char        chars[kPositions];
+    uint64_t    decimals;                                       // Bit n is the decimal point before character n
+
+    constexpr SynclavierKBI1DisplayCells() : chars(), decimals(0) {
+        clear();
+    }
+
+    // All blank
+    constexpr void clear() {
+        for (auto& c : chars)
+            c = ' ';
+
+        decimals = 0;
+    }
+
+    constexpr bool operator==(const SynclavierKBI1DisplayCells& other) const {
+        for (int position = 0; position < kPositions; position++) {
+            if (chars[position] != other.chars[position])
+                return false;
+        }
+
+        return decimals == other.decimals;
+    }
+
+    constexpr bool operator!=(const SynclavierKBI1DisplayCells& other) const {
+        return !(*this == other);
+    }
+};
+
+struct SynclavierKBI1ORKReadout {
+    static const int kDigits = 4;
+
+    SynclavierKBI1DisplayCells<kDigits> digits;
+    char                                unit = SynclavierKBI1ORKUnitNone;
+};
+
+class SynclavierKBI1DisplayFormat {
+public:
+    enum Align {
+        AlignRight,
+        AlignLeft,
+    };
+
+    static const char kOverflow = '-';                          // Fills a field a value does not fit in
+    static const int  kMarqueeGap = 4;                          // Blanks between the end of scrolling text and its start
+
+    // value / 10^places in the field. Returns false if it overflowed.
+    template <int N>
+    static constexpr bool fixed(SynclavierKBI1DisplayCells<N>& cells, int first, int width, int64_t value, int places,
+                                Align align = AlignRight, char overflow = kOverflow) {
+        if (!clip<N>(first, width))
+            return false;
+
+        places = places < 0 ? 0 : places > 18 ? 18 : places;
+
+        bool     negative  = value < 0;
+        uint64_t magnitude = negative ? 0 - (uint64_t) value : (uint64_t) value;
+
+        blank(cells, first, width);
+
+        for (int shown = places; shown >= 0; shown--) {
+            uint64_t digits  = magnitude;
+            int      dropped = places - shown;
+
+            // Round half away from zero
+            if (dropped > 0)
+                digits = (magnitude / power10(dropped - 1) + 5) / 10;
+
+            int  length = digitCount(digits);
+            bool sign   = negative && digits != 0;
+
+            // At least one digit before the point
+            if (length < shown + 1)
+                length = shown + 1;
+
+            if (length + sign > width)
+                continue;
+
+            int start = align == AlignRight ? first + width - length - sign : first;
+            int last  = start + sign + length - 1;
+
+            if (sign)
+                cells.chars[start] = '-';
+
+            for (int position = last; position > last - length; position--) {
+                cells.chars[position] = (char) ('0' + digits % 10);
+                digits /= 10;
+            }
+
+            if (shown > 0)
+                cells.decimals |= 1ULL << (last - shown + 1);
+
+            return true;
+        }
+
+        for (int position = first; position < first + width; position++)
+            cells.chars[position] = overflow;
+
+        return false;
+    }
+
+    template <int N>
+    static constexpr bool integer(SynclavierKBI1DisplayCells<N>& cells, int first, int width, int64_t value,
+                                  Align align = AlignRight, char overflow = kOverflow) {
+        return fixed(cells, first, width, value, 0, align, overflow);
+    }
+
+    // Text in the field, cut off at its end. Returns the number of positions the text takes.
+    template <int N>
+    static constexpr int text(SynclavierKBI1DisplayCells<N>& cells, int first, int width, const char* string,
+                              Align align = AlignLeft) {
+        if (!clip<N>(first, width))
+            return 0;
+
+        blank(cells, first, width);
+
+        int length   = positions(string);
+        int position = align == AlignRight && length < width ? first + width - length : first;
+        int end      = first + width;
+        bool decimal = false;
+
+        while (string && *string && position < end) {
+            char c = (*string++) & 0x7F;
+
+            if (c == '.' && !decimal) {
+                decimal = true;
+                continue;
+            }
+
+            if (decimal)
+                cells.decimals |= 1ULL << position;
+
+            cells.chars[position++] = c;
+            decimal = false;
+        }
+
+        // Trailing decimal point goes with a blank
+        if (decimal && position < end)
+            cells.decimals |= 1ULL << position;
+
+        return length;
+    }
+
+    // width characters of string starting offset characters in, wrapping around after kMarqueeGap blanks.
+    // Step offset once per frame to scroll. Text that fits is not scrolled. Decimal points are not parsed.
+    template <int N>
+    static constexpr void marquee(SynclavierKBI1DisplayCells<N>& cells, int first, int width, const char* string, long long offset) {
+        if (!clip<N>(first, width))
+            return;
+
+        int length = 0;
+
+        while (string && string[length])
+            length++;
+
+        if (length <= width) {
+            text(cells, first, width, string);
+            return;
+        }
+
+        blank(cells, first, width);
+
+        long long period = length + kMarqueeGap;
+        int       index  = (int) (((offset % period) + period) % period);
+
+        for (int position = first; position < first + width; position++) {
+            cells.chars[position] = index < length ? string[index] & 0x7F : ' ';
+
+            if (++index == period)
+                index = 0;
+        }
+    }
+
+    // ORK readout of value / 10^places with a unit LED
+    static constexpr SynclavierKBI1ORKReadout ork(int64_t value, int places, char unit = SynclavierKBI1ORKUnitNone) {
+        SynclavierKBI1ORKReadout readout;
+
+        fixed(readout.digits, 0, SynclavierKBI1ORKReadout::kDigits, value, places);
+        readout.unit = unit;
+
+        return readout;
+    }
+
+    // Positions text takes, each decimal point going with the character after it
+    static constexpr int positions(const char* string) {
+        int  length  = 0;
+        bool decimal = false;
+
+        while (string && *string) {
+            if ((*string++ & 0x7F) == '.' && !decimal) {
+                decimal = true;
+                continue;
+            }
+
+            length++;
+            decimal = false;
+        }
+
+        return length;
+    }
+
+private:
+    // Field inside the cells. false if nothing is left of it.
+    template <int N>
+    static constexpr bool clip(int& first, int& width) {
+        if (first < 0) {
+            width += first;
+            first  = 0;
+        }
+
+        if (width > N - first)
+            width = N - first;
+
+        return width > 0;
+    }
+
+    template <int N>
+    static constexpr void blank(SynclavierKBI1DisplayCells<N>& cells, int first, int width) {
+        for (int position = first; position < first + width; position++)
+            cells.chars[position] = ' ';
+
+        cells.decimals &= ~(((width >= 64) ? ~0ULL : (1ULL << width) - 1) << first);
+    }
+
+    static constexpr uint64_t power10(int exponent) {
+        uint64_t power = 1;
+
+        while (exponent-- > 0)
+            power *= 10;
+
+        return power;
+    }
+
+    static constexpr int digitCount(uint64_t value) {
+        int count = 1;
+
+        while (value >= 10) {
+            value /= 10;
+            count++;
+        }
+
+        return count;
+    }
+};
+
+#endif
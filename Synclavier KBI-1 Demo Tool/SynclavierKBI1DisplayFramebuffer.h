@@ -0,0 +1,288 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1DisplayFramebuffer.h
+//
+
+#ifndef SynclavierKBI1DisplayFramebuffer_h
+#define SynclavierKBI1DisplayFramebuffer_h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1DisplayFormat.h"
+
+// Shadow framebuffer for the ORK 4-digit display and the two lines of the VK display.
+//
+// Callers write text whenever they like, in the same format ME_SendDisplay takes (a decimal
+// point precedes the character it goes with), or cells made by SynclavierKBI1DisplayFormat,
+// which skips the text altogether. Nothing is sent until flush(). flush() compares
+// the text with what was last sent and only sends what changed:
+//
+//  - ORK: the whole display is rewritten if any character changed. There are no section messages for the ORK.
+//  - VK:  each line is split in two sections. Characters and decimal points of each section are sent with their
+//         own note numbers (SynclavierKBI1MIDIProtocolVKMIDINoteForCharSection and ...ForDecimalSection).
+//         If sending the changed sections would cost more than rewriting the line, the line is rewritten.
+//
+// Decimal point sections are sent as one character per position, '.' for lit and ' ' for dark.
+//
+// After the KBI-1 is sent SynclavierKBI1MIDIProtocolNRPNMessageClear call markCleared() so the
+// framebuffer knows the display is blank. After a reconnect call invalidate() to resend everything.
+
+class SynclavierKBI1DisplayFramebuffer {
+public:
+    static const int kORKMaxChars       = 16;                   // ORK text including decimal points and units suffix
+    static const int kVKLines           = 2;
+    static const int kVKSections        = 2;                    // Sections per line
+    static const int kVKCharsPerLine    = 40;
+    static const int kVKCharsPerSection = kVKCharsPerLine / kVKSections;
+
+    typedef SynclavierKBI1DisplayCells<kVKCharsPerLine> Line;
+
+    inline SynclavierKBI1DisplayFramebuffer() {
+        setORK(nullptr);
+
+        for (int line = 0; line < kVKLines; line++)
+            setVKLine(line, nullptr);
+
+        markCleared();
+        invalidate();
+
+        messagesSent    = 0;
+        messagesFull    = 0;
+        sectionsSent    = 0;
+        linesSent       = 0;
+    }
+
+    // Display text for the ORK. e.g. "440.0h"
+    inline void setORK(const char* text) {
+        int length = 0;
+
+        while (text && length < kORKMaxChars && text[length]) {
+            orkWant[length] = text[length] & 0x7F;
+            length++;
+        }
+
+        orkWant[length] = 0;
+
+        messagesFull += textFullCost(orkWant);
+    }
+
+    // ORK digits and unit LED, e.g. SynclavierKBI1DisplayFormat::ork(4400, 1, SynclavierKBI1ORKUnitHertz)
+    inline void setORK(const SynclavierKBI1ORKReadout& readout) {
+        int length = 0;
+
+        for (int position = 0; position < SynclavierKBI1ORKReadout::kDigits; position++) {
+            if (readout.digits.decimals & (1ULL << position))
+                orkWant[length++] = '.';
+
+            orkWant[length++] = readout.digits.chars[position] & 0x7F;
+        }
+
+        if (readout.unit)
+            orkWant[length++] = readout.unit & 0x7F;
+
+        orkWant[length] = 0;
+
+        messagesFull += length + 1;
+    }
+
+    // Display text for VK line 0 or 1. Short lines are padded with spaces.
+    inline void setVKLine(int line, const char* text) {
+        if (line < 0 || line >= kVKLines)
+            return;
+
+        vkWant[line].clear();
+        SynclavierKBI1DisplayFormat::text(vkWant[line], 0, kVKCharsPerLine, text);
+
+        messagesFull += textFullCost(text);
+    }
+
+    // VK line 0 or 1 as cells
+    inline void setVKLine(int line, const Line& cells) {
+        if (line < 0 || line >= kVKLines)
+            return;
+
+        vkWant[line] = cells;
+
+        messagesFull += cellsFullCost(cells);
+    }
+
+    // Display is blank. Typically after sending SynclavierKBI1MIDIProtocolNRPNMessageClear
+    inline void markCleared() {
+        orkSent[0] = 0;
+
+        for (int line = 0; line < kVKLines; line++)
+            vkSent[line].clear();
+
+        sentValid = true;
+    }
+
+    // What is on the display is unknown. Next flush rewrites everything.
+    inline void invalidate() {
+        sentValid = false;
+    }
+
+    // Send what changed since the last flush
+    inline void flush(SynclavierKBI1MIDIOutputBatch& batch) {
+        if (!sentValid || strcmp(orkWant, orkSent) != 0) {
+            sendORK(batch);
+            strcpy(orkSent, orkWant);
+        }
+
+        for (int line = 0; line < kVKLines; line++) {
+            auto& want = vkWant[line];
+            auto& sent = vkSent[line];
+
+            if (!sentValid) {
+                sendLine(batch, line);
+                sent = want;
+                continue;
+            }
+
+            int changedChars = 0;
+            int changedDecs  = 0;
+
+            for (int section = 0; section < kVKSections; section++) {
+                int first = section * kVKCharsPerSection;
+
+                if (memcmp(&want.chars[first], &sent.chars[first], kVKCharsPerSection) != 0)
+                    changedChars |= 1 << section;
+
+                if ((want.decimals ^ sent.decimals) & sectionMask(section))
+                    changedDecs |= 1 << section;
+            }
+
+            if ((changedChars | changedDecs) == 0)
+                continue;
+
+            // Each section costs one message per character plus the end of line
+            int sectionCost = (popCount(changedChars) + popCount(changedDecs)) * (kVKCharsPerSection + 1);
+
+            if (sectionCost >= lineFullCost(want))
+                sendLine(batch, line);
+
+            else {
+                for (int section = 0; section < kVKSections; section++) {
+                    if (changedChars & (1 << section))
+                        sendCharSection(batch, line, section);
+
+                    if (changedDecs & (1 << section))
+                        sendDecimalSection(batch, line, section);
+                }
+            }
+
+            sent = want;
+        }
+
+        sentValid = true;
+    }
+
+    // Statistics. messagesFullLines() is what sending the text on every set would have cost.
+    inline long long messages()          const {return messagesSent;}
+    inline long long messagesFullLines() const {return messagesFull;}
+    inline long long sections()          const {return sectionsSent;}
+    inline long long lines()             const {return linesSent;}
+
+private:
+    static inline int popCount(uint64_t bits) {
+        int count = 0;
+
+        for (; bits; bits &= bits - 1)
+            count++;
+
+        return count;
+    }
+
+    static inline uint64_t sectionMask(int section) {
+        return ((1ULL << kVKCharsPerSection) - 1) << (section * kVKCharsPerSection);
+    }
+
+    // Cost of sending the text as is, one message per character plus the end of line
+    static inline int textFullCost(const char* text) {
+        return text ? (int) strlen(text) + 1 : 1;
+    }
+
+    // As the same line sent as text, trailing blanks left off
+    static inline int cellsFullCost(const Line& line) {
+        int length = kVKCharsPerLine;
+
+        while (length > 0 && line.chars[length - 1] == ' ' && !(line.decimals >> (length - 1)))
+            length--;
+
+        return length + popCount(line.decimals) + 1;
+    }
+
+    static inline int lineFullCost(const Line& line) {
+        return kVKCharsPerLine + popCount(line.decimals) + 1;
+    }
+
+    inline void putChar(SynclavierKBI1MIDIOutputBatch& batch, int note, char c) {
+        batch.send3(0x90 + SynclavierKBI1MIDIProtocolDisplayChannel, note, c & 0x7F);
+        messagesSent++;
+    }
+
+    inline void endLine(SynclavierKBI1MIDIOutputBatch& batch, int note) {
+        batch.send3(0x80 + SynclavierKBI1MIDIProtocolDisplayChannel, note, 0);
+        messagesSent++;
+    }
+
+    inline void sendORK(SynclavierKBI1MIDIOutputBatch& batch) {
+        for (const char* text = orkWant; *text; text++)
+            putChar(batch, SynclavierKBI1MIDIProtocolORKDisplay, *text);
+
+        endLine(batch, SynclavierKBI1MIDIProtocolORKDisplay);
+    }
+
+    inline void sendLine(SynclavierKBI1MIDIOutputBatch& batch, int line) {
+        auto& want = vkWant[line];
+        int   note = line == 0 ? SynclavierKBI1MIDIProtocolVKDisplayLine0 : SynclavierKBI1MIDIProtocolVKDisplayLine1;
+
+        for (int position = 0; position < kVKCharsPerLine; position++) {
+            if (want.decimals & (1ULL << position))
+                putChar(batch, note, '.');
+
+            putChar(batch, note, want.chars[position]);
+        }
+
+        endLine(batch, note);
+        linesSent++;
+    }
+
+    inline void sendCharSection(SynclavierKBI1MIDIOutputBatch& batch, int line, int section) {
+        int note  = SynclavierKBI1MIDIProtocolVKMIDINoteForCharSection[line][section];
+        int first = section * kVKCharsPerSection;
+
+        for (int position = first; position < first + kVKCharsPerSection; position++)
+            putChar(batch, note, vkWant[line].chars[position]);
+
+        endLine(batch, note);
+        sectionsSent++;
+    }
+
+    inline void sendDecimalSection(SynclavierKBI1MIDIOutputBatch& batch, int line, int section) {
+        int note  = SynclavierKBI1MIDIProtocolVKMIDINoteForDecimalSection[line][section];
+        int first = section * kVKCharsPerSection;
+
+        for (int position = first; position < first + kVKCharsPerSection; position++)
+            putChar(batch, note, (vkWant[line].decimals & (1ULL << position)) ? '.' : ' ');
+
+        endLine(batch, note);
+        sectionsSent++;
+    }
+
+    char        orkWant[kORKMaxChars + 1];
+    char        orkSent[kORKMaxChars + 1];
+
+    Line        vkWant[kVKLines];
+    Line        vkSent[kVKLines];
+
+    bool        sentValid;
+
+    long long   messagesSent;
+    long long   messagesFull;
+    long long   sectionsSent;
+    long long   linesSent;
+};
+
+#endif
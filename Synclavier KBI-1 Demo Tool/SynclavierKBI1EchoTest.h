@@ -0,0 +1,255 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1EchoTest.h
+//
+
+#ifndef SynclavierKBI1EchoTest_h
+#define SynclavierKBI1EchoTest_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1HostTime.h"
+#include "SynclavierKBI1InputDecoder.h"
+
+// Round-trip latency and throughput of a link to a KBI-1, measured with Echo NRPNs.
+//
+// Each step sends count Echo NRPNs at a given rate, burst messages at a time. Every Echo carries
+// a sequence number in its value; the KBI-1 sends the value back. Replies are time stamped by the
+// transport as they arrive, so the round trip does not include any wait on the application
+// thread. A step reports round-trip percentiles, replies lost, replies out of order and
+// duplicated, and the rate actually achieved.
+//
+// ramp() looks for the highest rate the link sustains: the rate doubles until a step loses,
+// reorders or can not keep up, then the last good and first bad rates are bisected.
+//
+// Works over any transport: Core MIDI or ALSA with a real KBI-1, or the loopback transport with
+// a simulated one. Results are printed as JSON so runs can be compared by a script.
+//
+// Sequence numbers are 13 bits. The top bit of the 14-bit value alternates from step to step so
+// late replies to the last step are not taken for this one's.
+
+class SynclavierKBI1EchoTest {
+public:
+    static const int kMaxCount  = 1 << 13;                      // Echoes per step
+
+    struct Step {
+        int         rate;                                       // Echoes/sec asked for
+        int         burst;                                      // Echoes sent together
+        int         sent;
+        int         received;
+        int         lost;
+        int         reordered;                                  // Arrived after a later one
+        int         duplicates;
+        double      achievedRate;                               // Echoes/sec actually sent
+        uint64_t    rttMin, rttP50, rttP99, rttP999, rttMax;    // ns
+    };
+
+    inline SynclavierKBI1EchoTest(SynclavierKBI1MIDITransport& echoTransport)
+    :   transport(echoTransport),
+        batch(SynclavierKBI1MIDITransport::BatchFlushProc, &echoTransport, echoTransport.allowsRunningStatus()),
+        sendTimes(kMaxCount),
+        arrivals(kMaxCount) {
+        generation = 0;
+        highest.store(-1);
+        reordered.store(0);
+        duplicates.store(0);
+        received.store(0);
+
+        decoder.setProc(SynclavierKBI1InputNRPN, EchoProc, this);
+        transport.setReceiveProc(ReceiveProc, this);
+    }
+
+    // Send count echoes at rate per second. Waits up to settle ms after the last for replies.
+    inline Step run(int rate, int burst, int count, int settle) {
+        Step step = {};
+
+        count = std::max(1, std::min(count, (int) kMaxCount));
+        burst = std::max(1, std::min(burst, count));
+        rate  = std::max(1, rate);
+
+        generation ^= kMaxCount;
+
+        for (int i = 0; i < count; i++)
+            arrivals[i].store(0, std::memory_order_relaxed);
+
+        highest.store(-1);
+        reordered.store(0);
+        duplicates.store(0);
+        received.store(0);
+
+        // Bursts go out every burst / rate seconds
+        uint64_t interval = SynclavierKBI1NanosToHostTime((uint64_t) (1e9 * burst / rate));
+        uint64_t start    = SynclavierKBI1HostTimeNow();
+
+        for (int i = 0; i < count; i += burst) {
+            waitUntil(start + interval * (i / burst));
+
+            for (int j = i; j < i + burst && j < count; j++) {
+                sendTimes[j] = SynclavierKBI1HostTimeNow();
+                batch.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageEcho, generation | j, SynclavierKBI1MIDIProtocolNRPNChannel);
+            }
+
+            batch.flush();
+        }
+
+        uint64_t finished = SynclavierKBI1HostTimeNow();
+        uint64_t deadline = finished + SynclavierKBI1NanosToHostTime((uint64_t) settle * 1000000);
+
+        while (received.load(std::memory_order_acquire) < count && SynclavierKBI1HostTimeNow() < deadline)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+        std::vector<uint64_t> rtts;
+
+        rtts.reserve(count);
+
+        for (int i = 0; i < count; i++) {
+            uint64_t arrival = arrivals[i].load(std::memory_order_acquire);
+
+            if (arrival)
+                rtts.push_back(arrival > sendTimes[i] ? SynclavierKBI1HostTimeToNanos(arrival - sendTimes[i]) : 0);
+        }
+
+        std::sort(rtts.begin(), rtts.end());
+
+        auto at = [&](double fraction) {return rtts.empty() ? 0 : rtts[(size_t) (fraction * (rtts.size() - 1))];};
+
+        double seconds = SynclavierKBI1HostTimeToNanos(finished - start) / 1e9;
+
+        step.rate           = rate;
+        step.burst          = burst;
+        step.sent           = count;
+        step.received       = (int) rtts.size();
+        step.lost           = count - step.received;
+        step.reordered      = reordered.load();
+        step.duplicates     = duplicates.load();
+        step.achievedRate   = seconds > 0 ? (count - 1) / seconds : 0;
+        step.rttMin         = at(0);
+        step.rttP50         = at(0.5);
+        step.rttP99         = at(0.99);
+        step.rttP999        = at(0.999);
+        step.rttMax         = at(1);
+
+        return step;
+    }
+
+    // Nothing lost, reordered or duplicated, and the rate was kept up
+    static inline bool sustained(const Step& step) {
+        return step.lost == 0 && step.reordered == 0 && step.duplicates == 0 && (step.sent < 2 || step.achievedRate >= 0.95 * step.rate);
+    }
+
+    // Highest sustained rate between startRate and maxRate. Every step run is added to steps.
+    inline int ramp(int burst, int count, int settle, int startRate, int maxRate, std::vector<Step>& steps, int bisections = 4) {
+        int good = 0;
+        int bad  = 0;
+
+        for (int rate = std::max(1, startRate); rate <= maxRate; rate *= 2) {
+            steps.push_back(run(rate, burst, count, settle));
+
+            if (!sustained(steps.back())) {
+                bad = rate;
+                break;
+            }
+
+            good = rate;
+        }
+
+        for (int i = 0; i < bisections && bad && bad - good > 1; i++) {
+            int rate = good + (bad - good) / 2;
+
+            steps.push_back(run(rate, burst, count, settle));
+
+            if (sustained(steps.back()))
+                good = rate;
+            else
+                bad  = rate;
+        }
+
+        return good;
+    }
+
+    // {"transport": ..., "device": ..., "steps": [...], "max_sustained_rate": ...}
+    static inline void printJSON(FILE* file, const char* transportName, const char* device, const std::vector<Step>& steps, int maxSustained) {
+        fprintf(file, "{\n  \"transport\": \"%s\",\n  \"device\": \"%s\",\n  \"steps\": [", transportName, device);
+
+        for (size_t i = 0; i < steps.size(); i++) {
+            auto& step = steps[i];
+
+            fprintf(file, "%s\n    {\"rate\": %d, \"burst\": %d, \"sent\": %d, \"received\": %d, \"lost\": %d, \"reordered\": %d, \"duplicates\": %d, "
+                          "\"achieved_rate\": %.1f, \"sustained\": %s, "
+                          "\"rtt_us\": {\"min\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}}",
+                    i ? "," : "", step.rate, step.burst, step.sent, step.received, step.lost, step.reordered, step.duplicates,
+                    step.achievedRate, sustained(step) ? "true" : "false",
+                    step.rttMin / 1e3, step.rttP50 / 1e3, step.rttP99 / 1e3, step.rttP999 / 1e3, step.rttMax / 1e3);
+        }
+
+        fprintf(file, "\n  ],\n  \"max_sustained_rate\": %d\n}\n", maxSustained);
+    }
+
+private:
+    // Sleep until host time, then spin for the last bit so bursts go out on time
+    static inline void waitUntil(uint64_t time) {
+        uint64_t now  = SynclavierKBI1HostTimeNow();
+        uint64_t spin = SynclavierKBI1NanosToHostTime(200000);
+
+        if (time > now + spin)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(SynclavierKBI1HostTimeToNanos(time - now - spin)));
+
+        while (SynclavierKBI1HostTimeNow() < time)
+            ;
+    }
+
+    // ---- MIDI thread ----
+
+    static void ReceiveProc(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon) {
+        ((SynclavierKBI1EchoTest*) refCon)->decoder.receive(bytes, length, timeStamp);
+    }
+
+    static void EchoProc(const SynclavierKBI1InputEvent& event, void* refCon) {
+        auto& test = *(SynclavierKBI1EchoTest*) refCon;
+
+        if (event.number != SynclavierKBI1MIDIProtocolNRPNMessageEcho)
+            return;
+
+        // Late reply to the last step
+        if ((event.value & kMaxCount) != test.generation)
+            return;
+
+        int sequence = event.value & (kMaxCount - 1);
+
+        if (test.arrivals[sequence].load(std::memory_order_relaxed) != 0) {
+            test.duplicates.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        if (sequence < test.highest.load(std::memory_order_relaxed))
+            test.reordered.fetch_add(1, std::memory_order_relaxed);
+        else
+            test.highest.store(sequence, std::memory_order_relaxed);
+
+        test.arrivals[sequence].store(event.timeStamp ? event.timeStamp : 1, std::memory_order_release);
+        test.received.fetch_add(1, std::memory_order_release);
+    }
+
+    SynclavierKBI1MIDITransport&        transport;
+    SynclavierKBI1MIDIOutputBatch       batch;
+    SynclavierKBI1InputDecoder          decoder;                // MIDI thread
+
+    std::vector<uint64_t>               sendTimes;              // Host time each echo of this step was sent
+    std::vector<std::atomic<uint64_t>>  arrivals;               // Host time each reply arrived. 0 if not yet.
+    std::atomic<int>                    generation;             // 0 or kMaxCount
+    std::atomic<int>                    highest;                // Highest sequence received
+    std::atomic<int>                    reordered;
+    std::atomic<int>                    duplicates;
+    std::atomic<int>                    received;
+};
+
+#endif
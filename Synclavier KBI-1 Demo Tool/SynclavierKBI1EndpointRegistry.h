@@ -0,0 +1,337 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1EndpointRegistry.h
+//
+
+#ifndef SynclavierKBI1EndpointRegistry_h
+#define SynclavierKBI1EndpointRegistry_h
+
+#include <stdint.h>
+#include <string.h>
+
+// The MIDI endpoints a backend knows of, kept up to date one change at a time.
+//
+// A MIDI service says when an endpoint is added, removed or changed. Rather than walk every
+// endpoint in the setup and fetch and compare each one's name on every change, a backend reads
+// what it is told about into the registry:
+//
+//  - add()         an endpoint appeared, or its name or online state changed
+//  - remove()      an endpoint went away, or all of an entity's or device's endpoints did
+//
+// Endpoints are keyed by the backend's unique ID, which stays the same across unplugging and
+// plugging back in, in an open-addressed table. Names are hashed once, when an endpoint is added
+// or renamed, so finding a KBI-1 compares hashes and only compares names when they match.
+//
+// Transports claim() the endpoints they attach to. When a claimed endpoint is removed, goes
+// offline or is renamed, the registry calls the lost proc with its owner; endpoints nobody claimed
+// come and go without anyone being told. generation() changes whenever an endpoint becomes free
+// to claim, so a transport waiting for a KBI-1 only looks again when there is something new.
+//
+// Nothing is allocated. All calls are made on one thread, the one notifications arrive on.
+
+class SynclavierKBI1EndpointRegistry {
+public:
+    static const int kCapacity  = 512;                          // Slots. Keep well over the endpoints in a setup.
+    static const int kNameSize  = 64;
+
+    enum Kind : uint8_t {
+        KindSource,
+        KindDestination,
+    };
+
+    // A name to look for, hashed once
+    struct Name {
+        uint64_t    hash;
+        char        text[kNameSize];
+    };
+
+    struct Endpoint {
+        int32_t     uniqueID;
+        Kind        kind;
+        bool        online;
+        bool        used;
+        uint64_t    handle;                                     // Backend's reference, e.g. MIDIEndpointRef
+        uint64_t    entity;                                     // Endpoints of one entity (USB interface) are one unit. 0 if none.
+        uint64_t    device;
+        uint64_t    nameHash;
+        const void* owner;                                      // Who claimed it, nullptr if free
+        uint64_t    ownerHash;                                  // Name it was claimed under
+        char        name[kNameSize];
+    };
+
+    // owner lost endpoint. The endpoint is still in the registry during the call, and is free.
+    // Claim again after the add() or remove() that lost it returns, not from here.
+    typedef void (*LostProc)(const void* owner, const Endpoint& endpoint, void* refCon);
+
+    inline SynclavierKBI1EndpointRegistry() {
+        lostProc    = nullptr;
+        lostRefCon  = nullptr;
+
+        clear();
+    }
+
+    inline void setLostProc(LostProc proc, void* refCon) {
+        lostProc    = proc;
+        lostRefCon  = refCon;
+    }
+
+    inline void clear() {
+        for (auto& slot : slots)
+            slot.used = false;
+
+        endpointCount   = 0;
+        generationCount = 1;
+
+        addCount        = 0;
+        changeCount     = 0;
+        removeCount     = 0;
+        claimCount      = 0;
+        fullCount       = 0;
+    }
+
+    // FNV-1a. Names are short, and hashed only when an endpoint is added or renamed.
+    static inline uint64_t hash(const char* text) {
+        uint64_t value = 0xCBF29CE484222325ULL;
+
+        for (; *text; text++)
+            value = (value ^ (uint8_t) *text) * 0x100000001B3ULL;
+
+        return value;
+    }
+
+    static inline Name name(const char* text) {
+        Name key;
+
+        copyName(key.text, text);
+        key.hash = hash(key.text);
+
+        return key;
+    }
+
+    // An endpoint appeared or changed. Returns false if the registry is full.
+    inline bool add(int32_t uniqueID, Kind kind, uint64_t handle, uint64_t entity, uint64_t device, const char* endpointName, bool online) {
+        Endpoint* endpoint = slot(uniqueID);
+        char      text[kNameSize];
+
+        copyName(text, endpointName ? endpointName : "");
+
+        uint64_t nameHash = hash(text);
+
+        if (endpoint->used) {
+            bool renamed = endpoint->nameHash != nameHash || strcmp(endpoint->name, text) != 0;
+            bool moved   = endpoint->handle != handle || endpoint->kind != kind;
+
+            // Its owner can not keep it
+            if (endpoint->owner && (!online || moved || (renamed && nameHash != endpoint->ownerHash)))
+                lose(*endpoint);
+
+            changeCount++;
+        }
+
+        else {
+            if (endpointCount >= kCapacity * 3 / 4) {
+                fullCount++;
+                return false;
+            }
+
+            endpoint->used      = true;
+            endpoint->uniqueID  = uniqueID;
+            endpoint->owner     = nullptr;
+            endpoint->ownerHash = 0;
+
+            endpointCount++;
+            addCount++;
+        }
+
+        endpoint->kind      = kind;
+        endpoint->handle    = handle;
+        endpoint->entity    = entity;
+        endpoint->device    = device;
+        endpoint->online    = online;
+        endpoint->nameHash  = nameHash;
+
+        memcpy(endpoint->name, text, sizeof(text));
+
+        if (online && !endpoint->owner)
+            generationCount++;
+
+        return true;
+    }
+
+    // An endpoint went away. Returns false if it was not known.
+    inline bool remove(int32_t uniqueID) {
+        Endpoint* endpoint = slot(uniqueID);
+
+        if (!endpoint->used)
+            return false;
+
+        if (endpoint->owner)
+            lose(*endpoint);
+
+        erase(endpoint);
+
+        return true;
+    }
+
+    // A device or entity went away with its endpoints. Returns the number removed.
+    inline int removeParent(uint64_t parent) {
+        int32_t gone[kCapacity];
+        int     count = 0;
+
+        for (auto& endpoint : slots) {
+            if (endpoint.used && parent && (endpoint.entity == parent || endpoint.device == parent))
+                gone[count++] = endpoint.uniqueID;
+        }
+
+        for (int which = 0; which < count; which++)
+            remove(gone[which]);
+
+        return count;
+    }
+
+    // Pointers are good until the next add() or remove()
+    inline const Endpoint* find(int32_t uniqueID) const {
+        const Endpoint* endpoint = slot(uniqueID);
+
+        return endpoint->used ? endpoint : nullptr;
+    }
+
+    // By the backend's reference, for when the unique ID can no longer be asked for (it was removed)
+    inline const Endpoint* findHandle(uint64_t handle) const {
+        for (auto& endpoint : slots) {
+            if (endpoint.used && endpoint.handle == handle)
+                return &endpoint;
+        }
+
+        return nullptr;
+    }
+
+    // Attach owner to the first free online endpoint of kind with name, one on entity if there is one.
+    // Returns nullptr if there is none.
+    inline const Endpoint* claim(Kind kind, const Name& wanted, const void* owner, uint64_t entity = 0) {
+        Endpoint* found = nullptr;
+
+        claimCount++;
+
+        for (auto& endpoint : slots) {
+            if (!endpoint.used || endpoint.owner || !endpoint.online || endpoint.kind != kind || endpoint.nameHash != wanted.hash ||
+                strcmp(endpoint.name, wanted.text) != 0)
+                continue;
+
+            if (!found)
+                found = &endpoint;
+
+            if (entity == 0 || endpoint.entity == entity) {
+                found = &endpoint;
+                break;
+            }
+        }
+
+        if (found) {
+            found->owner     = owner;
+            found->ownerHash = wanted.hash;
+        }
+
+        return found;
+    }
+
+    // Let go of everything owner claimed
+    inline void release(const void* owner) {
+        for (auto& endpoint : slots) {
+            if (endpoint.used && endpoint.owner == owner) {
+                endpoint.owner = nullptr;
+
+                if (endpoint.online)
+                    generationCount++;
+            }
+        }
+    }
+
+    // Changes when an endpoint becomes free to claim
+    inline uint64_t generation() const {return generationCount;}
+
+    // Statistics
+    inline int       size()    const {return endpointCount;}
+    inline long long added()   const {return addCount;}
+    inline long long changed() const {return changeCount;}
+    inline long long removed() const {return removeCount;}
+    inline long long claims()  const {return claimCount;}
+    inline long long full()    const {return fullCount;}            // Endpoints not added for want of room
+
+private:
+    static inline void copyName(char* to, const char* from) {
+        size_t length = strlen(from);
+
+        if (length >= kNameSize)
+            length = kNameSize - 1;
+
+        memcpy(to, from, length);
+        to[length] = 0;
+    }
+
+    static inline uint32_t home(int32_t uniqueID) {
+        return ((uint32_t) uniqueID * 0x9E3779B1U) >> (32 - kLog2Capacity);
+    }
+
+    // The slot uniqueID is in, or the free slot it would go in
+    inline Endpoint* slot(int32_t uniqueID) {
+        uint32_t index = home(uniqueID);
+
+        while (slots[index].used && slots[index].uniqueID != uniqueID)
+            index = (index + 1) & (kCapacity - 1);
+
+        return &slots[index];
+    }
+
+    inline const Endpoint* slot(int32_t uniqueID) const {
+        return const_cast<SynclavierKBI1EndpointRegistry*>(this)->slot(uniqueID);
+    }
+
+    // Take the endpoint out and move up any that probed past it, so lookups never need tombstones
+    inline void erase(Endpoint* endpoint) {
+        uint32_t hole = (uint32_t) (endpoint - slots);
+
+        slots[hole].used = false;
+
+        for (uint32_t index = (hole + 1) & (kCapacity - 1); slots[index].used; index = (index + 1) & (kCapacity - 1)) {
+            uint32_t want = home(slots[index].uniqueID);
+
+            // Can move back to the hole if its home is not between the hole and where it is
+            if (((index - want) & (kCapacity - 1)) >= ((index - hole) & (kCapacity - 1))) {
+                slots[hole]       = slots[index];
+                slots[index].used = false;
+                hole              = index;
+            }
+        }
+
+        endpointCount--;
+        removeCount++;
+    }
+
+    inline void lose(Endpoint& endpoint) {
+        const void* owner = endpoint.owner;
+
+        endpoint.owner = nullptr;
+
+        if (lostProc)
+            lostProc(owner, endpoint, lostRefCon);
+    }
+
+    static const int kLog2Capacity = 9;
+
+    static_assert(1 << kLog2Capacity == kCapacity, "Capacity is a power of 2");
+
+    Endpoint    slots[kCapacity];
+    int         endpointCount;
+    uint64_t    generationCount;
+
+    LostProc    lostProc;
+    void*       lostRefCon;
+
+    long long   addCount;
+    long long   changeCount;
+    long long   removeCount;
+    long long   claimCount;
+    long long   fullCount;
+};
+
+#endif
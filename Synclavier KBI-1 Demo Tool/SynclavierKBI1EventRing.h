@@ -0,0 +1,183 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1EventRing.h
+//
+
+#ifndef SynclavierKBI1EventRing_h
+#define SynclavierKBI1EventRing_h
+
+#include <stdint.h>
+
+#include <atomic>
+
+// Decoded input from the KBI-1, handed from the MIDI thread to the application thread.
+struct SynclavierKBI1Event {
+    uint64_t timeStamp;                                         // Host time the packet arrived (see SynclavierKBI1HostTime.h)
+    uint8_t  channel;                                           // Zero-based MIDI channel
+    uint8_t  type;                                              // SynclavierKBI1EventType
+    uint16_t param;                                             // NRPN parameter number
+    uint16_t value;                                             // 14-bit value
+    uint16_t reserved;
+};
+
+enum SynclavierKBI1EventType : uint8_t {
+    SynclavierKBI1EventNone = 0,
+    SynclavierKBI1EventNRPN = 1,                                // Complete 4-part NRPN
+};
+
+// Fixed-capacity, wait-free ring of events with a single producer and a single consumer.
+//
+// The producer is the MIDI services callback. push() never allocates, locks or waits. If the ring is full
+// the event is dropped and counted in overflows(). The consumer (the application thread) drains events in batches.
+//
+// The consumer is woken through a wake proc supplied by the owner, e.g. signaling a run loop source:
+//  - WakeNever      consumer polls. Nothing is called on the producer's thread.
+//  - WakeWhenEmpty  wake proc is called only when the ring goes from empty to not empty. One wake per batch.
+//  - WakeAlways     wake proc is called for every event.
+//
+// WakeWhenEmpty can not miss a wake: the producer publishes the event before looking at what the consumer
+// has read and the consumer publishes what it has read before looking for more (both sequentially consistent),
+// so either the consumer sees the new event or the producer sees the ring was empty.
+//
+// kCapacity must be a power of 2.
+
+template <int kCapacity = 1024>
+class SynclavierKBI1EventRing {
+public:
+    static_assert((kCapacity & (kCapacity - 1)) == 0, "kCapacity must be a power of 2");
+
+    typedef void (*WakeProc)(void* refCon);
+
+    enum WakePolicy {
+        WakeNever,
+        WakeWhenEmpty,
+        WakeAlways,
+    };
+
+    inline SynclavierKBI1EventRing() {
+        head.store(0);
+        tail.store(0);
+        overflowCount.store(0);
+
+        producerTail    = 0;
+        wakeProc        = nullptr;
+        wakeRefCon      = nullptr;
+        wakePolicy      = WakeNever;
+    }
+
+    // Set before the producer starts
+    inline void setWakeProc(WakeProc proc, void* refCon, WakePolicy policy) {
+        wakeProc    = proc;
+        wakeRefCon  = refCon;
+        wakePolicy  = proc ? policy : WakeNever;
+    }
+
+    // Producer only. Returns false if the ring was full and the event was dropped.
+    inline bool push(const SynclavierKBI1Event& event) {
+        uint32_t position = head.load(std::memory_order_relaxed);
+
+        // Only re-read the consumer's position when the ring looks full
+        if (position - producerTail >= (uint32_t) kCapacity) {
+            producerTail = tail.load(std::memory_order_acquire);
+
+            if (position - producerTail >= (uint32_t) kCapacity) {
+                overflowCount.store(overflowCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        events[position & (kCapacity - 1)] = event;
+
+        if (wakePolicy != WakeWhenEmpty) {
+            head.store(position + 1, std::memory_order_release);
+
+            if (wakePolicy == WakeAlways)
+                wakeProc(wakeRefCon);
+
+            return true;
+        }
+
+        head.store(position + 1, std::memory_order_seq_cst);
+
+        producerTail = tail.load(std::memory_order_seq_cst);
+
+        if (producerTail == position)
+            wakeProc(wakeRefCon);
+
+        return true;
+    }
+
+    // Consumer only. Copies up to maxEvents events out. Returns the number copied. Looks again after
+    // publishing what it read, as the handler drain does, so an event pushed meanwhile is not left
+    // without a wake. If it returns maxEvents more may be waiting: call again, no wake comes for them.
+    inline int drain(SynclavierKBI1Event* out, int maxEvents) {
+        uint32_t position = tail.load(std::memory_order_relaxed);
+        int      count    = 0;
+
+        while (count < maxEvents) {
+            uint32_t end = head.load(std::memory_order_seq_cst);
+
+            if (position == end)
+                break;
+
+            while (position != end && count < maxEvents)
+                out[count++] = events[(position++) & (kCapacity - 1)];
+
+            tail.store(position, std::memory_order_seq_cst);
+        }
+
+        return count;
+    }
+
+    // Consumer only. Calls handler(const SynclavierKBI1Event&) for every event until the ring is empty.
+    template <typename HANDLER>
+    inline int drain(HANDLER&& handler) {
+        int total = 0;
+
+        while (true) {
+            uint32_t position = tail.load(std::memory_order_relaxed);
+            uint32_t end      = head.load(std::memory_order_seq_cst);
+
+            if (position == end)
+                return total;
+
+            while (position != end) {
+                handler(events[position & (kCapacity - 1)]);
+
+                position++;
+                total++;
+            }
+
+            tail.store(position, std::memory_order_seq_cst);
+        }
+    }
+
+    inline bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    inline int size() const {
+        return (int) (head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire));
+    }
+
+    // Events dropped because the ring was full
+    inline uint64_t overflows() const {
+        return overflowCount.load(std::memory_order_relaxed);
+    }
+
+    static inline int capacity() {return kCapacity;}
+
+private:
+    // Producer and consumer positions are kept on their own cache lines
+    alignas(64) std::atomic<uint32_t>   head;                   // Written by producer
+    uint32_t                            producerTail;           // Producer's last look at tail
+    std::atomic<uint64_t>               overflowCount;
+    WakeProc                            wakeProc;
+    void*                               wakeRefCon;
+    WakePolicy                          wakePolicy;
+
+    alignas(64) std::atomic<uint32_t>   tail;                   // Written by consumer
+
+    alignas(64) SynclavierKBI1Event     events[kCapacity];
+};
+
+#endif
@@ -0,0 +1,69 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1HostTime.h
+//
+
+#ifndef SynclavierKBI1HostTime_h
+#define SynclavierKBI1HostTime_h
+
+#include <stdint.h>
+
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+// Host time is the clock MIDI services timestamps packets with.
+//
+// On the Mac this is mach_absolute_time(), the same clock as MIDITimeStamp.
+// Elsewhere it is CLOCK_MONOTONIC in nanoseconds.
+// A timestamp of 0 means "now" to MIDI services.
+
+inline uint64_t SynclavierKBI1HostTimeNow()
+{
+#if defined(__APPLE__)
+    return mach_absolute_time();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+#endif
+}
+
+#if defined(__APPLE__)
+inline const mach_timebase_info_data_t& SynclavierKBI1HostTimeBase()
+{
+    static mach_timebase_info_data_t timeBase = [] {
+        mach_timebase_info_data_t info;
+        mach_timebase_info(&info);
+        return info;
+    }();
+
+    return timeBase;
+}
+#endif
+
+inline uint64_t SynclavierKBI1HostTimeToNanos(uint64_t hostTime)
+{
+#if defined(__APPLE__)
+    auto& timeBase = SynclavierKBI1HostTimeBase();
+
+    return timeBase.numer == timeBase.denom ? hostTime : (uint64_t) ((__uint128_t) hostTime * timeBase.numer / timeBase.denom);
+#else
+    return hostTime;
+#endif
+}
+
+inline uint64_t SynclavierKBI1NanosToHostTime(uint64_t nanos)
+{
+#if defined(__APPLE__)
+    auto& timeBase = SynclavierKBI1HostTimeBase();
+
+    return timeBase.numer == timeBase.denom ? nanos : (uint64_t) ((__uint128_t) nanos * timeBase.denom / timeBase.numer);
+#else
+    return nanos;
+#endif
+}
+
+#endif
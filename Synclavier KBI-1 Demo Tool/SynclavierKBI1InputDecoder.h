@@ -0,0 +1,238 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1InputDecoder.h
+//
+
+#ifndef SynclavierKBI1InputDecoder_h
+#define SynclavierKBI1InputDecoder_h
+
+#include <stdint.h>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDIParser.h"
+#include "SynclavierKBI1NRPNAssembler.h"
+
+// Turns everything the KBI-1 sends into compact, typed, timestamped events.
+//
+// Bytes from the transport are parsed (SynclavierKBI1MIDIParser) and each MIDI message is routed
+// by SynclavierKBI1InputRoutes, a constexpr table indexed by channel and status, to the decode for
+// that part of SynclavierKBI1MIDIProtocol.h:
+//
+//  Channel 1 (0x00)    Note on/off, per note aftertouch, pitch bend, controllers, pedals, ribbon
+//  Channel 2 (0x01)    ORK buttons, knob pitch bend, NRPN
+//  Channel 3 (0x02)    VK buttons
+//  Channel 4 (0x03)    VK buttons, right-most panel
+//  Channel 6 (0x05)    Ribbon pitch bend
+//
+// Every event carries the host time stamp of the packet it arrived in. Events are handed to a proc
+// registered for their type. Procs are kept in a fixed table so registering and dispatching never
+// allocate. Procs are called on the thread that calls receive(), normally the MIDI thread.
+
+enum SynclavierKBI1InputType : uint8_t {
+    SynclavierKBI1InputNone         = 0,
+    SynclavierKBI1InputNote         = 1,                        // number = key,    value = velocity, 0 for note off
+    SynclavierKBI1InputPressure     = 2,                        // number = key,    value = 0 - 127
+    SynclavierKBI1InputBend         = 3,                        //                  value = -8192 - 8191
+    SynclavierKBI1InputController   = 4,                        // number = 0x01, 0x02, 0x07 or 0x0B, value = 0 - 127
+    SynclavierKBI1InputPedal        = 5,                        // number = 0x40 - 0x45, value = 0 - 127 (64 and up is down)
+    SynclavierKBI1InputRibbonDelta  = 6,                        //                  value = -64 - 63 movement since the last one
+    SynclavierKBI1InputRibbonBend   = 7,                        //                  value = -8192 - 8191
+    SynclavierKBI1InputKnob         = 8,                        //                  value = -8192 - 8191
+    SynclavierKBI1InputButton       = 9,                        // number = button, value = 1 pressed, 0 released. channel tells the panel.
+    SynclavierKBI1InputNRPN         = 10,                       // number = param,  value = 14-bit value
+
+    SynclavierKBI1InputTypes        = 11,
+};
+
+// 16 bytes
+struct SynclavierKBI1InputEvent {
+    uint64_t timeStamp;                                         // Host time the packet arrived (see SynclavierKBI1HostTime.h)
+    uint8_t  type;                                              // SynclavierKBI1InputType
+    uint8_t  channel;                                           // Zero-based MIDI channel
+    uint16_t number;
+    int32_t  value;
+};
+
+// What is done with a MIDI message on a given channel
+enum SynclavierKBI1InputRoute : uint8_t {
+    SynclavierKBI1RouteIgnore = 0,
+    SynclavierKBI1RouteNote,
+    SynclavierKBI1RoutePressure,
+    SynclavierKBI1RouteBend,
+    SynclavierKBI1RouteController,                              // Controller, pedal or ribbon by controller number
+    SynclavierKBI1RouteRibbonBend,
+    SynclavierKBI1RouteKnob,
+    SynclavierKBI1RouteButton,
+    SynclavierKBI1RouteNRPN,
+};
+
+struct SynclavierKBI1InputRouteTableType {
+    uint8_t route[16][8];                                       // [channel][status >> 4 & 7]
+    uint8_t controller[128];                                    // SynclavierKBI1InputType by controller number on the note channel
+
+    constexpr SynclavierKBI1InputRouteTableType() : route(), controller() {
+        const int noteOff = 0x0, noteOn = 0x1, polyPressure = 0x2, control = 0x3, pitchBend = 0x6;
+
+        route[SynclavierKBI1MIDIProtocolNoteChannel][noteOff]       = SynclavierKBI1RouteNote;
+        route[SynclavierKBI1MIDIProtocolNoteChannel][noteOn]        = SynclavierKBI1RouteNote;
+        route[SynclavierKBI1MIDIProtocolNoteChannel][polyPressure]  = SynclavierKBI1RoutePressure;
+        route[SynclavierKBI1MIDIProtocolNoteChannel][control]       = SynclavierKBI1RouteController;
+        route[SynclavierKBI1MIDIProtocolNoteChannel][pitchBend]     = SynclavierKBI1RouteBend;
+
+        route[SynclavierKBI1MIDIProtocolORKChannel][noteOff]        = SynclavierKBI1RouteButton;
+        route[SynclavierKBI1MIDIProtocolORKChannel][noteOn]         = SynclavierKBI1RouteButton;
+        route[SynclavierKBI1MIDIProtocolKnobChannel][pitchBend]     = SynclavierKBI1RouteKnob;
+        route[SynclavierKBI1MIDIProtocolNRPNChannel][control]       = SynclavierKBI1RouteNRPN;
+
+        route[SynclavierKBI1MIDIProtocolVKChannel][noteOff]         = SynclavierKBI1RouteButton;
+        route[SynclavierKBI1MIDIProtocolVKChannel][noteOn]          = SynclavierKBI1RouteButton;
+        route[SynclavierKBI1MIDIProtocolVKAltChannel][noteOff]      = SynclavierKBI1RouteButton;
+        route[SynclavierKBI1MIDIProtocolVKAltChannel][noteOn]       = SynclavierKBI1RouteButton;
+
+        route[SynclavierKBI1MIDIProtocolRibbonChannel][pitchBend]   = SynclavierKBI1RouteRibbonBend;
+
+        controller[0x01] = SynclavierKBI1InputController;         // Mod wheel
+        controller[0x02] = SynclavierKBI1InputController;         // Breath
+        controller[0x07] = SynclavierKBI1InputController;         // Pedal 1
+        controller[0x0B] = SynclavierKBI1InputController;         // Pedal 2
+        controller[0x10] = SynclavierKBI1InputRibbonDelta;
+
+        for (int pedal = 0x40; pedal <= 0x45; pedal++)
+            controller[pedal] = SynclavierKBI1InputPedal;
+    }
+};
+
+static constexpr SynclavierKBI1InputRouteTableType SynclavierKBI1InputRoutes;
+
+static_assert(SynclavierKBI1InputRoutes.route[SynclavierKBI1MIDIProtocolNRPNChannel][0x3] == SynclavierKBI1RouteNRPN, "NRPN channel controllers are NRPN");
+static_assert(SynclavierKBI1InputRoutes.route[SynclavierKBI1MIDIProtocolDisplayChannel][0x1] == SynclavierKBI1RouteIgnore, "Display channel is output only");
+
+class SynclavierKBI1InputDecoder {
+public:
+    typedef void (*EventProc)(const SynclavierKBI1InputEvent& event, void* refCon);
+
+    inline SynclavierKBI1InputDecoder() {
+        for (int type = 0; type < SynclavierKBI1InputTypes; type++) {
+            procs[type].proc   = nullptr;
+            procs[type].refCon = nullptr;
+        }
+
+        eventCount = 0;
+    }
+
+    // Register the proc for one type of event. nullptr stops those events being decoded.
+    inline void setProc(SynclavierKBI1InputType type, EventProc proc, void* refCon) {
+        procs[type].proc   = proc;
+        procs[type].refCon = refCon;
+    }
+
+    // Decode a packet from the transport
+    inline void receive(const uint8_t* bytes, int length, uint64_t timeStamp) {
+        Handler handler;
+
+        handler.decoder   = this;
+        handler.timeStamp = timeStamp;
+
+        parser.parse(bytes, length, handler);
+    }
+
+    // Decode one MIDI message
+    inline void message(uint8_t status, uint8_t data1, uint8_t data2, uint64_t timeStamp) {
+        SynclavierKBI1InputEvent event;
+
+        event.timeStamp = timeStamp;
+        event.channel   = status & 0xF;
+        event.number    = data1;
+
+        switch (SynclavierKBI1InputRoutes.route[status & 0xF][(status >> 4) & 7]) {
+            case SynclavierKBI1RouteNote:
+                event.type  = SynclavierKBI1InputNote;
+                event.value = (status & 0xF0) == 0x90 ? data2 : 0;
+                break;
+
+            case SynclavierKBI1RoutePressure:
+                event.type  = SynclavierKBI1InputPressure;
+                event.value = data2;
+                break;
+
+            case SynclavierKBI1RouteBend:
+                event.type  = SynclavierKBI1InputBend;
+                event.value = bend(data1, data2);
+                break;
+
+            case SynclavierKBI1RouteController:
+                event.type  = SynclavierKBI1InputRoutes.controller[data1];
+                event.value = data2;
+
+                // Ribbon movements are relative, 7-bit two's complement
+                if (event.type == SynclavierKBI1InputRibbonDelta)
+                    event.value = data2 >= 0x40 ? data2 - 0x80 : data2;
+                break;
+
+            case SynclavierKBI1RouteRibbonBend:
+                event.type  = SynclavierKBI1InputRibbonBend;
+                event.value = bend(data1, data2);
+                break;
+
+            case SynclavierKBI1RouteKnob:
+                event.type  = SynclavierKBI1InputKnob;
+                event.value = bend(data1, data2);
+                break;
+
+            case SynclavierKBI1RouteButton:
+                event.type  = SynclavierKBI1InputButton;
+                event.value = (status & 0xF0) == 0x90 && data2 != 0;
+                break;
+
+            case SynclavierKBI1RouteNRPN:
+                if (!assembler.controller(data1, data2))
+                    return;
+
+                event.type   = SynclavierKBI1InputNRPN;
+                event.number = assembler.param();
+                event.value  = assembler.value();
+                break;
+
+            default:
+                return;
+        }
+
+        auto& entry = procs[event.type];
+
+        if (entry.proc) {
+            eventCount++;
+            entry.proc(event, entry.refCon);
+        }
+    }
+
+    // Statistics
+    inline long long events()        const {return eventCount;}
+    inline long long nrpnsRejected() const {return assembler.rejected();}
+    inline long long discarded()     const {return parser.discarded();}
+
+private:
+    struct Handler : SynclavierKBI1MIDIParserHandler {
+        SynclavierKBI1InputDecoder* decoder;
+        uint64_t                    timeStamp;
+
+        inline void message(uint8_t status, uint8_t data1, uint8_t data2) {
+            decoder->message(status, data1, data2, timeStamp);
+        }
+    };
+
+    struct ProcEntry {
+        EventProc   proc;
+        void*       refCon;
+    };
+
+    // 14-bit pitch bend, centered on 0
+    static inline int bend(uint8_t lsb, uint8_t msb) {
+        return (msb << 7 | lsb) - 0x2000;
+    }
+
+    SynclavierKBI1MIDIParser        parser;
+    SynclavierKBI1NRPNAssembler     assembler;
+    ProcEntry                       procs[SynclavierKBI1InputTypes];
+    long long                       eventCount;
+};
+
+#endif
@@ -0,0 +1,208 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1LEDState.h
+//
+
+#ifndef SynclavierKBI1LEDState_h
+#define SynclavierKBI1LEDState_h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+
+// Shadow state of the button lights on the ORK and VK.
+//
+// Each light is one of Off, Held, Blinking or On (the SynclavierKBI1MIDIProtocolButton* velocities)
+// packed 2 bits per light, 32 lights per 64-bit word:
+//
+//  - ORK       buttons 0 - 127 on MIDI Channel 2 (SynclavierKBI1MIDIProtocolORKChannel)
+//  - VK        buttons 0 - 127 on MIDI Channel 3 (SynclavierKBI1MIDIProtocolVKChannel)
+//  - VK alt    buttons 0 -  31 on MIDI Channel 4 (SynclavierKBI1MIDIProtocolVKAltChannel)
+//
+// Callers set as many lights as they like during a frame. flush() compares with what was last
+// sent a word at a time and sends a Note On only for lights that are different. A light that is
+// turned on and back off within the same frame sends nothing.
+
+class SynclavierKBI1LEDState {
+public:
+    enum LED {
+        LEDOff      = 0,
+        LEDHeld     = 1,
+        LEDBlinking = 2,
+        LEDOn       = 3,
+    };
+
+    static const int kORKButtons    = 128;
+    static const int kVKButtons     = 128;
+    static const int kVKAltButtons  =  32;
+    static const int kLEDs          = kORKButtons + kVKButtons + kVKAltButtons;
+    static const int kLEDsPerWord   = 32;
+    static const int kWords         = kLEDs / kLEDsPerWord;
+
+    inline SynclavierKBI1LEDState() {
+        memset(want, 0, sizeof(want));
+        markCleared();
+        invalidate();
+
+        ledsSent = 0;
+    }
+
+    // Channel is the zero-based MIDI channel the button is on. Returns false if there is no such button.
+    inline bool set(int channel, int button, LED state) {
+        int led = ledIndex(channel, button);
+
+        if (led < 0)
+            return false;
+
+        auto& word  = want[led / kLEDsPerWord];
+        int   shift = (led % kLEDsPerWord) * 2;
+
+        word = (word & ~(3ULL << shift)) | ((uint64_t) (state & 3) << shift);
+
+        return true;
+    }
+
+    // A light sent some other way, e.g. queued on SynclavierKBI1OutputScheduler. Recorded as
+    // already sent so flush() does not send it again.
+    inline bool setSent(int channel, int button, LED state) {
+        int led = ledIndex(channel, button);
+
+        if (led < 0 || !set(channel, button, state))
+            return false;
+
+        auto& word  = sent[led / kLEDsPerWord];
+        int   shift = (led % kLEDsPerWord) * 2;
+
+        word = (word & ~(3ULL << shift)) | ((uint64_t) (state & 3) << shift);
+
+        return true;
+    }
+
+    // Velocity as sent in the Note On (e.g. SynclavierKBI1MIDIProtocolButtonOn)
+    inline bool setVelocity(int channel, int button, int velocity) {
+        return set(channel, button, ledForVelocity(velocity));
+    }
+
+    inline LED get(int channel, int button) const {
+        int led = ledIndex(channel, button);
+
+        if (led < 0)
+            return LEDOff;
+
+        return (LED) ((want[led / kLEDsPerWord] >> ((led % kLEDsPerWord) * 2)) & 3);
+    }
+
+    // Turn every light off. Nothing is sent until the next flush.
+    inline void clearAll() {
+        memset(want, 0, sizeof(want));
+    }
+
+    // Lights are all off on the KBI-1. Typically after sending SynclavierKBI1MIDIProtocolNRPNMessageClear
+    inline void markCleared() {
+        memset(sent, 0, sizeof(sent));
+        sentValid = true;
+    }
+
+    // What is lit on the KBI-1 is unknown. Next flush sends every light.
+    inline void invalidate() {
+        sentValid = false;
+    }
+
+    // Send lights that changed since the last flush. Returns the number of Note On messages sent.
+    inline int flush(SynclavierKBI1MIDIOutputBatch& batch) {
+        int count = 0;
+
+        for (int index = 0; index < kWords; index++) {
+            uint64_t changed = sentValid ? want[index] ^ sent[index] : ~0ULL;
+
+            // Both bits of a light that changed
+            changed = (changed | (changed >> 1)) & 0x5555555555555555ULL;
+
+            while (changed) {
+                int bit = __builtin_ctzll(changed);
+                int led = index * kLEDsPerWord + bit / 2;
+
+                changed &= changed - 1;
+
+                sendLED(batch, led, (LED) ((want[index] >> bit) & 3));
+                count++;
+            }
+
+            sent[index] = want[index];
+        }
+
+        sentValid  = true;
+        ledsSent  += count;
+
+        return count;
+    }
+
+    // Velocity to send for a light
+    static inline int velocityForLED(LED state) {
+        static const int velocities[4] = {
+            SynclavierKBI1MIDIProtocolButtonOff,
+            SynclavierKBI1MIDIProtocolButtonHeld,
+            SynclavierKBI1MIDIProtocolButtonBlinking,
+            SynclavierKBI1MIDIProtocolButtonOn,
+        };
+
+        return velocities[state & 3];
+    }
+
+    static inline LED ledForVelocity(int velocity) {
+        if (velocity >= SynclavierKBI1MIDIProtocolButtonOn)
+            return LEDOn;
+
+        if (velocity >= SynclavierKBI1MIDIProtocolButtonBlinking)
+            return LEDBlinking;
+
+        if (velocity >= SynclavierKBI1MIDIProtocolButtonHeld)
+            return LEDHeld;
+
+        return LEDOff;
+    }
+
+    // Statistics
+    inline long long sentCount() const {return ledsSent;}
+
+protected:
+    static inline int ledIndex(int channel, int button) {
+        if (channel == SynclavierKBI1MIDIProtocolORKChannel && button >= 0 && button < kORKButtons)
+            return button;
+
+        if (channel == SynclavierKBI1MIDIProtocolVKChannel && button >= 0 && button < kVKButtons)
+            return kORKButtons + button;
+
+        if (channel == SynclavierKBI1MIDIProtocolVKAltChannel && button >= 0 && button < kVKAltButtons)
+            return kORKButtons + kVKButtons + button;
+
+        return -1;
+    }
+
+    inline void sendLED(SynclavierKBI1MIDIOutputBatch& batch, int led, LED state) {
+        int channel = SynclavierKBI1MIDIProtocolORKChannel;
+        int button  = led;
+
+        if (led >= kORKButtons + kVKButtons) {
+            channel = SynclavierKBI1MIDIProtocolVKAltChannel;
+            button  = led - kORKButtons - kVKButtons;
+        }
+
+        else if (led >= kORKButtons) {
+            channel = SynclavierKBI1MIDIProtocolVKChannel;
+            button  = led - kORKButtons;
+        }
+
+        // Note on with velocity of 0 indicates note off
+        batch.send3(0x90 + channel, button, velocityForLED(state));
+    }
+
+    uint64_t    want[kWords];
+    uint64_t    sent[kWords];
+    bool        sentValid;
+
+    long long   ledsSent;
+};
+
+#endif
@@ -0,0 +1,843 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1Log.h
+//
+
+#ifndef SynclavierKBI1Log_h
+#define SynclavierKBI1Log_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <type_traits>
+
+#include "SynclavierKBI1HostTime.h"
+
+// Logging that stays off the threads that send and receive MIDI.
+//
+//    SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 %d connected.\n", unit);
+//
+// A call site does not format anything. It writes a record, a pointer to its site (level, format,
+// file and line, fixed at compile time) and its arguments as raw values, into a byte ring belonging
+// to the calling thread. Nothing is locked, allocated or waited for; if the ring is full the record
+// is dropped and counted. Strings are copied into the record, up to kMaxString bytes.
+//
+// A background thread started with start() takes the records from every thread's ring and either
+// formats them as text (printf conversions, done there rather than by the caller) or writes them to
+// a file as compact binary. A binary log holds each format once; SynclavierKBI1LogReader turns it
+// back into text (the demo tool's -readlog).
+//
+// Levels below SYNCLAVIER_KBI1_LOG_LEVEL are compiled out: the call, and the evaluation of its
+// arguments, are not in the build. Build with -DSYNCLAVIER_KBI1_LOG_LEVEL=0 for trace logging of
+// every message.
+//
+// Until start() is called, and after stop(), records are formatted and printed on the calling
+// thread, as printf would.
+//
+// Records from one thread come out in order. Records from different threads are written a ring at
+// a time, so may be out of order with each other by up to one background pass; each has its time.
+
+enum SynclavierKBI1LogLevel {
+    SynclavierKBI1LogTrace      = 0,                            // Every message
+    SynclavierKBI1LogDebug      = 1,
+    SynclavierKBI1LogInfo       = 2,                            // Connects, status changes
+    SynclavierKBI1LogWarning    = 3,                            // Timeouts
+    SynclavierKBI1LogError      = 4,
+    SynclavierKBI1LogNone       = 5,
+};
+
+#ifndef SYNCLAVIER_KBI1_LOG_LEVEL
+#define SYNCLAVIER_KBI1_LOG_LEVEL SynclavierKBI1LogInfo
+#endif
+
+// One per call site. id and run belong to the background thread.
+struct SynclavierKBI1LogSite {
+    int         level;
+    const char* format;
+    const char* file;
+    int         line;
+    uint32_t    id;                                             // Number in the binary log
+    uint32_t    run;                                            // start() the id was given in, 0 for none
+};
+
+#define SynclavierKBI1Log(level, format, ...)                                                          \
+    do {                                                                                                \
+        if constexpr ((level) >= SYNCLAVIER_KBI1_LOG_LEVEL) {                                           \
+            static SynclavierKBI1LogSite kbi1LogSite = {(level), (format), __FILE__, __LINE__, 0, 0};   \
+            SynclavierKBI1Logger::shared().log(kbi1LogSite __VA_OPT__(,) __VA_ARGS__);                  \
+        }                                                                                               \
+    } while (0)
+
+// Argument types in a record
+enum SynclavierKBI1LogArg : uint8_t {
+    SynclavierKBI1LogArgInt     = 1,                            // int64_t
+    SynclavierKBI1LogArgUInt    = 2,                            // uint64_t
+    SynclavierKBI1LogArgDouble  = 3,
+    SynclavierKBI1LogArgString  = 4,                            // uint16_t length, then the bytes
+    SynclavierKBI1LogArgPointer = 5,                            // uint64_t
+};
+
+// Arguments of a record, as written by the call site and as stored in a binary log:
+// uint8_t count, count type bytes, then each value in order. Native byte order.
+class SynclavierKBI1LogArgs {
+public:
+    static const int kMaxString = 255;
+    static const int kMaxArgs   = 32;
+
+    struct Value {
+        uint8_t         type;
+        union {
+            int64_t     i;
+            uint64_t    u;
+            double      d;
+        };
+        const char*     string;                                 // Not terminated
+        int             length;
+    };
+
+    // Bytes the arguments take
+    template <typename... ARGS>
+    static inline int size(ARGS... args) {
+        return 1 + (int) sizeof...(ARGS) + (0 + ... + valueSize(args));
+    }
+
+    template <typename... ARGS>
+    static inline void encode(uint8_t* bytes, ARGS... args) {
+        static_assert(sizeof...(ARGS) <= kMaxArgs, "Too many log arguments");
+
+        bytes[0] = (uint8_t) sizeof...(ARGS);
+
+        if constexpr (sizeof...(ARGS) > 0) {
+            uint8_t* type  = bytes + 1;
+            uint8_t* value = type + sizeof...(ARGS);
+
+            (put(type, value, args), ...);
+        }
+    }
+
+    // Read arguments back. Returns the number read, or -1 if the bytes do not hold them.
+    static inline int decode(const uint8_t* bytes, int length, Value* values) {
+        if (length < 1 || bytes[0] > kMaxArgs || 1 + bytes[0] > length)
+            return -1;
+
+        int            count = bytes[0];
+        const uint8_t* value = bytes + 1 + count;
+        const uint8_t* end   = bytes + length;
+
+        for (int i = 0; i < count; i++) {
+            auto& v = values[i];
+
+            v.type   = bytes[1 + i];
+            v.u      = 0;
+            v.string = nullptr;
+            v.length = 0;
+
+            if (v.type == SynclavierKBI1LogArgString) {
+                uint16_t size;
+
+                if (end - value < 2)
+                    return -1;
+
+                memcpy(&size, value, 2);
+
+                if (end - value - 2 < size)
+                    return -1;
+
+                v.string = (const char*) value + 2;
+                v.length = size;
+                value   += 2 + size;
+            }
+
+            else if (v.type >= SynclavierKBI1LogArgInt && v.type <= SynclavierKBI1LogArgPointer) {
+                if (end - value < 8)
+                    return -1;
+
+                memcpy(&v.u, value, 8);
+                value += 8;
+            }
+
+            else
+                return -1;
+        }
+
+        return count;
+    }
+
+    // printf format with the values for its conversions. Conversions run out of values are printed as they are.
+    static inline void print(FILE* file, const char* format, const Value* values, int count) {
+        int next = 0;
+
+        while (*format) {
+            if (*format != '%') {
+                const char* run = format;
+
+                while (*format && *format != '%')
+                    format++;
+
+                fwrite(run, 1, format - run, file);
+                continue;
+            }
+
+            if (format[1] == '%') {
+                fputc('%', file);
+                format += 2;
+                continue;
+            }
+
+            // %[flags][width][.precision][length]conversion, rebuilt with the length the value has
+            char        spec[40];
+            int         used  = 0;
+            int         precision = -1;
+            const char* start = format++;
+
+            spec[used++] = '%';
+
+            while (*format && strchr("-+ #0123456789", *format) && used < 16)
+                spec[used++] = *format++;
+
+            if (*format == '.') {
+                precision = 0;
+
+                while (*++format >= '0' && *format <= '9')
+                    precision = precision < 1000 ? precision * 10 + (*format - '0') : precision;
+            }
+
+            while (*format && strchr("hlLqjzt", *format))
+                format++;
+
+            char conversion = *format;
+
+            if (!conversion)
+                break;
+
+            format++;
+
+            if (next == count || !strchr("diouxXcfFeEgGaAsp", conversion)) {
+                fwrite(start, 1, format - start, file);
+                continue;
+            }
+
+            const Value& v = values[next++];
+
+            if (conversion == 's') {
+                spec[used++] = '.';
+                spec[used++] = '*';
+                spec[used++] = 's';
+                spec[used]   = 0;
+
+                if (v.type == SynclavierKBI1LogArgString)
+                    fprintf(file, spec, precision >= 0 && precision < v.length ? precision : v.length, v.string);
+                else
+                    fputs("(?)", file);
+
+                continue;
+            }
+
+            if (precision >= 0)
+                used += snprintf(spec + used, 8, ".%d", precision);
+
+            if (strchr("fFeEgGaA", conversion)) {
+                spec[used++] = conversion;
+                spec[used]   = 0;
+
+                fprintf(file, spec, v.type == SynclavierKBI1LogArgDouble ? v.d : v.type == SynclavierKBI1LogArgInt ? (double) v.i : (double) v.u);
+            }
+
+            else if (conversion == 'p') {
+                fprintf(file, "%p", (void*) (uintptr_t) v.u);
+            }
+
+            else if (conversion == 'c') {
+                spec[used++] = 'c';
+                spec[used]   = 0;
+
+                fprintf(file, spec, (int) v.i);
+            }
+
+            else {
+                spec[used++] = 'l';
+                spec[used++] = 'l';
+                spec[used++] = conversion;
+                spec[used]   = 0;
+
+                long long integer = v.type == SynclavierKBI1LogArgDouble ? (long long) v.d : v.i;
+
+                if (conversion == 'd' || conversion == 'i')
+                    fprintf(file, spec, integer);
+                else
+                    fprintf(file, spec, (unsigned long long) integer);
+            }
+        }
+    }
+
+private:
+    template <typename T>
+    static inline int valueSize(T value) {
+        if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>)
+            return 2 + (value ? (int) strnlen(value, kMaxString) : 0);
+        else
+            return 8;
+    }
+
+    template <typename T>
+    static inline void put(uint8_t*& type, uint8_t*& value, T v) {
+        if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>) {
+            uint16_t length = v ? (uint16_t) strnlen(v, kMaxString) : 0;
+
+            *type++ = SynclavierKBI1LogArgString;
+            memcpy(value, &length, 2);
+            memcpy(value + 2, v, length);
+            value += 2 + length;
+            return;
+        }
+
+        else if constexpr (std::is_floating_point_v<T>) {
+            double d = v;
+
+            *type++ = SynclavierKBI1LogArgDouble;
+            memcpy(value, &d, 8);
+        }
+
+        else if constexpr (std::is_pointer_v<T>) {
+            uint64_t p = (uint64_t) (uintptr_t) v;
+
+            *type++ = SynclavierKBI1LogArgPointer;
+            memcpy(value, &p, 8);
+        }
+
+        else if constexpr (std::is_enum_v<T> || std::is_signed_v<T>) {
+            int64_t i = (int64_t) v;
+
+            *type++ = SynclavierKBI1LogArgInt;
+            memcpy(value, &i, 8);
+        }
+
+        else {
+            static_assert(std::is_integral_v<T>, "Log arguments are numbers, pointers and strings");
+
+            uint64_t u = (uint64_t) v;
+
+            *type++ = SynclavierKBI1LogArgUInt;
+            memcpy(value, &u, 8);
+        }
+
+        value += 8;
+    }
+};
+
+// Binary log file: the magic, then entries, each starting with its type byte.
+//
+//  'F' format      uint32_t id, int32_t level, int32_t line, uint16_t format length, uint16_t file length, format, file
+//  'R' record      uint32_t id, uint64_t ns (host time), uint16_t argument bytes, arguments (SynclavierKBI1LogArgs)
+//  'D' dropped     uint64_t records dropped since the last 'D'
+static const char SynclavierKBI1LogMagic[8] = {'K', 'B', 'I', '1', 'L', 'O', 'G', '1'};
+
+class SynclavierKBI1Logger {
+public:
+    static const int kThreads       = 8;                        // Threads that can log. More are dropped.
+    static const int kRingSize      = 1 << 16;                  // Bytes per thread
+    static const int kMaxRecord     = 2048;
+    static const int kPollInterval  = 2;                        // ms between background passes
+
+    static inline SynclavierKBI1Logger& shared() {
+        static SynclavierKBI1Logger logger;
+        return logger;
+    }
+
+    // Start the background thread: text to file, or binary to file if binary is set. The file is
+    // the caller's to open and, after stop(), close.
+    inline bool start(FILE* output, bool binary = false) {
+        if (running.load() || !output)
+            return false;
+
+        file        = output;
+        binaryFile  = binary;
+        nextId      = 1;
+        runCount   += 1;                                        // Formats are written again in each file
+        reported    = dropped();
+
+        if (binaryFile)
+            fwrite(SynclavierKBI1LogMagic, 1, sizeof(SynclavierKBI1LogMagic), file);
+
+        running.store(true);
+        thread = std::thread([this] {run();});
+
+        return true;
+    }
+
+    // Write everything waiting and stop the background thread. Logging goes back to the calling thread.
+    inline void stop() {
+        if (!running.load())
+            return;
+
+        running.store(false);
+        thread.join();
+
+        // A thread that saw running before it was cleared may still be putting a record in its ring
+        for (int index = 0; index < kThreads && index < ringCount.load(); index++)
+            while (rings[index].writing.load())
+                std::this_thread::yield();
+
+        drain();
+        fflush(file);
+    }
+
+    inline bool started() const {return running.load(std::memory_order_relaxed);}
+
+    template <typename... ARGS>
+    inline void log(SynclavierKBI1LogSite& site, ARGS... args) {
+        int argBytes = SynclavierKBI1LogArgs::size(args...);
+        int length   = (int) ((sizeof(Header) + argBytes + 7) & ~7);
+
+        if (length > kMaxRecord) {
+            droppedLarge.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // Not started: format here, as printf did
+        if (!running.load(std::memory_order_acquire)) {
+            uint8_t bytes[kMaxRecord];
+
+            SynclavierKBI1LogArgs::encode(bytes, args...);
+            printRecord(stdout, site.format, bytes, argBytes);
+            return;
+        }
+
+        Ring* ring = threadRing();
+
+        if (!ring) {
+            droppedLarge.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // Either stop() waits for this record and writes it, or this sees stop() and prints it here
+        ring->writing.store(true);
+
+        if (!running.load()) {
+            uint8_t bytes[kMaxRecord];
+
+            ring->writing.store(false, std::memory_order_release);
+
+            SynclavierKBI1LogArgs::encode(bytes, args...);
+            printRecord(stdout, site.format, bytes, argBytes);
+            return;
+        }
+
+        uint8_t* bytes = ring->reserve(length);
+
+        if (!bytes) {
+            ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            ring->writing.store(false, std::memory_order_release);
+            return;
+        }
+
+        Header header;
+
+        header.length   = (uint32_t) length;
+        header.argBytes = (uint32_t) argBytes;
+        header.site     = &site;
+        header.time     = SynclavierKBI1HostTimeNow();
+
+        memcpy(bytes, &header, sizeof(header));
+        SynclavierKBI1LogArgs::encode(bytes + sizeof(header), args...);
+
+        ring->commit(length);
+        ring->writing.store(false, std::memory_order_release);
+    }
+
+    // Records dropped because a ring was full, too many threads logged or a record was too big
+    inline uint64_t dropped() const {
+        uint64_t count = droppedLarge.load(std::memory_order_relaxed);
+
+        for (auto& ring : rings)
+            count += ring.dropped.load(std::memory_order_relaxed);
+
+        return count;
+    }
+
+    // Records written by the background thread
+    inline uint64_t written() const {return writtenCount.load(std::memory_order_relaxed);}
+
+    // Format and arguments as text
+    static inline void printRecord(FILE* output, const char* format, const uint8_t* args, int length) {
+        SynclavierKBI1LogArgs::Value values[SynclavierKBI1LogArgs::kMaxArgs];
+
+        int count = SynclavierKBI1LogArgs::decode(args, length, values);
+
+        SynclavierKBI1LogArgs::print(output, format, values, count < 0 ? 0 : count);
+    }
+
+private:
+    struct Header {
+        uint32_t                length;                         // Whole record, a multiple of 8. site is null for padding.
+        uint32_t                argBytes;
+        SynclavierKBI1LogSite*  site;
+        uint64_t                time;
+    };
+
+    // Single producer (the thread it belongs to), single consumer (the background thread)
+    struct Ring {
+        alignas(64) std::atomic<uint64_t>   head;               // Written by producer
+        std::atomic<uint64_t>               dropped;
+        std::atomic<bool>                   writing;            // Between the running check and commit
+        alignas(64) std::atomic<uint64_t>   tail;               // Written by consumer
+        alignas(64) uint8_t                 bytes[kRingSize];
+
+        // Room for length bytes in one piece, or nullptr. Padding goes in to skip the end of the ring.
+        inline uint8_t* reserve(int length) {
+            uint64_t position  = head.load(std::memory_order_relaxed);
+            uint64_t free      = kRingSize - (position - tail.load(std::memory_order_acquire));
+            int      offset    = (int) (position & (kRingSize - 1));
+            int      remaining = kRingSize - offset;
+
+            if (remaining >= length)
+                return length <= (int64_t) free ? bytes + offset : nullptr;
+
+            if ((int64_t) remaining + length > (int64_t) free)
+                return nullptr;
+
+            Header padding = {(uint32_t) remaining, 0, nullptr, 0};
+
+            if (remaining >= (int) sizeof(Header))
+                memcpy(bytes + offset, &padding, sizeof(padding));
+
+            head.store(position + remaining, std::memory_order_release);
+
+            return bytes;
+        }
+
+        inline void commit(int length) {
+            head.store(head.load(std::memory_order_relaxed) + length, std::memory_order_release);
+        }
+    };
+
+    inline SynclavierKBI1Logger() {
+        file        = nullptr;
+        binaryFile  = false;
+        nextId      = 1;
+        runCount    = 0;
+        reported    = 0;
+
+        running.store(false);
+        ringCount.store(0);
+        droppedLarge.store(0);
+        writtenCount.store(0);
+
+        for (auto& ring : rings) {
+            ring.head.store(0);
+            ring.tail.store(0);
+            ring.dropped.store(0);
+            ring.writing.store(false);
+        }
+    }
+
+    inline Ring* threadRing() {
+        static thread_local Ring* ring = nullptr;
+        static thread_local bool  tried = false;
+
+        if (!tried) {
+            int index = ringCount.fetch_add(1);
+
+            ring  = index < kThreads ? &rings[index] : nullptr;
+            tried = true;
+        }
+
+        return ring;
+    }
+
+    inline void run() {
+        for (;;) {
+            bool more = running.load(std::memory_order_acquire);
+
+            drain();
+
+            if (!more)
+                break;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds((int) kPollInterval));
+        }
+
+        fflush(file);
+    }
+
+    // One pass over every ring
+    inline void drain() {
+        bool wrote = false;
+
+        for (int index = 0; index < kThreads && index < ringCount.load(std::memory_order_acquire); index++) {
+            Ring&    ring     = rings[index];
+            uint64_t position = ring.tail.load(std::memory_order_relaxed);
+            uint64_t end      = ring.head.load(std::memory_order_acquire);
+
+            while (position != end) {
+                int offset    = (int) (position & (kRingSize - 1));
+                int remaining = kRingSize - offset;
+
+                if (remaining < (int) sizeof(Header)) {
+                    position += remaining;
+                    continue;
+                }
+
+                Header header;
+
+                memcpy(&header, ring.bytes + offset, sizeof(header));
+
+                if (header.site)
+                    write(header, ring.bytes + offset + sizeof(header));
+
+                position += header.length;
+                wrote     = true;
+            }
+
+            ring.tail.store(position, std::memory_order_release);
+        }
+
+        // Say how many were lost since the last pass, where they were lost
+        uint64_t total = dropped(), lost = total - reported;
+
+        if (lost && binaryFile) {
+            fputc('D', file);
+            fwrite(&lost, sizeof(lost), 1, file);
+        }
+
+        else if (lost)
+            fprintf(file, "(%llu log records dropped)\n", (unsigned long long) lost);
+
+        reported = total;
+
+        if (wrote || lost)
+            fflush(file);
+    }
+
+    inline void write(const Header& header, const uint8_t* args) {
+        SynclavierKBI1LogSite& site = *header.site;
+
+        writtenCount.store(writtenCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+        if (!binaryFile) {
+            printRecord(file, site.format, args, (int) header.argBytes);
+            return;
+        }
+
+        // Each format once per file, the first time it is used
+        if (site.run != runCount) {
+            uint16_t formatLength = (uint16_t) strnlen(site.format, 0xFFFF);
+            uint16_t fileLength   = (uint16_t) strnlen(site.file, 0xFFFF);
+            int32_t  level        = site.level;
+            int32_t  line         = site.line;
+
+            site.id  = nextId++;
+            site.run = runCount;
+
+            fputc('F', file);
+            fwrite(&site.id, 4, 1, file);
+            fwrite(&level, 4, 1, file);
+            fwrite(&line, 4, 1, file);
+            fwrite(&formatLength, 2, 1, file);
+            fwrite(&fileLength, 2, 1, file);
+            fwrite(site.format, 1, formatLength, file);
+            fwrite(site.file, 1, fileLength, file);
+        }
+
+        uint64_t nanos    = SynclavierKBI1HostTimeToNanos(header.time);
+        uint16_t argBytes = (uint16_t) header.argBytes;
+
+        fputc('R', file);
+        fwrite(&site.id, 4, 1, file);
+        fwrite(&nanos, 8, 1, file);
+        fwrite(&argBytes, 2, 1, file);
+        fwrite(args, 1, argBytes, file);
+    }
+
+    Ring                    rings[kThreads];
+    std::atomic<int>        ringCount;
+    std::atomic<uint64_t>   droppedLarge;                       // No ring, or too big
+    std::atomic<uint64_t>   writtenCount;
+    std::atomic<bool>       running;
+    std::thread             thread;
+
+    // Background thread
+    FILE*                   file;
+    bool                    binaryFile;
+    uint32_t                nextId;
+    uint32_t                runCount;                           // start() calls
+    uint64_t                reported;                           // Dropped records written to the log so far
+};
+
+// Reads a binary log back
+class SynclavierKBI1LogReader {
+public:
+    static const int kMaxFormats = 4096;
+
+    struct Entry {
+        int         level;
+        const char* format;
+        const char* file;
+        int         line;
+        uint64_t    nanos;                                      // Host time, ns
+        uint8_t     args[2048];
+        int         argBytes;
+    };
+
+    inline SynclavierKBI1LogReader() {
+        file        = nullptr;
+        formatCount = 0;
+        dropCount   = 0;
+        storageUsed = 0;
+    }
+
+    inline ~SynclavierKBI1LogReader() {close();}
+
+    inline bool open(const char* path) {
+        char magic[sizeof(SynclavierKBI1LogMagic)];
+
+        close();
+
+        file      = fopen(path, "rb");
+        dropCount = 0;
+
+        if (!file)
+            return false;
+
+        if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, SynclavierKBI1LogMagic, sizeof(magic)) != 0) {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    inline void close() {
+        if (file)
+            fclose(file);
+
+        file        = nullptr;
+        formatCount = 0;
+        storageUsed = 0;
+    }
+
+    // Next record. false at the end of the log or if it is damaged.
+    inline bool next(Entry& entry) {
+        int type;
+
+        while (file && (type = fgetc(file)) != EOF) {
+            if (type == 'D') {
+                uint64_t count;
+
+                if (fread(&count, 8, 1, file) != 1)
+                    return false;
+
+                dropCount += count;
+            }
+
+            else if (type == 'F') {
+                if (!readFormat())
+                    return false;
+            }
+
+            else if (type == 'R') {
+                uint32_t id;
+                uint16_t argBytes;
+
+                if (fread(&id, 4, 1, file) != 1 || fread(&entry.nanos, 8, 1, file) != 1 || fread(&argBytes, 2, 1, file) != 1)
+                    return false;
+
+                if (id == 0 || id > (uint32_t) formatCount || argBytes > sizeof(entry.args) || fread(entry.args, 1, argBytes, file) != argBytes)
+                    return false;
+
+                auto& format = formats[id - 1];
+
+                entry.level    = format.level;
+                entry.format   = format.format;
+                entry.file     = format.file;
+                entry.line     = format.line;
+                entry.argBytes = argBytes;
+
+                return true;
+            }
+
+            else
+                return false;
+        }
+
+        return false;
+    }
+
+    // Whole log as text: seconds from the first record, level, message. Returns the number of records.
+    inline long long print(FILE* output) {
+        static const char* levels[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "NONE"};
+
+        Entry     entry;
+        uint64_t  first = 0;
+        long long count = 0;
+
+        while (next(entry)) {
+            if (count++ == 0)
+                first = entry.nanos;
+
+            fprintf(output, "%12.6f %-5s ", (entry.nanos - first) * 1e-9, levels[entry.level >= 0 && entry.level <= 5 ? entry.level : 5]);
+            SynclavierKBI1Logger::printRecord(output, entry.format, entry.args, entry.argBytes);
+
+            size_t length = strlen(entry.format);
+
+            if (length == 0 || entry.format[length - 1] != '\n')
+                fputc('\n', output);
+        }
+
+        if (dropCount)
+            fprintf(output, "(%llu records dropped)\n", (unsigned long long) dropCount);
+
+        return count;
+    }
+
+    inline uint64_t dropped() const {return dropCount;}
+
+private:
+    struct Format {
+        int         level;
+        int         line;
+        const char* format;
+        const char* file;
+    };
+
+    inline bool readFormat() {
+        uint32_t id;
+        int32_t  level, line;
+        uint16_t formatLength, fileLength;
+
+        if (fread(&id, 4, 1, file) != 1 || fread(&level, 4, 1, file) != 1 || fread(&line, 4, 1, file) != 1 ||
+            fread(&formatLength, 2, 1, file) != 1 || fread(&fileLength, 2, 1, file) != 1)
+            return false;
+
+        // Ids are given out in order
+        if (id != (uint32_t) formatCount + 1 || formatCount == kMaxFormats ||
+            storageUsed + formatLength + fileLength + 2 > (int) sizeof(storage))
+            return false;
+
+        char* format = storage + storageUsed;
+        char* source = format + formatLength + 1;
+
+        if (fread(format, 1, formatLength, file) != formatLength || fread(source, 1, fileLength, file) != fileLength)
+            return false;
+
+        format[formatLength] = 0;
+        source[fileLength]   = 0;
+        storageUsed         += formatLength + fileLength + 2;
+
+        formats[formatCount++] = {level, line, format, source};
+
+        return true;
+    }
+
+    FILE*       file;
+    Format      formats[kMaxFormats];
+    int         formatCount;
+    uint64_t    dropCount;
+    char        storage[1 << 18];                               // Format and file strings
+    int         storageUsed;
+};
+
+#endif
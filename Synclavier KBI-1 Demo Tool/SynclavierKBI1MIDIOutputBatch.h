@@ -0,0 +1,165 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDIOutputBatch.h
+//
+
+#ifndef SynclavierKBI1MIDIOutputBatch_h
+#define SynclavierKBI1MIDIOutputBatch_h
+
+#include "SynclavierKBI1MIDIProtocol.h"
+
+// Output batching for messages sent to the KBI-1.
+//
+// Rather than handing each 3-byte message to MIDI services on its own, messages are
+// collected into one buffer and handed over as a single block when the batch is flushed.
+// The owner flushes at the end of each pass of its event loop; the batch also flushes
+// itself if the next message would not fit.
+//
+// Running status - https://en.wikipedia.org/wiki/MIDI#Running_status
+// When enabled, a status byte that repeats the previous one is left out. An NRPN on
+// channel 2 is four controller messages with the same status, so it goes from 12 bytes to 9.
+// Running status never carries over from one flush to the next so each block can be
+// interpreted on its own. Note Core MIDI does not allow running status within a MIDIPacket,
+// so it should only be enabled for byte-stream destinations.
+
+class SynclavierKBI1MIDIOutputBatch {
+public:
+    typedef unsigned char BatchByte;
+
+    // Called with the collected bytes when the batch is flushed. Bytes are only valid during the call.
+    typedef void (*FlushProc)(const BatchByte* bytes, int length, void* refCon);
+
+    static const int kCapacity = 1024;                          // Bytes collected before the batch flushes on its own
+
+    inline SynclavierKBI1MIDIOutputBatch(FlushProc proc, void* refCon, bool runningStatus) {
+        flushProc       = proc;
+        flushRefCon     = refCon;
+        useRunning      = runningStatus;
+        length          = 0;
+        runningByte     = 0;
+
+        messageCount     = 0;
+        byteCount        = 0;
+        flushCount       = 0;
+        statusBytesSaved = 0;
+    }
+
+    // Where flushed bytes go. Anything collected for the old destination is sent there first.
+    inline void setFlushProc(FlushProc proc, void* refCon) {
+        flush();
+        flushProc   = proc;
+        flushRefCon = refCon;
+    }
+
+    inline void setRunningStatus(bool runningStatus) {
+        flush();
+        useRunning = runningStatus;
+    }
+
+    // Channel message with two data bytes (note on/off, controller, pitch bend...)
+    inline void send3(BatchByte byte1, BatchByte byte2, BatchByte byte3) {
+        if (length + 3 > kCapacity)
+            flush();
+
+        putStatus(byte1);
+        buffer[length++] = byte2 & 0x7F;
+        buffer[length++] = byte3 & 0x7F;
+        messageCount++;
+    }
+
+    // Channel message with one data byte (program change, channel pressure)
+    inline void send2(BatchByte byte1, BatchByte byte2) {
+        if (length + 2 > kCapacity)
+            flush();
+
+        putStatus(byte1);
+        buffer[length++] = byte2 & 0x7F;
+        messageCount++;
+    }
+
+    // Status byte alone (real time, tune request, SysEx start and end)
+    inline void send1(BatchByte byte1) {
+        if (length + 1 > kCapacity)
+            flush();
+
+        putStatus(byte1);
+        messageCount++;
+    }
+
+    // Data byte of a SysEx
+    inline void sendData(BatchByte byte) {
+        if (length + 1 > kCapacity)
+            flush();
+
+        buffer[length++] = byte & 0x7F;
+    }
+
+    inline void sendNRPN(int param, int value, int chan) {
+        SynclavierKBI1MIDIProtocolNRPN nrpnMessage(param, value, chan);
+
+        // Keep the 4 parts together so the KBI-1 sees them in one block
+        if (length + 12 > kCapacity)
+            flush();
+
+        send3(nrpnMessage.nrpn1()[0], nrpnMessage.nrpn1()[1], nrpnMessage.nrpn1()[2]);
+        send3(nrpnMessage.nrpn2()[0], nrpnMessage.nrpn2()[1], nrpnMessage.nrpn2()[2]);
+        send3(nrpnMessage.data1()[0], nrpnMessage.data1()[1], nrpnMessage.data1()[2]);
+        send3(nrpnMessage.data2()[0], nrpnMessage.data2()[1], nrpnMessage.data2()[2]);
+    }
+
+    // Hand whatever has been collected to the flush proc
+    inline void flush() {
+        if (length == 0)
+            return;
+
+        if (flushProc)
+            flushProc(buffer, length, flushRefCon);
+
+        byteCount  += length;
+        flushCount += 1;
+        length      = 0;
+        runningByte = 0;
+    }
+
+    // Discard collected messages without sending them
+    inline void discard() {
+        length      = 0;
+        runningByte = 0;
+    }
+
+    inline int  pending() const {return length;}
+    inline bool empty()   const {return length == 0;}
+
+    // Statistics
+    inline long long messages()         const {return messageCount;}
+    inline long long bytes()            const {return byteCount;}
+    inline long long flushes()          const {return flushCount;}
+    inline long long runningSaved()     const {return statusBytesSaved;}
+
+private:
+    inline void putStatus(BatchByte status) {
+        if (useRunning && status == runningByte && status >= 0x80 && status < 0xF0) {
+            statusBytesSaved++;
+            return;
+        }
+
+        buffer[length++] = status;
+
+        // Only channel messages establish running status
+        runningByte = (status < 0xF0) ? status : 0;
+    }
+
+    FlushProc   flushProc;
+    void*       flushRefCon;
+    bool        useRunning;
+
+    BatchByte   buffer[kCapacity];
+    int         length;
+    BatchByte   runningByte;
+
+    long long   messageCount;
+    long long   byteCount;
+    long long   flushCount;
+    long long   statusBytesSaved;
+};
+
+#endif
@@ -0,0 +1,310 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDIParser.h
+//
+
+#ifndef SynclavierKBI1MIDIParser_h
+#define SynclavierKBI1MIDIParser_h
+
+#include <stdint.h>
+
+// Streaming MIDI 1.0 parser - https://midi.org/midi-1-0-core-specifications
+//
+// Bytes are fed in as they arrive, a packet at a time. The parser keeps its state between calls
+// so a message split across packets is put back together. It handles:
+//
+//  - Running status. Channel messages may leave out a repeated status byte.
+//  - System Real-Time bytes (0xF8 - 0xFF) anywhere, including in the middle of a message or SysEx.
+//    They are handed on at once and do not disturb the message they interrupt.
+//  - System Common messages. They cancel running status.
+//  - SysEx streams of any length. Handed on in chunks as they arrive; a SysEx is ended by 0xF7
+//    or by any other status byte.
+//
+// Decoding is driven by SynclavierKBI1MIDIStatusTable, a constexpr table indexed by status byte.
+// When nothing is pending, complete channel messages (with or without running status) are decoded
+// several bytes at a time without going through the per-byte state machine.
+//
+// The handler is a template parameter so calls to it inline. Derive from
+// SynclavierKBI1MIDIParserHandler and override what is needed.
+
+// What a status byte starts
+enum SynclavierKBI1MIDIStatusKind : uint8_t {
+    SynclavierKBI1MIDIStatusData        = 0,                    // 0x00 - 0x7F, not a status byte
+    SynclavierKBI1MIDIStatusChannel     = 1,                    // 0x80 - 0xEF
+    SynclavierKBI1MIDIStatusCommon      = 2,                    // 0xF1 - 0xF6
+    SynclavierKBI1MIDIStatusSysExStart  = 3,                    // 0xF0
+    SynclavierKBI1MIDIStatusSysExEnd    = 4,                    // 0xF7
+    SynclavierKBI1MIDIStatusRealTime    = 5,                    // 0xF8 - 0xFF
+};
+
+struct SynclavierKBI1MIDIStatusInfo {
+    uint8_t kind;                                               // SynclavierKBI1MIDIStatusKind
+    uint8_t dataBytes;                                          // Data bytes that follow the status
+};
+
+struct SynclavierKBI1MIDIStatusTableType {
+    SynclavierKBI1MIDIStatusInfo entry[256];
+
+    constexpr SynclavierKBI1MIDIStatusTableType() : entry() {
+        for (int status = 0; status < 256; status++) {
+            uint8_t kind  = SynclavierKBI1MIDIStatusData;
+            uint8_t bytes = 0;
+
+            if (status >= 0xF8)
+                kind = SynclavierKBI1MIDIStatusRealTime;
+
+            else if (status == 0xF0)
+                kind = SynclavierKBI1MIDIStatusSysExStart;
+
+            else if (status == 0xF7)
+                kind = SynclavierKBI1MIDIStatusSysExEnd;
+
+            else if (status >= 0xF1) {
+                kind  = SynclavierKBI1MIDIStatusCommon;
+                bytes = (status == 0xF2) ? 2 : (status == 0xF1 || status == 0xF3) ? 1 : 0;
+            }
+
+            else if (status >= 0x80) {
+                kind  = SynclavierKBI1MIDIStatusChannel;
+                bytes = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+            }
+
+            entry[status].kind      = kind;
+            entry[status].dataBytes = bytes;
+        }
+    }
+
+    constexpr const SynclavierKBI1MIDIStatusInfo& operator[](int status) const {return entry[status];}
+};
+
+static constexpr SynclavierKBI1MIDIStatusTableType SynclavierKBI1MIDIStatusTable;
+
+static_assert(SynclavierKBI1MIDIStatusTable[0x90].dataBytes == 2, "Note On has 2 data bytes");
+static_assert(SynclavierKBI1MIDIStatusTable[0xC5].dataBytes == 1, "Program Change has 1 data byte");
+static_assert(SynclavierKBI1MIDIStatusTable[0xD0].dataBytes == 1, "Channel Pressure has 1 data byte");
+static_assert(SynclavierKBI1MIDIStatusTable[0xF2].dataBytes == 2, "Song Position has 2 data bytes");
+static_assert(SynclavierKBI1MIDIStatusTable[0xF8].kind == SynclavierKBI1MIDIStatusRealTime, "Clock is real-time");
+
+// Receives what the parser decodes. All calls are made on the thread calling parse().
+struct SynclavierKBI1MIDIParserHandler {
+    // Channel or System Common message. data2 is 0 for messages with fewer than 2 data bytes.
+    inline void message(uint8_t status, uint8_t data1, uint8_t data2) {}
+
+    // System Real-Time byte
+    inline void realTime(uint8_t status) {}
+
+    // Part of a SysEx. start is set on the chunk beginning with 0xF0, end on the chunk ending it.
+    // An end chunk with length 0 means the SysEx was ended by another status byte.
+    inline void sysEx(const uint8_t* bytes, int length, bool start, bool end) {}
+};
+
+class SynclavierKBI1MIDIParser {
+public:
+    inline SynclavierKBI1MIDIParser() {
+        reset();
+    }
+
+    inline void reset() {
+        runningStatus   = 0;
+        status          = 0;
+        needed          = 0;
+        have            = 0;
+        data[0]         = 0;
+        data[1]         = 0;
+        inSysEx         = false;
+        sysExStart      = false;
+
+        messageCount    = 0;
+        discardCount    = 0;
+    }
+
+    // Parse the next bytes of the stream. May be called with any split of the stream.
+    template <typename HANDLER>
+    inline void parse(const uint8_t* bytes, int length, HANDLER& handler) {
+        const uint8_t* end = bytes + length;
+
+        while (bytes < end) {
+
+            // Fast path: nothing pending, decode whole channel messages
+            if (have == 0 && !inSysEx)
+                bytes = parseMessages(bytes, end, handler);
+
+            if (bytes < end)
+                bytes = parseByte(bytes, end, handler);
+        }
+    }
+
+    // Statistics
+    inline long long messages()  const {return messageCount;}
+    inline long long discarded() const {return discardCount;}             // Data bytes with no status to go with them, or incomplete messages
+
+    // Whether a message or SysEx is partly received
+    inline bool pending() const {return have != 0 || inSysEx;}
+
+private:
+    template <typename HANDLER>
+    inline const uint8_t* parseMessages(const uint8_t* bytes, const uint8_t* end, HANDLER& handler) {
+        while (end - bytes >= 3) {
+            uint8_t byte0 = bytes[0];
+
+            // Status, 2 data bytes
+            if (byte0 >= 0x80 && byte0 < 0xF0 && SynclavierKBI1MIDIStatusTable[byte0].dataBytes == 2 && ((bytes[1] | bytes[2]) & 0x80) == 0) {
+                handler.message(byte0, bytes[1], bytes[2]);
+                runningStatus = byte0;
+                messageCount++;
+                bytes += 3;
+                continue;
+            }
+
+            // Running status, 2 data bytes
+            if (byte0 < 0x80 && runningStatus && SynclavierKBI1MIDIStatusTable[runningStatus].dataBytes == 2 && (bytes[1] & 0x80) == 0) {
+                handler.message(runningStatus, byte0, bytes[1]);
+                messageCount++;
+                bytes += 2;
+                continue;
+            }
+
+            // Status, 1 data byte
+            if (byte0 >= 0xC0 && byte0 < 0xE0 && (bytes[1] & 0x80) == 0) {
+                handler.message(byte0, bytes[1], 0);
+                runningStatus = byte0;
+                messageCount++;
+                bytes += 2;
+                continue;
+            }
+
+            // Anything else goes through the state machine
+            break;
+        }
+
+        return bytes;
+    }
+
+    template <typename HANDLER>
+    inline const uint8_t* parseByte(const uint8_t* bytes, const uint8_t* end, HANDLER& handler) {
+        uint8_t byte = *bytes;
+        auto&   info = SynclavierKBI1MIDIStatusTable[byte];
+
+        switch (info.kind) {
+            case SynclavierKBI1MIDIStatusRealTime:
+                handler.realTime(byte);
+                return bytes + 1;
+
+            case SynclavierKBI1MIDIStatusData: {
+                if (inSysEx)
+                    return sysExData(bytes, end, handler);
+
+                // Running status starts a new message
+                if (have == 0) {
+                    if (runningStatus == 0) {
+                        discardCount++;
+                        return bytes + 1;
+                    }
+
+                    status  = runningStatus;
+                    needed  = SynclavierKBI1MIDIStatusTable[status].dataBytes;
+                    have    = 1;
+                    data[1] = 0;
+                }
+
+                data[have - 1] = byte;
+
+                if (have++ == needed)
+                    complete(handler);
+
+                return bytes + 1;
+            }
+
+            default:
+                break;
+        }
+
+        // Any other status byte ends a SysEx or a partial message
+        if (inSysEx) {
+            inSysEx = false;
+            handler.sysEx(bytes, byte == 0xF7 ? 1 : 0, false, true);
+
+            if (byte == 0xF7)
+                return bytes + 1;
+        }
+
+        if (have != 0)
+            discardCount++;
+
+        have = 0;
+
+        switch (info.kind) {
+            case SynclavierKBI1MIDIStatusSysExStart:
+                runningStatus = 0;
+                inSysEx       = true;
+                sysExStart    = true;
+                return sysExData(bytes, end, handler);
+
+            case SynclavierKBI1MIDIStatusSysExEnd:
+                runningStatus = 0;                              // Stray EOX
+                return bytes + 1;
+
+            case SynclavierKBI1MIDIStatusCommon:
+                runningStatus = 0;
+                break;
+
+            default:
+                runningStatus = byte;
+                break;
+        }
+
+        status = byte;
+        needed = info.dataBytes;
+        have   = 1;
+        data[0] = data[1] = 0;
+
+        if (needed == 0)
+            complete(handler);
+
+        return bytes + 1;
+    }
+
+    // Hand on the SysEx bytes up to the next status byte in one chunk
+    template <typename HANDLER>
+    inline const uint8_t* sysExData(const uint8_t* bytes, const uint8_t* end, HANDLER& handler) {
+        const uint8_t* chunk = bytes;
+
+        // 0xF0 itself is part of the first chunk
+        if (sysExStart)
+            bytes++;
+
+        while (bytes < end && *bytes < 0x80)
+            bytes++;
+
+        bool ended = bytes < end && *bytes == 0xF7;
+
+        if (ended) {
+            bytes++;
+            inSysEx = false;
+        }
+
+        handler.sysEx(chunk, (int) (bytes - chunk), sysExStart, ended);
+        sysExStart = false;
+
+        return bytes;
+    }
+
+    template <typename HANDLER>
+    inline void complete(HANDLER& handler) {
+        handler.message(status, data[0], data[1]);
+        messageCount++;
+        have = 0;
+    }
+
+    uint8_t     runningStatus;                                  // 0 if none
+    uint8_t     status;                                         // Message being received
+    uint8_t     needed;                                         // Data bytes it needs
+    uint8_t     have;                                           // 0 if no message pending, else 1 + data bytes received
+    uint8_t     data[2];
+    bool        inSysEx;
+    bool        sysExStart;
+
+    long long   messageCount;
+    long long   discardCount;
+};
+
+#endif
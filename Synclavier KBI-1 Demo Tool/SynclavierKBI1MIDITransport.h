@@ -0,0 +1,76 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDITransport.h
+//
+
+#ifndef SynclavierKBI1MIDITransport_h
+#define SynclavierKBI1MIDITransport_h
+
+#include <stdint.h>
+
+// Connection to a KBI-1 through some MIDI service.
+//
+// Output is handed over in batches of complete MIDI messages (see SynclavierKBI1MIDIOutputBatch).
+// Input is handed to the receive proc a packet at a time, on whatever thread the backend reads on.
+//
+// Backends:
+//  - SynclavierKBI1MIDITransportCoreMIDI.h     Mac OS Core MIDI
+//  - SynclavierKBI1MIDITransportALSA.h         Linux ALSA rawmidi. Experimental: not yet run against a KBI-1.
+//  - SynclavierKBI1MIDITransportLoopback.h     In-process pair of endpoints, for benchmarks and simulation
+//
+// Timestamps are host time (SynclavierKBI1HostTime.h). A timestamp of 0 means now.
+
+class SynclavierKBI1MIDITransport {
+public:
+    typedef unsigned char TransportByte;
+
+    // Called with bytes received from the KBI-1. Bytes are only valid during the call.
+    typedef void (*ReceiveProc)(const TransportByte* bytes, int length, uint64_t timeStamp, void* refCon);
+
+    inline SynclavierKBI1MIDITransport() {
+        receiveProc     = nullptr;
+        receiveRefCon   = nullptr;
+    }
+
+    virtual ~SynclavierKBI1MIDITransport() {}
+
+    virtual const char* name() const = 0;
+
+    // Connect to MIDI services. Returns false if MIDI services are not available.
+    virtual bool open() = 0;
+    virtual void close() {}
+
+    // Look for the KBI-1 if it is not connected. Returns true if it is connected.
+    virtual bool findDevice() = 0;
+    virtual bool connected() const = 0;
+
+    // Send a block of complete MIDI messages. Returns false if they could not be sent.
+    virtual bool send(const TransportByte* bytes, int length, uint64_t timeStamp) = 0;
+
+    // Whether send() can be given messages that use running status
+    virtual bool allowsRunningStatus() const = 0;
+
+    // Whether send() delivers at the time stamp it is given. If not, messages go out when sent.
+    virtual bool schedulesOutput() const {return false;}
+
+    // Set before the device is found
+    inline void setReceiveProc(ReceiveProc proc, void* refCon) {
+        receiveProc     = proc;
+        receiveRefCon   = refCon;
+    }
+
+    // SynclavierKBI1MIDIOutputBatch flush proc. refCon is the transport.
+    static inline void BatchFlushProc(const unsigned char* bytes, int length, void* refCon) {
+        ((SynclavierKBI1MIDITransport*) refCon)->send(bytes, length, 0);
+    }
+
+protected:
+    inline void deliver(const TransportByte* bytes, int length, uint64_t timeStamp) {
+        if (receiveProc)
+            receiveProc(bytes, length, timeStamp, receiveRefCon);
+    }
+
+    ReceiveProc receiveProc;
+    void*       receiveRefCon;
+};
+
+#endif
@@ -0,0 +1,222 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDITransportALSA.h
+//
+
+#ifndef SynclavierKBI1MIDITransportALSA_h
+#define SynclavierKBI1MIDITransportALSA_h
+
+#if defined(__linux__)
+
+#include <alloca.h>                                             // snd_rawmidi_info_alloca
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+#include <alsa/asoundlib.h>                                     // Link with -lasound
+
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1Log.h"
+#include "SynclavierKBI1HostTime.h"
+
+// Linux ALSA rawmidi backend.
+//
+// Looks through the sound cards for a rawmidi device whose name starts with the device name
+// ("Synclavier KBI-1" for the USB MIDI class driver) and opens its first subdevice for input and
+// output. rawmidi is a plain byte stream so running status can be used. Devices already open are
+// passed over, so one transport per unit attaches to each KBI-1 in turn.
+//
+// Input is read on a thread of our own and handed to the receive proc as it arrives, timestamped
+// on arrival. A read or poll error (e.g. the KBI-1 was unplugged) marks the device lost; the next
+// findDevice() closes it and looks again.
+//
+// Experimental. The Linux CI job builds it against libasound and scans for a device, but it has
+// not been run against a KBI-1. Use the -echo test (mainLinux.cpp) to try it.
+
+class SynclavierKBI1MIDITransportALSA : public SynclavierKBI1MIDITransport {
+public:
+    inline SynclavierKBI1MIDITransportALSA(const char* deviceName = "Synclavier KBI-1") {
+        midiDeviceName  = deviceName;
+        input           = nullptr;
+        output          = nullptr;
+
+        running.store(false);
+        lost.store(false);
+    }
+
+    ~SynclavierKBI1MIDITransportALSA() override {
+        close();
+    }
+
+    const char* name() const override {return "ALSA rawmidi";}
+
+    // Nothing to connect to until the device is found
+    bool open() override {
+        return true;
+    }
+
+    void close() override {
+        running.store(false);
+
+        if (reader.joinable())
+            reader.join();
+
+        if (input)
+            snd_rawmidi_close(input);
+
+        if (output)
+            snd_rawmidi_close(output);
+
+        input  = nullptr;
+        output = nullptr;
+
+        lost.store(false);
+    }
+
+    bool findDevice() override {
+        if (lost.load()) {
+            SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 lost.\n");
+            close();
+        }
+
+        if (input && output)
+            return true;
+
+        char hwName[32];
+
+        if (!findRawMidi(hwName, sizeof(hwName)))
+            return false;
+
+        if (snd_rawmidi_open(&input, &output, hwName, SND_RAWMIDI_NONBLOCK) < 0) {
+            input  = nullptr;
+            output = nullptr;
+            return false;
+        }
+
+        // Reads stay non-blocking and are polled for. Writes block until the driver has room.
+        snd_rawmidi_nonblock(output, 0);
+
+        SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 found %s.\n", hwName);
+
+        running.store(true);
+        reader = std::thread(&SynclavierKBI1MIDITransportALSA::readLoop, this);
+
+        return true;
+    }
+
+    bool connected() const override {
+        return input && output && !lost.load();
+    }
+
+    // rawmidi can not schedule, so the time stamp is ignored and the bytes go out now
+    bool send(const TransportByte* bytes, int length, uint64_t timeStamp) override {
+        if (!connected())
+            return false;
+
+        ssize_t written = snd_rawmidi_write(output, bytes, length);
+
+        if (written == -ENODEV) {
+            lost.store(true);
+            return false;
+        }
+
+        return written == length;
+    }
+
+    bool allowsRunningStatus() const override {return true;}
+
+private:
+    inline bool findRawMidi(char* hwName, size_t size) {
+        snd_rawmidi_info_t* info;
+        snd_rawmidi_info_alloca(&info);
+
+        size_t nameLength = strlen(midiDeviceName);
+        int    card       = -1;
+
+        while (snd_card_next(&card) == 0 && card >= 0) {
+            char      ctlName[16];
+            snd_ctl_t *ctl;
+
+            snprintf(ctlName, sizeof(ctlName), "hw:%d", card);
+
+            if (snd_ctl_open(&ctl, ctlName, 0) < 0)
+                continue;
+
+            int device = -1;
+
+            while (snd_ctl_rawmidi_next_device(ctl, &device) == 0 && device >= 0) {
+                snd_rawmidi_info_set_device   (info, device);
+                snd_rawmidi_info_set_subdevice(info, 0);
+                snd_rawmidi_info_set_stream   (info, SND_RAWMIDI_STREAM_INPUT);
+
+                if (snd_ctl_rawmidi_info(ctl, info) < 0)
+                    continue;
+
+                // Units already opened (by us or another process) have no subdevice free
+                if (snd_rawmidi_info_get_subdevices_avail(info) == 0)
+                    continue;
+
+                if (strncmp(snd_rawmidi_info_get_name(info), midiDeviceName, nameLength) == 0) {
+                    snprintf(hwName, size, "hw:%d,%d,0", card, device);
+                    snd_ctl_close(ctl);
+                    return true;
+                }
+            }
+
+            snd_ctl_close(ctl);
+        }
+
+        return false;
+    }
+
+    inline void readLoop() {
+        struct pollfd   fds[4];
+        unsigned char   buffer[256];
+
+        int count = snd_rawmidi_poll_descriptors(input, fds, 4);
+
+        while (running.load()) {
+            unsigned short revents = 0;
+
+            // Wake up now and then to notice close()
+            if (poll(fds, count, 100) <= 0)
+                continue;
+
+            if (snd_rawmidi_poll_descriptors_revents(input, fds, count, &revents) < 0 || (revents & (POLLERR | POLLHUP))) {
+                lost.store(true);
+                return;
+            }
+
+            if ((revents & POLLIN) == 0)
+                continue;
+
+            ssize_t length = snd_rawmidi_read(input, buffer, sizeof(buffer));
+
+            if (length == -EAGAIN)
+                continue;
+
+            if (length < 0) {
+                lost.store(true);
+                return;
+            }
+
+            deliver(buffer, (int) length, SynclavierKBI1HostTimeNow());
+        }
+    }
+
+    const char*         midiDeviceName;
+
+    snd_rawmidi_t*      input;
+    snd_rawmidi_t*      output;
+
+    std::thread         reader;
+    std::atomic<bool>   running;
+    std::atomic<bool>   lost;
+};
+
+#endif
+
+#endif
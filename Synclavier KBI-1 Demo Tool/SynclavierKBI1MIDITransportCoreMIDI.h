@@ -0,0 +1,376 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDITransportCoreMIDI.h
+//
+
+#ifndef SynclavierKBI1MIDITransportCoreMIDI_h
+#define SynclavierKBI1MIDITransportCoreMIDI_h
+
+#if defined(__APPLE__)
+
+#include <stdio.h>
+
+#include <CoreMIDI/CoreMIDI.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1HostTime.h"
+#include "SynclavierKBI1EndpointRegistry.h"
+#include "SynclavierKBI1Log.h"
+
+// Mac OS Core MIDI backend.
+//
+// Finds the KBI-1 source and destination endpoints by name. Input arrives on Core MIDI's
+// high-priority thread and is handed to the receive proc one MIDIPacket at a time.
+// Core MIDI does not allow running status within a MIDIPacket.
+//
+// Any number of transports may be open at once, one per KBI-1. They share one MIDI client and
+// each has its own ports. Each transport attaches to the first KBI-1 source no other transport
+// has, and to the destination of the same entity (the same USB interface).
+//
+// The endpoints in the MIDI setup are kept in a SynclavierKBI1EndpointRegistry shared by all
+// transports. It is filled once, when the first transport opens, and from then on follows Core
+// MIDI's notifications: objects added and removed, and names and online state changing. Names
+// are fetched only for endpoints that are new or changed, and the setup is never walked again.
+//
+// A transport whose endpoint went away (or went offline) lets go of both, forgets them and calls
+// its change proc. Transports still looking for a KBI-1 then look in the registry, and call their
+// change proc if they find one. Transports whose endpoints were not touched carry on as they were.
+// This happens on the thread that called open(), normally the main application thread.
+
+class SynclavierKBI1MIDITransportCoreMIDI : public SynclavierKBI1MIDITransport {
+public:
+    typedef void (*ChangeProc)(void* refCon);
+
+    typedef SynclavierKBI1EndpointRegistry Registry;
+
+    inline SynclavierKBI1MIDITransportCoreMIDI(CFStringRef clientName = CFSTR("KBI-1 Test Program"), CFStringRef deviceName = CFSTR("Synclavier KBI-1")) {
+        char text[Registry::kNameSize];
+
+        if (!CFStringGetCString(deviceName, text, sizeof(text), kCFStringEncodingUTF8))
+            text[0] = 0;
+
+        midiClientName  = clientName;
+        midiDeviceName  = Registry::name(text);
+        seenGeneration  = 0;
+
+        midiClientRef   = 0;
+        nextTransport   = nullptr;
+        midiOutputPort  = 0;
+        midiInputPort   = 0;
+        inputRef        = 0;
+        outputRef       = 0;
+        inputEntity     = 0;
+        lost            = false;
+
+        changeProc      = nullptr;
+        changeRefCon    = nullptr;
+    }
+
+    ~SynclavierKBI1MIDITransportCoreMIDI() override {
+        close();
+    }
+
+    const char* name() const override {return "Core MIDI";}
+
+    bool open() override {
+        if (midiClientRef)
+            return true;
+
+        if (sharedClientRef == 0) {
+            MIDIClientCreate(midiClientName, NotifyProc, nullptr, &sharedClientRef);
+
+            if (sharedClientRef == 0)
+                return false;
+
+            fillRegistry();
+        }
+
+        midiClientRef = sharedClientRef;
+        nextTransport = openTransports;
+        openTransports = this;
+
+        MIDIInputPortCreate (midiClientRef, midiClientName, ReadProc, this, &midiInputPort);
+        MIDIOutputPortCreate(midiClientRef, midiClientName, &midiOutputPort);
+
+        return midiInputPort != 0 && midiOutputPort != 0;
+    }
+
+    void close() override {
+        if (midiClientRef == 0)
+            return;
+
+        if (midiInputPort)
+            MIDIPortDispose(midiInputPort);
+
+        if (midiOutputPort)
+            MIDIPortDispose(midiOutputPort);
+
+        registry.release(this);
+
+        for (auto link = &openTransports; *link; link = &(*link)->nextTransport) {
+            if (*link == this) {
+                *link = nextTransport;
+                break;
+            }
+        }
+
+        // Last one out
+        if (openTransports == nullptr) {
+            MIDIClientDispose(sharedClientRef);
+            sharedClientRef = 0;
+
+            registry.clear();
+        }
+
+        midiClientRef  = midiInputPort = midiOutputPort = 0;
+        inputRef       = outputRef     = 0;
+        nextTransport  = nullptr;
+        seenGeneration = 0;
+    }
+
+    // Looks in the registry only when an endpoint has come free since the last look
+    bool findDevice() override {
+        if (connected() || midiClientRef == 0 || registry.generation() == seenGeneration)
+            return connected();
+
+        seenGeneration = registry.generation();
+
+        if (inputRef == 0) {
+            auto endpoint = registry.claim(Registry::KindSource, midiDeviceName, this);
+
+            if (endpoint) {
+                inputRef    = (MIDIEndpointRef) endpoint->handle;
+                inputEntity = endpoint->entity;
+                SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 input  found 0x%08x.\n", inputRef);
+
+                MIDIPortConnectSource(midiInputPort, inputRef, (void*) (long long) inputRef);
+            }
+        }
+
+        // The destination of the same entity as our source if there is one, so input and output are the same KBI-1
+        if (outputRef == 0) {
+            auto endpoint = registry.claim(Registry::KindDestination, midiDeviceName, this, inputRef ? inputEntity : 0);
+
+            if (endpoint) {
+                outputRef = (MIDIEndpointRef) endpoint->handle;
+                SynclavierKBI1Log(SynclavierKBI1LogInfo, "KBI-1 output found 0x%08x.\n", outputRef);
+            }
+        }
+
+        return connected();
+    }
+
+    bool connected() const override {
+        return inputRef != 0 && outputRef != 0;
+    }
+
+    // Sent as a single MIDIPacketList
+    bool send(const TransportByte* bytes, int length, uint64_t timeStamp) override {
+        alignas(MIDIPacketList) Byte buffer[SynclavierKBI1MIDIOutputBatch::kCapacity + sizeof(MIDIPacketList)];
+
+        if (outputRef == 0 || length > SynclavierKBI1MIDIOutputBatch::kCapacity)
+            return false;
+
+        MIDIPacketList* pktlist = (MIDIPacketList*) &buffer[0];
+        MIDIPacket*     pkt     = MIDIPacketListInit(pktlist);
+
+        pkt = MIDIPacketListAdd(pktlist, sizeof(buffer), pkt, timeStamp, length, bytes);
+
+        return pkt && MIDISend(midiOutputPort, outputRef, pktlist) == 0;
+    }
+
+    bool allowsRunningStatus() const override {return false;}
+
+    // MIDI services holds packets until their time stamp
+    bool schedulesOutput() const override {return true;}
+
+    // Called when a MIDI setup change takes the KBI-1 away, or brings one back
+    inline void setChangeProc(ChangeProc proc, void* refCon) {
+        changeProc      = proc;
+        changeRefCon    = refCon;
+    }
+
+private:
+    // Read an endpoint's unique ID, name and online state into the registry
+    static inline void addEndpoint(MIDIEndpointRef endpointRef, Registry::Kind kind) {
+        SInt32          uniqueID = 0, offline = 0;
+        MIDIEntityRef   entityRef = 0;
+        MIDIDeviceRef   deviceRef = 0;
+        CFStringRef     nameRef   = nullptr;
+        char            text[Registry::kNameSize] = "";
+
+        if (endpointRef == 0 || MIDIObjectGetIntegerProperty(endpointRef, kMIDIPropertyUniqueID, &uniqueID) != 0)
+            return;
+
+        // Virtual endpoints have no entity
+        if (MIDIEndpointGetEntity(endpointRef, &entityRef) == 0 && entityRef)
+            MIDIEntityGetDevice(entityRef, &deviceRef);
+
+        // The endpoint says it is offline if its entity or device is
+        MIDIObjectGetIntegerProperty(endpointRef, kMIDIPropertyOffline, &offline);
+
+        if (MIDIObjectGetStringProperty(endpointRef, kMIDIPropertyName, &nameRef) == 0 && nameRef) {
+            CFStringGetCString(nameRef, text, sizeof(text), kCFStringEncodingUTF8);
+            CFRelease(nameRef);
+        }
+
+        if (!registry.add(uniqueID, kind, endpointRef, entityRef, deviceRef, text, offline == 0))
+            SynclavierKBI1Log(SynclavierKBI1LogWarning, "Too many MIDI endpoints, %s not followed.\n", text);
+    }
+
+    static inline void addEntity(MIDIEntityRef entityRef) {
+        ItemCount sources      = MIDIEntityGetNumberOfSources(entityRef);
+        ItemCount destinations = MIDIEntityGetNumberOfDestinations(entityRef);
+
+        for (ItemCount which = 0; which < sources; which++)
+            addEndpoint(MIDIEntityGetSource(entityRef, which), Registry::KindSource);
+
+        for (ItemCount which = 0; which < destinations; which++)
+            addEndpoint(MIDIEntityGetDestination(entityRef, which), Registry::KindDestination);
+    }
+
+    static inline void addDevice(MIDIDeviceRef deviceRef) {
+        ItemCount entities = MIDIDeviceGetNumberOfEntities(deviceRef);
+
+        for (ItemCount which = 0; which < entities; which++)
+            addEntity(MIDIDeviceGetEntity(deviceRef, which));
+    }
+
+    // An object added, or its name or online state changed: read it and whatever endpoints it has
+    static inline void addObject(MIDIObjectRef objectRef, MIDIObjectType objectType) {
+        switch (objectType) {
+            case kMIDIObjectType_Source:        addEndpoint(objectRef, Registry::KindSource);       break;
+            case kMIDIObjectType_Destination:   addEndpoint(objectRef, Registry::KindDestination);  break;
+            case kMIDIObjectType_Entity:        addEntity(objectRef);                               break;
+            case kMIDIObjectType_Device:        addDevice(objectRef);                               break;
+            default:                                                                                break;
+        }
+    }
+
+    // An object removed. It can no longer be asked for its unique ID, so it is looked for by reference.
+    static inline void removeObject(MIDIObjectRef objectRef, MIDIObjectType objectType) {
+        if (objectType == kMIDIObjectType_Source || objectType == kMIDIObjectType_Destination) {
+            if (auto endpoint = registry.findHandle(objectRef))
+                registry.remove(endpoint->uniqueID);
+        }
+
+        else if (objectType == kMIDIObjectType_Entity || objectType == kMIDIObjectType_Device)
+            registry.removeParent(objectRef);
+    }
+
+    // The whole setup, once
+    static inline void fillRegistry() {
+        ItemCount sources      = MIDIGetNumberOfSources();
+        ItemCount destinations = MIDIGetNumberOfDestinations();
+
+        registry.clear();
+        registry.setLostProc(LostProc, nullptr);
+
+        for (ItemCount which = 0; which < sources; which++)
+            addEndpoint(MIDIGetSource(which), Registry::KindSource);
+
+        for (ItemCount which = 0; which < destinations; which++)
+            addEndpoint(MIDIGetDestination(which), Registry::KindDestination);
+    }
+
+    // A transport's endpoint went away. Let go of both and start over.
+    static void LostProc(const void* owner, const Registry::Endpoint& endpoint, void* refCon) {
+        auto transport = (SynclavierKBI1MIDITransportCoreMIDI*) owner;
+
+        if (transport->inputRef)
+            MIDIPortDisconnectSource(transport->midiInputPort, transport->inputRef);
+
+        registry.release(transport);
+
+        transport->inputRef = transport->outputRef = 0;
+        transport->seenGeneration = 0;
+        transport->lost = true;
+    }
+
+    // We are handed a MIDIPacketList by a callback from MIDI Services on its own thread.
+    static void ReadProc(const MIDIPacketList *pktlist, void *readProcRefCon, void *srcConnRefCon) {
+        auto&           transport = *(SynclavierKBI1MIDITransportCoreMIDI*) readProcRefCon;
+        MIDIEndpointRef endPoint  = (MIDIEndpointRef) (long long) srcConnRefCon;
+
+        // Not from KBI-1
+        if (endPoint != transport.inputRef)
+            return;
+
+        auto&   lst = *pktlist;
+        auto    ppk = &lst.packet[0];
+
+        for (UInt32 i=0; i<lst.numPackets; i++, ppk = MIDIPacketNext(ppk)) {
+            auto& packet = *ppk;
+
+            transport.deliver(&packet.data[0], packet.length, packet.timeStamp ? packet.timeStamp : SynclavierKBI1HostTimeNow());
+        }
+    }
+
+    // Follow the change in the registry. Transports that lost their KBI-1 are told, then those
+    // without one look for one.
+    static void NotifyProc(const MIDINotification *message, void *refCon) {
+        switch (message->messageID) {
+            case kMIDIMsgObjectAdded: {
+                auto& change = *(const MIDIObjectAddRemoveNotification*) message;
+                addObject(change.child, change.childType);
+                break;
+            }
+
+            case kMIDIMsgObjectRemoved: {
+                auto& change = *(const MIDIObjectAddRemoveNotification*) message;
+                removeObject(change.child, change.childType);
+                break;
+            }
+
+            case kMIDIMsgPropertyChanged: {
+                auto& change = *(const MIDIObjectPropertyChangeNotification*) message;
+
+                if (CFEqual(change.propertyName, kMIDIPropertyName) || CFEqual(change.propertyName, kMIDIPropertyOffline))
+                    addObject(change.object, change.objectType);
+
+                break;
+            }
+
+            // kMIDIMsgSetupChanged follows the ones above, which say what changed
+            default:
+                return;
+        }
+
+        for (auto transport = openTransports; transport; transport = transport->nextTransport) {
+            bool lost  = transport->lost;
+            bool found = !transport->connected() && transport->findDevice();
+
+            transport->lost = false;
+
+            if ((lost || found) && transport->changeProc)
+                transport->changeProc(transport->changeRefCon);
+        }
+    }
+
+    // Shared by all open transports
+    static inline Registry                              registry;
+    static inline MIDIClientRef                         sharedClientRef = 0;
+    static inline SynclavierKBI1MIDITransportCoreMIDI*  openTransports  = nullptr;
+
+    CFStringRef     midiClientName;
+    Registry::Name  midiDeviceName;
+
+    MIDIClientRef   midiClientRef;                              // MIDIClientRef for communicating with MIDI services. Shared.
+    MIDIPortRef     midiOutputPort;                             // MIDIPortRef for sending   data to   MIDIServices
+    MIDIPortRef     midiInputPort;                              // MIDIPortRef for receiving data from MIDIServices
+    MIDIEndpointRef inputRef;
+    MIDIEndpointRef outputRef;
+    uint64_t        inputEntity;                                // Entity of inputRef, for the paired destination
+    uint64_t        seenGeneration;                             // Registry generation last looked at
+    bool            lost;                                       // Endpoints went away in this notification
+
+    ChangeProc      changeProc;
+    void*           changeRefCon;
+
+    SynclavierKBI1MIDITransportCoreMIDI* nextTransport;         // List of open transports
+};
+
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDITransportLoopback.h
+//
+
+#ifndef SynclavierKBI1MIDITransportLoopback_h
+#define SynclavierKBI1MIDITransportLoopback_h
+
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1HostTime.h"
+
+// In-process loopback. Two endpoints wired back to back: what one sends the other receives.
+//
+// Delivery is zero-copy and synchronous. The peer's receive proc is called on the sender's
+// thread with the sender's own buffer, so a round trip costs two function calls. This lets the
+// protocol code be benchmarked and load-tested with no MIDI hardware or MIDI services.
+//
+//    SynclavierKBI1MIDILoopback loopback;
+//    loopback.host   - transport the host application uses
+//    loopback.device - transport a simulated KBI-1 uses
+
+class SynclavierKBI1MIDITransportLoopback : public SynclavierKBI1MIDITransport {
+public:
+    inline SynclavierKBI1MIDITransportLoopback() {
+        peer            = nullptr;
+        running         = true;
+        isOpen          = false;
+
+        sendCount       = 0;
+        byteCount       = 0;
+    }
+
+    const char* name() const override {return "Loopback";}
+
+    bool open() override {
+        isOpen = true;
+        return true;
+    }
+
+    void close() override {
+        isOpen = false;
+    }
+
+    bool findDevice() override {
+        return connected();
+    }
+
+    bool connected() const override {
+        return isOpen && peer && peer->isOpen;
+    }
+
+    bool send(const TransportByte* bytes, int length, uint64_t timeStamp) override {
+        if (!connected())
+            return false;
+
+        sendCount += 1;
+        byteCount += length;
+
+        peer->deliver(bytes, length, timeStamp ? timeStamp : SynclavierKBI1HostTimeNow());
+
+        return true;
+    }
+
+    bool allowsRunningStatus() const override {return running;}
+
+    // Simulate a byte-stream link (running status allowed) or a packet link like Core MIDI
+    inline void setAllowsRunningStatus(bool allow) {running = allow;}
+
+    // Statistics
+    inline long long sends() const {return sendCount;}
+    inline long long bytes() const {return byteCount;}
+
+private:
+    friend class SynclavierKBI1MIDILoopback;
+
+    SynclavierKBI1MIDITransportLoopback*    peer;
+    bool                                    running;
+    bool                                    isOpen;
+
+    long long                               sendCount;
+    long long                               byteCount;
+};
+
+class SynclavierKBI1MIDILoopback {
+public:
+    inline SynclavierKBI1MIDILoopback() {
+        host.peer   = &device;
+        device.peer = &host;
+    }
+
+    SynclavierKBI1MIDITransportLoopback host;
+    SynclavierKBI1MIDITransportLoopback device;
+};
+
+#endif
@@ -0,0 +1,155 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDITransportMetrics.h
+//
+
+#ifndef SynclavierKBI1MIDITransportMetrics_h
+#define SynclavierKBI1MIDITransportMetrics_h
+
+#include <stdio.h>
+
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1MIDIParser.h"
+#include "SynclavierKBI1HostTime.h"
+#include "SynclavierKBI1Metrics.h"
+
+// Counts everything going through another transport (SynclavierKBI1Metrics.h).
+//
+// Sits between the application and the real transport, as SynclavierKBI1MIDITransportTrace does,
+// and passes every call through. Per MIDI channel it counts messages and bytes each way, running
+// status included, and it times each send() call, which is where a MIDI service can block.
+//
+// Input is counted on the thread it arrives on and output on the thread that sends it. Each side's
+// metrics are on a cache line of their own.
+//
+//    metrics.attach(&coreMIDITransport);
+//    metrics.addTo(registry, "unit=\"1\"");
+//    device.attach(&metrics, 1);
+
+class SynclavierKBI1MIDITransportMetrics : public SynclavierKBI1MIDITransport {
+public:
+    // One direction. Bytes of system messages count in packets and bytes but not per channel.
+    struct Direction {
+        SynclavierKBI1Counter   packets;
+        SynclavierKBI1Counter   bytes;
+        SynclavierKBI1Counter   channelMessages[16];
+        SynclavierKBI1Counter   channelBytes[16];
+
+        uint8_t                 status;                         // Running status, 0 if none
+        uint8_t                 have;                           // Data bytes of the message so far
+    };
+
+    inline SynclavierKBI1MIDITransportMetrics() {
+        transport       = nullptr;
+
+        in.status       = 0;
+        in.have         = 0;
+        out.status      = 0;
+        out.have        = 0;
+    }
+
+    // Count traffic through inner. Call before the device is found.
+    inline void attach(SynclavierKBI1MIDITransport* inner) {
+        transport = inner;
+
+        transport->setReceiveProc(InnerReceiveProc, this);
+    }
+
+    // List the metrics. labels go on all of them, e.g. unit="1".
+    template <int kCapacity>
+    inline void addTo(SynclavierKBI1MetricsRegistry<kCapacity>& registry, const char* labels) {
+        registry.add(&in.packets,           "kbi1_midi_in_packets_total",   "Packets received from the KBI-1",              labels);
+        registry.add(&in.bytes,             "kbi1_midi_in_bytes_total",     "Bytes received from the KBI-1",                labels);
+        registry.add(in.channelMessages,    "kbi1_midi_in_messages_total",  "Channel messages received, per MIDI channel",  labels, 16, "channel");
+        registry.add(in.channelBytes,       "kbi1_midi_in_channel_bytes_total", "Bytes of channel messages received, per MIDI channel", labels, 16, "channel");
+
+        registry.add(&out.packets,          "kbi1_midi_out_packets_total",  "Blocks handed to the MIDI service",            labels);
+        registry.add(&out.bytes,            "kbi1_midi_out_bytes_total",    "Bytes sent to the KBI-1",                      labels);
+        registry.add(out.channelMessages,   "kbi1_midi_out_messages_total", "Channel messages sent, per MIDI channel",      labels, 16, "channel");
+        registry.add(out.channelBytes,      "kbi1_midi_out_channel_bytes_total", "Bytes of channel messages sent, per MIDI channel", labels, 16, "channel");
+        registry.add(&sendFailures,         "kbi1_midi_send_failures_total", "Blocks the MIDI service would not take",      labels);
+        registry.add(&sendTime,             "kbi1_midi_send_seconds",       "Time spent in each send call",                 labels);
+    }
+
+    const char* name() const override {return transport->name();}
+
+    bool open() override {return transport->open();}
+    void close() override {transport->close();}
+
+    bool findDevice() override {return transport->findDevice();}
+    bool connected() const override {return transport->connected();}
+
+    bool send(const TransportByte* bytes, int length, uint64_t timeStamp) override {
+        count(out, bytes, length);
+
+        uint64_t start = SynclavierKBI1HostTimeNow();
+        bool     sent  = transport->send(bytes, length, timeStamp);
+
+        sendTime.record(SynclavierKBI1HostTimeToNanos(SynclavierKBI1HostTimeNow() - start));
+
+        if (!sent)
+            sendFailures.add();
+
+        return sent;
+    }
+
+    bool allowsRunningStatus() const override {return transport->allowsRunningStatus();}
+    bool schedulesOutput() const override {return transport->schedulesOutput();}
+
+    // Any thread
+    inline const Direction&                 input()  const {return in;}
+    inline const Direction&                 output() const {return out;}
+    inline const SynclavierKBI1Histogram&   sends()  const {return sendTime;}
+
+private:
+    static void InnerReceiveProc(const TransportByte* bytes, int length, uint64_t timeStamp, void* refCon) {
+        auto& metrics = *(SynclavierKBI1MIDITransportMetrics*) refCon;
+
+        count(metrics.in, bytes, length);
+
+        metrics.deliver(bytes, length, timeStamp);
+    }
+
+    // Follows status through the bytes so messages sent with running status are counted too
+    static inline void count(Direction& direction, const TransportByte* bytes, int length) {
+        direction.packets.add();
+        direction.bytes.add(length);
+
+        for (int i = 0; i < length; i++) {
+            uint8_t byte = bytes[i];
+            auto&   info = SynclavierKBI1MIDIStatusTable[byte];
+
+            if (info.kind == SynclavierKBI1MIDIStatusRealTime)
+                continue;
+
+            if (info.kind == SynclavierKBI1MIDIStatusChannel) {
+                direction.status = byte;
+                direction.have   = 0;
+            }
+
+            else if (info.kind != SynclavierKBI1MIDIStatusData) {
+                direction.status = 0;
+                continue;
+            }
+
+            else if (direction.status == 0)
+                continue;
+
+            else if (++direction.have == SynclavierKBI1MIDIStatusTable[direction.status].dataBytes) {
+                direction.have = 0;
+                direction.channelMessages[direction.status & 0xF].add();
+            }
+
+            direction.channelBytes[direction.status & 0xF].add();
+        }
+    }
+
+    SynclavierKBI1MIDITransport*    transport;
+
+    alignas(64) Direction           in;                         // MIDI thread
+
+    alignas(64) Direction           out;                        // Application thread
+    SynclavierKBI1Counter           sendFailures;
+    SynclavierKBI1Histogram         sendTime;
+};
+
+#endif
@@ -0,0 +1,76 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDITransportTrace.h
+//
+
+#ifndef SynclavierKBI1MIDITransportTrace_h
+#define SynclavierKBI1MIDITransportTrace_h
+
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1Trace.h"
+
+// Records everything going through another transport in a trace (SynclavierKBI1Trace.h).
+//
+// Sits between the application and the real transport and passes every call through. Output is
+// recorded as it is handed to the transport, input as the transport hands it over, on the thread
+// it arrives on. Each direction has its own lane in the writer, so recording never waits.
+//
+//    trace.attach(&coreMIDITransport, &writer, unit);
+//    device.attach(&trace, unit);
+
+class SynclavierKBI1MIDITransportTrace : public SynclavierKBI1MIDITransport {
+public:
+    inline SynclavierKBI1MIDITransportTrace() {
+        transport   = nullptr;
+        writer      = nullptr;
+        unit        = 0;
+        inLane      = -1;
+        outLane     = -1;
+    }
+
+    // Record traffic through inner. Call before the device is found.
+    inline void attach(SynclavierKBI1MIDITransport* inner, SynclavierKBI1TraceWriter* traceWriter, int traceUnit) {
+        transport   = inner;
+        writer      = traceWriter;
+        unit        = traceUnit;
+        inLane      = writer ? writer->addLane() : -1;
+        outLane     = writer ? writer->addLane() : -1;
+
+        transport->setReceiveProc(InnerReceiveProc, this);
+    }
+
+    const char* name() const override {return transport->name();}
+
+    bool open() override {return transport->open();}
+    void close() override {transport->close();}
+
+    bool findDevice() override {return transport->findDevice();}
+    bool connected() const override {return transport->connected();}
+
+    bool send(const TransportByte* bytes, int length, uint64_t timeStamp) override {
+        if (writer)
+            writer->record(outLane, SynclavierKBI1TraceOut, unit, bytes, length, timeStamp);
+
+        return transport->send(bytes, length, timeStamp);
+    }
+
+    bool allowsRunningStatus() const override {return transport->allowsRunningStatus();}
+    bool schedulesOutput() const override {return transport->schedulesOutput();}
+
+private:
+    static void InnerReceiveProc(const TransportByte* bytes, int length, uint64_t timeStamp, void* refCon) {
+        auto& trace = *(SynclavierKBI1MIDITransportTrace*) refCon;
+
+        if (trace.writer)
+            trace.writer->record(trace.inLane, SynclavierKBI1TraceIn, trace.unit, bytes, length, timeStamp);
+
+        trace.deliver(bytes, length, timeStamp);
+    }
+
+    SynclavierKBI1MIDITransport*    transport;
+    SynclavierKBI1TraceWriter*      writer;
+    int                             unit;
+    int                             inLane;                     // MIDI thread
+    int                             outLane;                    // Application thread
+};
+
+#endif
@@ -0,0 +1,139 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1MIDITransportUMP.h
+//
+
+#ifndef SynclavierKBI1MIDITransportUMP_h
+#define SynclavierKBI1MIDITransportUMP_h
+
+#include <stdint.h>
+
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1UMP.h"
+
+// Universal MIDI Packets to and from a KBI-1 on a MIDI 1.0 transport (SynclavierKBI1UMP.h).
+//
+// For a host that works in MIDI 2.0. Sits on top of another transport, as
+// SynclavierKBI1MIDITransportMetrics does, but is handed and hands back 32-bit words rather
+// than bytes:
+//
+//  - Input     bytes from the KBI-1 are parsed and handed to the receive proc as UMP words,
+//              a packet's worth at a time, on the thread the inner transport reads on
+//  - Output    words given to send() are converted to MIDI 1.0 and handed to the inner
+//              transport as one block, with running status if it allows it
+//
+// With protocol 2 (the default) channel voice messages arrive as MIDI 2.0 messages: an NRPN is
+// one Assignable Controller message and values are scaled up to 16 and 32 bits. With protocol 1
+// they arrive as MIDI 1.0 messages in UMP words. send() takes either.
+//
+//    ump.attach(&coreMIDITransport);
+//    ump.setReceiveProc(HostReceiveProc, &host);
+//    ump.open();
+
+class SynclavierKBI1MIDITransportUMP {
+public:
+    // Called with whole UMP messages received from the KBI-1. Words are only valid during the call.
+    typedef void (*ReceiveProc)(const uint32_t* words, int count, uint64_t timeStamp, void* refCon);
+
+    inline SynclavierKBI1MIDITransportUMP(int group = 0) : inBatch(InFlushProc, this), fromMIDI1(inBatch, group),
+                                                            outBatch(OutFlushProc, this, false), toMIDI1(outBatch) {
+        transport       = nullptr;
+        receiveProc     = nullptr;
+        receiveRefCon   = nullptr;
+
+        inTimeStamp     = 0;
+        outTimeStamp    = 0;
+        sendFailed      = false;
+        sendFailures    = 0;
+    }
+
+    // Carry words over inner. Call before the device is found.
+    inline void attach(SynclavierKBI1MIDITransport* inner) {
+        transport = inner;
+
+        transport->setReceiveProc(InnerReceiveProc, this);
+        outBatch.setRunningStatus(transport->allowsRunningStatus());
+    }
+
+    inline void setReceiveProc(ReceiveProc proc, void* refCon) {
+        receiveProc     = proc;
+        receiveRefCon   = refCon;
+    }
+
+    // 2 for MIDI 2.0 channel voice messages in, 1 for MIDI 1.0 ones. Set before the device is found.
+    inline void setProtocol(int protocol) {fromMIDI1.setProtocol(protocol);}
+
+    inline const char* name() const {return transport->name();}
+
+    inline bool open() {return transport->open();}
+    inline void close() {transport->close();}
+
+    inline bool findDevice() {return transport->findDevice();}
+    inline bool connected() const {return transport->connected();}
+
+    // Send whole UMP messages. Returns false if they could not all be converted and sent.
+    inline bool send(const uint32_t* words, int count, uint64_t timeStamp) {
+        outTimeStamp = timeStamp;
+        sendFailed   = false;
+
+        int used = toMIDI1.convert(words, count);
+
+        outBatch.flush();
+
+        return used == count && !sendFailed;
+    }
+
+    // SynclavierKBI1UMPBatch flush proc. refCon is the transport.
+    static inline void BatchFlushProc(const uint32_t* words, int count, void* refCon) {
+        ((SynclavierKBI1MIDITransportUMP*) refCon)->send(words, count, 0);
+    }
+
+    // Statistics
+    inline long long received() const {return inBatch.words();}         // Words handed to the receive proc
+    inline long long sent()     const {return outBatch.bytes();}        // Bytes handed to the inner transport
+    inline long long dropped()  const {return toMIDI1.dropped();}       // Messages with no MIDI 1.0 form
+    inline long long failures() const {return sendFailures;}
+
+private:
+    static void InnerReceiveProc(const SynclavierKBI1MIDITransport::TransportByte* bytes, int length, uint64_t timeStamp, void* refCon) {
+        auto& ump = *(SynclavierKBI1MIDITransportUMP*) refCon;
+
+        ump.inTimeStamp = timeStamp;
+        ump.fromMIDI1.convert(bytes, length);
+        ump.inBatch.flush();
+    }
+
+    static void InFlushProc(const uint32_t* words, int count, void* refCon) {
+        auto& ump = *(SynclavierKBI1MIDITransportUMP*) refCon;
+
+        if (ump.receiveProc)
+            ump.receiveProc(words, count, ump.inTimeStamp, ump.receiveRefCon);
+    }
+
+    static void OutFlushProc(const SynclavierKBI1MIDIOutputBatch::BatchByte* bytes, int length, void* refCon) {
+        auto& ump = *(SynclavierKBI1MIDITransportUMP*) refCon;
+
+        if (!ump.transport->send(bytes, length, ump.outTimeStamp)) {
+            ump.sendFailed = true;
+            ump.sendFailures++;
+        }
+    }
+
+    SynclavierKBI1MIDITransport*    transport;
+    ReceiveProc                     receiveProc;
+    void*                           receiveRefCon;
+
+    // MIDI thread
+    SynclavierKBI1UMPBatch          inBatch;
+    SynclavierKBI1UMPFromMIDI1      fromMIDI1;
+    uint64_t                        inTimeStamp;
+
+    // Application thread
+    SynclavierKBI1MIDIOutputBatch   outBatch;
+    SynclavierKBI1UMPToMIDI1        toMIDI1;
+    uint64_t                        outTimeStamp;
+    bool                            sendFailed;
+    long long                       sendFailures;
+};
+
+#endif
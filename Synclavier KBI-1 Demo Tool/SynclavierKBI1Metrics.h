@@ -0,0 +1,323 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1Metrics.h
+//
+
+#ifndef SynclavierKBI1Metrics_h
+#define SynclavierKBI1Metrics_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+// Counters, gauges and histograms that a running process can be looked at through.
+//
+// Each metric has one thread that writes it, the thread whose work it counts (the MIDI thread
+// for input, the application thread for output). Writing is a relaxed load and store, with no
+// locked instruction and no cache line shared with another writer: owners keep the metrics each
+// thread writes together, on a cache line of their own (see SynclavierKBI1MIDITransportMetrics.h).
+// Any thread can read them at any time.
+//
+//  - SynclavierKBI1Counter     a count that only goes up
+//  - SynclavierKBI1Gauge       a level, such as how much is waiting in a queue
+//  - SynclavierKBI1Histogram   durations in fixed power-of-2 buckets from 1 usec to 1 sec, with their sum and largest
+//
+// Metrics are listed by name, help and labels in a SynclavierKBI1MetricsRegistry. The registry
+// writes them all out in the Prometheus text format: write() to a FILE, or writeFile(), which
+// replaces the file in one rename so a scraper (node_exporter's textfile collector, or cat) never
+// sees half of it. The process carries on while they are written; a snapshot may be a count or
+// two out between metrics but never tears a value.
+//
+// Nothing is allocated. Registering is done once, at start up, on one thread.
+
+class SynclavierKBI1Counter {
+public:
+    inline SynclavierKBI1Counter() {count.store(0);}
+
+    // Owning thread
+    inline void add(uint64_t n = 1) {count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);}
+    inline void set(uint64_t n)     {count.store(n, std::memory_order_relaxed);}     // From a count kept elsewhere on the same thread
+
+    // Any thread
+    inline uint64_t value() const {return count.load(std::memory_order_relaxed);}
+
+private:
+    std::atomic<uint64_t> count;
+};
+
+class SynclavierKBI1Gauge {
+public:
+    inline SynclavierKBI1Gauge() {level.store(0);}
+
+    inline void set(int64_t n) {level.store(n, std::memory_order_relaxed);}
+
+    inline int64_t value() const {return level.load(std::memory_order_relaxed);}
+
+private:
+    std::atomic<int64_t> level;
+};
+
+class SynclavierKBI1Histogram {
+public:
+    static const int kBuckets  = 21;                            // Up to 1 usec, 2 usec, ... 2^20 usec, then more
+    static const int kFirstLog = 10;                            // 2^10 ns, about 1 usec
+
+    inline SynclavierKBI1Histogram() {
+        for (auto& bucket : buckets)
+            bucket.store(0);
+
+        total.store(0);
+        largest.store(0);
+    }
+
+    // Owning thread
+    inline void record(uint64_t nanos) {
+        auto& bucket = buckets[bucketOf(nanos)];
+
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total.store(total.load(std::memory_order_relaxed) + nanos, std::memory_order_relaxed);
+
+        if (nanos > largest.load(std::memory_order_relaxed))
+            largest.store(nanos, std::memory_order_relaxed);
+    }
+
+    // Any thread. Bucket kBuckets is everything over the last bound.
+    inline uint64_t count(int bucket) const {return buckets[bucket].load(std::memory_order_relaxed);}
+    inline uint64_t sum()             const {return total.load(std::memory_order_relaxed);}             // ns
+    inline uint64_t max()             const {return largest.load(std::memory_order_relaxed);}           // ns
+
+    inline uint64_t count() const {
+        uint64_t n = 0;
+
+        for (auto& bucket : buckets)
+            n += bucket.load(std::memory_order_relaxed);
+
+        return n;
+    }
+
+    // Largest ns counted in bucket
+    static inline uint64_t bound(int bucket) {return 1ULL << (kFirstLog + bucket);}
+
+    // The bucket nanos is counted in
+    static inline int bucketOf(uint64_t nanos) {
+        if (nanos <= bound(0))
+            return 0;
+
+        int bucket = 64 - __builtin_clzll(nanos - 1) - kFirstLog;
+
+        return bucket < kBuckets ? bucket : kBuckets;
+    }
+
+    // ns below which fraction of the durations fall, to the bucket. An estimate, for reports.
+    inline uint64_t percentile(double fraction) const {
+        uint64_t n = count(), seen = 0;
+
+        for (int bucket = 0; bucket < kBuckets && n; bucket++) {
+            seen += count(bucket);
+
+            if (seen >= fraction * n)
+                return bound(bucket);
+        }
+
+        return max();
+    }
+
+private:
+    std::atomic<uint64_t> buckets[kBuckets + 1];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> largest;
+};
+
+template <int kCapacity = 512>
+class SynclavierKBI1MetricsRegistry {
+public:
+    static const int kLabelSize = 48;
+
+    inline SynclavierKBI1MetricsRegistry() {
+        entryCount = 0;
+        dropCount  = 0;
+    }
+
+    // count metrics in a row are listed as one, with index label 0 to count - 1, e.g. one per MIDI channel.
+    // labels are Prometheus labels for all of them, without the braces, e.g. unit="1", and are copied.
+    // name, help and index must outlive the registry.
+    inline bool add(const SynclavierKBI1Counter* counters, const char* name, const char* help, const char* labels = nullptr,
+                    int count = 1, const char* index = nullptr) {
+        return addEntry(KindCounter, counters, name, help, labels, count, index);
+    }
+
+    inline bool add(const SynclavierKBI1Gauge* gauges, const char* name, const char* help, const char* labels = nullptr,
+                    int count = 1, const char* index = nullptr) {
+        return addEntry(KindGauge, gauges, name, help, labels, count, index);
+    }
+
+    inline bool add(const SynclavierKBI1Histogram* histogram, const char* name, const char* help, const char* labels = nullptr) {
+        return addEntry(KindHistogram, histogram, name, help, labels, 1, nullptr);
+    }
+
+    // Write every metric in the Prometheus text format, metrics of the same name together
+    inline void write(FILE* file) const {
+        for (int first = 0; first < entryCount; first++) {
+            if (listedBefore(first))
+                continue;
+
+            const Entry& family = entries[first];
+
+            fprintf(file, "# HELP %s %s\n", family.name, family.help);
+            fprintf(file, "# TYPE %s %s\n", family.name, family.kind == KindCounter ? "counter" : family.kind == KindGauge ? "gauge" : "histogram");
+
+            for (int which = first; which < entryCount; which++) {
+                if (strcmp(entries[which].name, family.name) == 0)
+                    writeEntry(file, entries[which]);
+            }
+        }
+    }
+
+    // Write to path + ".tmp", then rename it over path. Returns false if it could not be written.
+    inline bool writeFile(const char* path) const {
+        char temporary[1024];
+
+        if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int) sizeof(temporary))
+            return false;
+
+        FILE* file = fopen(temporary, "w");
+
+        if (!file)
+            return false;
+
+        write(file);
+
+        bool written = ferror(file) == 0;
+
+        if (fclose(file) != 0 || !written || rename(temporary, path) != 0) {
+            remove(temporary);
+            return false;
+        }
+
+        return true;
+    }
+
+    inline int size()     const {return entryCount;}
+    inline int dropped()  const {return dropCount;}             // add() calls over capacity
+
+private:
+    enum Kind {
+        KindCounter,
+        KindGauge,
+        KindHistogram,
+    };
+
+    struct Entry {
+        Kind        kind;
+        const void* metric;
+        const char* name;
+        const char* help;
+        char        labels[kLabelSize];
+        int         count;
+        const char* index;
+    };
+
+    inline bool addEntry(Kind kind, const void* metric, const char* name, const char* help, const char* labels, int count, const char* index) {
+        if (entryCount == kCapacity) {
+            dropCount++;
+            return false;
+        }
+
+        Entry& entry = entries[entryCount++];
+
+        entry.kind   = kind;
+        entry.metric = metric;
+        entry.name   = name;
+        entry.help   = help ? help : "";
+        entry.count  = count > 1 ? count : 1;
+        entry.index  = index;
+
+        snprintf(entry.labels, sizeof(entry.labels), "%s", labels ? labels : "");
+
+        return true;
+    }
+
+    inline bool listedBefore(int which) const {
+        for (int earlier = 0; earlier < which; earlier++) {
+            if (strcmp(entries[earlier].name, entries[which].name) == 0)
+                return true;
+        }
+
+        return false;
+    }
+
+    // name{labels,index="n",extra} - the braces are left out if there are no labels
+    static inline void writeName(FILE* file, const char* name, const char* suffix, const Entry& entry, int element, const char* extra) {
+        const char* separator = "";
+
+        fprintf(file, "%s%s", name, suffix);
+
+        if (!entry.labels[0] && !entry.index && !extra)
+            return;
+
+        fputc('{', file);
+
+        if (entry.labels[0]) {
+            fputs(entry.labels, file);
+            separator = ",";
+        }
+
+        if (entry.index) {
+            fprintf(file, "%s%s=\"%d\"", separator, entry.index, element);
+            separator = ",";
+        }
+
+        if (extra)
+            fprintf(file, "%s%s", separator, extra);
+
+        fputc('}', file);
+    }
+
+    static inline void writeEntry(FILE* file, const Entry& entry) {
+        for (int element = 0; element < entry.count; element++) {
+            if (entry.kind == KindCounter) {
+                writeName(file, entry.name, "", entry, element, nullptr);
+                fprintf(file, " %llu\n", (unsigned long long) ((const SynclavierKBI1Counter*) entry.metric)[element].value());
+            }
+
+            else if (entry.kind == KindGauge) {
+                writeName(file, entry.name, "", entry, element, nullptr);
+                fprintf(file, " %lld\n", (long long) ((const SynclavierKBI1Gauge*) entry.metric)[element].value());
+            }
+
+            else
+                writeHistogram(file, entry, *(const SynclavierKBI1Histogram*) entry.metric);
+        }
+    }
+
+    // Buckets are cumulative, bounds in seconds. The count is the +Inf bucket, so the two always agree.
+    static inline void writeHistogram(FILE* file, const Entry& entry, const SynclavierKBI1Histogram& histogram) {
+        uint64_t cumulative = 0;
+        char     bound[40];
+
+        for (int bucket = 0; bucket <= SynclavierKBI1Histogram::kBuckets; bucket++) {
+            cumulative += histogram.count(bucket);
+
+            if (bucket < SynclavierKBI1Histogram::kBuckets)
+                snprintf(bound, sizeof(bound), "le=\"%.9g\"", SynclavierKBI1Histogram::bound(bucket) * 1e-9);
+            else
+                snprintf(bound, sizeof(bound), "le=\"+Inf\"");
+
+            writeName(file, entry.name, "_bucket", entry, 0, bound);
+            fprintf(file, " %llu\n", (unsigned long long) cumulative);
+        }
+
+        writeName(file, entry.name, "_sum", entry, 0, nullptr);
+        fprintf(file, " %.9g\n", histogram.sum() * 1e-9);
+
+        writeName(file, entry.name, "_count", entry, 0, nullptr);
+        fprintf(file, " %llu\n", (unsigned long long) cumulative);
+    }
+
+    Entry   entries[kCapacity];
+    int     entryCount;
+    int     dropCount;
+};
+
+#endif
@@ -0,0 +1,83 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1NRPNAssembler.h
+//
+
+#ifndef SynclavierKBI1NRPNAssembler_h
+#define SynclavierKBI1NRPNAssembler_h
+
+#include "SynclavierKBI1MIDIProtocol.h"
+
+// Puts NRPN messages from the KBI-1 back together.
+//
+// Feed it every controller message received on the NRPN channel. All 4 parts must arrive and
+// arrive in order (param MSB, param LSB, data MSB, data LSB) with no other controller movement
+// in between. This prevents NRPNs with dropped parts from being handled.
+
+class SynclavierKBI1NRPNAssembler {
+public:
+    inline SynclavierKBI1NRPNAssembler() {
+        reset();
+    }
+
+    inline void reset() {
+        midiParamMSB    = midiParamLSB    = midiDataMSB    = midiDataLSB    = 0;
+        midiParamMSBSeq = midiParamLSBSeq = midiDataMSBSeq = midiDataLSBSeq = -1;
+
+        midiReceivedSequence = 0;
+        rejectedCount        = 0;
+    }
+
+    // Returns true when a complete NRPN has been received. param() and value() then hold it.
+    inline bool controller(int number, int data) {
+        bool midiNRPNReceived = false;
+
+        if (number == SynclavierKBI1MIDIProtocolNRPN::nrpnMSB) {
+            midiParamMSB      = data;
+            midiParamMSBSeq   = midiReceivedSequence;
+        }
+        else if (number == SynclavierKBI1MIDIProtocolNRPN::nrpnLSB) {
+            midiParamLSB      = data;
+            midiParamLSBSeq   = midiReceivedSequence;
+        }
+        else if (number == SynclavierKBI1MIDIProtocolNRPN::dataMSB) {
+            midiDataMSB      = data;
+            midiDataMSBSeq   = midiReceivedSequence;
+        }
+        else if (number == SynclavierKBI1MIDIProtocolNRPN::dataLSB) {
+            midiDataLSB      = data;
+            midiDataLSBSeq   = midiReceivedSequence;
+            midiNRPNReceived = true;
+        }
+
+        // One more processed
+        midiReceivedSequence++;
+
+        if (!midiNRPNReceived)
+            return false;
+
+        // Require all 4 packets to be sent and sent in order.
+        if ((midiParamMSBSeq == midiReceivedSequence-4)
+        &&  (midiParamLSBSeq == midiReceivedSequence-3)
+        &&  (midiDataMSBSeq  == midiReceivedSequence-2)
+        &&  (midiDataLSBSeq  == midiReceivedSequence-1))
+            return true;
+
+        rejectedCount++;
+
+        return false;
+    }
+
+    inline int param() const {return midiParamMSB<<7 | midiParamLSB;}
+    inline int value() const {return midiDataMSB <<7 | midiDataLSB;}
+
+    // Data LSBs that arrived without the 3 parts before them
+    inline long long rejected() const {return rejectedCount;}
+
+private:
+    int         midiParamMSB,    midiParamLSB,    midiDataMSB,    midiDataLSB;
+    int         midiParamMSBSeq, midiParamLSBSeq, midiDataMSBSeq, midiDataLSBSeq;
+    int         midiReceivedSequence;
+    long long   rejectedCount;
+};
+
+#endif
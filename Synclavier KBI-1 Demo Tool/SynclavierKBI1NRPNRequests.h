@@ -0,0 +1,402 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1NRPNRequests.h
+//
+
+#ifndef SynclavierKBI1NRPNRequests_h
+#define SynclavierKBI1NRPNRequests_h
+
+#include <stdint.h>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1HostTime.h"
+
+// Outstanding NRPN queries to the KBI-1 and the replies that answer them.
+//
+// The KBI-1 answers a query with an NRPN of the same parameter number (WhoAreYou is answered
+// by HereIAm, Status by Status, Echo by Echo). Each query sent through the table is held until
+// a reply with its parameter arrives, or its deadline passes. Any number of queries may be in
+// flight, for the same or different parameters. Replies for a parameter answer its queries
+// oldest first. A query may also name the reply value it expects (Echo sends back the value it
+// was given) so a lost reply does not shift every later reply onto the wrong query.
+//
+// A query whose deadline passes is sent again, up to its number of retries, each time waiting
+// twice as long as before. When it is answered or out of retries its completion proc is called.
+//
+// Round-trip times are kept in a histogram per parameter. Only queries answered on their first
+// try are counted, since a reply to a query sent more than once can not be matched to one send.
+//
+// Times are host time (SynclavierKBI1HostTime.h). A query's round trip runs from when it is
+// put in the output batch to the time stamp of the packet that brings the reply, so it also
+// includes any wait for the batch to be flushed.
+//
+// Nothing is allocated. All calls must be made on one thread, normally the main application thread.
+
+// Round-trip times. Log scale, 4 buckets per power of 2 so a percentile is within 19%.
+class SynclavierKBI1RTTHistogram {
+public:
+    static const int kSubBits = 2;
+    static const int kBuckets = 64 << kSubBits;
+
+    inline SynclavierKBI1RTTHistogram() {
+        clear();
+    }
+
+    inline void clear() {
+        for (int bucket = 0; bucket < kBuckets; bucket++)
+            counts[bucket] = 0;
+
+        sampleCount = 0;
+        minimum     = UINT64_MAX;
+        maximum     = 0;
+    }
+
+    inline void record(uint64_t nanos) {
+        counts[bucketFor(nanos)]++;
+        sampleCount++;
+
+        if (nanos < minimum) minimum = nanos;
+        if (nanos > maximum) maximum = nanos;
+    }
+
+    // ns at or below which fraction of the samples lie. The top of the bucket it falls in.
+    inline uint64_t percentile(double fraction) const {
+        if (sampleCount == 0)
+            return 0;
+
+        long long rank = (long long) (fraction * (sampleCount - 1)) + 1;
+        long long seen = 0;
+
+        for (int bucket = 0; bucket < kBuckets; bucket++) {
+            seen += counts[bucket];
+
+            if (seen >= rank) {
+                uint64_t top = bucketTop(bucket);
+
+                return top < maximum ? top : maximum;
+            }
+        }
+
+        return maximum;
+    }
+
+    inline long long samples() const {return sampleCount;}
+    inline uint64_t  min()     const {return sampleCount ? minimum : 0;}
+    inline uint64_t  max()     const {return maximum;}
+
+private:
+    static inline int bucketFor(uint64_t nanos) {
+        if (nanos < (1 << kSubBits))
+            return (int) nanos;
+
+        int octave = 63 - __builtin_clzll(nanos);
+        int sub    = (int) (nanos >> (octave - kSubBits)) & ((1 << kSubBits) - 1);
+
+        return ((octave - kSubBits + 1) << kSubBits) + sub;
+    }
+
+    // Largest value that falls in bucket
+    static inline uint64_t bucketTop(int bucket) {
+        if (bucket < (1 << kSubBits))
+            return bucket;
+
+        int      octave = (bucket >> kSubBits) + kSubBits - 1;
+        uint64_t sub    = bucket & ((1 << kSubBits) - 1);
+        uint64_t base   = ((uint64_t) 1 << octave) + (sub << (octave - kSubBits));
+
+        return base + ((uint64_t) 1 << (octave - kSubBits)) - 1;
+    }
+
+    long long   counts[kBuckets];
+    long long   sampleCount;
+    uint64_t    minimum;
+    uint64_t    maximum;
+};
+
+class SynclavierKBI1NRPNRequests {
+public:
+    static const int kCapacity  = 32;                           // Queries in flight
+    static const int kParams    = 8;                            // Parameters with statistics kept. Covers SynclavierKBI1MIDIProtocol.h.
+    static const int kAnyValue  = -1;
+
+    enum Outcome {
+        Answered,
+        TimedOut,
+        Cancelled,
+    };
+
+    struct Result {
+        uint32_t    id;
+        int         param;
+        int         value;                                      // Sent
+        int         reply;                                      // Value of the reply when answered
+        Outcome     outcome;
+        int         attempts;                                   // Times sent
+        uint64_t    roundTrip;                                  // ns from the last send to the reply, when answered
+    };
+
+    // Called when a query is answered, runs out of retries or is cancelled
+    typedef void (*CompletionProc)(const Result& result, void* refCon);
+
+    struct ParamStats {
+        long long                   sent;                       // Queries, not counting retries
+        long long                   retries;
+        long long                   answered;
+        long long                   timedOut;
+        long long                   unmatched;                  // Replies with no query waiting for them
+        SynclavierKBI1RTTHistogram  roundTrips;
+    };
+
+    inline SynclavierKBI1NRPNRequests(SynclavierKBI1MIDIOutputBatch* outputBatch = nullptr, int outputChannel = SynclavierKBI1MIDIProtocolNRPNChannel) {
+        batch       = outputBatch;
+        channel     = outputChannel;
+        count       = 0;
+        nextId      = 1;
+        sequence    = 0;
+        full        = 0;
+
+        for (auto& request : requests)
+            request.id = 0;
+
+        for (auto& stats : paramStats)
+            clearStats(stats);
+    }
+
+    inline void setBatch(SynclavierKBI1MIDIOutputBatch* outputBatch) {batch = outputBatch;}
+
+    // Send a query. timeout is ns to wait for the first try. expect is the reply value wanted,
+    // or kAnyValue. Returns an id for cancel(), or 0 if the table is full.
+    inline uint32_t send(int param, int value, uint64_t timeout, int retries = 0, CompletionProc proc = nullptr, void* refCon = nullptr, int expect = kAnyValue) {
+        Request* request = nullptr;
+
+        for (auto& slot : requests) {
+            if (slot.id == 0) {
+                request = &slot;
+                break;
+            }
+        }
+
+        if (!request) {
+            full++;
+            return 0;
+        }
+
+        uint64_t now = SynclavierKBI1HostTimeNow();
+
+        if (nextId == 0)                                        // 0 is a free slot
+            nextId = 1;
+
+        request->id         = nextId++;
+        request->sequence   = sequence++;
+        request->param      = param;
+        request->value      = value;
+        request->expect     = expect;
+        request->timeout    = SynclavierKBI1NanosToHostTime(timeout);
+        request->retries    = retries;
+        request->attempts   = 0;
+        request->proc       = proc;
+        request->refCon     = refCon;
+
+        count++;
+        statsFor(param).sent++;
+
+        transmit(*request, now);
+
+        return request->id;
+    }
+
+    // Offer an NRPN received from the KBI-1. timeStamp is the host time the packet arrived.
+    // Returns true if it answered a query.
+    inline bool reply(int param, int value, uint64_t timeStamp) {
+        Request* oldest = nullptr;
+
+        if (count != 0) {
+            for (auto& request : requests) {
+                if (request.id == 0 || request.param != param)
+                    continue;
+
+                if (request.expect != kAnyValue && request.expect != value)
+                    continue;
+
+                if (!oldest || (int32_t) (request.sequence - oldest->sequence) < 0)
+                    oldest = &request;
+            }
+        }
+
+        auto& stats = statsFor(param);
+
+        if (!oldest) {
+            stats.unmatched++;
+            return false;
+        }
+
+        Result result = resultFor(*oldest, Answered);
+
+        result.reply     = value;
+        result.roundTrip = timeStamp > oldest->sentTime ? SynclavierKBI1HostTimeToNanos(timeStamp - oldest->sentTime) : 0;
+
+        stats.answered++;
+
+        if (oldest->attempts == 1)
+            stats.roundTrips.record(result.roundTrip);
+
+        complete(*oldest, result);
+
+        return true;
+    }
+
+    // Retry or give up on queries whose deadline has passed. Call when next() is due.
+    inline void expire(uint64_t now) {
+        if (count == 0)
+            return;
+
+        for (auto& request : requests) {
+            if (request.id == 0 || request.deadline > now)
+                continue;
+
+            if (request.attempts <= request.retries) {
+                statsFor(request.param).retries++;
+
+                request.timeout *= 2;
+                transmit(request, now);
+                continue;
+            }
+
+            statsFor(request.param).timedOut++;
+
+            complete(request, resultFor(request, TimedOut));
+        }
+    }
+
+    inline bool cancel(uint32_t id) {
+        for (auto& request : requests) {
+            if (id != 0 && request.id == id) {
+                complete(request, resultFor(request, Cancelled));
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Cancel everything (e.g. the KBI-1 went away)
+    inline void cancelAll() {
+        for (auto& request : requests) {
+            if (request.id != 0)
+                complete(request, resultFor(request, Cancelled));
+        }
+    }
+
+    // Host time of the earliest deadline. 0 if nothing is in flight.
+    inline uint64_t next() const {
+        uint64_t earliest = 0;
+
+        for (auto& request : requests) {
+            if (request.id != 0 && (earliest == 0 || request.deadline < earliest))
+                earliest = request.deadline;
+        }
+
+        return earliest;
+    }
+
+    // Whether a query for param is in flight
+    inline bool pending(int param) const {
+        for (auto& request : requests) {
+            if (request.id != 0 && request.param == param)
+                return true;
+        }
+
+        return false;
+    }
+
+    inline int  inFlight() const {return count;}
+    inline bool empty()    const {return count == 0;}
+
+    // Statistics. Parameters from kParams up share the last entry.
+    inline const ParamStats& stats(int param) const {return paramStats[param >= 0 && param < kParams ? param : kParams - 1];}
+    inline long long         rejected()       const {return full;}     // Queries not sent because the table was full
+
+    inline void clearStatistics() {
+        for (auto& stats : paramStats)
+            clearStats(stats);
+
+        full = 0;
+    }
+
+private:
+    struct Request {
+        uint32_t        id;                                     // 0 if the slot is free
+        uint32_t        sequence;                               // Order sent
+        int             param;
+        int             value;
+        int             expect;
+        int             retries;
+        int             attempts;
+        uint64_t        timeout;                                // Host time to wait for this try
+        uint64_t        sentTime;                               // Host time of the last try
+        uint64_t        deadline;
+        CompletionProc  proc;
+        void*           refCon;
+    };
+
+    inline void transmit(Request& request, uint64_t now) {
+        request.attempts++;
+        request.sentTime = now;
+        request.deadline = now + request.timeout;
+
+        if (batch)
+            batch->sendNRPN(request.param, request.value, channel);
+    }
+
+    inline Result resultFor(const Request& request, Outcome outcome) const {
+        Result result;
+
+        result.id        = request.id;
+        result.param     = request.param;
+        result.value     = request.value;
+        result.reply     = 0;
+        result.outcome   = outcome;
+        result.attempts  = request.attempts;
+        result.roundTrip = 0;
+
+        return result;
+    }
+
+    // Free the slot before calling the proc so the proc may send another query
+    inline void complete(Request& request, const Result& result) {
+        auto proc   = request.proc;
+        auto refCon = request.refCon;
+
+        request.id = 0;
+        count--;
+
+        if (proc)
+            proc(result, refCon);
+    }
+
+    inline ParamStats& statsFor(int param) {
+        return paramStats[param >= 0 && param < kParams ? param : kParams - 1];
+    }
+
+    static inline void clearStats(ParamStats& stats) {
+        stats.sent      = 0;
+        stats.retries   = 0;
+        stats.answered  = 0;
+        stats.timedOut  = 0;
+        stats.unmatched = 0;
+        stats.roundTrips.clear();
+    }
+
+    SynclavierKBI1MIDIOutputBatch*  batch;
+    int                             channel;
+
+    Request                         requests[kCapacity];
+    int                             count;
+    uint32_t                        nextId;
+    uint32_t                        sequence;
+
+    ParamStats                      paramStats[kParams];
+    long long                       full;
+};
+
+#endif
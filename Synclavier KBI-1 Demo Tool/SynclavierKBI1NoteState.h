@@ -0,0 +1,282 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1NoteState.h
+//
+
+#ifndef SynclavierKBI1NoteState_h
+#define SynclavierKBI1NoteState_h
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1InputDecoder.h"
+
+// Which keys are down and which notes are sounding, given the sustain and hold pedals.
+//
+// Notes are kept in 128-bit sets (SynclavierKBI1NoteSet), one bit per key, held in a GCC/Clang
+// vector so each operation on a set is one SSE or NEON instruction. Nothing loops over notes:
+//
+//  - keys          keys that are down
+//  - sustained     keys let go of while the sustain pedal (0x40) was down
+//  - latched       keys that were down when the hold pedal (0x42, sostenuto) went down
+//
+//  sounding = keys | sustained | latched
+//
+// Lifting the sustain pedal releases sustained & ~(keys | latched) in one go; lifting the hold
+// pedal releases latched & ~(keys | sustained). The release proc is handed the whole set.
+//
+// The portamento, repeat, arpeggiate and punch-in pedals (0x41, 0x43 - 0x45) are only tracked.
+//
+// Notes and pedals come from the input decoder on the MIDI thread. After each one the sounding
+// set is published with the pedals, so another thread (the audio thread, once per block) can read
+// it with sounding() at the cost of a few loads and a sequence check, without locks.
+
+// Vector extension: & | ^ ~ work on both 64-bit halves at once
+typedef uint64_t SynclavierKBI1NoteBits __attribute__((vector_size(16)));
+
+struct SynclavierKBI1NoteSet {
+    SynclavierKBI1NoteBits bits;
+
+    static inline SynclavierKBI1NoteSet none()          {return {SynclavierKBI1NoteBits{0, 0}};}
+    static inline SynclavierKBI1NoteSet all()           {return {SynclavierKBI1NoteBits{~0ULL, ~0ULL}};}
+    static inline SynclavierKBI1NoteSet of(int note)    {SynclavierKBI1NoteSet set = none(); set.set(note); return set;}
+
+    inline bool test(int note) const {return (bits[(note >> 6) & 1] >> (note & 63)) & 1;}
+    inline void set(int note)        {bits[(note >> 6) & 1] |=  1ULL << (note & 63);}
+    inline void reset(int note)      {bits[(note >> 6) & 1] &= ~(1ULL << (note & 63));}
+
+    inline bool empty() const {return (bits[0] | bits[1]) == 0;}
+    inline int  count() const {return __builtin_popcountll(bits[0]) + __builtin_popcountll(bits[1]);}
+
+    // Lowest and highest note in the set. -1 if it is empty.
+    inline int lowest() const {
+        return bits[0] ? __builtin_ctzll(bits[0]) : bits[1] ? 64 + __builtin_ctzll(bits[1]) : -1;
+    }
+
+    inline int highest() const {
+        return bits[1] ? 127 - __builtin_clzll(bits[1]) : bits[0] ? 63 - __builtin_clzll(bits[0]) : -1;
+    }
+
+    // Call proc(note) for each note in the set, lowest first
+    template <typename PROC>
+    inline void forEach(PROC proc) const {
+        for (int word = 0; word < 2; word++) {
+            for (uint64_t remaining = bits[word]; remaining; remaining &= remaining - 1)
+                proc(word * 64 + __builtin_ctzll(remaining));
+        }
+    }
+
+    inline SynclavierKBI1NoteSet operator|(const SynclavierKBI1NoteSet& other) const {return {bits | other.bits};}
+    inline SynclavierKBI1NoteSet operator&(const SynclavierKBI1NoteSet& other) const {return {bits & other.bits};}
+    inline SynclavierKBI1NoteSet operator^(const SynclavierKBI1NoteSet& other) const {return {bits ^ other.bits};}
+    inline SynclavierKBI1NoteSet operator~() const                                   {return {~bits};}
+
+    inline bool operator==(const SynclavierKBI1NoteSet& other) const {
+        SynclavierKBI1NoteBits diff = bits ^ other.bits;
+
+        return (diff[0] | diff[1]) == 0;
+    }
+
+    inline bool operator!=(const SynclavierKBI1NoteSet& other) const {return !(*this == other);}
+};
+
+class SynclavierKBI1NoteState {
+public:
+    typedef SynclavierKBI1InputDecoder::EventProc EventProc;
+
+    // Called with notes that stopped sounding, on the thread that handles input
+    typedef void (*ReleaseProc)(const SynclavierKBI1NoteSet& released, uint64_t timeStamp, void* refCon);
+
+    // Pedal controller numbers, from SynclavierKBI1MIDIProtocol.h
+    enum Pedal {
+        PedalSustain    = 0x40,
+        PedalPortamento = 0x41,
+        PedalHold       = 0x42,
+        PedalRepeat     = 0x43,
+        PedalArpeggiate = 0x44,
+        PedalPunchIn    = 0x45,
+    };
+
+    inline SynclavierKBI1NoteState() {
+        proc            = nullptr;
+        refCon          = nullptr;
+        releaseProc     = nullptr;
+        releaseRefCon   = nullptr;
+
+        publishedSequence.store(0);
+        published[0].store(0);
+        published[1].store(0);
+        publishedPedals.store(0);
+
+        reset();
+    }
+
+    // Take notes and pedals from decoder
+    inline void attach(SynclavierKBI1InputDecoder& decoder) {
+        decoder.setProc(SynclavierKBI1InputNote,  InputProc, this);
+        decoder.setProc(SynclavierKBI1InputPedal, InputProc, this);
+    }
+
+    // Where note and pedal events go once the state has been updated
+    inline void setProc(EventProc eventProc, void* eventRefCon) {
+        proc    = eventProc;
+        refCon  = eventRefCon;
+    }
+
+    inline void setReleaseProc(ReleaseProc proc, void* refCon) {
+        releaseProc     = proc;
+        releaseRefCon   = refCon;
+    }
+
+    // All keys up, all pedals up, nothing sounding. Nothing is released.
+    inline void reset() {
+        keySet          = SynclavierKBI1NoteSet::none();
+        sustainedSet    = SynclavierKBI1NoteSet::none();
+        latchedSet      = SynclavierKBI1NoteSet::none();
+        pedalBits       = 0;
+
+        publish();
+    }
+
+    // ---- Input thread ----
+
+    static void InputProc(const SynclavierKBI1InputEvent& event, void* refCon) {
+        auto& state = *(SynclavierKBI1NoteState*) refCon;
+
+        state.input(event);
+
+        if (state.proc)
+            state.proc(event, state.refCon);
+    }
+
+    inline void input(const SynclavierKBI1InputEvent& event) {
+        if (event.type == SynclavierKBI1InputNote) {
+            if (event.value)
+                noteOn(event.number);
+            else
+                noteOff(event.number, event.timeStamp);
+        }
+
+        else if (event.type == SynclavierKBI1InputPedal)
+            pedal(event.number, event.value >= 64, event.timeStamp);
+    }
+
+    inline void noteOn(int note) {
+        keySet.set(note & 0x7F);
+        publish();
+    }
+
+    inline void noteOff(int note, uint64_t timeStamp) {
+        note &= 0x7F;
+
+        if (!keySet.test(note))
+            return;
+
+        keySet.reset(note);
+
+        if (pedalDown(PedalSustain))
+            sustainedSet.set(note);
+
+        else if (!latchedSet.test(note))
+            release(SynclavierKBI1NoteSet::of(note), timeStamp);
+
+        publish();
+    }
+
+    inline void pedal(int number, bool down, uint64_t timeStamp) {
+        if (number < PedalSustain || number > PedalPunchIn || down == pedalDown(number))
+            return;
+
+        pedalBits ^= 1 << (number - PedalSustain);
+
+        if (number == PedalSustain && !down) {
+            release(sustainedSet & ~(keySet | latchedSet), timeStamp);
+            sustainedSet = SynclavierKBI1NoteSet::none();
+        }
+
+        else if (number == PedalHold) {
+            if (down)
+                latchedSet = keySet;
+
+            else {
+                release(latchedSet & ~(keySet | sustainedSet), timeStamp);
+                latchedSet = SynclavierKBI1NoteSet::none();
+            }
+        }
+
+        publish();
+    }
+
+    // ---- Any thread ----
+
+    // Notes sounding as of the last note or pedal. Lock-free; retries only if one is being handled right then.
+    // pedals, if given, gets the pedals down at the same moment (bit n is pedal 0x40 + n).
+    inline SynclavierKBI1NoteSet sounding(int* pedals = nullptr) const {
+        SynclavierKBI1NoteSet set = SynclavierKBI1NoteSet::none();
+        uint32_t              sequence;
+        int                   down;
+
+        do {
+            sequence    = publishedSequence.load(std::memory_order_acquire);
+            set.bits[0] = published[0].load(std::memory_order_relaxed);
+            set.bits[1] = published[1].load(std::memory_order_relaxed);
+            down        = publishedPedals.load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((sequence & 1) || sequence != publishedSequence.load(std::memory_order_relaxed));
+
+        if (pedals)
+            *pedals = down;
+
+        return set;
+    }
+
+    // ---- Input thread ----
+
+    inline SynclavierKBI1NoteSet keys()      const {return keySet;}
+    inline SynclavierKBI1NoteSet sustained() const {return sustainedSet;}
+    inline SynclavierKBI1NoteSet latched()   const {return latchedSet;}
+    inline SynclavierKBI1NoteSet current()   const {return keySet | sustainedSet | latchedSet;}
+
+    inline bool pedalDown(int number) const {
+        return number >= PedalSustain && number <= PedalPunchIn && (pedalBits >> (number - PedalSustain)) & 1;
+    }
+
+private:
+    inline void release(const SynclavierKBI1NoteSet& released, uint64_t timeStamp) {
+        if (!released.empty() && releaseProc)
+            releaseProc(released, timeStamp, releaseRefCon);
+    }
+
+    // Seqlock: odd while the set is being written
+    inline void publish() {
+        SynclavierKBI1NoteSet set = current();
+        uint32_t              sequence = publishedSequence.load(std::memory_order_relaxed);
+
+        publishedSequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        published[0].store(set.bits[0], std::memory_order_relaxed);
+        published[1].store(set.bits[1], std::memory_order_relaxed);
+        publishedPedals.store(pedalBits, std::memory_order_relaxed);
+
+        publishedSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    SynclavierKBI1NoteSet   keySet;
+    SynclavierKBI1NoteSet   sustainedSet;
+    SynclavierKBI1NoteSet   latchedSet;
+    int                     pedalBits;                          // Bit n is pedal 0x40 + n
+
+    EventProc               proc;
+    void*                   refCon;
+    ReleaseProc             releaseProc;
+    void*                   releaseRefCon;
+
+    std::atomic<uint32_t>   publishedSequence;
+    std::atomic<uint64_t>   published[2];
+    std::atomic<int>        publishedPedals;
+};
+
+#endif
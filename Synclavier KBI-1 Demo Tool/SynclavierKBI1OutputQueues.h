@@ -0,0 +1,588 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1OutputQueues.h
+//
+
+#ifndef SynclavierKBI1OutputQueues_h
+#define SynclavierKBI1OutputQueues_h
+
+#include <stdint.h>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1HostTime.h"
+
+// Output to the KBI-1 in priority order, within a budget of bytes per ms.
+//
+// The output batch flushes into these queues rather than straight to the transport. Each message
+// is put in one of four queues by its channel and status:
+//
+//  - Control       controllers on the NRPN channel (NRPN queries, replies and Clear)
+//  - Performance   anything not below
+//  - LEDs          notes on the ORK, VK and VK alt channels
+//  - Display       notes on the display channel
+//
+// dispatch() sends control messages whatever the budget, so a reply or status query is never held
+// up behind a full-panel redraw. Then performance, LED and display messages are sent, in that
+// order, while the budget lasts. Budget not spent builds up, to at most a burst. A display line
+// or section (its characters and the end of line) is always sent whole.
+//
+// Updates that a newer one has replaced are dropped while they wait:
+//
+//  - A light queued again takes the new velocity in its old place in the queue.
+//  - A display line or section queued again replaces the one still waiting. A full VK line
+//    replaces its sections.
+//  - A Clear NRPN drops every light and display update queued before it.
+//
+// Everything a dispatch() sends goes in one transport send, with running status if the transport
+// allows it. With no budget (the default) everything queued is sent on each dispatch().
+//
+// Output queued on SynclavierKBI1OutputScheduler is timed by the scheduler and does not pass through here.
+//
+// Nothing is allocated. A full queue drops the message and counts it in overflows(). System
+// exclusive is not queued. All calls must be made on one thread. kCapacity must be a power of 2.
+
+template <int kCapacity = 1024>
+class SynclavierKBI1OutputQueues {
+public:
+    static_assert((kCapacity & (kCapacity - 1)) == 0, "kCapacity must be a power of 2");
+
+    enum Priority {
+        PriorityControl,
+        PriorityPerformance,
+        PriorityLEDs,
+        PriorityDisplay,
+
+        kPriorities
+    };
+
+    static const int kMaxSend = 1024;                           // Bytes per transport send
+
+    inline SynclavierKBI1OutputQueues(SynclavierKBI1MIDITransport* outputTransport = nullptr) {
+        transport       = outputTransport;
+        useRunning      = false;
+        bytesPerMs      = 0;
+        burst           = 0;
+        credit          = 0;
+        lastTime        = 0;
+
+        inStatus        = 0;
+        inLength        = 0;
+        inNeeded        = 0;
+        inSysEx         = false;
+
+        sendCount       = 0;
+
+        discard();
+
+        for (auto& queue : queues) {
+            queue.peak          = 0;
+            queue.queuedCount   = 0;
+            queue.sentCount     = 0;
+            queue.byteCount     = 0;
+            queue.staleCount    = 0;
+            queue.overflowCount = 0;
+            queue.maxWait       = 0;
+        }
+    }
+
+    inline void setTransport(SynclavierKBI1MIDITransport* outputTransport) {
+        transport = outputTransport;
+    }
+
+    inline void setRunningStatus(bool runningStatus) {
+        useRunning = runningStatus;
+    }
+
+    // Bytes per ms the KBI-1 is sent, and the most that can build up while idle. 0 for no budget.
+    inline void setBudget(int budgetBytesPerMs, int burstBytes) {
+        bytesPerMs  = budgetBytesPerMs > 0 ? budgetBytesPerMs : 0;
+        burst       = burstBytes > kMaxSend ? kMaxSend : burstBytes > 3 ? burstBytes : 3;
+        credit      = burst;
+        lastTime    = 0;
+    }
+
+    // SynclavierKBI1MIDIOutputBatch flush proc. refCon is the queues.
+    static inline void BatchFlushProc(const unsigned char* bytes, int length, void* refCon) {
+        ((SynclavierKBI1OutputQueues*) refCon)->receive(bytes, length, SynclavierKBI1HostTimeNow());
+    }
+
+    // Queue complete MIDI messages, which may use running status. time is host time, for wait statistics.
+    inline void receive(const uint8_t* bytes, int length, uint64_t time) {
+        for (int i = 0; i < length; i++) {
+            uint8_t byte = bytes[i];
+
+            // Real time messages can go anywhere, even inside other messages
+            if (byte >= 0xF8) {
+                enqueue(PriorityPerformance, time, byte, 0, 0, 1);
+                continue;
+            }
+
+            if (byte & 0x80) {
+                inSysEx = byte == 0xF0;
+
+                if (inSysEx || byte == 0xF7) {
+                    inStatus = 0;
+                    continue;
+                }
+
+                inStatus    = byte;
+                inLength    = 0;
+                inNeeded    = dataBytes(byte);
+
+                // Tune request
+                if (inNeeded == 0) {
+                    enqueue(PriorityPerformance, time, byte, 0, 0, 1);
+                    inStatus = 0;
+                }
+
+                continue;
+            }
+
+            if (inSysEx || inStatus == 0)
+                continue;
+
+            inData[inLength++] = byte;
+
+            if (inLength < inNeeded)
+                continue;
+
+            send(time, inStatus, inData[0], inNeeded > 1 ? inData[1] : 0, inNeeded + 1);
+
+            inLength = 0;
+
+            // System common messages do not set running status
+            if (inStatus >= 0xF0)
+                inStatus = 0;
+        }
+    }
+
+    // Queue one message of length bytes
+    inline void send(uint64_t time, uint8_t byte1, uint8_t byte2, uint8_t byte3, int length = 3) {
+        int channel = byte1 & 0x0F;
+        int command = byte1 & 0xF0;
+
+        if (command == 0xB0 && channel == SynclavierKBI1MIDIProtocolNRPNChannel) {
+            enqueue(PriorityControl, time, byte1, byte2, byte3, length);
+            watchNRPN(byte2, byte3);
+        }
+
+        else if ((command == 0x80 || command == 0x90) && channel == SynclavierKBI1MIDIProtocolDisplayChannel)
+            queueDisplay(time, byte1, byte2, byte3);
+
+        else if ((command == 0x80 || command == 0x90) && ledKey(channel, byte2) >= 0)
+            queueLED(time, byte1, byte2, byte3);
+
+        else
+            enqueue(PriorityPerformance, time, byte1, byte2, byte3, length);
+    }
+
+    // Send control messages, then whatever else the budget allows. Returns the number of bytes sent.
+    inline int dispatch(uint64_t now) {
+        uint8_t buffer[kMaxSend];
+        int     length  = 0;
+        uint8_t running = 0;
+        int     total   = 0;
+
+        if (bytesPerMs) {
+            if (lastTime) {
+                credit += (double) SynclavierKBI1HostTimeToNanos(now - lastTime) * bytesPerMs / 1000000.0;
+
+                if (credit > burst)
+                    credit = burst;
+            }
+
+            lastTime = now;
+        }
+
+        auto put = [&](const Entry& entry) {
+            if (length + 3 > kMaxSend) {
+                total += length;
+                deliver(buffer, length);
+                length  = 0;
+                running = 0;
+            }
+
+            if (!useRunning || entry.bytes[0] != running || entry.bytes[0] >= 0xF0)
+                buffer[length++] = entry.bytes[0];
+
+            running = entry.bytes[0] < 0xF0 ? entry.bytes[0] : 0;
+
+            for (int i = 1; i < entry.length; i++)
+                buffer[length++] = entry.bytes[i];
+        };
+
+        for (int priority = 0; priority < kPriorities; priority++) {
+            auto& queue = queues[priority];
+
+            while (queue.head != queue.tail) {
+                uint32_t end   = queue.head;
+                int      bytes = unitBytes(priority, end);
+
+                // Control goes whatever the budget. The rest waits for enough, or for a full burst if it is bigger.
+                if (bytesPerMs && priority != PriorityControl && bytes > credit && credit < burst)
+                    break;
+
+                for (uint32_t sequence = queue.head; sequence != end; sequence++) {
+                    auto& entry = queue.entries[sequence & (kCapacity - 1)];
+
+                    if (entry.dropped)
+                        continue;
+
+                    put(entry);
+                    markSent(queue, entry, now);
+                }
+
+                queue.head  = end;
+                credit     -= bytes;
+            }
+        }
+
+        if (length) {
+            total += length;
+            deliver(buffer, length);
+        }
+
+        return total;
+    }
+
+    // Host time dispatch() can next send something. 0 if nothing is waiting.
+    inline uint64_t next() const {
+        if (empty())
+            return 0;
+
+        if (bytesPerMs == 0 || queues[PriorityControl].head != queues[PriorityControl].tail || credit >= burst)
+            return lastTime;
+
+        double need = 3;
+
+        for (int priority = PriorityPerformance; priority < kPriorities; priority++) {
+            auto& queue = queues[priority];
+
+            if (queue.head != queue.tail) {
+                uint32_t end = queue.head;
+
+                need = unitBytes(priority, end);
+                break;
+            }
+        }
+
+        if (need > burst)
+            need = burst;
+
+        if (need <= credit)
+            return lastTime;
+
+        return lastTime + SynclavierKBI1NanosToHostTime((uint64_t) ((need - credit) * 1000000.0 / bytesPerMs) + 1);
+    }
+
+    // Forget everything queued (e.g. the KBI-1 went away)
+    inline void discard() {
+        for (auto& queue : queues) {
+            queue.head = 0;
+            queue.tail = 0;
+        }
+
+        for (auto& run : displayRuns)
+            run = {};
+
+        for (auto& led : ledQueued)
+            led = kNone;
+
+        nrpnParam   = 0;
+        nrpnValue   = 0;
+    }
+
+    inline int  pending(int priority) const {return (int) (queues[priority].tail - queues[priority].head);}
+    inline bool empty() const {
+        for (auto& queue : queues) {
+            if (queue.head != queue.tail)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Statistics, per priority
+    inline int       peak(int priority)      const {return queues[priority].peak;}              // Most waiting at once
+    inline long long queued(int priority)    const {return queues[priority].queuedCount;}
+    inline long long sent(int priority)      const {return queues[priority].sentCount;}         // Messages
+    inline long long bytes(int priority)     const {return queues[priority].byteCount;}         // Without running status
+    inline long long stale(int priority)     const {return queues[priority].staleCount;}        // Replaced while waiting
+    inline long long overflows(int priority) const {return queues[priority].overflowCount;}
+    inline uint64_t  maxWait(int priority)   const {return queues[priority].maxWait;}           // ns from queued to sent
+
+    inline long long sends() const {return sendCount;}
+
+    static inline const char* name(int priority) {
+        static const char* names[kPriorities] = {"control", "performance", "leds", "display"};
+
+        return names[priority];
+    }
+
+private:
+    static const uint32_t kNone         = UINT32_MAX;
+    static const int      kDisplayNotes = SynclavierKBI1MIDIProtocolVKDisplayLine1Section1Decimals + 1;
+    static const int      kLEDKeys      = 3 * 128;
+
+    struct Entry {
+        uint64_t    time;
+        uint8_t     bytes[3];
+        uint8_t     length;
+        uint8_t     dropped;
+    };
+
+    struct Queue {
+        Entry       entries[kCapacity];
+        uint32_t    head;                                       // Sequence numbers. Entries are at sequence & (kCapacity - 1).
+        uint32_t    tail;
+
+        int         peak;
+        long long   queuedCount;
+        long long   sentCount;
+        long long   byteCount;
+        long long   staleCount;
+        long long   overflowCount;
+        uint64_t    maxWait;
+    };
+
+    // A display line or section: its characters and end of line
+    struct DisplayRun {
+        uint32_t    first;                                      // Of the last one queued whole
+        uint32_t    last;
+        uint32_t    openFirst;                                  // Of the one being queued
+        bool        open;                                       // End of line not queued yet
+        bool        queued;                                     // first - last may be waiting
+    };
+
+    static inline int dataBytes(uint8_t status) {
+        switch (status & 0xF0) {
+            case 0xC0:
+            case 0xD0:  return 1;
+            case 0xF0:  return status == 0xF1 || status == 0xF3 ? 1 : status == 0xF2 ? 2 : 0;
+            default:    return 2;
+        }
+    }
+
+    static inline int ledKey(int channel, int note) {
+        if (channel == SynclavierKBI1MIDIProtocolORKChannel || channel == SynclavierKBI1MIDIProtocolVKChannel || channel == SynclavierKBI1MIDIProtocolVKAltChannel)
+            return (channel - SynclavierKBI1MIDIProtocolORKChannel) * 128 + (note & 0x7F);
+
+        return -1;
+    }
+
+    static inline bool waiting(const Queue& queue, uint32_t sequence) {
+        return (int32_t) (sequence - queue.head) >= 0 && (int32_t) (queue.tail - sequence) > 0;
+    }
+
+    inline bool enqueue(int priority, uint64_t time, uint8_t byte1, uint8_t byte2, uint8_t byte3, int length) {
+        auto& queue = queues[priority];
+
+        if (queue.tail - queue.head == kCapacity) {
+            queue.overflowCount++;
+            return false;
+        }
+
+        auto& entry = queue.entries[queue.tail++ & (kCapacity - 1)];
+
+        entry.time      = time;
+        entry.bytes[0]  = byte1;
+        entry.bytes[1]  = byte2;
+        entry.bytes[2]  = byte3;
+        entry.length    = (uint8_t) length;
+        entry.dropped   = 0;
+
+        queue.queuedCount++;
+
+        if ((int) (queue.tail - queue.head) > queue.peak)
+            queue.peak = (int) (queue.tail - queue.head);
+
+        return true;
+    }
+
+    // A light still waiting takes the new velocity
+    inline void queueLED(uint64_t time, uint8_t byte1, uint8_t byte2, uint8_t byte3) {
+        auto&    queue    = queues[PriorityLEDs];
+        int      key      = ledKey(byte1 & 0x0F, byte2);
+        uint32_t sequence = ledQueued[key];
+
+        if (sequence != kNone && waiting(queue, sequence)) {
+            auto& entry = queue.entries[sequence & (kCapacity - 1)];
+
+            if (!entry.dropped && entry.bytes[1] == byte2 && (entry.bytes[0] & 0x0F) == (byte1 & 0x0F)) {
+                entry.bytes[0] = byte1;
+                entry.bytes[2] = byte3;
+
+                queue.queuedCount++;
+                queue.staleCount++;
+                return;
+            }
+        }
+
+        if (enqueue(PriorityLEDs, time, byte1, byte2, byte3, 3))
+            ledQueued[key] = queue.tail - 1;
+    }
+
+    inline void queueDisplay(uint64_t time, uint8_t byte1, uint8_t byte2, uint8_t byte3) {
+        auto& queue = queues[PriorityDisplay];
+        int   note  = byte2 & 0x7F;
+
+        if (note >= kDisplayNotes) {
+            enqueue(PriorityDisplay, time, byte1, byte2, byte3, 3);
+            return;
+        }
+
+        auto& run = displayRuns[note];
+
+        if (!enqueue(PriorityDisplay, time, byte1, byte2, byte3, 3))
+            return;
+
+        if (!run.open) {
+            run.open        = true;
+            run.openFirst   = queue.tail - 1;
+        }
+
+        // End of line. What this replaces is dropped.
+        if ((byte1 & 0xF0) == 0x80) {
+            dropRun(note, run.openFirst);
+
+            if (note == SynclavierKBI1MIDIProtocolVKDisplayLine0 || note == SynclavierKBI1MIDIProtocolVKDisplayLine1) {
+                int line = note - SynclavierKBI1MIDIProtocolVKDisplayLine0;
+
+                for (int section = 0; section < 2; section++) {
+                    dropRun(SynclavierKBI1MIDIProtocolVKMIDINoteForCharSection[line][section],    run.openFirst);
+                    dropRun(SynclavierKBI1MIDIProtocolVKMIDINoteForDecimalSection[line][section], run.openFirst);
+                }
+            }
+
+            run.open    = false;
+            run.queued  = true;
+            run.first   = run.openFirst;
+            run.last    = queue.tail - 1;
+        }
+    }
+
+    // Drop the line or section for note still waiting, if it was queued before sequence
+    inline void dropRun(int note, uint32_t before) {
+        auto& queue = queues[PriorityDisplay];
+        auto& run   = displayRuns[note];
+
+        if (!run.queued || !waiting(queue, run.first) || (int32_t) (run.first - before) >= 0)
+            return;
+
+        for (uint32_t sequence = run.first; sequence != run.last + 1; sequence++) {
+            auto& entry = queue.entries[sequence & (kCapacity - 1)];
+
+            if (!entry.dropped && (entry.bytes[1] & 0x7F) == note) {
+                entry.dropped = 1;
+                queue.staleCount++;
+            }
+        }
+
+        run.queued = false;
+    }
+
+    // A Clear NRPN drops every light and display update queued before it
+    inline void watchNRPN(uint8_t controller, uint8_t value) {
+        switch (controller) {
+            case SynclavierKBI1MIDIProtocolNRPN::nrpnMSB:   nrpnParam = (nrpnParam & 0x7F) | (value << 7);      break;
+            case SynclavierKBI1MIDIProtocolNRPN::nrpnLSB:   nrpnParam = (nrpnParam & ~0x7F) | value;            break;
+            case SynclavierKBI1MIDIProtocolNRPN::dataMSB:   nrpnValue = (nrpnValue & 0x7F) | (value << 7);      break;
+
+            case SynclavierKBI1MIDIProtocolNRPN::dataLSB:
+                nrpnValue = (nrpnValue & ~0x7F) | value;
+
+                if (nrpnParam == SynclavierKBI1MIDIProtocolNRPNMessageClear)
+                    dropAll(PriorityLEDs), dropAll(PriorityDisplay);
+
+                break;
+        }
+    }
+
+    inline void dropAll(int priority) {
+        auto& queue = queues[priority];
+
+        for (uint32_t sequence = queue.head; sequence != queue.tail; sequence++) {
+            auto& entry = queue.entries[sequence & (kCapacity - 1)];
+
+            if (!entry.dropped) {
+                entry.dropped = 1;
+                queue.staleCount++;
+            }
+        }
+
+        // A light set again after the Clear is a new update, not one to merge into what was dropped
+        if (priority == PriorityLEDs) {
+            for (auto& led : ledQueued)
+                led = kNone;
+        }
+
+        // A line being queued is cut off by the Clear. What is left of it would start a line of its own.
+        if (priority == PriorityDisplay) {
+            for (auto& run : displayRuns)
+                run = {};
+        }
+    }
+
+    // Bytes in the next thing to send from the queue, and the sequence after it. A display line goes whole.
+    inline int unitBytes(int priority, uint32_t& end) const {
+        auto& queue = queues[priority];
+        int   bytes = 0;
+
+        while (end != queue.tail) {
+            auto& entry = queue.entries[end++ & (kCapacity - 1)];
+
+            if (entry.dropped)
+                continue;
+
+            bytes += entry.length;
+
+            if (priority != PriorityDisplay || (entry.bytes[0] & 0xF0) == 0x80)
+                break;
+        }
+
+        return bytes;
+    }
+
+    inline void markSent(Queue& queue, const Entry& entry, uint64_t now) {
+        uint64_t wait = now > entry.time ? SynclavierKBI1HostTimeToNanos(now - entry.time) : 0;
+
+        queue.sentCount++;
+        queue.byteCount += entry.length;
+
+        if (wait > queue.maxWait)
+            queue.maxWait = wait;
+    }
+
+    inline void deliver(const uint8_t* bytes, int length) {
+        if (transport)
+            transport->send(bytes, length, 0);
+
+        sendCount++;
+    }
+
+    SynclavierKBI1MIDITransport*    transport;
+    bool                            useRunning;
+
+    int                             bytesPerMs;
+    int                             burst;
+    double                          credit;                     // Bytes that can be sent now
+    uint64_t                        lastTime;                   // Of the last dispatch
+
+    Queue                           queues[kPriorities];
+    DisplayRun                      displayRuns[kDisplayNotes];
+    uint32_t                        ledQueued[kLEDKeys];        // Sequence of each light's queued update
+
+    // Parsing what the batch hands over
+    uint8_t                         inStatus;
+    uint8_t                         inData[2];
+    int                             inLength;
+    int                             inNeeded;
+    bool                            inSysEx;
+
+    int                             nrpnParam;
+    int                             nrpnValue;
+
+    long long                       sendCount;
+};
+
+#endif
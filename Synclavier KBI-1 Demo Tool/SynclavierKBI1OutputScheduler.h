@@ -0,0 +1,230 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1OutputScheduler.h
+//
+
+#ifndef SynclavierKBI1OutputScheduler_h
+#define SynclavierKBI1OutputScheduler_h
+
+#include <stdint.h>
+
+#include <initializer_list>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDITransport.h"
+
+// Output queued against a future host time (SynclavierKBI1HostTime.h).
+//
+// Messages wait in a fixed-capacity binary min-heap ordered by time, then by the order they were
+// queued. dispatch() hands the transport everything due before now + lookahead, one send per time
+// stamp, with the messages' own time stamps.
+//
+// A transport that schedules output (Core MIDI) delivers each packet at its time stamp, so the
+// driver does the timing rather than our thread: dispatch with a lookahead of a few ms and
+// jitter does not depend on when the application thread runs. For a transport that can not
+// schedule, dispatch with no lookahead and call dispatch() when next() is due.
+//
+// Nothing is allocated. If the heap is full the message is dropped and counted in overflows().
+// All calls must be made on one thread. kCapacity must be a power of 2.
+
+template <int kCapacity = 1024>
+class SynclavierKBI1OutputScheduler {
+public:
+    static_assert((kCapacity & (kCapacity - 1)) == 0, "kCapacity must be a power of 2");
+
+    static const int kMaxSend = 256;                            // Bytes per send
+
+    inline SynclavierKBI1OutputScheduler(SynclavierKBI1MIDITransport* outputTransport = nullptr) {
+        transport       = outputTransport;
+        count           = 0;
+        sequence        = 0;
+
+        sendCount       = 0;
+        messageCount    = 0;
+        overflowCount   = 0;
+    }
+
+    inline void setTransport(SynclavierKBI1MIDITransport* outputTransport) {
+        transport = outputTransport;
+    }
+
+    // Queue a 3 byte message for host time
+    inline bool send3(uint64_t time, uint8_t byte1, uint8_t byte2, uint8_t byte3) {
+        if (count == kCapacity) {
+            overflowCount++;
+            return false;
+        }
+
+        Entry entry;
+
+        entry.time      = time;
+        entry.sequence  = sequence++;
+        entry.bytes[0]  = byte1;
+        entry.bytes[1]  = byte2;
+        entry.bytes[2]  = byte3;
+        entry.length    = 3;
+
+        heap[count] = entry;
+        siftUp(count++);
+
+        return true;
+    }
+
+    // Queue a button light (note on with velocity of 0 indicates note off)
+    inline bool sendButton(uint64_t time, int channel, int button, int velocity) {
+        return send3(time, 0x90 + (channel & 0xF), button & 0x7F, velocity & 0x7F);
+    }
+
+    // Queue an NRPN. All 4 parts go at the same time in order.
+    inline bool sendNRPN(uint64_t time, int param, int value, int chan) {
+        if (count > kCapacity - 4) {
+            overflowCount++;
+            return false;
+        }
+
+        SynclavierKBI1MIDIProtocolNRPN nrpn(param, value, chan);
+
+        for (auto message : {nrpn.nrpn1(), nrpn.nrpn2(), nrpn.data1(), nrpn.data2()})
+            send3(time, message[0], message[1], message[2]);
+
+        return true;
+    }
+
+    // Send everything due before now + lookahead. Returns the number of messages sent.
+    inline int dispatch(uint64_t now, uint64_t lookahead = 0) {
+        uint8_t buffer[kMaxSend];
+        int     sent = 0;
+
+        while (count && heap[0].time <= now + lookahead) {
+            uint64_t time   = heap[0].time;
+            int      length = 0;
+
+            // Messages for the same time go in one send
+            while (count && heap[0].time == time && length + heap[0].length <= kMaxSend) {
+                for (int i = 0; i < heap[0].length; i++)
+                    buffer[length++] = heap[0].bytes[i];
+
+                pop();
+                sent++;
+            }
+
+            // Late messages go now. Without lookahead the transport is not asked to schedule.
+            uint64_t timeStamp = (lookahead == 0 || time < now) ? 0 : time;
+
+            if (transport)
+                transport->send(buffer, length, timeStamp);
+
+            sendCount++;
+        }
+
+        messageCount += sent;
+
+        return sent;
+    }
+
+    // Host time of the earliest queued message. 0 if none.
+    inline uint64_t next() const {
+        return count ? heap[0].time : 0;
+    }
+
+    // Forget everything queued (e.g. the KBI-1 went away)
+    inline void discard() {
+        count = 0;
+    }
+
+    // Forget the note ons and offs queued on a channel, e.g. button lights once the panel has been
+    // cleared. The rest keep their times and order. Returns the number forgotten.
+    inline int discardNotes(int channel) {
+        int kept = 0;
+
+        for (int index = 0; index < count; index++) {
+            uint8_t status = heap[index].bytes[0];
+
+            if ((status & 0xE0) == 0x80 && (status & 0xF) == (channel & 0xF))
+                continue;
+
+            heap[kept] = heap[index];
+            siftUp(kept++);
+        }
+
+        int forgotten = count - kept;
+
+        count = kept;
+
+        return forgotten;
+    }
+
+    inline int  pending() const {return count;}
+    inline int  room()    const {return kCapacity - count;}
+    inline bool empty()   const {return count == 0;}
+
+    // Statistics
+    inline long long sends()     const {return sendCount;}
+    inline long long messages()  const {return messageCount;}
+    inline long long overflows() const {return overflowCount;}
+
+private:
+    struct Entry {
+        uint64_t    time;
+        uint32_t    sequence;                                   // Keeps messages for the same time in the order queued
+        uint8_t     bytes[3];
+        uint8_t     length;
+    };
+
+    static inline bool before(const Entry& a, const Entry& b) {
+        if (a.time != b.time)
+            return a.time < b.time;
+
+        return (int32_t) (a.sequence - b.sequence) < 0;
+    }
+
+    inline void siftUp(int index) {
+        Entry entry = heap[index];
+
+        while (index > 0) {
+            int parent = (index - 1) / 2;
+
+            if (!before(entry, heap[parent]))
+                break;
+
+            heap[index] = heap[parent];
+            index       = parent;
+        }
+
+        heap[index] = entry;
+    }
+
+    inline void pop() {
+        Entry entry = heap[--count];
+        int   index = 0;
+
+        while (true) {
+            int child = index * 2 + 1;
+
+            if (child >= count)
+                break;
+
+            if (child + 1 < count && before(heap[child + 1], heap[child]))
+                child++;
+
+            if (!before(heap[child], entry))
+                break;
+
+            heap[index] = heap[child];
+            index       = child;
+        }
+
+        heap[index] = entry;
+    }
+
+    SynclavierKBI1MIDITransport*    transport;
+
+    Entry                           heap[kCapacity];
+    int                             count;
+    uint32_t                        sequence;
+
+    long long                       sendCount;
+    long long                       messageCount;
+    long long                       overflowCount;
+};
+
+#endif
@@ -0,0 +1,83 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1PanelState.h
+//
+
+#ifndef SynclavierKBI1PanelState_h
+#define SynclavierKBI1PanelState_h
+
+#include <chrono>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1DisplayFramebuffer.h"
+#include "SynclavierKBI1LEDState.h"
+
+// Everything the host has put on the ORK/VK panel: the button lights and the displays.
+//
+// The panel state is kept across disconnects. When the KBI-1 asks for a refresh
+// (SynclavierKBI1MIDIProtocolNRPNMessageRefresh) restore() rebuilds the panel from it
+// in one burst: Clear, then only the lights that are not off, then the display.
+
+class SynclavierKBI1PanelState {
+public:
+    struct RestoreStats {
+        int     lights;                                         // Note On messages for lights
+        int     displayMessages;                                // Messages for the displays
+        int     bytes;                                          // Bytes handed to the batch's flush proc
+        int     packetLists;                                    // Times the batch was flushed
+        double  microseconds;                                   // Time to build and send the burst
+    };
+
+    SynclavierKBI1LEDState              leds;
+    SynclavierKBI1DisplayFramebuffer    display;
+
+    // Clear display and turn off all lights
+    inline void clear(SynclavierKBI1MIDIOutputBatch& batch) {
+        batch.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageClear, 0, SynclavierKBI1MIDIProtocolNRPNChannel);
+
+        leds.markCleared();
+        display.markCleared();
+    }
+
+    // Send changes since the last flush
+    inline void flush(SynclavierKBI1MIDIOutputBatch& batch) {
+        leds.flush(batch);
+        display.flush(batch);
+    }
+
+    // What is on the panel is unknown, e.g. after the KBI-1 was unplugged
+    inline void invalidate() {
+        leds.invalidate();
+        display.invalidate();
+    }
+
+    // Rebuild the whole panel from the shadow state and send it right away
+    inline RestoreStats restore(SynclavierKBI1MIDIOutputBatch& batch) {
+        RestoreStats stats = {};
+
+        // Keep whatever was already collected out of the measurement
+        batch.flush();
+
+        auto      start         = std::chrono::steady_clock::now();
+        long long bytesBefore   = batch.bytes();
+        long long flushesBefore = batch.flushes();
+        long long displayBefore = display.messages();
+
+        clear(batch);
+
+        // Against a cleared panel only lights that are not off and display sections that are not blank are sent
+        stats.lights = leds.flush(batch);
+        display.flush(batch);
+
+        batch.flush();
+
+        stats.displayMessages = (int) (display.messages() - displayBefore);
+        stats.bytes           = (int) (batch.bytes()      - bytesBefore);
+        stats.packetLists     = (int) (batch.flushes()    - flushesBefore);
+        stats.microseconds    = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+        return stats;
+    }
+};
+
+#endif
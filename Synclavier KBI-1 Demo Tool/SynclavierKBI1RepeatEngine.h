@@ -0,0 +1,276 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1RepeatEngine.h
+//
+
+#ifndef SynclavierKBI1RepeatEngine_h
+#define SynclavierKBI1RepeatEngine_h
+
+#include <stdint.h>
+#include <math.h>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1HostTime.h"
+#include "SynclavierKBI1OutputScheduler.h"
+#include "SynclavierKBI1NoteState.h"
+
+// Repeat and arpeggiate, done by the host while the KBI-1's Repeat (0x43) or Arpeggiate (0x44)
+// pedal is down.
+//
+//  - Repeat        every note sounding is played again on each step
+//  - Arpeggiate    one note sounding per step, going up, down or up and down through them
+//
+// Arpeggiate wins if both pedals are down. What is sounding, and which pedals are down, is read
+// from SynclavierKBI1NoteState, so sustained and held notes repeat too.
+//
+// Steps are on a fixed grid: step n is at origin + n * period, worked out from n each time so
+// it never drifts. The period comes from a rate in steps per second, or from an external tempo
+// in beats per minute and steps per beat, with the grid lined up on the host time of a beat.
+//
+// run() queues the note on and its note off for every step due before now + lookahead on an
+// output scheduler, with the step's own host time. A transport that schedules output plays
+// them on time however late run() is called, as long as it is called within the lookahead. For
+// one that does not, dispatch the scheduler when next() is due. Notes in the lookahead still
+// play after the pedal comes up or the key is let go; each note on goes with its note off, so
+// nothing hangs. Steps missed entirely (run() called more than a period late) are skipped.
+//
+// Nothing is allocated. All calls must be made on one thread, normally the main application thread.
+
+class SynclavierKBI1RepeatEngine {
+public:
+    typedef SynclavierKBI1OutputScheduler<> Scheduler;
+
+    enum Pattern {
+        PatternUp,
+        PatternDown,
+        PatternUpDown,
+    };
+
+    inline SynclavierKBI1RepeatEngine(const SynclavierKBI1NoteState& noteState, Scheduler& outputScheduler)
+    :   notes(noteState),
+        scheduler(outputScheduler) {
+        channel     = SynclavierKBI1MIDIProtocolNoteChannel;
+        velocity    = 100;
+        gate        = 0.5;
+        pattern     = PatternUp;
+        rising      = true;
+
+        tempoOrigin = 0;
+        period      = 0;
+
+        active      = false;
+        origin      = 0;
+        step        = 0;
+        lastNote    = -1;
+
+        stepCount   = 0;
+        noteCount   = 0;
+        skipCount   = 0;
+
+        setRate(8);
+    }
+
+    // Zero-based MIDI channel the notes are played on
+    inline void setChannel(int outputChannel)       {channel = outputChannel & 0xF;}
+    inline void setVelocity(int noteVelocity)       {velocity = noteVelocity < 1 ? 1 : noteVelocity > 127 ? 127 : noteVelocity;}
+    inline void setPattern(Pattern arpeggio)        {pattern = arpeggio;}
+
+    // Fraction of a step each note lasts
+    inline void setGate(double fraction) {
+        gate = fraction < 0.05 ? 0.05 : fraction > 0.95 ? 0.95 : fraction;
+    }
+
+    // Free running, steps per second. Starts on the pedal going down.
+    inline void setRate(double stepsPerSecond) {
+        tempoOrigin = 0;
+        setPeriod(1e9 / (stepsPerSecond > 0.1 ? stepsPerSecond : 0.1));
+    }
+
+    // Follow an external tempo. beatTime is the host time of any beat; steps fall on the grid through it.
+    inline void setTempo(double beatsPerMinute, int stepsPerBeat, uint64_t beatTime) {
+        tempoOrigin = beatTime ? beatTime : 1;
+        setPeriod(60e9 / ((beatsPerMinute > 1 ? beatsPerMinute : 1) * (stepsPerBeat > 0 ? stepsPerBeat : 1)));
+    }
+
+    // Queue every step due before now + lookahead. Returns the number of notes queued.
+    inline int run(uint64_t now, uint64_t lookahead) {
+        int pedals;
+        int queued = 0;
+
+        SynclavierKBI1NoteSet sounding = notes.sounding(&pedals);
+
+        bool arpeggiate = (pedals >> (SynclavierKBI1NoteState::PedalArpeggiate - SynclavierKBI1NoteState::PedalSustain)) & 1;
+        bool repeat     = (pedals >> (SynclavierKBI1NoteState::PedalRepeat     - SynclavierKBI1NoteState::PedalSustain)) & 1;
+
+        if (!arpeggiate && !repeat) {
+            active = false;
+            return 0;
+        }
+
+        if (!active) {
+            start(now);
+            active = true;
+        }
+
+        // More than a step late: go on from the next step still to come, rather than play late
+        if (stepTime(step) + period < now) {
+            uint64_t due = (uint64_t) ((now - origin) / periodHost) + 1;
+
+            skipCount += (long long) (due - step);
+            step       = due;
+        }
+
+        for (uint64_t time = stepTime(step); time < now + lookahead; time = stepTime(++step)) {
+            uint64_t off = time + (uint64_t) (period * gate);
+
+            stepCount++;
+
+            if (sounding.empty())
+                continue;
+
+            if (arpeggiate) {
+                int note = nextNote(sounding);
+
+                queued += play(note, time, off);
+            }
+
+            else
+                sounding.forEach([&](int note) {queued += play(note, time, off);});
+        }
+
+        noteCount += queued;
+
+        return queued;
+    }
+
+    // Host time of the next step. 0 if neither pedal is down.
+    inline uint64_t next() const {
+        return active ? stepTime(step) : 0;
+    }
+
+    inline bool running() const {return active;}
+
+    // Host time of step 0, and the host time between steps
+    inline uint64_t stepOrigin() const {return origin;}
+    inline double   stepPeriod() const {return periodHost;}
+
+    // Statistics
+    inline long long steps()   const {return stepCount;}
+    inline long long played()  const {return noteCount;}
+    inline long long skipped() const {return skipCount;}
+
+private:
+    inline void setPeriod(double nanos) {
+        uint64_t now = active ? stepTime(step) : 0;
+
+        periodHost  = (double) SynclavierKBI1NanosToHostTime((uint64_t) (nanos * 1024)) / 1024;
+        period      = (uint64_t) periodHost;
+
+        // A change while running takes effect from the next step
+        if (active)
+            start(now);
+    }
+
+    // Grid for a pedal going down at now
+    inline void start(uint64_t now) {
+        step     = 0;
+        lastNote = -1;
+        rising   = true;
+        origin   = now;
+
+        if (tempoOrigin) {
+            double steps = ceil(((double) now - (double) tempoOrigin) / periodHost);
+
+            origin = tempoOrigin + (int64_t) llround(steps * periodHost);
+        }
+    }
+
+    inline uint64_t stepTime(uint64_t index) const {
+        return origin + (uint64_t) llround((double) index * periodHost);
+    }
+
+    // Next note of the arpeggio, picked from the set with a mask rather than a search
+    inline int nextNote(const SynclavierKBI1NoteSet& sounding) {
+        SynclavierKBI1NoteSet above = sounding & ~below(lastNote + 1);
+        SynclavierKBI1NoteSet under = sounding & below(lastNote < 0 ? 128 : lastNote);
+
+        int note;
+
+        switch (pattern) {
+            case PatternUp:
+                note = above.empty() ? sounding.lowest() : above.lowest();
+                break;
+
+            case PatternDown:
+                note = under.empty() ? sounding.highest() : under.highest();
+                break;
+
+            default:
+                if (rising && above.empty())
+                    rising = false;
+
+                else if (!rising && under.empty())
+                    rising = true;
+
+                note = rising ? (above.empty() ? sounding.lowest()  : above.lowest())
+                              : (under.empty() ? sounding.highest() : under.highest());
+                break;
+        }
+
+        lastNote = note;
+
+        return note;
+    }
+
+    // Notes below note
+    static inline SynclavierKBI1NoteSet below(int note) {
+        SynclavierKBI1NoteSet set = SynclavierKBI1NoteSet::none();
+
+        if (note >= 128)
+            return SynclavierKBI1NoteSet::all();
+
+        if (note > 64) {
+            set.bits[0] = ~0ULL;
+            set.bits[1] = (1ULL << (note - 64)) - 1;
+        }
+
+        else if (note > 0)
+            set.bits[0] = note == 64 ? ~0ULL : (1ULL << note) - 1;
+
+        return set;
+    }
+
+    // Only with room for the note off too, so a full scheduler can not leave a note hanging
+    inline int play(int note, uint64_t on, uint64_t off) {
+        if (scheduler.room() < 2)
+            return 0;
+
+        scheduler.send3(on, 0x90 + channel, note, velocity);
+        scheduler.send3(off, 0x80 + channel, note, 0);
+
+        return 1;
+    }
+
+    const SynclavierKBI1NoteState&  notes;
+    Scheduler&                      scheduler;
+
+    int                             channel;
+    int                             velocity;
+    double                          gate;
+    Pattern                         pattern;
+    bool                            rising;
+
+    uint64_t                        tempoOrigin;                // Host time of a beat. 0 when free running.
+    double                          periodHost;                 // Host time between steps
+    uint64_t                        period;
+
+    bool                            active;
+    uint64_t                        origin;                     // Host time of step 0
+    uint64_t                        step;                       // Next to queue
+    int                             lastNote;                   // Arpeggio
+
+    long long                       stepCount;
+    long long                       noteCount;
+    long long                       skipCount;
+};
+
+#endif
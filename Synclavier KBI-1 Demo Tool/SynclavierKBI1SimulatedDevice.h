@@ -0,0 +1,538 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1SimulatedDevice.h
+//
+
+#ifndef SynclavierKBI1SimulatedDevice_h
+#define SynclavierKBI1SimulatedDevice_h
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+#include "SynclavierKBI1MIDIParser.h"
+#include "SynclavierKBI1NRPNAssembler.h"
+#include "SynclavierKBI1LEDState.h"
+#include "SynclavierKBI1HostTime.h"
+
+// A KBI-1 in software, for testing the host side with no hardware.
+//
+// Attach it to the device end of a transport (the loopback's device, or a virtual MIDI port)
+// and it behaves as SynclavierKBI1MIDIProtocol.h describes:
+//
+//  - Answers WhoAreYou, Status and Echo. Clears on Clear (or Status 0).
+//  - Sends HereIAm when powered on and Status whenever the keyboard changes.
+//  - Asks the host for a Refresh on request, forgetting what was on its panel as a real one has.
+//  - The ORK or VK can be plugged in, powered down and back up.
+//  - Keeps a model of the display and the button lights so tests can check what the host sent.
+//
+// SynclavierKBI1SimulatedTraffic generates a performance (keys, aftertouch, ribbon, knob, wheel,
+// pedals and panel buttons) and play() sends it at real time or many times faster.
+//
+// Input is handled on whatever thread the transport delivers on. Output from there, from the
+// traffic player and from the controls below goes out one send at a time, as one USB stream would.
+// The models should be read when no input is arriving.
+
+class SynclavierKBI1SimulatedDevice {
+public:
+    static const int kORKMaxChars       = 16;
+    static const int kVKCharsPerLine    = 40;
+    static const int kVKCharsPerSection = kVKCharsPerLine / 2;
+
+    inline SynclavierKBI1SimulatedDevice(SynclavierKBI1MIDITransport& deviceTransport)
+    :   transport(deviceTransport),
+        replies(FlushProc, this, deviceTransport.allowsRunningStatus()) {
+        keyboard        = SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome;
+        powered         = false;
+        hostStatus      = -1;
+
+        nrpnCount       = 0;
+        echoCount       = 0;
+        clearCount      = 0;
+        ignoredCount    = 0;
+
+        clearModel();
+
+        transport.setReceiveProc(ReceiveProc, this);
+    }
+
+    // ---- Controls ----
+
+    // Power on the KBI-1. It announces itself.
+    inline void powerOn() {
+        std::lock_guard<std::mutex> lock(output);
+
+        powered = true;
+        replies.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageHereIAm, SynclavierKBI1MIDIProtocolNRPNMessageIAmKBI1, SynclavierKBI1MIDIProtocolNRPNChannel);
+        replies.flush();
+    }
+
+    // Stop answering, as if unplugged or stopped
+    inline void powerOff() {
+        std::lock_guard<std::mutex> lock(output);
+
+        powered = false;
+    }
+
+    // Plug in, power up or power down the ORK or VK. SynclavierKBI1MIDIProtocolNRPNMessage*Here, or NoOneHome.
+    // The panel comes up blank. The new status is sent to the host.
+    inline void setKeyboard(int status) {
+        std::lock_guard<std::mutex> lock(output);
+
+        if (status == keyboard)
+            return;
+
+        keyboard = status;
+        clearModel();
+
+        if (powered) {
+            replies.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageStatus, keyboard, SynclavierKBI1MIDIProtocolNRPNChannel);
+            replies.flush();
+        }
+    }
+
+    // Power the keyboard down and back up
+    inline void powerCycleKeyboard() {
+        int status = keyboard;
+
+        setKeyboard(SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome);
+        setKeyboard(status);
+    }
+
+    // Lose the panel and ask the host to put it back
+    inline void requestRefresh() {
+        std::lock_guard<std::mutex> lock(output);
+
+        clearModel();
+        replies.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageRefresh, SynclavierKBI1MIDIProtocolNRPNAskValue, SynclavierKBI1MIDIProtocolNRPNChannel);
+        replies.flush();
+    }
+
+    // Ask the host who it is. The answer is in hostIdentity().
+    inline void askHost() {
+        std::lock_guard<std::mutex> lock(output);
+
+        replies.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNAskValue, SynclavierKBI1MIDIProtocolNRPNChannel);
+        replies.flush();
+    }
+
+    // Press and release a panel button (ORK, VK or VK alt channel)
+    inline void pressButton(int channel, int button) {
+        uint8_t bytes[6] = {
+            (uint8_t) (0x90 + channel), (uint8_t) (button & 0x7F), 0x7F,
+            (uint8_t) (0x80 + channel), (uint8_t) (button & 0x7F), 0x00,
+        };
+
+        send(bytes, sizeof(bytes));
+    }
+
+    // Send complete MIDI messages as the KBI-1
+    inline void send(const uint8_t* bytes, int length) {
+        std::lock_guard<std::mutex> lock(output);
+
+        if (powered)
+            transport.send(bytes, length, 0);
+    }
+
+    // ---- Model of the panel ----
+
+    inline const char* ork() const {return orkText;}
+
+    // Line 0 or 1 as text, a decimal point before the character it goes with, trailing blanks removed.
+    // The same form the host gives SynclavierKBI1DisplayFramebuffer::setVKLine().
+    inline void vkLine(int line, char* text, int size) const {
+        int length = 0;
+
+        for (int position = 0; position < kVKCharsPerLine && length < size - 2; position++) {
+            if (vkDecimals[line & 1] & (1ULL << position))
+                text[length++] = '.';
+
+            text[length++] = vkChars[line & 1][position];
+        }
+
+        while (length > 0 && text[length - 1] == ' ')
+            length--;
+
+        text[length] = 0;
+    }
+
+    SynclavierKBI1LEDState                  leds;               // Lights as the host last set them. Read with get().
+
+    inline int  keyboardStatus() const {return keyboard;}
+    inline bool poweredOn()      const {return powered;}
+    inline int  hostIdentity()   const {return hostStatus;}      // What the host said it is. -1 until asked.
+
+    // Statistics
+    inline long long nrpns()   const {return nrpnCount;}
+    inline long long echoes()  const {return echoCount;}
+    inline long long clears()  const {return clearCount;}
+    inline long long ignored() const {return ignoredCount;}      // Panel messages while no keyboard was on
+
+private:
+    struct Handler : SynclavierKBI1MIDIParserHandler {
+        SynclavierKBI1SimulatedDevice* device;
+
+        inline void message(uint8_t status, uint8_t data1, uint8_t data2) {
+            device->message(status, data1, data2);
+        }
+    };
+
+    static void ReceiveProc(const unsigned char* bytes, int length, uint64_t timeStamp, void* refCon) {
+        auto&   device = *(SynclavierKBI1SimulatedDevice*) refCon;
+        Handler handler;
+
+        handler.device = &device;
+
+        std::lock_guard<std::mutex> lock(device.output);
+
+        if (device.powered)
+            device.parser.parse(bytes, length, handler);
+
+        device.replies.flush();
+    }
+
+    static void FlushProc(const unsigned char* bytes, int length, void* refCon) {
+        auto& device = *(SynclavierKBI1SimulatedDevice*) refCon;
+
+        device.transport.send(bytes, length, 0);
+    }
+
+    inline void message(uint8_t status, uint8_t data1, uint8_t data2) {
+        int channel = status & 0xF;
+        int kind    = status & 0xF0;
+
+        if (kind == 0xB0 && channel == SynclavierKBI1MIDIProtocolNRPNChannel) {
+            if (assembler.controller(data1, data2))
+                nrpn(assembler.param(), assembler.value());
+
+            return;
+        }
+
+        if (kind != 0x90 && kind != 0x80)
+            return;
+
+        if (keyboard == SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome) {
+            ignoredCount++;
+            return;
+        }
+
+        int velocity = kind == 0x90 ? data2 : 0;
+
+        if (channel == SynclavierKBI1MIDIProtocolDisplayChannel)
+            display(data1, kind == 0x90, velocity);
+
+        else
+            leds.setVelocity(channel, data1, velocity);
+    }
+
+    inline void nrpn(int param, int value) {
+        nrpnCount++;
+
+        switch (param) {
+            case SynclavierKBI1MIDIProtocolNRPNMessageWhoAreYou:
+                if (value == SynclavierKBI1MIDIProtocolNRPNAskValue)
+                    replies.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageHereIAm, SynclavierKBI1MIDIProtocolNRPNMessageIAmKBI1, SynclavierKBI1MIDIProtocolNRPNChannel);
+                break;
+
+            case SynclavierKBI1MIDIProtocolNRPNMessageStatus:
+                if (value == SynclavierKBI1MIDIProtocolNRPNAskValue)
+                    replies.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageStatus, keyboard, SynclavierKBI1MIDIProtocolNRPNChannel);
+
+                else if (value == 0)
+                    clear();
+
+                else
+                    hostStatus = value;                         // Answer to askHost()
+                break;
+
+            case SynclavierKBI1MIDIProtocolNRPNMessageClear:
+                clear();
+                break;
+
+            case SynclavierKBI1MIDIProtocolNRPNMessageEcho:
+                echoCount++;
+                replies.sendNRPN(SynclavierKBI1MIDIProtocolNRPNMessageEcho, value, SynclavierKBI1MIDIProtocolNRPNChannel);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    inline void clear() {
+        clearCount++;
+        clearModel();
+    }
+
+    inline void clearModel() {
+        orkText[0]    = 0;
+        pendingORK[0] = 0;
+        orkLength     = 0;
+
+        for (int line = 0; line < 2; line++) {
+            memset(vkChars[line], ' ', kVKCharsPerLine);
+            vkDecimals[line] = 0;
+        }
+
+        for (auto& length : pendingLength)
+            length = 0;
+
+        leds.clearAll();
+    }
+
+    // Characters come as note ons and are shown on the note off
+    inline void display(int note, bool on, int c) {
+        if (note < 0 || note > SynclavierKBI1MIDIProtocolVKDisplayLine1Section1Decimals)
+            return;
+
+        if (on) {
+            if (note == SynclavierKBI1MIDIProtocolORKDisplay) {
+                if (orkLength < kORKMaxChars)
+                    pendingORK[orkLength++] = (char) c;
+            }
+
+            else if (pendingLength[note] < (int) sizeof(pending[note]))
+                pending[note][pendingLength[note]++] = (char) c;
+
+            return;
+        }
+
+        int   length = pendingLength[note];
+        char* text   = pending[note];
+
+        pendingLength[note] = 0;
+
+        switch (note) {
+            case SynclavierKBI1MIDIProtocolORKDisplay:
+                memcpy(orkText, pendingORK, orkLength);
+                orkText[orkLength] = 0;
+                orkLength = 0;
+                break;
+
+            case SynclavierKBI1MIDIProtocolVKDisplayLine0:
+            case SynclavierKBI1MIDIProtocolVKDisplayLine1: {
+                int  line     = note - SynclavierKBI1MIDIProtocolVKDisplayLine0;
+                int  position = 0;
+                bool decimal  = false;
+
+                memset(vkChars[line], ' ', kVKCharsPerLine);
+                vkDecimals[line] = 0;
+
+                for (int i = 0; i < length && position < kVKCharsPerLine; i++) {
+                    if (text[i] == '.' && !decimal) {
+                        decimal = true;
+                        continue;
+                    }
+
+                    if (decimal)
+                        vkDecimals[line] |= 1ULL << position;
+
+                    vkChars[line][position++] = text[i];
+                    decimal = false;
+                }
+
+                if (decimal && position < kVKCharsPerLine)
+                    vkDecimals[line] |= 1ULL << position;
+                break;
+            }
+
+            default: {
+                bool decimals = note >= SynclavierKBI1MIDIProtocolVKDisplayLine0Section0Decimals;
+                int  index    = note - (decimals ? SynclavierKBI1MIDIProtocolVKDisplayLine0Section0Decimals : SynclavierKBI1MIDIProtocolVKDisplayLine0Section0Chars);
+                int  line     = index / 2;
+                int  first    = (index % 2) * kVKCharsPerSection;
+
+                for (int i = 0; i < length && i < kVKCharsPerSection; i++) {
+                    if (!decimals)
+                        vkChars[line][first + i] = text[i];
+
+                    else if (text[i] == '.')
+                        vkDecimals[line] |=  (1ULL << (first + i));
+
+                    else
+                        vkDecimals[line] &= ~(1ULL << (first + i));
+                }
+                break;
+            }
+        }
+    }
+
+    SynclavierKBI1MIDITransport&    transport;
+    SynclavierKBI1MIDIOutputBatch   replies;
+    std::mutex                      output;                     // One stream out. Also guards the models.
+
+    SynclavierKBI1MIDIParser        parser;
+    SynclavierKBI1NRPNAssembler     assembler;
+
+    int                             keyboard;                   // SynclavierKBI1MIDIProtocolNRPNMessage*Here
+    bool                            powered;
+    int                             hostStatus;
+
+    char                            orkText[kORKMaxChars + 1];
+    char                            pendingORK[kORKMaxChars];
+    int                             orkLength;
+
+    char                            vkChars[2][kVKCharsPerLine];
+    uint64_t                        vkDecimals[2];              // Bit n is decimal point before character n
+
+    char                            pending[SynclavierKBI1MIDIProtocolVKDisplayLine1Section1Decimals + 1][kVKCharsPerLine * 2];
+    int                             pendingLength[SynclavierKBI1MIDIProtocolVKDisplayLine1Section1Decimals + 1];
+
+    long long                       nrpnCount;
+    long long                       echoCount;
+    long long                       clearCount;
+    long long                       ignoredCount;
+};
+
+// A performance on the KBI-1, as the MIDI messages it sends and when.
+//
+// Generated from a seed so runs can be repeated. Per second of performance, roughly:
+//  - 8 notes, held 0.1 - 0.6 s, with aftertouch every 10 ms while held (VK)
+//  - Ribbon gestures: relative movements and ribbon pitch bend every 2 ms, 0.3 - 1.5 s long
+//  - Knob turns: pitch bend on the knob channel every 5 ms, 0.2 - 0.8 s long
+//  - Mod wheel sweeps, sustain pedal, and the odd panel button press
+//
+// play() sends it through a simulated device. speed is times real time; 0 sends it as fast as possible.
+
+struct SynclavierKBI1TimedMessage {
+    uint64_t    time;                                           // ns from the start
+    uint8_t     bytes[3];
+    uint8_t     length;
+};
+
+class SynclavierKBI1SimulatedTraffic {
+public:
+    static inline std::vector<SynclavierKBI1TimedMessage> generate(double seconds, unsigned seed = 1, bool aftertouch = true) {
+        std::vector<SynclavierKBI1TimedMessage> messages;
+        std::mt19937                            random(seed);
+
+        const uint64_t end = (uint64_t) (seconds * 1e9);
+
+        auto uniform = [&](double low, double high) {return low + (high - low) * (random() / (double) random.max());};
+        auto ms      = [](double milliseconds) {return (uint64_t) (milliseconds * 1e6);};
+
+        auto add = [&](uint64_t time, int status, int data1, int data2) {
+            if (time >= end)
+                return;
+
+            SynclavierKBI1TimedMessage message;
+
+            message.time     = time;
+            message.bytes[0] = (uint8_t) status;
+            message.bytes[1] = (uint8_t) (data1 & 0x7F);
+            message.bytes[2] = (uint8_t) (data2 & 0x7F);
+            message.length   = 3;
+
+            messages.push_back(message);
+        };
+
+        // Notes
+        for (uint64_t time = 0; time < end; time += ms(uniform(20, 230))) {
+            int      key  = 36 + random() % 61;
+            uint64_t held = ms(uniform(100, 600));
+
+            add(time, 0x90 + SynclavierKBI1MIDIProtocolNoteChannel, key, 1 + random() % 127);
+
+            for (uint64_t at = ms(10); aftertouch && at < held; at += ms(10))
+                add(time + at, 0xA0 + SynclavierKBI1MIDIProtocolNoteChannel, key, random() % 128);
+
+            add(time + held, 0x80 + SynclavierKBI1MIDIProtocolNoteChannel, key, 0x40);
+        }
+
+        // Ribbon gestures
+        for (uint64_t time = ms(uniform(0, 1000)); time < end; time += ms(uniform(1000, 3000))) {
+            uint64_t length   = ms(uniform(300, 1500));
+            int      position = 0x2000;
+
+            for (uint64_t at = 0; at < length; at += ms(2)) {
+                int delta = (int) (random() % 15) - 7;
+
+                position = std::max(0, std::min(0x3FFF, position + delta * 16));
+
+                add(time + at, 0xB0 + SynclavierKBI1MIDIProtocolNoteChannel, 0x10, delta & 0x7F);
+                add(time + at, 0xE0 + SynclavierKBI1MIDIProtocolRibbonChannel, position & 0x7F, position >> 7);
+            }
+        }
+
+        // Knob turns
+        for (uint64_t time = ms(uniform(0, 2000)); time < end; time += ms(uniform(2000, 4000))) {
+            uint64_t length = ms(uniform(200, 800));
+            int      value  = random() % 0x4000;
+            int      step   = (int) (random() % 65) - 32;
+
+            for (uint64_t at = 0; at < length; at += ms(5)) {
+                value = std::max(0, std::min(0x3FFF, value + step));
+
+                add(time + at, 0xE0 + SynclavierKBI1MIDIProtocolKnobChannel, value & 0x7F, value >> 7);
+            }
+        }
+
+        // Mod wheel sweeps
+        for (uint64_t time = ms(uniform(0, 4000)); time < end; time += ms(uniform(3000, 6000))) {
+            for (int step = 0; step < 64; step++)
+                add(time + ms(step * 8), 0xB0 + SynclavierKBI1MIDIProtocolNoteChannel, 0x01, step < 32 ? step * 4 : (63 - step) * 4);
+        }
+
+        // Sustain pedal
+        for (uint64_t time = ms(uniform(0, 2000)); time < end; time += ms(uniform(1000, 4000))) {
+            add(time,                         0xB0 + SynclavierKBI1MIDIProtocolNoteChannel, 0x40, 0x7F);
+            add(time + ms(uniform(200, 900)), 0xB0 + SynclavierKBI1MIDIProtocolNoteChannel, 0x40, 0x00);
+        }
+
+        // Panel buttons
+        for (uint64_t time = ms(uniform(0, 2000)); time < end; time += ms(uniform(500, 2500))) {
+            int button = random() % 128;
+
+            add(time,          0x90 + SynclavierKBI1MIDIProtocolVKChannel, button, 0x7F);
+            add(time + ms(80), 0x80 + SynclavierKBI1MIDIProtocolVKChannel, button, 0x00);
+        }
+
+        std::stable_sort(messages.begin(), messages.end(), [](const SynclavierKBI1TimedMessage& a, const SynclavierKBI1TimedMessage& b) {
+            return a.time < b.time;
+        });
+
+        return messages;
+    }
+
+    // Send messages through device at speed times real time (0 for as fast as possible).
+    // Messages due at the same time go in one send. Returns the number of messages sent.
+    static inline long long play(SynclavierKBI1SimulatedDevice& device, const std::vector<SynclavierKBI1TimedMessage>& messages, double speed) {
+        uint8_t   buffer[SynclavierKBI1MIDIOutputBatch::kCapacity];
+        uint64_t  start = SynclavierKBI1HostTimeToNanos(SynclavierKBI1HostTimeNow());
+        long long sent  = 0;
+
+        for (size_t i = 0; i < messages.size(); ) {
+            uint64_t time   = messages[i].time;
+            int      length = 0;
+
+            if (speed > 0) {
+                uint64_t due = start + (uint64_t) (time / speed);
+                uint64_t now = SynclavierKBI1HostTimeToNanos(SynclavierKBI1HostTimeNow());
+
+                if (due > now)
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+            }
+
+            while (i < messages.size() && messages[i].time == time && length + messages[i].length <= (int) sizeof(buffer)) {
+                memcpy(&buffer[length], messages[i].bytes, messages[i].length);
+                length += messages[i].length;
+                i++;
+                sent++;
+            }
+
+            device.send(buffer, length);
+        }
+
+        return sent;
+    }
+};
+
+#endif
@@ -0,0 +1,371 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1TimerWheel.h
+//
+
+#ifndef SynclavierKBI1TimerWheel_h
+#define SynclavierKBI1TimerWheel_h
+
+#include <stdint.h>
+
+#include "SynclavierKBI1HostTime.h"
+
+// Hierarchical timer wheel with millisecond resolution.
+//
+// kLevels wheels of kSlots slots each. Level 0 holds timers due in the next 64 ms, one slot per
+// millisecond. Each level above covers 64 times the span of the one below (4 s, 4.6 min, 4.9 h).
+// As time passes the slots of the upper levels are cascaded down. Scheduling, cancelling and
+// firing a timer are O(1). A bitmap of occupied slots per level finds the next timer due without
+// looking at empty slots, so the event loop can sleep until exactly then.
+//
+// Timers are owned by the caller and linked into the wheel, so nothing is allocated.
+// A timer proc may schedule or cancel any timer, including itself.
+// All calls must be made on one thread, normally the main application thread.
+//
+//    SynclavierKBI1Timer       poll(PollProc, NULL, 50);               // Every 50 ms
+//    SynclavierKBI1TimerWheel  wheel;
+//
+//    wheel.schedule(poll, 0);
+//
+//    while (1) {
+//        wheel.advance(SynclavierKBI1TimerWheel::clock());
+//        ...wait for input or wheel.untilNext(SynclavierKBI1TimerWheel::clock()) ms
+//    }
+
+class SynclavierKBI1TimerWheel;
+
+class SynclavierKBI1Timer {
+public:
+    typedef void (*TimerProc)(SynclavierKBI1Timer& timer, void* refCon);
+
+    // period is in ms. 0 for a one-shot timer.
+    inline SynclavierKBI1Timer(TimerProc timerProc = nullptr, void* timerRefCon = nullptr, uint32_t timerPeriod = 0) {
+        proc    = timerProc;
+        refCon  = timerRefCon;
+        period  = timerPeriod;
+        expiry  = 0;
+        level   = 0;
+        slot    = 0;
+        next    = this;
+        prev    = this;
+    }
+
+    // Linked into the wheel by address
+    SynclavierKBI1Timer(const SynclavierKBI1Timer&) = delete;
+    SynclavierKBI1Timer& operator=(const SynclavierKBI1Timer&) = delete;
+
+    inline void setPeriod(uint32_t timerPeriod) {period = timerPeriod;}
+
+    inline bool     scheduled() const {return next != this;}
+    inline uint64_t due()       const {return expiry;}         // ms, when scheduled
+
+private:
+    friend class SynclavierKBI1TimerWheel;
+
+    inline void unlink() {
+        prev->next = next;
+        next->prev = prev;
+        next = prev = this;
+    }
+
+    inline void linkBefore(SynclavierKBI1Timer& where) {
+        next        = &where;
+        prev        = where.prev;
+        prev->next  = this;
+        where.prev  = this;
+    }
+
+    TimerProc               proc;
+    void*                   refCon;
+    uint32_t                period;
+    uint64_t                expiry;
+    uint8_t                 level;                              // Where it is in the wheel
+    uint8_t                 slot;
+
+    SynclavierKBI1Timer*    next;                               // Circular list. Points to itself when not scheduled.
+    SynclavierKBI1Timer*    prev;
+};
+
+class SynclavierKBI1TimerWheel {
+public:
+    static const int kLevels    = 4;
+    static const int kSlotBits  = 6;
+    static const int kSlots     = 1 << kSlotBits;
+    static const int kNowhere   = 0xFF;                         // Level of a timer taken out of its slot to be fired
+
+    // Milliseconds of host time
+    static inline uint64_t clock() {
+        return SynclavierKBI1HostTimeToNanos(SynclavierKBI1HostTimeNow()) / 1000000;
+    }
+
+    inline SynclavierKBI1TimerWheel(uint64_t startTime = clock()) {
+        now         = startTime;
+        timerCount  = 0;
+        firedCount  = 0;
+
+        for (int level = 0; level < kLevels; level++) {
+            occupied[level] = 0;
+            stale[level]    = 0;
+
+            for (int slot = 0; slot < kSlots; slot++)
+                slotMin[level][slot] = UINT64_MAX;
+        }
+    }
+
+    // Fire in delay ms. A timer already scheduled is moved.
+    inline void schedule(SynclavierKBI1Timer& timer, uint64_t delay) {
+        scheduleAt(timer, now + delay);
+    }
+
+    // Fire at time (ms). Times already passed fire on the next advance().
+    inline void scheduleAt(SynclavierKBI1Timer& timer, uint64_t time) {
+        cancel(timer);
+
+        timer.expiry = time > now ? time : now + 1;
+        insert(timer);
+        timerCount++;
+    }
+
+    inline void cancel(SynclavierKBI1Timer& timer) {
+        if (!timer.scheduled())
+            return;
+
+        // The slot's bit is left set and its earliest expiry may now be too early.
+        // Both are put right when the slot is next looked at.
+        if (timer.level != kNowhere)
+            stale[timer.level] |= (uint64_t) 1 << timer.slot;
+
+        timer.unlink();
+        timerCount--;
+    }
+
+    // Fire everything due up to and including time. Periodic timers are put back for their next period.
+    inline void advance(uint64_t time) {
+        while (now < time) {
+
+            // Nothing scheduled, jump ahead
+            if (timerCount == 0) {
+                now = time;
+                break;
+            }
+
+            // Skip to the next time a slot needs looking at
+            uint64_t next = nextEvent();
+
+            if (next > time) {
+                now = time;
+                break;
+            }
+
+            now = next;
+
+            cascade();
+            fire();
+        }
+    }
+
+    // ms from time until the next timer is due. 0 if one is due now, -1 if none are scheduled.
+    inline int64_t untilNext(uint64_t time) {
+        if (timerCount == 0)
+            return -1;
+
+        uint64_t next = earliest();
+
+        return next > time ? (int64_t) (next - time) : 0;
+    }
+
+    // Statistics
+    inline int          scheduledTimers() const {return timerCount;}
+    inline long long    fired()           const {return firedCount;}
+    inline uint64_t     time()            const {return now;}
+
+private:
+    inline int slotFor(uint64_t expiry, int level) const {
+        return (int) (expiry >> (level * kSlotBits)) & (kSlots - 1);
+    }
+
+    inline void insert(SynclavierKBI1Timer& timer) {
+        uint64_t delta = timer.expiry - now;
+        int      level = 0;
+
+        while (level < kLevels - 1 && delta >= ((uint64_t) 1 << ((level + 1) * kSlotBits)))
+            level++;
+
+        // Beyond the top level: park in the furthest top-level slot and look again when it cascades
+        uint64_t expiry = timer.expiry;
+        uint64_t span   = (uint64_t) 1 << (kLevels * kSlotBits);
+
+        if (delta >= span)
+            expiry = now + span - 1;
+
+        int slot = slotFor(expiry, level);
+
+        timer.linkBefore(slots[level][slot]);
+        timer.level = level;
+        timer.slot  = slot;
+
+        occupied[level] |= (uint64_t) 1 << slot;
+
+        if (timer.expiry < slotMin[level][slot])
+            slotMin[level][slot] = timer.expiry;
+    }
+
+    // The next time after now at which a level 0 slot fires or an upper slot cascades
+    inline uint64_t nextEvent() {
+        uint64_t best = UINT64_MAX;
+
+        for (int level = 0; level < kLevels; level++) {
+            if (occupied[level] == 0)
+                continue;
+
+            int      shift = level * kSlotBits;
+            uint64_t base  = (now >> shift) + 1;                   // First slot after now at this level
+
+            // Rotate so bit 0 is the slot for base
+            int      start   = (int) (base & (kSlots - 1));
+            uint64_t rotated = (occupied[level] >> start) | (start ? occupied[level] << (kSlots - start) : 0);
+
+            // Level 0 slots are looked at when due; upper slots when they cascade at the start of their span
+            uint64_t when = (base + __builtin_ctzll(rotated)) << shift;
+
+            if (when < best)
+                best = when;
+        }
+
+        return best;
+    }
+
+    // The earliest expiry of any timer. Exact: the first occupied slot of each level holds the
+    // earliest timers of that level, and each slot keeps its earliest expiry.
+    inline uint64_t earliest() {
+        uint64_t best = UINT64_MAX;
+
+        for (int level = 0; level < kLevels; level++) {
+            while (occupied[level]) {
+                int      shift   = level * kSlotBits;
+                uint64_t base    = level == 0 ? now + 1 : (now >> shift) + 1;
+                int      start   = (int) (base & (kSlots - 1));
+                uint64_t rotated = (occupied[level] >> start) | (start ? occupied[level] << (kSlots - start) : 0);
+                int      slot    = (start + __builtin_ctzll(rotated)) & (kSlots - 1);
+
+                auto&    head    = slots[level][slot];
+
+                // Cancelled timers leave bits behind
+                if (head.next == &head) {
+                    occupied[level]     &= ~((uint64_t) 1 << slot);
+                    stale[level]        &= ~((uint64_t) 1 << slot);
+                    slotMin[level][slot] = UINT64_MAX;
+                    continue;
+                }
+
+                // Look again after a cancel
+                if (stale[level] & ((uint64_t) 1 << slot)) {
+                    slotMin[level][slot] = UINT64_MAX;
+
+                    for (auto timer = head.next; timer != &head; timer = timer->next) {
+                        if (timer->expiry < slotMin[level][slot])
+                            slotMin[level][slot] = timer->expiry;
+                    }
+
+                    stale[level] &= ~((uint64_t) 1 << slot);
+                }
+
+                if (slotMin[level][slot] < best)
+                    best = slotMin[level][slot];
+
+                break;
+            }
+        }
+
+        return best;
+    }
+
+    // At the start of each upper level span, move its timers down
+    inline void cascade() {
+        int top = 0;
+
+        while (top < kLevels - 1 && slotFor(now, top) == 0)
+            top++;
+
+        for (int level = top; level > 0; level--) {
+            int slot = slotFor(now, level);
+
+            if ((occupied[level] & ((uint64_t) 1 << slot)) == 0)
+                continue;
+
+            SynclavierKBI1Timer list;
+
+            take(level, slot, list);
+
+            while (list.next != &list) {
+                auto& timer = *list.next;
+
+                timer.unlink();
+                insert(timer);
+            }
+        }
+    }
+
+    inline void fire() {
+        int slot = slotFor(now, 0);
+
+        if ((occupied[0] & ((uint64_t) 1 << slot)) == 0)
+            return;
+
+        SynclavierKBI1Timer list;
+
+        take(0, slot, list);
+
+        while (list.next != &list) {
+            auto& timer = *list.next;
+
+            timer.unlink();
+            timerCount--;
+            firedCount++;
+
+            // Periodic timers keep their phase
+            if (timer.period) {
+                uint64_t next = timer.expiry + timer.period;
+
+                if (next <= now)
+                    next = now + timer.period;
+
+                scheduleAt(timer, next);
+            }
+
+            if (timer.proc)
+                timer.proc(timer, timer.refCon);
+        }
+    }
+
+    // Move a slot's timers to list so timer procs can change the wheel while they are fired
+    inline void take(int level, int slot, SynclavierKBI1Timer& list) {
+        auto& head = slots[level][slot];
+
+        occupied[level]     &= ~((uint64_t) 1 << slot);
+        stale[level]        &= ~((uint64_t) 1 << slot);
+        slotMin[level][slot] = UINT64_MAX;
+
+        if (head.next == &head)
+            return;
+
+        for (auto timer = head.next; timer != &head; timer = timer->next)
+            timer->level = kNowhere;
+
+        list.next       = head.next;
+        list.prev       = head.prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head.next       = head.prev = &head;
+    }
+
+    uint64_t                now;                                // ms. Everything due at or before now has fired.
+    int                     timerCount;
+    long long               firedCount;
+
+    uint64_t                occupied[kLevels];                  // Bit per slot that may hold timers
+    uint64_t                stale[kLevels];                     // Bit per slot with a timer cancelled since slotMin was found
+    uint64_t                slotMin[kLevels][kSlots];           // Earliest expiry in each slot
+    SynclavierKBI1Timer     slots[kLevels][kSlots];             // List heads
+};
+
+#endif
@@ -0,0 +1,553 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1Trace.h
+//
+
+#ifndef SynclavierKBI1Trace_h
+#define SynclavierKBI1Trace_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "SynclavierKBI1MIDITransport.h"
+#include "SynclavierKBI1HostTime.h"
+
+// Binary trace of the MIDI traffic to and from KBI-1s, for reproducing problems and offline benchmarks.
+//
+// File layout (little-endian):
+//
+//  SynclavierKBI1TraceHeader       64 bytes
+//  Records                         SynclavierKBI1TraceRecord, then its MIDI bytes padded to 8
+//  Index                           SynclavierKBI1TraceIndexEntry for every kIndexInterval'th record
+//
+// Records are appended as traffic happens. The index is written and the header filled in when the
+// trace is closed. A trace that was never closed (the tool crashed or was killed) has no index and
+// a record count of 0, and is read by walking the records up to the end of the file.
+//
+// SynclavierKBI1TraceWriter takes records on the MIDI threads and the application thread without
+// locking or waiting. Each source (see SynclavierKBI1MIDITransportTrace.h) has a lane of its own,
+// a single-producer ring of bytes. A thread of the writer's own merges the lanes in time order and
+// writes them to the file. If a lane is full the record is dropped and counted.
+//
+// SynclavierKBI1TraceReader maps a trace into memory and walks it, or replays it into a transport
+// receive proc at its original timing, a multiple of it, or as fast as possible.
+
+enum SynclavierKBI1TraceDirection : uint8_t {
+    SynclavierKBI1TraceIn   = 0,                                // From the KBI-1
+    SynclavierKBI1TraceOut  = 1,                                // To the KBI-1
+};
+
+struct SynclavierKBI1TraceHeader {
+    char        magic[8];                                       // "KBI1TRC"
+    uint32_t    version;
+    uint32_t    headerSize;
+    uint64_t    startTime;                                      // Wall clock at time 0, ns since 1970
+    uint64_t    recordCount;                                    // 0 if the trace was not closed
+    uint64_t    dataEnd;                                        // File offset of the end of the records. 0 if not closed.
+    uint64_t    indexOffset;                                    // File offset of the index. 0 if none.
+    uint64_t    indexCount;
+    uint64_t    dropped;                                        // Records lost because a lane was full
+};
+
+struct SynclavierKBI1TraceRecord {
+    uint64_t    time;                                           // ns since the trace started
+    uint32_t    length;                                         // MIDI bytes that follow
+    uint8_t     direction;                                      // SynclavierKBI1TraceDirection
+    uint8_t     unit;                                           // Which KBI-1
+    uint16_t    reserved;
+};
+
+struct SynclavierKBI1TraceIndexEntry {
+    uint64_t    time;
+    uint64_t    offset;                                         // File offset of the record
+};
+
+static_assert(sizeof(SynclavierKBI1TraceHeader) == 64, "Trace header is 64 bytes");
+static_assert(sizeof(SynclavierKBI1TraceRecord) == 16, "Trace record header is 16 bytes");
+
+static const char     SynclavierKBI1TraceMagic[8]   = "KBI1TRC";
+static const uint32_t SynclavierKBI1TraceVersion    = 1;
+static const int      SynclavierKBI1TraceMaxLength  = 65535;    // MIDI bytes in a record
+
+inline uint64_t SynclavierKBI1TraceRecordSize(uint32_t length)
+{
+    return sizeof(SynclavierKBI1TraceRecord) + ((length + 7) & ~7ULL);
+}
+
+// Lanes hold cache-line aligned counters, so the writer should be static or on the stack rather
+// than allocated with new. Mac OS 10.13 does not have aligned new.
+class SynclavierKBI1TraceWriter {
+public:
+    static const int kMaxLanes          = 32;
+    static const int kLaneBytes         = 1 << 18;              // Per lane. A power of 2.
+    static const int kIndexInterval     = 1024;                 // Records per index entry
+
+    inline SynclavierKBI1TraceWriter() {
+        file        = nullptr;
+        laneCount.store(0);
+        startHost   = 0;
+        offset      = 0;
+        recordCount = 0;
+
+        running.store(false);
+    }
+
+    inline ~SynclavierKBI1TraceWriter() {
+        close();
+
+        for (auto& lane : lanes)
+            delete[] lane.buffer;
+    }
+
+    // Create the trace file and start writing. Returns false if it could not be created.
+    inline bool open(const char* path) {
+        close();
+
+        file = fopen(path, "wb");
+
+        if (!file)
+            return false;
+
+        setvbuf(file, nullptr, _IOFBF, 1 << 16);
+
+        startHost   = SynclavierKBI1HostTimeNow();
+        offset      = 0;
+        recordCount = 0;
+
+        index.clear();
+
+        for (int i = 0; i < laneCount.load(); i++) {
+            lanes[i].head.store(0);
+            lanes[i].tail.store(0);
+            lanes[i].producerTail = 0;
+            lanes[i].dropped.store(0);
+        }
+
+        SynclavierKBI1TraceHeader header = makeHeader();
+
+        fwrite(&header, sizeof(header), 1, file);
+        offset = sizeof(header);
+
+        running.store(true);
+        thread = std::thread([this] {run();});
+
+        return true;
+    }
+
+    // Write what is left, the index and the header, and close the file
+    inline void close() {
+        if (!file)
+            return;
+
+        running.store(false);
+        thread.join();
+
+        drain();
+
+        SynclavierKBI1TraceHeader header = makeHeader();
+
+        header.recordCount  = recordCount;
+        header.dataEnd      = offset;
+        header.indexOffset  = index.empty() ? 0 : offset;
+        header.indexCount   = index.size();
+
+        if (!index.empty())
+            fwrite(index.data(), sizeof(index[0]), index.size(), file);
+
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, file);
+        fclose(file);
+
+        file = nullptr;
+    }
+
+    // A lane for one producer thread. Returns -1 if there are no more.
+    // Lanes are added from one thread, before or while writing.
+    inline int addLane() {
+        int number = laneCount.load(std::memory_order_relaxed);
+
+        if (number == kMaxLanes)
+            return -1;
+
+        auto& lane = lanes[number];
+
+        if (!lane.buffer)
+            lane.buffer = new uint8_t[kLaneBytes];
+
+        laneCount.store(number + 1, std::memory_order_release);
+
+        return number;
+    }
+
+    // Producer of lane only. Never allocates, locks or waits.
+    // timeStamp is host time, 0 for now. Returns false if the record was dropped.
+    inline bool record(int laneNumber, SynclavierKBI1TraceDirection direction, int unit, const uint8_t* bytes, int length, uint64_t timeStamp) {
+        if (laneNumber < 0 || laneNumber >= laneCount.load(std::memory_order_relaxed) || !running.load(std::memory_order_relaxed))
+            return false;
+
+        auto&    lane = lanes[laneNumber];
+        uint64_t size = SynclavierKBI1TraceRecordSize(length);
+        uint64_t head = lane.head.load(std::memory_order_relaxed);
+
+        if (length < 0 || length > SynclavierKBI1TraceMaxLength || size > kLaneBytes / 2) {
+            lane.dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        // Only re-read the writer's position when the lane looks full
+        if (head + size - lane.producerTail > (uint64_t) kLaneBytes) {
+            lane.producerTail = lane.tail.load(std::memory_order_acquire);
+
+            if (head + size - lane.producerTail > (uint64_t) kLaneBytes) {
+                lane.dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+
+        uint64_t time = timeStamp ? timeStamp : SynclavierKBI1HostTimeNow();
+
+        SynclavierKBI1TraceRecord record;
+
+        record.time      = time > startHost ? SynclavierKBI1HostTimeToNanos(time - startHost) : 0;
+        record.length    = (uint32_t) length;
+        record.direction = direction;
+        record.unit      = (uint8_t) unit;
+        record.reserved  = 0;
+
+        copyIn(lane, head, &record, sizeof(record));
+        copyIn(lane, head + sizeof(record), bytes, length);
+
+        lane.head.store(head + size, std::memory_order_release);
+
+        return true;
+    }
+
+    inline bool isOpen() const {return file != nullptr;}
+
+    // Statistics
+    inline long long records() const {return recordCount;}                 // Written so far. Writer thread, or after close().
+    inline long long dropped() const {
+        long long count = 0;
+        int       lanesInUse = laneCount.load(std::memory_order_acquire);
+
+        for (int i = 0; i < lanesInUse; i++)
+            count += lanes[i].dropped.load(std::memory_order_relaxed);
+
+        return count;
+    }
+
+private:
+    struct Lane {
+        alignas(64) std::atomic<uint64_t>   head;               // Bytes written. Producer.
+        uint64_t                            producerTail;       // Producer's copy of tail
+        std::atomic<long long>              dropped;
+        alignas(64) std::atomic<uint64_t>   tail;               // Bytes read. Writer thread.
+        uint8_t*                            buffer = nullptr;
+    };
+
+    inline SynclavierKBI1TraceHeader makeHeader() const {
+        SynclavierKBI1TraceHeader header = {};
+
+        memcpy(header.magic, SynclavierKBI1TraceMagic, sizeof(header.magic));
+
+        auto wallClock = std::chrono::system_clock::now().time_since_epoch();
+        auto sinceOpen = SynclavierKBI1HostTimeToNanos(SynclavierKBI1HostTimeNow() - startHost);
+
+        header.version      = SynclavierKBI1TraceVersion;
+        header.headerSize   = sizeof(header);
+        header.startTime    = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(wallClock).count() - sinceOpen;
+        header.dropped      = dropped();
+
+        return header;
+    }
+
+    static inline void copyIn(Lane& lane, uint64_t position, const void* from, size_t length) {
+        size_t at    = position & (kLaneBytes - 1);
+        size_t first = length < kLaneBytes - at ? length : kLaneBytes - at;
+
+        memcpy(&lane.buffer[at], from, first);
+        memcpy(lane.buffer, (const uint8_t*) from + first, length - first);
+    }
+
+    static inline void copyOut(const Lane& lane, uint64_t position, void* to, size_t length) {
+        size_t at    = position & (kLaneBytes - 1);
+        size_t first = length < kLaneBytes - at ? length : kLaneBytes - at;
+
+        memcpy(to, &lane.buffer[at], first);
+        memcpy((uint8_t*) to + first, lane.buffer, length - first);
+    }
+
+    // ---- Writer thread ----
+
+    inline void run() {
+        while (running.load()) {
+            if (drain() == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    // Write out everything waiting, earliest first across the lanes. Returns the number of records.
+    inline int drain() {
+        uint8_t buffer[sizeof(SynclavierKBI1TraceRecord) + SynclavierKBI1TraceMaxLength + 8];
+        int     count = 0;
+        int     lanesInUse = laneCount.load(std::memory_order_acquire);
+
+        while (true) {
+            SynclavierKBI1TraceRecord   earliest = {};
+            Lane*                       from     = nullptr;
+
+            for (int i = 0; i < lanesInUse; i++) {
+                auto&    lane = lanes[i];
+                uint64_t tail = lane.tail.load(std::memory_order_relaxed);
+
+                if (lane.head.load(std::memory_order_acquire) == tail)
+                    continue;
+
+                SynclavierKBI1TraceRecord record;
+
+                copyOut(lane, tail, &record, sizeof(record));
+
+                if (!from || record.time < earliest.time) {
+                    earliest = record;
+                    from     = &lane;
+                }
+            }
+
+            if (!from)
+                return count;
+
+            uint64_t tail = from->tail.load(std::memory_order_relaxed);
+            uint64_t size = SynclavierKBI1TraceRecordSize(earliest.length);
+
+            copyOut(*from, tail, buffer, size);
+            from->tail.store(tail + size, std::memory_order_release);
+
+            if (recordCount % kIndexInterval == 0)
+                index.push_back({earliest.time, offset});
+
+            fwrite(buffer, size, 1, file);
+
+            offset += size;
+            recordCount++;
+            count++;
+        }
+    }
+
+    Lane                                        lanes[kMaxLanes];
+    std::atomic<int>                            laneCount;
+    uint64_t                                    startHost;      // Host time of time 0
+    std::atomic<bool>                           running;
+
+    // Writer thread
+    FILE*                                       file;
+    std::thread                                 thread;
+    uint64_t                                    offset;
+    long long                                   recordCount;
+    std::vector<SynclavierKBI1TraceIndexEntry>  index;
+};
+
+class SynclavierKBI1TraceReader {
+public:
+    struct Record {
+        uint64_t        time;                                   // ns since the trace started
+        int             direction;                              // SynclavierKBI1TraceDirection
+        int             unit;
+        const uint8_t*  bytes;                                  // In the mapped file
+        int             length;
+    };
+
+    inline SynclavierKBI1TraceReader() {
+        data        = nullptr;
+        size        = 0;
+        header      = nullptr;
+        dataEnd     = 0;
+        indexCount  = 0;
+        position    = 0;
+    }
+
+    inline ~SynclavierKBI1TraceReader() {
+        close();
+    }
+
+    // Map a trace. Returns false if it is not a trace this code can read.
+    inline bool open(const char* path) {
+        close();
+
+        int descriptor = ::open(path, O_RDONLY);
+
+        if (descriptor < 0)
+            return false;
+
+        struct stat info;
+
+        if (fstat(descriptor, &info) != 0 || (size_t) info.st_size < sizeof(SynclavierKBI1TraceHeader)) {
+            ::close(descriptor);
+            return false;
+        }
+
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+        ::close(descriptor);
+
+        if (mapped == MAP_FAILED)
+            return false;
+
+        data    = (const uint8_t*) mapped;
+        size    = info.st_size;
+        header  = (const SynclavierKBI1TraceHeader*) data;
+
+        if (memcmp(header->magic, SynclavierKBI1TraceMagic, sizeof(header->magic)) != 0 || header->version != SynclavierKBI1TraceVersion
+         || header->headerSize < sizeof(SynclavierKBI1TraceHeader) || header->headerSize > size) {
+            close();
+            return false;
+        }
+
+        // Not closed: the records run to the end of the file
+        dataEnd = header->dataEnd && header->dataEnd <= size ? header->dataEnd : size;
+
+        if (header->indexOffset + header->indexCount * sizeof(SynclavierKBI1TraceIndexEntry) > size)
+            indexCount = 0;
+        else
+            indexCount = header->indexOffset ? header->indexCount : 0;
+
+        rewind();
+
+        return true;
+    }
+
+    inline void close() {
+        if (data)
+            munmap((void*) data, size);
+
+        data    = nullptr;
+        size    = 0;
+        header  = nullptr;
+    }
+
+    inline void rewind() {
+        position = header ? header->headerSize : 0;
+    }
+
+    // The next record. Returns false at the end, or where a trace that was not closed was cut short.
+    inline bool next(Record& record) {
+        if (!data || position + sizeof(SynclavierKBI1TraceRecord) > dataEnd)
+            return false;
+
+        SynclavierKBI1TraceRecord stored;
+
+        memcpy(&stored, data + position, sizeof(stored));
+
+        uint64_t recordSize = SynclavierKBI1TraceRecordSize(stored.length);
+
+        if (stored.length > (uint32_t) SynclavierKBI1TraceMaxLength || position + recordSize > dataEnd)
+            return false;
+
+        record.time      = stored.time;
+        record.direction = stored.direction;
+        record.unit      = stored.unit;
+        record.bytes     = data + position + sizeof(stored);
+        record.length    = (int) stored.length;
+
+        position += recordSize;
+
+        return true;
+    }
+
+    // Go to the first record at or after time ns. Uses the index if there is one.
+    inline void seek(uint64_t time) {
+        rewind();
+
+        if (indexCount) {
+            auto*  entries = (const SynclavierKBI1TraceIndexEntry*) (data + header->indexOffset);
+            size_t low     = 0;
+            size_t high    = indexCount;
+
+            // Last entry at or before time
+            while (high - low > 1) {
+                size_t middle = (low + high) / 2;
+
+                if (entries[middle].time <= time)
+                    low = middle;
+                else
+                    high = middle;
+            }
+
+            if (entries[low].time <= time && entries[low].offset < dataEnd)
+                position = entries[low].offset;
+        }
+
+        uint64_t before = position;
+        Record   record;
+
+        while (next(record)) {
+            if (record.time >= time) {
+                position = before;
+                return;
+            }
+
+            before = position;
+        }
+    }
+
+    // Hand the records going direction to proc from the current position, as a transport hands it
+    // packets. speed is times the original timing, 0 for as fast as possible. unit -1 for all.
+    // Each packet is time stamped with the host time it is handed over. Returns the number of records.
+    inline long long replay(SynclavierKBI1MIDITransport::ReceiveProc proc, void* refCon, SynclavierKBI1TraceDirection direction, double speed = 0, int unit = -1) {
+        Record    record;
+        long long count = 0;
+        uint64_t  start = SynclavierKBI1HostTimeNow();
+        bool      first = true;
+        uint64_t  base  = 0;
+
+        while (next(record)) {
+            if (record.direction != direction || (unit >= 0 && record.unit != unit))
+                continue;
+
+            if (first) {
+                base  = record.time;
+                first = false;
+            }
+
+            if (speed > 0 && record.time > base) {
+                uint64_t due = start + SynclavierKBI1NanosToHostTime((uint64_t) ((record.time - base) / speed));
+                uint64_t now = SynclavierKBI1HostTimeNow();
+
+                if (due > now)
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(SynclavierKBI1HostTimeToNanos(due - now)));
+            }
+
+            proc(record.bytes, record.length, SynclavierKBI1HostTimeNow(), refCon);
+            count++;
+        }
+
+        return count;
+    }
+
+    inline bool isOpen() const {return data != nullptr;}
+
+    // From the header. 0 records means the trace was not closed, so walk it to count.
+    inline long long records()    const {return header ? (long long) header->recordCount : 0;}
+    inline long long dropped()    const {return header ? (long long) header->dropped : 0;}
+    inline uint64_t  startTime()  const {return header ? header->startTime : 0;}
+    inline bool      hasIndex()   const {return indexCount != 0;}
+
+private:
+    const uint8_t*                      data;
+    size_t                              size;
+    const SynclavierKBI1TraceHeader*    header;
+    uint64_t                            dataEnd;
+    uint64_t                            indexCount;
+    uint64_t                            position;               // File offset of the next record
+};
+
+#endif
@@ -0,0 +1,613 @@
+//
+//  Synclavier MIDI Protocol - SynclavierKBI1UMP.h
+//
+
+#ifndef SynclavierKBI1UMP_h
+#define SynclavierKBI1UMP_h
+
+#include <stdint.h>
+
+#include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1MIDIParser.h"
+#include "SynclavierKBI1MIDIOutputBatch.h"
+
+// MIDI 2.0 Universal MIDI Packets - https://midi.org/universal-midi-packet-ump-and-midi-2-0-protocol-specification
+//
+// A UMP message is 1 to 4 32-bit words. The top 4 bits of the first word are the message type,
+// which alone gives the length (SynclavierKBI1UMPWords), so a buffer of messages is walked a
+// word count at a time with no byte-by-byte state. Everything the KBI-1 sends fits in:
+//
+//  - Type 1    System real time and common, 1 word
+//  - Type 2    MIDI 1.0 channel voice, 1 word: the status and data bytes as they are
+//  - Type 3    7-bit SysEx, 2 words per 6 bytes
+//  - Type 4    MIDI 2.0 channel voice, 2 words: the first holds status, channel and indexes,
+//              the second the value, 16-bit velocity or 32-bit everything else
+//
+// In MIDI 2.0 messages an NRPN is one Assignable Controller message (bank, index and a 32-bit
+// value) rather than four controllers, and velocity, aftertouch, controllers, ribbon and knob
+// values are scaled up from 7 and 14 bits by the specification's bit-repeating rule, so the
+// lowest, middle and highest values stay where they were and scaling back down gives back the
+// original value exactly.
+//
+// The KBI-1 speaks MIDI 1.0. Converters sit at the edges (see SynclavierKBI1MIDITransportUMP.h):
+//
+//  - SynclavierKBI1UMPFromMIDI1    bytes from the KBI-1 to UMP words, through the MIDI 1.0 parser
+//  - SynclavierKBI1UMPToMIDI1      UMP words to bytes for the KBI-1, into a MIDI 1.0 output batch
+//
+// Words are collected in a SynclavierKBI1UMPBatch and handed on a block at a time, as
+// SynclavierKBI1MIDIOutputBatch does with bytes. Nothing is allocated.
+
+// Words in a message, by message type
+static constexpr uint8_t SynclavierKBI1UMPWords[16] = {1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4};
+
+enum SynclavierKBI1UMPType : uint8_t {
+    SynclavierKBI1UMPUtility            = 0x0,
+    SynclavierKBI1UMPSystem             = 0x1,
+    SynclavierKBI1UMPMIDI1              = 0x2,
+    SynclavierKBI1UMPSysEx7             = 0x3,
+    SynclavierKBI1UMPMIDI2              = 0x4,
+};
+
+// MIDI 2.0 channel voice status (the opcode in bits 20 - 23 of the first word)
+enum SynclavierKBI1UMPOpcode : uint8_t {
+    SynclavierKBI1UMPRegisteredController  = 0x2,               // RPN
+    SynclavierKBI1UMPAssignableController  = 0x3,               // NRPN
+    SynclavierKBI1UMPNoteOff               = 0x8,
+    SynclavierKBI1UMPNoteOn                = 0x9,
+    SynclavierKBI1UMPPolyPressure          = 0xA,
+    SynclavierKBI1UMPControlChange         = 0xB,
+    SynclavierKBI1UMPProgramChange         = 0xC,
+    SynclavierKBI1UMPChannelPressure       = 0xD,
+    SynclavierKBI1UMPPitchBend             = 0xE,
+};
+
+// 7-bit SysEx status (bits 20 - 23)
+enum SynclavierKBI1UMPSysExStatus : uint8_t {
+    SynclavierKBI1UMPSysExComplete  = 0x0,
+    SynclavierKBI1UMPSysExStart     = 0x1,
+    SynclavierKBI1UMPSysExContinue  = 0x2,
+    SynclavierKBI1UMPSysExEnd       = 0x3,
+};
+
+class SynclavierKBI1UMP {
+public:
+    // Fields of a first word
+    static inline int words(uint32_t word)   {return SynclavierKBI1UMPWords[word >> 28];}
+    static inline int type(uint32_t word)    {return word >> 28;}
+    static inline int group(uint32_t word)   {return (word >> 24) & 0xF;}
+    static inline int status(uint32_t word)  {return (word >> 16) & 0xFF;}
+    static inline int opcode(uint32_t word)  {return (word >> 20) & 0xF;}
+    static inline int channel(uint32_t word) {return (word >> 16) & 0xF;}
+    static inline int index1(uint32_t word)  {return (word >> 8) & 0x7F;}
+    static inline int index2(uint32_t word)  {return word & 0x7F;}
+
+    // Scale a value of from bits up to to bits: shift it up, then above the middle fill the new
+    // low bits by repeating the value's bits below its top one
+    static constexpr uint32_t scaleUp(uint32_t value, int from, int to) {
+        int      shift   = to - from;
+        uint32_t shifted = value << shift;
+
+        if (value <= (1U << (from - 1)))
+            return shifted;
+
+        int      repeat = from - 1;
+        uint32_t bits   = value & ((1U << repeat) - 1);
+
+        bits = shift > repeat ? bits << (shift - repeat) : bits >> (repeat - shift);
+
+        for (; bits; bits >>= repeat)
+            shifted |= bits;
+
+        return shifted;
+    }
+
+    static inline uint32_t scaleDown(uint32_t value, int from, int to) {
+        return value >> (from - to);
+    }
+
+    // One word
+    static inline uint32_t system(int group, int status, int data1, int data2) {
+        return (uint32_t) SynclavierKBI1UMPSystem << 28 | (uint32_t) (group & 0xF) << 24 | (uint32_t) (status & 0xFF) << 16 | (data1 & 0x7F) << 8 | (data2 & 0x7F);
+    }
+
+    static inline uint32_t midi1(int group, int status, int data1, int data2) {
+        return (uint32_t) SynclavierKBI1UMPMIDI1 << 28 | (uint32_t) (group & 0xF) << 24 | (uint32_t) (status & 0xFF) << 16 | (data1 & 0x7F) << 8 | (data2 & 0x7F);
+    }
+
+    // First word of a MIDI 2.0 channel voice message
+    static inline uint32_t head(int group, int opcode, int channel, int index1, int index2) {
+        return (uint32_t) SynclavierKBI1UMPMIDI2 << 28 | (uint32_t) (group & 0xF) << 24 | (uint32_t) (opcode & 0xF) << 20 |
+               (uint32_t) (channel & 0xF) << 16 | (index1 & 0x7F) << 8 | (index2 & 0x7F);
+    }
+
+    // MIDI 2.0 channel voice messages, 2 words into message
+    static inline void noteOn(uint32_t* message, int group, int channel, int note, uint16_t velocity) {
+        message[0] = head(group, SynclavierKBI1UMPNoteOn, channel, note, 0);
+        message[1] = (uint32_t) velocity << 16;
+    }
+
+    static inline void noteOff(uint32_t* message, int group, int channel, int note, uint16_t velocity) {
+        message[0] = head(group, SynclavierKBI1UMPNoteOff, channel, note, 0);
+        message[1] = (uint32_t) velocity << 16;
+    }
+
+    static inline void polyPressure(uint32_t* message, int group, int channel, int note, uint32_t value) {
+        message[0] = head(group, SynclavierKBI1UMPPolyPressure, channel, note, 0);
+        message[1] = value;
+    }
+
+    static inline void controller(uint32_t* message, int group, int channel, int number, uint32_t value) {
+        message[0] = head(group, SynclavierKBI1UMPControlChange, channel, number, 0);
+        message[1] = value;
+    }
+
+    // NRPN param (14 bits) set to value. The bank is the param's MSB, the index its LSB.
+    static inline void assignable(uint32_t* message, int group, int channel, int param, uint32_t value) {
+        message[0] = head(group, SynclavierKBI1UMPAssignableController, channel, param >> 7, param);
+        message[1] = value;
+    }
+
+    // RPN
+    static inline void registered(uint32_t* message, int group, int channel, int param, uint32_t value) {
+        message[0] = head(group, SynclavierKBI1UMPRegisteredController, channel, param >> 7, param);
+        message[1] = value;
+    }
+
+    static inline void program(uint32_t* message, int group, int channel, int number) {
+        message[0] = head(group, SynclavierKBI1UMPProgramChange, channel, 0, 0);
+        message[1] = (uint32_t) (number & 0x7F) << 24;
+    }
+
+    static inline void channelPressure(uint32_t* message, int group, int channel, uint32_t value) {
+        message[0] = head(group, SynclavierKBI1UMPChannelPressure, channel, 0, 0);
+        message[1] = value;
+    }
+
+    // 0x80000000 is the middle
+    static inline void pitchBend(uint32_t* message, int group, int channel, uint32_t value) {
+        message[0] = head(group, SynclavierKBI1UMPPitchBend, channel, 0, 0);
+        message[1] = value;
+    }
+
+    // Up to 6 bytes of a SysEx, 2 words into message
+    static inline void sysEx7(uint32_t* message, int group, int sysExStatus, const uint8_t* bytes, int count) {
+        uint8_t data[6] = {};
+
+        for (int i = 0; i < count && i < 6; i++)
+            data[i] = bytes[i] & 0x7F;
+
+        message[0] = (uint32_t) SynclavierKBI1UMPSysEx7 << 28 | (uint32_t) (group & 0xF) << 24 | (uint32_t) (sysExStatus & 0xF) << 20 |
+                     (uint32_t) (count & 0xF) << 16 | data[0] << 8 | data[1];
+        message[1] = (uint32_t) data[2] << 24 | (uint32_t) data[3] << 16 | (uint32_t) data[4] << 8 | data[5];
+    }
+
+    // Walk whole messages: proc(const uint32_t* message, int words). Returns the words used;
+    // a message cut off at the end is left for the next call.
+    template <typename PROC>
+    static inline int forEach(const uint32_t* words, int count, PROC proc) {
+        int used = 0;
+
+        while (used < count) {
+            int length = SynclavierKBI1UMPWords[words[used] >> 28];
+
+            if (used + length > count)
+                break;
+
+            proc(words + used, length);
+            used += length;
+        }
+
+        return used;
+    }
+};
+
+static_assert(SynclavierKBI1UMP::scaleUp(0x40, 7, 32) == 0x80000000U, "The middle stays in the middle");
+static_assert(SynclavierKBI1UMP::scaleUp(0x7F, 7, 16) == 0xFFFF, "The top stays at the top");
+
+// Collects UMP messages and hands them on a block at a time
+class SynclavierKBI1UMPBatch {
+public:
+    // Called with the collected words when the batch is flushed. Words are only valid during the call.
+    typedef void (*FlushProc)(const uint32_t* words, int count, void* refCon);
+
+    static const int kCapacity = 256;                           // Words collected before the batch flushes on its own
+
+    inline SynclavierKBI1UMPBatch(FlushProc proc = nullptr, void* refCon = nullptr) {
+        flushProc       = proc;
+        flushRefCon     = refCon;
+        length          = 0;
+
+        messageCount    = 0;
+        wordCount       = 0;
+        flushCount      = 0;
+    }
+
+    inline void setFlushProc(FlushProc proc, void* refCon) {
+        flush();
+        flushProc   = proc;
+        flushRefCon = refCon;
+    }
+
+    // Room for a message of count words, to be filled in. Messages are never split across flushes.
+    inline uint32_t* reserve(int count) {
+        if (length + count > kCapacity)
+            flush();
+
+        uint32_t* message = &buffer[length];
+
+        length += count;
+        messageCount++;
+
+        return message;
+    }
+
+    inline void add(const uint32_t* message) {
+        int       count = SynclavierKBI1UMP::words(message[0]);
+        uint32_t* to    = reserve(count);
+
+        for (int i = 0; i < count; i++)
+            to[i] = message[i];
+    }
+
+    inline void add1(uint32_t word) {*reserve(1) = word;}
+
+    inline void flush() {
+        if (length == 0)
+            return;
+
+        if (flushProc)
+            flushProc(buffer, length, flushRefCon);
+
+        wordCount  += length;
+        flushCount += 1;
+        length      = 0;
+    }
+
+    inline void discard() {length = 0;}
+
+    inline int  pending() const {return length;}
+    inline bool empty()   const {return length == 0;}
+
+    // Statistics
+    inline long long messages() const {return messageCount;}
+    inline long long words()    const {return wordCount;}
+    inline long long flushes()  const {return flushCount;}
+
+private:
+    FlushProc   flushProc;
+    void*       flushRefCon;
+
+    uint32_t    buffer[kCapacity];
+    int         length;
+
+    long long   messageCount;
+    long long   wordCount;
+    long long   flushCount;
+};
+
+// MIDI 1.0 bytes to UMP, as MIDI 2.0 channel voice messages or, with setProtocol(1), as MIDI 1.0
+// ones in UMP words. Controllers 99 and 98 (101 and 100 for an RPN) then 6 and 38 become one
+// Assignable (Registered) Controller message when 38 arrives, as the KBI-1 sends all four.
+class SynclavierKBI1UMPFromMIDI1 : public SynclavierKBI1MIDIParserHandler {
+public:
+    inline SynclavierKBI1UMPFromMIDI1(SynclavierKBI1UMPBatch& outputBatch, int outputGroup = 0) : batch(outputBatch) {
+        group       = outputGroup & 0xF;
+        midi2       = true;
+
+        sysExLength = 0;
+        sysExStarted = false;
+
+        reset();
+    }
+
+    inline void reset() {
+        parser.reset();
+
+        for (auto& state : channels)
+            state = {};
+
+        sysExLength  = 0;
+        sysExStarted = false;
+    }
+
+    // 2 for MIDI 2.0 channel voice messages, 1 for MIDI 1.0 ones
+    inline void setProtocol(int protocol) {midi2 = protocol != 1;}
+
+    // Convert the next bytes of the stream. May be called with any split of the stream.
+    inline void convert(const uint8_t* bytes, int length) {
+        parser.parse(bytes, length, *this);
+    }
+
+    // ---- SynclavierKBI1MIDIParserHandler ----
+
+    inline void message(uint8_t status, uint8_t data1, uint8_t data2) {
+        int channel = status & 0xF;
+
+        if (status >= 0xF0) {
+            batch.add1(SynclavierKBI1UMP::system(group, status, data1, data2));
+            return;
+        }
+
+        if (!midi2) {
+            batch.add1(SynclavierKBI1UMP::midi1(group, status, data1, data2));
+            return;
+        }
+
+        switch (status >> 4) {
+            case 0x8:
+                SynclavierKBI1UMP::noteOff(batch.reserve(2), group, channel, data1, (uint16_t) SynclavierKBI1UMP::scaleUp(data2, 7, 16));
+                break;
+
+            // A note on with velocity 0 is a note off with the default release velocity
+            case 0x9:
+                if (data2)
+                    SynclavierKBI1UMP::noteOn(batch.reserve(2), group, channel, data1, (uint16_t) SynclavierKBI1UMP::scaleUp(data2, 7, 16));
+                else
+                    SynclavierKBI1UMP::noteOff(batch.reserve(2), group, channel, data1, 0x8000);
+                break;
+
+            case 0xA:
+                SynclavierKBI1UMP::polyPressure(batch.reserve(2), group, channel, data1, SynclavierKBI1UMP::scaleUp(data2, 7, 32));
+                break;
+
+            case 0xB:
+                controller(channel, data1, data2);
+                break;
+
+            case 0xC:
+                SynclavierKBI1UMP::program(batch.reserve(2), group, channel, data1);
+                break;
+
+            case 0xD:
+                SynclavierKBI1UMP::channelPressure(batch.reserve(2), group, channel, SynclavierKBI1UMP::scaleUp(data1, 7, 32));
+                break;
+
+            default:
+                SynclavierKBI1UMP::pitchBend(batch.reserve(2), group, channel, SynclavierKBI1UMP::scaleUp(data1 | data2 << 7, 14, 32));
+                break;
+        }
+    }
+
+    inline void realTime(uint8_t status) {
+        batch.add1(SynclavierKBI1UMP::system(group, status, 0, 0));
+    }
+
+    // Packed 6 bytes to a message. The last 6 are held until it is known whether more follow.
+    inline void sysEx(const uint8_t* bytes, int length, bool start, bool end) {
+        if (start) {
+            sysExLength  = 0;
+            sysExStarted = false;
+            bytes++;                                            // 0xF0
+            length--;
+        }
+
+        for (int i = 0; i < length; i++) {
+            if (bytes[i] == 0xF7)
+                break;
+
+            if (sysExLength == 6) {
+                SynclavierKBI1UMP::sysEx7(batch.reserve(2), group, sysExStarted ? SynclavierKBI1UMPSysExContinue : SynclavierKBI1UMPSysExStart, sysExBytes, 6);
+                sysExStarted = true;
+                sysExLength  = 0;
+            }
+
+            sysExBytes[sysExLength++] = bytes[i];
+        }
+
+        if (end) {
+            SynclavierKBI1UMP::sysEx7(batch.reserve(2), group, sysExStarted ? SynclavierKBI1UMPSysExEnd : SynclavierKBI1UMPSysExComplete, sysExBytes, sysExLength);
+            sysExLength  = 0;
+            sysExStarted = false;
+        }
+    }
+
+    inline const SynclavierKBI1MIDIParser& midiParser() const {return parser;}
+
+private:
+    enum Selected : uint8_t {
+        SelectedNone,
+        SelectedNRPN,
+        SelectedRPN,
+    };
+
+    struct ChannelState {
+        uint8_t selected;                                       // Selected
+        uint8_t paramMSB;
+        uint8_t paramLSB;
+        uint8_t dataMSB;
+    };
+
+    inline void controller(int channel, int number, int value) {
+        auto& state = channels[channel];
+
+        switch (number) {
+            case SynclavierKBI1MIDIProtocolNRPN::nrpnMSB:   state.selected = SelectedNRPN; state.paramMSB = value;    return;
+            case SynclavierKBI1MIDIProtocolNRPN::nrpnLSB:   state.selected = SelectedNRPN; state.paramLSB = value;    return;
+            case 0x65:                                      state.selected = SelectedRPN;  state.paramMSB = value;    return;
+            case 0x64:                                      state.selected = SelectedRPN;  state.paramLSB = value;    return;
+
+            case SynclavierKBI1MIDIProtocolNRPN::dataMSB:
+                if (state.selected == SelectedNone)
+                    break;
+
+                state.dataMSB = value;
+                return;
+
+            case SynclavierKBI1MIDIProtocolNRPN::dataLSB: {
+                if (state.selected == SelectedNone)
+                    break;
+
+                int      param = state.paramMSB << 7 | state.paramLSB;
+                uint32_t data  = SynclavierKBI1UMP::scaleUp(state.dataMSB << 7 | value, 14, 32);
+
+                if (state.selected == SelectedNRPN)
+                    SynclavierKBI1UMP::assignable(batch.reserve(2), group, channel, param, data);
+                else
+                    SynclavierKBI1UMP::registered(batch.reserve(2), group, channel, param, data);
+
+                return;
+            }
+
+            default:
+                break;
+        }
+
+        SynclavierKBI1UMP::controller(batch.reserve(2), group, channel, number, SynclavierKBI1UMP::scaleUp(value, 7, 32));
+    }
+
+    SynclavierKBI1UMPBatch&     batch;
+    SynclavierKBI1MIDIParser    parser;
+    int                         group;
+    bool                        midi2;
+
+    ChannelState                channels[16];
+
+    uint8_t                     sysExBytes[6];
+    int                         sysExLength;
+    bool                        sysExStarted;
+};
+
+// UMP to MIDI 1.0 bytes. Values are scaled back down; an Assignable (Registered) Controller
+// message becomes all four NRPN (RPN) controllers. Message types with no MIDI 1.0 form
+// (utility, per-note controllers, 128-bit data) are counted and left out.
+class SynclavierKBI1UMPToMIDI1 {
+public:
+    inline SynclavierKBI1UMPToMIDI1(SynclavierKBI1MIDIOutputBatch& outputBatch) : batch(outputBatch) {
+        droppedCount = 0;
+    }
+
+    // Convert whole messages. Returns the words used; a message cut off at the end is left.
+    inline int convert(const uint32_t* words, int count) {
+        return SynclavierKBI1UMP::forEach(words, count, [this](const uint32_t* message, int) {
+            convertMessage(message);
+        });
+    }
+
+    inline void convertMessage(const uint32_t* message) {
+        uint32_t word   = message[0];
+        int      status = SynclavierKBI1UMP::status(word);
+        int      data1  = SynclavierKBI1UMP::index1(word);
+        int      data2  = SynclavierKBI1UMP::index2(word);
+
+        switch (SynclavierKBI1UMP::type(word)) {
+            case SynclavierKBI1UMPSystem:
+                sendSystem(status, data1, data2);
+                break;
+
+            case SynclavierKBI1UMPMIDI1:
+                if (SynclavierKBI1MIDIStatusTable[status].dataBytes == 1)
+                    batch.send2(status, data1);
+                else
+                    batch.send3(status, data1, data2);
+                break;
+
+            case SynclavierKBI1UMPSysEx7:
+                sendSysEx(message);
+                break;
+
+            case SynclavierKBI1UMPMIDI2:
+                sendChannelVoice(word, message[1]);
+                break;
+
+            default:
+                droppedCount++;
+                break;
+        }
+    }
+
+    // Statistics
+    inline long long dropped() const {return droppedCount;}
+
+private:
+    inline void sendSystem(int status, int data1, int data2) {
+        int bytes = SynclavierKBI1MIDIStatusTable[status].dataBytes;
+
+        if (bytes == 2)
+            batch.send3(status, data1, data2);
+        else if (bytes == 1)
+            batch.send2(status, data1);
+        else
+            batch.send1(status);
+    }
+
+    inline void sendSysEx(const uint32_t* message) {
+        int     sysExStatus = (message[0] >> 20) & 0xF;
+        int     count       = (message[0] >> 16) & 0xF;
+        uint8_t data[6]     = {(uint8_t) (message[0] >> 8), (uint8_t) message[0], (uint8_t) (message[1] >> 24),
+                               (uint8_t) (message[1] >> 16), (uint8_t) (message[1] >> 8), (uint8_t) message[1]};
+
+        if (sysExStatus == SynclavierKBI1UMPSysExComplete || sysExStatus == SynclavierKBI1UMPSysExStart)
+            batch.send1(0xF0);
+
+        for (int i = 0; i < count && i < 6; i++)
+            batch.sendData(data[i]);
+
+        if (sysExStatus == SynclavierKBI1UMPSysExComplete || sysExStatus == SynclavierKBI1UMPSysExEnd)
+            batch.send1(0xF7);
+    }
+
+    inline void sendChannelVoice(uint32_t word, uint32_t value) {
+        int channel = SynclavierKBI1UMP::channel(word);
+        int index1  = SynclavierKBI1UMP::index1(word);
+        int index2  = SynclavierKBI1UMP::index2(word);
+
+        switch (SynclavierKBI1UMP::opcode(word)) {
+            case SynclavierKBI1UMPNoteOff:
+                batch.send3(0x80 | channel, index1, SynclavierKBI1UMP::scaleDown(value >> 16, 16, 7));
+                break;
+
+            // A MIDI 2.0 note on is never a note off
+            case SynclavierKBI1UMPNoteOn: {
+                int velocity = SynclavierKBI1UMP::scaleDown(value >> 16, 16, 7);
+
+                batch.send3(0x90 | channel, index1, velocity ? velocity : 1);
+                break;
+            }
+
+            case SynclavierKBI1UMPPolyPressure:
+                batch.send3(0xA0 | channel, index1, SynclavierKBI1UMP::scaleDown(value, 32, 7));
+                break;
+
+            case SynclavierKBI1UMPControlChange:
+                batch.send3(0xB0 | channel, index1, SynclavierKBI1UMP::scaleDown(value, 32, 7));
+                break;
+
+            // All four parts, in order, as the KBI-1 requires
+            case SynclavierKBI1UMPAssignableController:
+            case SynclavierKBI1UMPRegisteredController: {
+                bool nrpn = SynclavierKBI1UMP::opcode(word) == SynclavierKBI1UMPAssignableController;
+                int  data = SynclavierKBI1UMP::scaleDown(value, 32, 14);
+
+                batch.send3(0xB0 | channel, nrpn ? SynclavierKBI1MIDIProtocolNRPN::nrpnMSB : 0x65, index1);
+                batch.send3(0xB0 | channel, nrpn ? SynclavierKBI1MIDIProtocolNRPN::nrpnLSB : 0x64, index2);
+                batch.send3(0xB0 | channel, SynclavierKBI1MIDIProtocolNRPN::dataMSB, data >> 7);
+                batch.send3(0xB0 | channel, SynclavierKBI1MIDIProtocolNRPN::dataLSB, data & 0x7F);
+                break;
+            }
+
+            case SynclavierKBI1UMPProgramChange:
+                batch.send2(0xC0 | channel, value >> 24);
+                break;
+
+            case SynclavierKBI1UMPChannelPressure:
+                batch.send2(0xD0 | channel, SynclavierKBI1UMP::scaleDown(value, 32, 7));
+                break;
+
+            case SynclavierKBI1UMPPitchBend: {
+                int bend = SynclavierKBI1UMP::scaleDown(value, 32, 14);
+
+                batch.send3(0xE0 | channel, bend & 0x7F, bend >> 7);
+                break;
+            }
+
+            default:
+                droppedCount++;
+                break;
+        }
+    }
+
+    SynclavierKBI1MIDIOutputBatch&  batch;
+    long long                       droppedCount;
+};
+
+#endif
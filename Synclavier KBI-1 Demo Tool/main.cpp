@@ -6,409 +6,454 @@
 //
 
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
 
 #include <CoreMIDI/CoreMIDI.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <CoreServices/CoreServices.h>
 
 #include "SynclavierKBI1MIDIProtocol.h"
+#include "SynclavierKBI1HostTime.h"
+#include "SynclavierKBI1TimerWheel.h"
+#include "SynclavierKBI1Device.h"
+#include "SynclavierKBI1DisplayFormat.h"
+#include "SynclavierKBI1MIDITransportCoreMIDI.h"
+#include "SynclavierKBI1MIDITransportTrace.h"
+#include "SynclavierKBI1MIDITransportMetrics.h"
+#include "SynclavierKBI1Metrics.h"
+#include "SynclavierKBI1Log.h"
+#include "SynclavierKBI1Benchmarks.h"
 
 // Bare-bones example of communicating with KBI-1 using Macintosh Core Midi.
 // This demo program includes no error recovery.
+//
+// Runs every KBI-1 plugged in, up to kMaxDevices. Each one has its own transport and its own
+// SynclavierKBI1Device holding its decoder, input ring, output batch, panel and status.
 
-// Simple interface to Mac OS Core MIDI
-static MIDIClientRef   MU_MIDIClientRef;        // MIDIClientRef for communicating with MIDI services
-static MIDIPortRef     MU_MIDIOutputPort;       // MIDIPortRef for sending   data to   MIDIServices
-static MIDIPortRef     MU_MIDIInputPort;        // MIDIPortRef for receiving data from MIDIServices
-static MIDIEndpointRef kbi1InputRef;
-static MIDIEndpointRef kbi1OutputRef;
-static CFRunLoopRef    mainRunLoop;
-
-// KBI-1 Management
-static bool kbi1Connected;
-static int  kbi1Status;
-static int  kbi1Time;
-static int  midiParamMSB,    midiParamLSB,    midiDataMSB,    midiDataLSB;
-static int  midiParamMSBSeq, midiParamLSBSeq, midiDataMSBSeq, midiDataLSBSeq;
-static int  midiReceivedSequence;
-static int  secondsCounter;
-static int  testButton = -1;
-
-void ME_Send3Bytes(MIDIEndpointRef cableNum, unsigned char byte1, unsigned char byte2, unsigned char byte3) {
-    MIDIPacketList pktlist;
-    MIDIPacket&    pkt = *MIDIPacketListInit(&pktlist);
-    
-    pktlist.numPackets = 1;
-    
-    pkt.timeStamp = 0;
-    pkt.length    = 3;
-    pkt.data[0]   = byte1;
-    pkt.data[1]   = byte2;
-    pkt.data[2]   = byte3;
-    
-    MIDISend(MU_MIDIOutputPort, kbi1OutputRef, &pktlist);
+static const int kMaxDevices    =   16;
+
+// Simple interface to Mac OS Core MIDI. See SynclavierKBI1MIDITransport.h for other MIDI services.
+// The transports share one MIDI client. Each attaches to a different KBI-1.
+static SynclavierKBI1MIDITransportCoreMIDI kbi1Transports[kMaxDevices];
+
+// Per-device state. Static, as devices hold cache-line aligned rings.
+static SynclavierKBI1Device kbi1Devices[kMaxDevices];
+
+// With -record, everything to and from the KBI-1s goes through these to a trace file
+static SynclavierKBI1MIDITransportTrace kbi1Traces[kMaxDevices];
+static SynclavierKBI1TraceWriter        kbi1TraceWriter;
+
+// Traffic per channel and send times for each KBI-1, and every device's metrics, written to a file with -metrics
+static SynclavierKBI1MIDITransportMetrics   kbi1LinkMetrics[kMaxDevices];
+static SynclavierKBI1MetricsRegistry<>      kbi1Metrics;
+static const char*                          kbi1MetricsPath;
+
+// Log records are formatted on a background thread, to stdout, or written as binary to a file with -log
+static FILE* kbi1LogFile;
+
+static volatile sig_atomic_t kbi1Quit;         // Control-C
+
+static CFRunLoopRef       mainRunLoop;
+static CFRunLoopSourceRef kbi1InputSource;      // Signaled when decoded input is waiting in any device's input ring
+
+static uint64_t startTime;                      // ms
+
+// Each task runs on its own timer. The event loop sleeps until input arrives or the next timer is due.
+static const int kProbePeriod   = 1000;         // ms. Look for KBI-1s and ask who they are.
+static const int kPollPeriod    =   50;         // ms. Ask for ORK/VK status.
+static const int kTimeout       =  200;         // ms without a status reply, over all tries, before the KBI-1 is taken to be gone
+static const int kRenderPeriod  =   33;         // ms. Update the display at 30 frames/sec.
+static const int kLightsPeriod  =  250;         // ms. Step the LED test.
+static const int kControlPeriod =    5;         // ms. Hand on the latest ribbon, knob, wheel and pedal values.
+static const int kLookahead     =   20;         // ms. How far ahead scheduled output is handed to a transport that schedules.
+static const int kMetricsPeriod = 1000;         // ms. Write the metrics file.
+
+// Output budget per KBI-1, beyond control messages. USB full speed carries one 64-byte packet per 1 ms frame
+// (16 MIDI events). Staying under it leaves room for NRPN replies during a full-panel redraw.
+static const int kOutputBudget  =   32;         // Bytes per ms
+static const int kOutputBurst   =  256;         // Bytes that can go at once after a quiet spell
+
+static SynclavierKBI1TimerWheel kbi1Timers;
+
+// Output to each KBI-1 is collected in its device's batch and handed to its transport once per pass of the event loop.
+void ME_Flush()
+{
+    for (auto& device : kbi1Devices)
+        device.flush();
 }
 
-void ME_SendNRPN(MIDIEndpointRef cableNum, int param, int value)
+// Hand scheduled output to the transports. Core MIDI is given it ahead of time and sends it on time.
+void ME_Dispatch()
 {
-    SynclavierKBI1MIDIProtocolNRPN nrpnMessage(param, value, SynclavierKBI1MIDIProtocolNRPNChannel);
-    
-    ME_Send3Bytes(cableNum, nrpnMessage.nrpn1()[0], nrpnMessage.nrpn1()[1], nrpnMessage.nrpn1()[2]);
-    ME_Send3Bytes(cableNum, nrpnMessage.nrpn2()[0], nrpnMessage.nrpn2()[1], nrpnMessage.nrpn2()[2]);
-    ME_Send3Bytes(cableNum, nrpnMessage.data1()[0], nrpnMessage.data1()[1], nrpnMessage.data1()[2]);
-    ME_Send3Bytes(cableNum, nrpnMessage.data2()[0], nrpnMessage.data2()[1], nrpnMessage.data2()[2]);
+    uint64_t now = SynclavierKBI1HostTimeNow();
+
+    for (int unit = 0; unit < kMaxDevices; unit++) {
+        uint64_t lookahead = kbi1Transports[unit].schedulesOutput() ? SynclavierKBI1NanosToHostTime(kLookahead * 1000000ULL) : 0;
+
+        kbi1Devices[unit].dispatch(now, lookahead);
+    }
 }
 
-void ME_SendDisplay(MIDIEndpointRef cableNum, int whichChannel, int whichDisplay, const char* display)
+// Run loop source perform callback. Handles everything waiting in the input rings on the main application thread.
+// Each device sends its replies as soon as its input is handled.
+void MU_DrainInput(void* info)
 {
-    while (display && *display)
-        ME_Send3Bytes(cableNum, 0x90 + whichChannel, whichDisplay, (*display++) & 0x7F);
+    for (auto& device : kbi1Devices)
+        device.drainInput();
+}
 
-    ME_Send3Bytes(cableNum, 0x80 + whichChannel, whichDisplay, 0);
+// Control-C. Stop the event loop so the trace can be finished.
+void MU_Quit(int signal)
+{
+    kbi1Quit = 1;
 }
 
-void ME_SendButton(MIDIEndpointRef cableNum, int whichChannel, int whichButton, int velData)
+// Called on a MIDI thread when a device's input ring goes from empty to not empty.
+// In this command-line tool example we have to wake up the main thread explictly.
+void MU_WakeMain(void* refCon)
 {
-    // Note on with velocity of 0 indicates note off
-    ME_Send3Bytes(cableNum, 0x90 + whichChannel, whichButton, velData);
+    CFRunLoopSourceSignal(kbi1InputSource);
+    CFRunLoopWakeUp(mainRunLoop);
 }
 
-void MU_ReadProc(const MIDIPacketList *pktlist, void *readProcRefCon, void *srcConnRefCon)
+// Callback - MIDI services calls us back when ports are added or removed (e.g. a USB MIDI device is plugged in.
+// The transport calls us when its KBI-1 went away or it found one. Anything collected for the old device is stale.
+// Probe right away rather than at the next probe task, so a KBI-1 plugged back in is asked who it is at once.
+// We are called on the main application thread. refCon is the device.
+void MU_Notify(void* refCon)
 {
-    MIDIEndpointRef endPoint = (MIDIEndpointRef) (long long) srcConnRefCon;
-    
-    // Not from KBI-1
-    if (endPoint != kbi1InputRef)
-        return;
-    
-    auto&   lst = *pktlist;
-    auto    ppk = &lst.packet[0];
-
-    // We are handed a MIDIPacketList by a callback from MIDI Services.
-    // We forward the MIDIPacketLists to MIDI Event processing where they are converted to Synclavier MIDI Events.
-    // We will be called back below (HandleMIDIMessage or HandleMIDISysex) with the assembled message.
-    for (int i=0; i<lst.numPackets; i++, ppk = MIDIPacketNext(ppk)) {
-        auto& packet = *ppk;
-        auto  pData  = &packet.data[0];
-        auto  length = packet.length;
-        
-        while (length > 0) {
-            auto byte1 = *pData++;
-            length     -= 1;
-            
-            // data byte?
-            if (byte1 < 0x80)
-                continue;
-            
-            // System Real-Time Messages - one byte. KBI-1 will not send these.
-            if (byte1 >= 0xF8)
-                continue;
-            
-            // System Common Messages. KBI-1 will not send these so just bail. They are variable-length.
-            if (byte1 >= 0xF0)
-                break;
-            
-            // Must be complete message
-            if (length == 0)
-                break;
-            
-            auto byte2 = *pData++;
-            length     -= 1;
-
-            // Ignore program change
-            if ((byte1 & 0xF0) == 0xC)
-                continue;
-            
-            // Ignore channel pressure
-            if ((byte1 & 0xF0) == 0xD)
-                continue;
-            
-            // Must be complete message
-            if (length == 0)
-                break;
-            
-            auto byte3 = *pData++;
-            length     -= 1;
-
-            // NRPN messages all come on MIDI Channel 2 (0x01). MIDI Channel 1 (0x0) is where
-            // the note on/off messages come in. Other MIDI Channel uses are described in SynclavierKBI1MIDIProtocol.h.
-            if ((byte1 & 0xF) != SynclavierKBI1MIDIProtocolNRPNChannel)
-                continue;
-            
-            // Ignore unless controller movement.
-            if ((byte1 & 0xF0) != 0xB0)
-                continue;
-            
-            // Handle NRPN messages from KBI-1.
-            bool midiNRPNReceived = false;
-            
-            if (byte2 == SynclavierKBI1MIDIProtocolNRPN::nrpnMSB) {
-                midiParamMSB      = byte3;
-                midiParamMSBSeq   = midiReceivedSequence;
-            }
-            else if (byte2 == SynclavierKBI1MIDIProtocolNRPN::nrpnLSB) {
-                midiParamLSB      = byte3;
-                midiParamLSBSeq   = midiReceivedSequence;
-            }
-            else if (byte2 == SynclavierKBI1MIDIProtocolNRPN::dataMSB) {
-                midiDataMSB      = byte3;
-                midiDataMSBSeq   = midiReceivedSequence;
-            }
-            else if (byte2 == SynclavierKBI1MIDIProtocolNRPN::dataLSB) {
-                midiDataLSB      = byte3;
-                midiDataLSBSeq   = midiReceivedSequence;
-                midiNRPNReceived = true;
-            }
-                            
-            // One more processed
-            midiReceivedSequence++;
-            
-            // Require all 4 packets to be sent and sent in order.
-            // This will prevent dropped packets from being handled.
-            if (midiNRPNReceived) {
-                if ((midiParamMSBSeq == midiReceivedSequence-4)
-                &&  (midiParamLSBSeq == midiReceivedSequence-3)
-                &&  (midiDataMSBSeq  == midiReceivedSequence-2)
-                &&  (midiDataLSBSeq  == midiReceivedSequence-1)) {
-                    int param = midiParamMSB<<7 | midiParamLSB;
-                    int data  = midiDataMSB <<7 | midiDataLSB;
-                    
-                    // Process NRPN message on main application thread.
-                    CFRunLoopPerformBlock(mainRunLoop, kCFRunLoopDefaultMode, ^{
-
-                        // KBI-1 could now be unplugged
-                        if (kbi1InputRef == 0 || kbi1OutputRef == 0)
-                            return;
-
-                        // Look for Identification as KBI-1
-                        if (param == SynclavierKBI1MIDIProtocolNRPNMessageHereIAm && data == SynclavierKBI1MIDIProtocolNRPNMessageIAmKBI1) {
-                            if (!kbi1Connected) {
-                                kbi1Connected = true;
-                                
-                                printf("KBI-1 connected.\n");
-                                
-                                // Ask KBI1 to report whether ORK or VK is connected
-                                ME_SendNRPN(kbi1OutputRef, SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNAskValue);
-                            }
-                        }
-                        
-                        // Look for ORK or VK connected. Software polls status once per second
-                        else if (param == SynclavierKBI1MIDIProtocolNRPNMessageStatus) {
-                            int newStatus = data;
-                            
-                            // Record activity
-                            kbi1Time = secondsCounter;
-                            
-                            // Look for change in status
-                            if (newStatus != kbi1Status) {
-                                
-                                // Kbi1 asks who we are so it can handle velocity accordingly
-                                if (newStatus == SynclavierKBI1MIDIProtocolNRPNAskValue)
-                                    ME_SendNRPN(kbi1OutputRef, SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNMessageOtherHere);
-                                                               
-                                else if (newStatus != SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome) {
-                                    
-                                    kbi1Status = newStatus;
-                                    
-                                    if (kbi1Status == SynclavierKBI1MIDIProtocolNRPNMessageORKHere)
-                                        printf("Ork connected.\n");
-                                    
-                                    else if (kbi1Status == SynclavierKBI1MIDIProtocolNRPNMessageVKHere)
-                                        printf("VK connected.\n");
-                                    
-                                    else
-                                        printf("Unknown keyboard connected.\n");
-
-                                    // Begin by clearing ORK/VK Display
-                                    ME_SendNRPN(kbi1OutputRef, SynclavierKBI1MIDIProtocolNRPNMessageClear, 0);
-                                    
-                                    // Start LED test
-                                    testButton = -1;
-                                }
-                                
-                                // Else ork disconnected or powered down. Remove the buttons from update list
-                                else {
-                                    
-                                    kbi1Status = newStatus;
-                                    
-                                    printf("ORK/VK disconnected.\n");
-                                }
-                            }
-                        }
-                        
-                        // Refresh. KBI-1 asks for refresh after we time out by breaking into debugger. That is the KBI-1 is reconnecting
-                        // to us so it needs a refresh. We never noticed it going away.
-                        else if (param == SynclavierKBI1MIDIProtocolNRPNMessageRefresh && data == SynclavierKBI1MIDIProtocolNRPNAskValue)  {
-
-                            // Must respond with clear to start things going agin
-                            if (kbi1Status != SynclavierKBI1MIDIProtocolNRPNMessageNoOneHome)
-                                ME_SendNRPN(kbi1OutputRef, SynclavierKBI1MIDIProtocolNRPNMessageClear, 0);
-                        }
-                    });
-                    
-                    // In this command-line tool example we have to wake up the main thread explictly.
-                    CFRunLoopWakeUp(mainRunLoop);
-                }
-            }
-        }
-    }
+    auto& device = *(SynclavierKBI1Device*) refCon;
+
+    device.forget();
+    device.probe();
 }
 
-void MU_PollForKBI1()
+
+// Recommended practice it to poll KBI-1 periodically. This detects the keyboard
+// being turned off for example. MIDI services also tells the transport when the KBI-1
+// MIDI USB Device is removed or reconnected (see MU_Notify).
+
+// Probe task. Wait for devices to show up and ask them who they are. Also detect them going away.
+void MU_Probe(SynclavierKBI1Timer& timer, void* refCon)
 {
-    if (kbi1InputRef == 0) {
-        auto n = MIDIGetNumberOfSources();
-        
-        for (int which = 0; which < n; which++) {
-            CFStringRef epNameRef = NULL;
-
-            auto endpointRef = MIDIGetSource(which);
-            
-            if (endpointRef == 0)
-                continue;
-            
-            if (MIDIObjectGetStringProperty(endpointRef, kMIDIPropertyName, &epNameRef) != 0)
-                continue;
-            
-            if (epNameRef == nullptr)
-                continue;
-            
-            if (CFStringCompare(epNameRef, CFSTR("Synclavier KBI-1"), 0) == kCFCompareEqualTo) {
-                kbi1InputRef = endpointRef;
-                printf("KBI-1 input  found 0x%08x.\n", kbi1InputRef);
-                
-                MIDIPortConnectSource(MU_MIDIInputPort, kbi1InputRef, (void*) (long long) kbi1InputRef);
-            }
-            
-            CFRelease(epNameRef);
-        }
+    for (auto& device : kbi1Devices)
+        device.probe();
+}
+
+// Poll task. For each KBI1 connected, poll for ORK or VK being available.
+// Look for it going away (e.g. powered down, maybe stopped in debugger).
+void MU_Poll(SynclavierKBI1Timer& timer, void* refCon)
+{
+    for (auto& device : kbi1Devices)
+        device.poll();
+}
+
+// Render task. Update the displays and send display and light changes.
+void MU_Render(SynclavierKBI1Timer& timer, void* refCon)
+{
+    int tenths = (int) ((SynclavierKBI1TimerWheel::clock() - startTime) / 100);
+
+    // Seconds to a tenth. The ORK shows up to 999.9.
+    auto ork = SynclavierKBI1DisplayFormat::ork(tenths % 10000, 1);
+
+    SynclavierKBI1DisplayFramebuffer::Line line;
+    SynclavierKBI1DisplayFormat::fixed(line, 0, 11, tenths, 1);
+
+    for (auto& device : kbi1Devices) {
+        if (device.status() == SynclavierKBI1MIDIProtocolNRPNMessageORKHere)
+            device.panel.display.setORK(ork);
+
+        if (device.status() == SynclavierKBI1MIDIProtocolNRPNMessageVKHere)
+            device.panel.display.setVKLine(0, line);
+
+        // Only changes are sent
+        device.render();
     }
-    
-    if (kbi1OutputRef == 0) {
-        auto n = MIDIGetNumberOfDestinations();
-        
-        for (int which = 0; which < n; which++) {
-            CFStringRef epNameRef = NULL;
-
-            auto endpointRef = MIDIGetDestination(which);
-            
-            if (endpointRef == 0)
-                continue;
-            
-            if (MIDIObjectGetStringProperty(endpointRef, kMIDIPropertyName, &epNameRef) != 0)
-                continue;
-            
-            if (epNameRef == nullptr)
-                continue;
-            
-            if (CFStringCompare(epNameRef, CFSTR("Synclavier KBI-1"), 0) == kCFCompareEqualTo) {
-                kbi1OutputRef = endpointRef;
-                printf("KBI-1 output found 0x%08x.\n", kbi1OutputRef);
-            }
-            CFRelease(epNameRef);
+}
+
+// Lights task. We just need the music now.
+// Each step is scheduled for the next tick of the task so the lights step in exact time
+// however late the main thread gets to them. Scheduled output skips the output queues, so
+// the device forgets steps not yet sent when it clears or restores the panel.
+void MU_Lights(SynclavierKBI1Timer& timer, void* refCon)
+{
+    uint64_t when = SynclavierKBI1NanosToHostTime(timer.due() * 1000000ULL);
+
+    for (auto& device : kbi1Devices) {
+        int channel;
+
+        if (device.status() == SynclavierKBI1MIDIProtocolNRPNMessageORKHere)
+            channel = SynclavierKBI1MIDIProtocolORKChannel;
+
+        else if (device.status() == SynclavierKBI1MIDIProtocolNRPNMessageVKHere)
+            channel = SynclavierKBI1MIDIProtocolVKChannel;
+
+        else
+            continue;
+
+        if (device.testButton >= 0) {
+            device.scheduler.sendButton(when, channel, device.testButton, SynclavierKBI1MIDIProtocolButtonOff);
+            device.panel.leds.setSent(channel, device.testButton, SynclavierKBI1LEDState::LEDOff);
         }
+
+        device.testButton = (device.testButton + 1) & 0x7F;
+
+        device.scheduler.sendButton(when, channel, device.testButton, SynclavierKBI1MIDIProtocolButtonOn);
+        device.panel.leds.setSent(channel, device.testButton, SynclavierKBI1LEDState::LEDOn);
     }
 }
 
-// Callback - MIDI services calls us back when ports are added or removed (e.g. a USB MIDI device is plugged in.
-// We respond by performing a callback into the app.
-// We are called on the main application thread.
-void MU_Notify(const MIDINotification *message, void *refCon)
+// Controls task. Ribbon, knob, wheel and pedal input is cut down to the latest value per control each period.
+// An application gets the values by setting each device's controls proc.
+void MU_Controls(SynclavierKBI1Timer& timer, void* refCon)
 {
-    // Simply poll for the device again
-    kbi1InputRef = kbi1OutputRef = NULL;
-    
-    MU_PollForKBI1();
+    for (auto& device : kbi1Devices)
+        device.tickControls();
+}
+
+// Metrics task. Replace the metrics file with a new snapshot, for a scraper to pick up.
+void MU_Metrics(SynclavierKBI1Timer& timer, void* refCon)
+{
+    if (!kbi1Metrics.writeFile(kbi1MetricsPath))
+        SynclavierKBI1Log(SynclavierKBI1LogWarning, "Could not write %s.\n", kbi1MetricsPath);
 }
 
 
+// Round-trip latency and throughput of a real KBI-1. Results are JSON, on stdout or in the file given with -json.
+int MU_EchoTest(int argc, const char* argv[])
+{
+    auto& transport = kbi1Transports[0];
+
+    if (!transport.open()) {
+        fprintf(stderr, "Could not connect to MIDI services.\n");
+        return 1;
+    }
+
+    // Give a KBI-1 just plugged in a few seconds to show up
+    for (int tries = 0; tries < 50 && !transport.findDevice(); tries++)
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, true);
+
+    if (!transport.connected()) {
+        fprintf(stderr, "No KBI-1 found.\n");
+        return 1;
+    }
+
+    return SynclavierKBI1RunEchoTest(transport, "KBI-1", argc, argv);
+}
+
 // Start the show.
 int main(int argc, const char * argv[]) {
 
-    MIDIClientCreate    (CFSTR("KBI-1 Test Program"), MU_Notify, NULL, &MU_MIDIClientRef);
-    MIDIInputPortCreate (MU_MIDIClientRef, CFSTR("KBI-1 Test Program"), MU_ReadProc, NULL, &MU_MIDIInputPort);
-    MIDIOutputPortCreate(MU_MIDIClientRef, CFSTR("KBI-1 Test Program"), &MU_MIDIOutputPort);
+    // Benchmarks run stand-alone without MIDI services. e.g. -bench batch
+    if (argc > 2 && strcmp(argv[1], "-bench") == 0)
+        return SynclavierKBI1RunBenchmark(argv[2], argc - 3, argv + 3);
+
+    // Print a binary log as text. e.g. -readlog show.log
+    if (argc > 2 && strcmp(argv[1], "-readlog") == 0) {
+        static SynclavierKBI1LogReader reader;
+
+        if (!reader.open(argv[2])) {
+            fprintf(stderr, "%s is not a KBI-1 log.\n", argv[2]);
+            return 1;
+        }
+
+        reader.print(stdout);
+        return 0;
+    }
+
+    // Echo test against the first KBI-1 found. e.g. -echo -rate 2000 -burst 4
+    if (argc > 1 && strcmp(argv[1], "-echo") == 0)
+        return MU_EchoTest(argc - 2, argv + 2);
+
+    // Record all traffic to and from the KBI-1s until control-C. e.g. -record show.trace
+    // Replay it with -bench trace -trace show.trace
+    if (argc > 2 && strcmp(argv[1], "-record") == 0) {
+        if (!kbi1TraceWriter.open(argv[2])) {
+            printf("Could not create %s. Terminating.\n", argv[2]);
+            exit(0);
+        }
+
+        printf("Recording to %s.\n", argv[2]);
+    }
+
+    // Write metrics in the Prometheus text format once a second. e.g. -metrics /var/lib/node_exporter/kbi1.prom
+    for (int arg = 1; arg + 1 < argc; arg++) {
+        if (strcmp(argv[arg], "-metrics") == 0)
+            kbi1MetricsPath = argv[arg + 1];
+    }
+
+    // Log in binary to a file instead of as text. e.g. -log show.log. Read it with -readlog show.log
+    for (int arg = 1; arg + 1 < argc; arg++) {
+        if (strcmp(argv[arg], "-log") == 0 && !(kbi1LogFile = fopen(argv[arg + 1], "wb"))) {
+            printf("Could not create %s. Terminating.\n", argv[arg + 1]);
+            exit(0);
+        }
+    }
+
+    signal(SIGINT, MU_Quit);
     
-    if (MU_MIDIClientRef == 0 || MU_MIDIInputPort == 0 || MU_MIDIOutputPort == 0) {
-        printf("Could not connect to MIDI services. Terminating.\n");
-        exit(0);
+    for (int unit = 0; unit < kMaxDevices; unit++) {
+        auto& transport = kbi1Transports[unit];
+        auto& device    = kbi1Devices[unit];
+
+        SynclavierKBI1MIDITransport* link = &transport;
+
+        if (kbi1TraceWriter.isOpen()) {
+            kbi1Traces[unit].attach(link, &kbi1TraceWriter, unit + 1);
+            link = &kbi1Traces[unit];
+        }
+
+        if (kbi1MetricsPath) {
+            char labels[SynclavierKBI1MetricsRegistry<>::kLabelSize];
+
+            snprintf(labels, sizeof(labels), "unit=\"%d\"", unit + 1);
+
+            kbi1LinkMetrics[unit].attach(link);
+            kbi1LinkMetrics[unit].addTo(kbi1Metrics, labels);
+            device.addMetrics(kbi1Metrics, labels);
+
+            link = &kbi1LinkMetrics[unit];
+        }
+
+        device.attach(link, unit + 1);
+
+        device.setTimeout(kTimeout);
+        device.setOutputBudget(kOutputBudget, kOutputBurst);
+
+        transport.setChangeProc(MU_Notify, &device);
+
+        if (!transport.open()) {
+            printf("Could not connect to MIDI services. Terminating.\n");
+            exit(0);
+        }
     }
     
-    printf("Start of KBI-1 Demo. Waiting for KBI-1.\n");
+    // From here on, nothing is formatted or written on the main thread
+    SynclavierKBI1Logger::shared().start(kbi1LogFile ? kbi1LogFile : stdout, kbi1LogFile != nullptr);
+
+    SynclavierKBI1Log(SynclavierKBI1LogInfo, "Start of KBI-1 Demo. Waiting for KBI-1s.\n");
     
     mainRunLoop = CFRunLoopGetMain();
+    
+    // Input from the MIDI thread is handled by a run loop source on the main thread
+    CFRunLoopSourceContext inputContext = {};
+    
+    inputContext.perform = MU_DrainInput;
+    kbi1InputSource      = CFRunLoopSourceCreate(NULL, 0, &inputContext);
+    
+    CFRunLoopAddSource(mainRunLoop, kbi1InputSource, kCFRunLoopDefaultMode);
+    
+    for (auto& device : kbi1Devices)
+        device.setWakeProc(MU_WakeMain, NULL);
+
+    // Start the tasks. Probe right away.
+    SynclavierKBI1Timer probeTimer  (MU_Probe,   NULL, kProbePeriod);
+    SynclavierKBI1Timer pollTimer   (MU_Poll,    NULL, kPollPeriod);
+    SynclavierKBI1Timer renderTimer (MU_Render,  NULL, kRenderPeriod);
+    SynclavierKBI1Timer lightsTimer (MU_Lights,  NULL, kLightsPeriod);
+    SynclavierKBI1Timer controlTimer(MU_Controls, NULL, kControlPeriod);
+    SynclavierKBI1Timer metricsTimer(MU_Metrics,  NULL, kMetricsPeriod);
+
+    startTime = SynclavierKBI1TimerWheel::clock();
+
+    kbi1Timers.advance(startTime);
+    kbi1Timers.schedule(probeTimer,  0);
+    kbi1Timers.schedule(pollTimer,   kPollPeriod);
+    kbi1Timers.schedule(renderTimer, kRenderPeriod);
+    kbi1Timers.schedule(lightsTimer, kLightsPeriod);
+    kbi1Timers.schedule(controlTimer, kControlPeriod);
+
+    if (kbi1MetricsPath)
+        kbi1Timers.schedule(metricsTimer, kMetricsPeriod);
+
+    while (!kbi1Quit) {
+        uint64_t now = SynclavierKBI1TimerWheel::clock();
+
+        // Run the tasks that are due
+        kbi1Timers.advance(now);
+
+        // Retry queries the KBI-1s have not answered in time, or give up on them
+        uint64_t hostNow = SynclavierKBI1HostTimeNow();
+
+        for (auto& device : kbi1Devices)
+            device.expire(hostNow);
+
+        // Send everything the tasks collected, and scheduled output that is due
+        ME_Flush();
+        ME_Dispatch();
 
-    while (1) {
-
-        // Recommended practice it to poll KBI-1 periodically. This detects the keyboard
-        // being turned off for example. A more comprehensive example would register for
-        // MIDI topology changes to be notified when the KBI-1 MIDI USB Device was
-        // removed or reconnected.
-        
-        // Wait for device to show up. Also detect going away.
-        if (kbi1InputRef == 0 || kbi1InputRef == 0) {
-            if (kbi1Connected) {
-                printf("KBI-1 unplugged.\n");
-                
-                kbi1Connected = false;
-                kbi1Status    = 0;
-            }
-            
-            MU_PollForKBI1();
-            
-            // Poll immediately if found
-            if (kbi1InputRef != 0 && kbi1OutputRef != 0)
+        // Wait for input or the next task to be due
+        int64_t wait = kbi1Timers.untilNext(now);
+
+        // Or for a query to be due for retry
+        for (auto& device : kbi1Devices) {
+            uint64_t deadline = device.nextDeadline();
+
+            if (deadline == 0)
                 continue;
+
+            int64_t due = (int64_t) (SynclavierKBI1HostTimeToNanos(deadline) / 1000000) - (int64_t) now + 1;
+
+            if (due < 0)
+                due = 0;
+
+            if (wait < 0 || due < wait)
+                wait = due;
         }
-        
-        // Poll for KBI1 if it is not connected
-        else if (!kbi1Connected)
-            ME_SendNRPN(kbi1OutputRef, SynclavierKBI1MIDIProtocolNRPNMessageWhoAreYou, SynclavierKBI1MIDIProtocolNRPNAskValue);
-        
-        // Look for it going away (e.g. powered down, maybe stopped in debugger) if it is connected
-        else if (kbi1Status != 0 && (secondsCounter > kbi1Time + 5)) {
-            printf("KBI-1 timout\n");
-            
-            kbi1Connected = false;
-            kbi1Status    = 0;
-        }
-        
-        // Else if KBI1 connected, poll for ORK or VK being available
-        else
-            ME_SendNRPN(kbi1OutputRef, SynclavierKBI1MIDIProtocolNRPNMessageStatus, SynclavierKBI1MIDIProtocolNRPNAskValue);
-        
-        // Display
-        if (kbi1Status == SynclavierKBI1MIDIProtocolNRPNMessageORKHere) {
-            char number[10];
-            snprintf(number, sizeof(number), "%4d", secondsCounter % 1000);
-            ME_SendDisplay(kbi1OutputRef, SynclavierKBI1MIDIProtocolDisplayChannel, SynclavierKBI1MIDIProtocolORKDisplay, number);
-            
-            if (testButton >= 0)
-                ME_SendButton(kbi1OutputRef, SynclavierKBI1MIDIProtocolORKChannel, testButton, 0);
-            
-            // Lights. We just need the music now.
-            testButton = (testButton + 1) & 0x7F;
-            ME_SendButton(kbi1OutputRef, SynclavierKBI1MIDIProtocolORKChannel, testButton, 127);
+
+        // Or for output held back by the budget
+        for (auto& device : kbi1Devices) {
+            uint64_t ready = device.nextOutput();
+
+            if (ready == 0)
+                continue;
+
+            int64_t due = (int64_t) (SynclavierKBI1HostTimeToNanos(ready) / 1000000) - (int64_t) now + 1;
+
+            if (due < 0)
+                due = 0;
+
+            if (wait < 0 || due < wait)
+                wait = due;
         }
-        
-        if (kbi1Status == SynclavierKBI1MIDIProtocolNRPNMessageVKHere) {
-            char number[20];
-            snprintf(number, sizeof(number), "%10d", secondsCounter);
-            ME_SendDisplay(kbi1OutputRef, SynclavierKBI1MIDIProtocolDisplayChannel, SynclavierKBI1MIDIProtocolVKDisplayLine0, number);
-            
-            if (testButton >= 0)
-                ME_SendButton(kbi1OutputRef, SynclavierKBI1MIDIProtocolVKChannel, testButton, 0);
-            
-            // Lights. We just need the music now.
-            testButton = (testButton + 1) & 0x7F;
-            ME_SendButton(kbi1OutputRef, SynclavierKBI1MIDIProtocolVKChannel, testButton, 127);
+
+        // Or for scheduled output we have to send ourselves
+        for (int unit = 0; unit < kMaxDevices; unit++) {
+            auto& scheduler = kbi1Devices[unit].scheduler;
+
+            if (scheduler.empty())
+                continue;
+
+            int64_t due = (int64_t) (SynclavierKBI1HostTimeToNanos(scheduler.next()) / 1000000) - (int64_t) now;
+
+            if (kbi1Transports[unit].schedulesOutput())
+                due -= kLookahead;
+
+            if (due < 0)
+                due = 0;
+
+            if (wait < 0 || due < wait)
+                wait = due;
         }
-        
-        // Wait for things to happen
-        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, false);
-        
-        secondsCounter++;
+
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, wait < 0 ? 1.0 : wait / 1000.0, true);
     }
+
+    SynclavierKBI1Logger::shared().stop();
+
+    if (kbi1LogFile)
+        fclose(kbi1LogFile);
+
+    if (kbi1TraceWriter.isOpen()) {
+        kbi1TraceWriter.close();
+
+        printf("Recorded %lld packets, %lld dropped.\n", kbi1TraceWriter.records(), kbi1TraceWriter.dropped());
+    }
+
+    // Last snapshot, so the file shows how the run ended
+    if (kbi1MetricsPath)
+        kbi1Metrics.writeFile(kbi1MetricsPath);
     
     return 0;
 }
@@ -0,0 +1,88 @@
+//
+//  mainLinux.cpp
+//  Synclavier KBI-1 Demo Tool
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+
+#include "SynclavierKBI1Log.h"
+#include "SynclavierKBI1Benchmarks.h"
+
+#if KBI1_HAVE_ALSA
+#include "SynclavierKBI1MIDITransportALSA.h"
+#endif
+
+// Linux build (CMakeLists.txt), for running the benchmarks and load tests on Linux machines and
+// for testing a KBI-1 on ALSA. The demo itself is Mac only (main.cpp).
+//
+//    -bench <name> [options]     as on the Mac, see SynclavierKBI1Benchmarks.h
+//    -readlog <file>             print a binary log as text
+//    -echo [options]             echo test against the first KBI-1 found (built with ALSA only, which is experimental)
+
+#if KBI1_HAVE_ALSA
+
+// Round-trip latency and throughput of a real KBI-1 over ALSA rawmidi. Results are JSON, on stdout or in the file given with -json.
+static int MU_EchoTest(int argc, const char* argv[])
+{
+    static SynclavierKBI1MIDITransportALSA transport;
+
+    if (!transport.open()) {
+        fprintf(stderr, "Could not connect to ALSA.\n");
+        return 1;
+    }
+
+    // Give a KBI-1 just plugged in a few seconds to show up
+    for (int tries = 0; tries < 50 && !transport.findDevice(); tries++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    if (!transport.connected()) {
+        fprintf(stderr, "No KBI-1 found.\n");
+        return 1;
+    }
+
+    int result = SynclavierKBI1RunEchoTest(transport, "KBI-1", argc, argv);
+
+    transport.close();
+
+    return result;
+}
+
+#endif
+
+int main(int argc, const char * argv[]) {
+
+    // Benchmarks run stand-alone without MIDI services. e.g. -bench batch
+    if (argc > 2 && strcmp(argv[1], "-bench") == 0)
+        return SynclavierKBI1RunBenchmark(argv[2], argc - 3, argv + 3);
+
+    // Print a binary log as text. e.g. -readlog show.log
+    if (argc > 2 && strcmp(argv[1], "-readlog") == 0) {
+        static SynclavierKBI1LogReader reader;
+
+        if (!reader.open(argv[2])) {
+            fprintf(stderr, "%s is not a KBI-1 log.\n", argv[2]);
+            return 1;
+        }
+
+        reader.print(stdout);
+        return 0;
+    }
+
+    // Echo test against the first KBI-1 found. e.g. -echo -rate 2000 -burst 4
+    if (argc > 1 && strcmp(argv[1], "-echo") == 0) {
+#if KBI1_HAVE_ALSA
+        return MU_EchoTest(argc - 2, argv + 2);
+#else
+        fprintf(stderr, "Built without ALSA. Install the ALSA development files (libasound2-dev) and build again.\n");
+        return 1;
+#endif
+    }
+
+    fprintf(stderr, "usage: %s -bench <name> [options] | -bench list | -readlog <file> | -echo [options]\n", argv[0]);
+
+    return 1;
+}